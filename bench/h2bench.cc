@@ -0,0 +1,455 @@
+// 进程内压测：不经过 socket 和内核协议栈，把客户端字节流直接喂给
+// http2Server::MessageCallback 所用的 http2_session_on_input，只测服务端 CPU 开销。
+//
+// 客户端字节流要么来自 --load 的录制文件，要么在启动时用一个 nghttp2 客户端
+// 与真实的服务端 session 在内存里对跑一遍生成（多流、CONTINUATION、padding、大 DATA）。
+// 之后每个线程反复新建服务端 session 回放这段字节流，统计每核每秒请求数。
+//
+//   ./h2bench -t 4 -d 5
+//   ./h2bench --save mix.h2b    录制一段合成流量
+//   ./h2bench --load mix.h2b    回放录制文件
+#include <getopt.h>
+#include <time.h>
+
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http2Session.h"
+
+namespace
+{
+
+struct bench_options {
+    int threads = 1;
+    double duration = 5.0;        // seconds of replay per thread
+    size_t chunk = 16384;         // bytes handed to the session per read, like one socket read
+    int streams = 200;            // requests per synthetic connection
+    size_t large_body = 256 * 1024;
+    size_t padding = 64;
+    std::string accept_encoding = "gzip, br";   // empty: ask for identity responses
+    std::string load_path;
+    std::string save_path;
+};
+
+// 一段可回放的客户端字节流
+struct bench_script {
+    std::string bytes;
+    uint32_t requests = 0;
+};
+
+const char kScriptMagic[8] = {'H', '2', 'B', 'E', 'N', 'C', 'H', '1'};
+
+double thread_cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---- synthetic traffic generation ----
+
+struct body_source {
+    const std::string *body;
+    size_t offset;
+};
+
+struct gen_client {
+    std::string *recorded;
+    muduo::net::Buffer to_server;
+    size_t padding;
+    uint32_t completed;
+    uint32_t failed;
+    std::deque<body_source> sources;
+};
+
+ssize_t gen_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+    gen_client *client = (gen_client *)user_data;
+    client->recorded->append((const char *)data, length);
+    client->to_server.append(data, length);
+    return length;
+}
+
+int gen_stream_close_callback(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    gen_client *client = (gen_client *)user_data;
+    if (stream_id % 2 == 0) {
+        return 0;   // server push, not one of our requests
+    }
+    if (error_code == NGHTTP2_NO_ERROR) {
+        client->completed++;
+    } else {
+        client->failed++;
+    }
+    return 0;
+}
+
+// Pad HEADERS and DATA on every third stream
+ssize_t gen_select_padding_callback(nghttp2_session *session, const nghttp2_frame *frame, size_t max_payloadlen, void *user_data)
+{
+    gen_client *client = (gen_client *)user_data;
+    if (frame->hd.stream_id % 3 != 0) {
+        return frame->hd.length;
+    }
+    size_t padded = frame->hd.length + client->padding;
+    return padded < max_payloadlen ? padded : max_payloadlen;
+}
+
+ssize_t gen_body_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                               uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    body_source *src = (body_source *)source->ptr;
+    size_t remaining = src->body->size() - src->offset;
+    size_t n = remaining < length ? remaining : length;
+    memcpy(buf, src->body->data() + src->offset, n);
+    src->offset += n;
+    if (src->offset == src->body->size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+}
+
+nghttp2_nv make_nv(const char *name, const std::string &value)
+{
+    nghttp2_nv nv = {(uint8_t *)name, (uint8_t *)value.data(), strlen(name), value.size(), NGHTTP2_NV_FLAG_NONE};
+    return nv;
+}
+
+void submit_mix(nghttp2_session *client_session, gen_client *client, const bench_options &opts,
+                const std::string &small_body, const std::string &large_body, const std::string &big_header)
+{
+    static const std::string kGet = "GET", kPost = "POST", kScheme = "http", kAuthority = "bench";
+    static const std::string kRoot = "/", kApi = "/api/items", kEcho = "/echo", kUpload = "/upload";
+    static const std::string kUa = "h2bench", kJson = "application/json";
+
+    for (int i = 0; i < opts.streams; ++i) {
+        const std::string *method = &kGet;
+        const std::string *path = &kRoot;
+        const std::string *body = NULL;
+        bool continuation = false;
+        switch (i % 10) {
+        case 0: case 1: case 2: case 3:
+            break;
+        case 4: case 5:
+            path = &kApi;
+            break;
+        case 6:
+            method = &kPost; path = &kEcho; body = &small_body;
+            break;
+        case 7:
+            path = &kEcho; continuation = true;  // header block larger than one frame
+            break;
+        case 8:
+            method = &kPost; path = &kUpload; body = &large_body;
+            break;
+        default:
+            path = &kEcho;
+            break;
+        }
+
+        std::vector<nghttp2_nv> nva;
+        nva.push_back(make_nv(":method", *method));
+        nva.push_back(make_nv(":scheme", kScheme));
+        nva.push_back(make_nv(":authority", kAuthority));
+        nva.push_back(make_nv(":path", *path));
+        nva.push_back(make_nv("user-agent", kUa));
+        if (!opts.accept_encoding.empty()) {
+            nva.push_back(make_nv("accept-encoding", opts.accept_encoding));
+        }
+        if (body) {
+            nva.push_back(make_nv("content-type", kJson));
+        }
+        if (continuation) {
+            nva.push_back(make_nv("x-bench-a", big_header));
+            nva.push_back(make_nv("x-bench-b", big_header));
+            nva.push_back(make_nv("x-bench-c", big_header));
+        }
+
+        if (body) {
+            client->sources.push_back(body_source{body, 0});
+            nghttp2_data_provider data_prd;
+            data_prd.source.ptr = &client->sources.back();
+            data_prd.read_callback = gen_body_read_callback;
+            nghttp2_submit_request(client_session, NULL, nva.data(), nva.size(), &data_prd, NULL);
+        } else {
+            nghttp2_submit_request(client_session, NULL, nva.data(), nva.size(), NULL, NULL);
+        }
+    }
+}
+
+// Run a real nghttp2 client against an in-memory server session and record every byte the client sent.
+bool generate_script(const bench_options &opts, bench_script *script)
+{
+    gen_client client;
+    client.recorded = &script->bytes;
+    client.padding = opts.padding;
+    client.completed = 0;
+    client.failed = 0;
+
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, gen_send_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, gen_stream_close_callback);
+    nghttp2_session_callbacks_set_select_padding_callback(callbacks, gen_select_padding_callback);
+    nghttp2_session *client_session;
+    nghttp2_session_client_new(&client_session, callbacks, &client);
+    nghttp2_session_callbacks_del(callbacks);
+
+    // Open the receive windows fully so large responses never wait on WINDOW_UPDATE during replay
+    nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, NGHTTP2_MAX_WINDOW_SIZE};
+    nghttp2_submit_settings(client_session, NGHTTP2_FLAG_NONE, &iv, 1);
+    nghttp2_submit_window_update(client_session, NGHTTP2_FLAG_NONE, 0,
+                                 NGHTTP2_MAX_WINDOW_SIZE - NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE);
+
+    muduo::net::Buffer to_client;
+    all_data *server = http2_session_create(muduo::net::TcpConnectionPtr(), &to_client);
+
+    std::string small_body(1024, 's');
+    std::string large_body(opts.large_body, 'L');
+    std::string big_header(8192, 'h');
+    bool submitted = false;
+    bool ok = true;
+
+    for (int rounds = 0; ; ++rounds) {
+        if (nghttp2_session_send(client_session) != 0) {
+            ok = false;
+            break;
+        }
+        size_t sent = client.to_server.readableBytes();
+        if (sent > 0 && http2_session_on_input(server, &client.to_server) < 0) {
+            ok = false;
+            break;
+        }
+        size_t received = to_client.readableBytes();
+        if (received > 0) {
+            ssize_t rv = nghttp2_session_mem_recv(client_session, (const uint8_t *)to_client.peek(), received);
+            if (rv < 0) {
+                ok = false;
+                break;
+            }
+            to_client.retrieveAll();
+        }
+        // Submit the requests once the server SETTINGS (MAX_CONCURRENT_STREAMS) have been applied
+        if (!submitted && received > 0) {
+            submit_mix(client_session, &client, opts, small_body, large_body, big_header);
+            submitted = true;
+            continue;
+        }
+        if (submitted && client.completed + client.failed == (uint32_t)opts.streams) {
+            break;
+        }
+        if (sent == 0 && received == 0 && !nghttp2_session_want_write(client_session)) {
+            ok = false;  // stalled
+            break;
+        }
+    }
+    // Flush trailing WINDOW_UPDATE / SETTINGS ACK so the replay sees the same bytes
+    nghttp2_session_send(client_session);
+
+    script->requests = client.completed;
+    http2_session_destroy(server);
+    nghttp2_session_del(client_session);
+    if (client.failed > 0) {
+        std::cerr << client.failed << " synthetic streams failed" << std::endl;
+    }
+    return ok && client.completed > 0;
+}
+
+// ---- script files ----
+
+bool save_script(const std::string &path, const bench_script &script)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    uint32_t header[2] = {script.requests, 0};
+    bool ok = fwrite(kScriptMagic, sizeof kScriptMagic, 1, fp) == 1
+        && fwrite(header, sizeof header, 1, fp) == 1
+        && fwrite(script.bytes.data(), 1, script.bytes.size(), fp) == script.bytes.size();
+    fclose(fp);
+    return ok;
+}
+
+bool load_script(const std::string &path, bench_script *script)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    char magic[sizeof kScriptMagic];
+    uint32_t header[2];
+    bool ok = fread(magic, sizeof magic, 1, fp) == 1 && memcmp(magic, kScriptMagic, sizeof magic) == 0
+        && fread(header, sizeof header, 1, fp) == 1;
+    if (ok) {
+        script->requests = header[0];
+        char buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+            script->bytes.append(buf, n);
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+// ---- replay ----
+
+struct thread_result {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t failed_connections = 0;    // The session rejected the input; their requests are not counted
+    uint64_t bytes_out = 0;
+    double cpu_seconds = 0;
+};
+
+// One fresh server connection: feed the script in socket-read sized chunks and drain the output.
+// Returns false when the session failed on the input before the whole script was fed.
+bool replay_once(const bench_script &script, size_t chunk, muduo::net::Buffer *in, muduo::net::Buffer *out,
+                 uint64_t *bytes_out)
+{
+    bool ok = true;
+    all_data *data = http2_session_create(muduo::net::TcpConnectionPtr(), out);
+    const char *p = script.bytes.data();
+    size_t left = script.bytes.size();
+    while (left > 0) {
+        size_t n = left < chunk ? left : chunk;
+        in->append(p, n);
+        p += n;
+        left -= n;
+        if (http2_session_on_input(data, in) < 0) {
+            ok = false;
+            break;
+        }
+        *bytes_out += out->readableBytes();
+        out->retrieveAll();
+    }
+    in->retrieveAll();
+    http2_session_destroy(data);
+    return ok;
+}
+
+void replay_thread(const bench_script &script, const bench_options &opts, thread_result *result)
+{
+    muduo::net::Buffer in, out;
+    double wall_end = wall_seconds() + opts.duration;
+    double cpu_start = thread_cpu_seconds();
+    do {
+        if (replay_once(script, opts.chunk, &in, &out, &result->bytes_out)) {
+            result->connections++;
+            result->requests += script.requests;
+        } else {
+            result->failed_connections++;
+        }
+    } while (wall_seconds() < wall_end);
+    result->cpu_seconds = thread_cpu_seconds() - cpu_start;
+}
+
+void usage()
+{
+    std::cout << "usage: h2bench [-t threads] [-d seconds] [-c chunk_bytes] [-s streams]\n"
+                 "               [--large bytes] [--padding bytes] [--accept-encoding value]\n"
+                 "               [--load file | --save file]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    bench_options opts;
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"streams", required_argument, NULL, 's'},
+        {"large", required_argument, NULL, 'L'},
+        {"padding", required_argument, NULL, 'P'},
+        {"accept-encoding", required_argument, NULL, 'E'},
+        {"load", required_argument, NULL, 'l'},
+        {"save", required_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "t:d:c:s:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 't': opts.threads = atoi(optarg); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'c': opts.chunk = strtoul(optarg, NULL, 10); break;
+        case 's': opts.streams = atoi(optarg); break;
+        case 'L': opts.large_body = strtoul(optarg, NULL, 10); break;
+        case 'P': opts.padding = strtoul(optarg, NULL, 10); break;
+        case 'E': opts.accept_encoding = optarg; break;
+        case 'l': opts.load_path = optarg; break;
+        case 'w': opts.save_path = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+    if (opts.threads < 1 || opts.chunk == 0 || opts.streams < 1) {
+        usage();
+        return 1;
+    }
+
+    bench_script script;
+    if (!opts.load_path.empty()) {
+        if (!load_script(opts.load_path, &script)) {
+            std::cerr << "cannot load " << opts.load_path << std::endl;
+            return 1;
+        }
+    } else if (!generate_script(opts, &script)) {
+        std::cerr << "failed to generate synthetic traffic" << std::endl;
+        return 1;
+    }
+    if (!opts.save_path.empty()) {
+        if (!save_script(opts.save_path, script)) {
+            return 1;
+        }
+        std::cout << "saved " << script.requests << " requests, " << script.bytes.size()
+                  << " bytes to " << opts.save_path << std::endl;
+        return 0;
+    }
+
+    std::vector<thread_result> results(opts.threads);
+    std::vector<std::thread> threads;
+    double wall_start = wall_seconds();
+    for (int i = 0; i < opts.threads; ++i) {
+        threads.emplace_back(replay_thread, std::cref(script), std::cref(opts), &results[i]);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double wall = wall_seconds() - wall_start;
+
+    thread_result total;
+    for (const auto &r : results) {
+        total.connections += r.connections;
+        total.requests += r.requests;
+        total.failed_connections += r.failed_connections;
+        total.bytes_out += r.bytes_out;
+        total.cpu_seconds += r.cpu_seconds;
+    }
+    printf("script:      %u requests, %zu bytes per connection\n", script.requests, script.bytes.size());
+    printf("threads:     %d, wall %.2fs, cpu %.2fs\n", opts.threads, wall, total.cpu_seconds);
+    printf("replayed:    %llu connections, %llu requests, %.1f MB out\n",
+           (unsigned long long)total.connections, (unsigned long long)total.requests, total.bytes_out / 1e6);
+    if (total.failed_connections) {
+        printf("failed:      %llu connections rejected by the session, not counted above\n",
+               (unsigned long long)total.failed_connections);
+    }
+    printf("throughput:  %.0f req/s wall\n", total.requests / wall);
+    printf("efficiency:  %.0f req/core-second\n", total.requests / total.cpu_seconds);
+    return 0;
+}
@@ -0,0 +1,396 @@
+// 流量回放：读取 muduohttp --capture 录下的文件，把每条连接的客户端字节流按原顺序送回服务端。
+// 默认直接喂给进程内的服务端 session（http2_session_on_input -> nghttp2_session_mem_recv，只测服务端 CPU）；
+// 给出 --connect 时经真实 TCP 连接发给运行中的服务器。默认尽快发送，--paced 按录制时的间隔发送
+// （--speed 倍速），保留生产流量的并发与突发形态。
+//
+//   ./muduohttp 8443 --capture prod.h2cap --capture-sample 50
+//   ./h2replay prod.h2cap -t 4 -n 20                          进程内，尽快，每个线程回放 20 遍
+//   ./h2replay prod.h2cap --paced --connect 127.0.0.1:8443    按原速打到运行中的服务器
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "http2Session.h"
+
+namespace
+{
+
+// A replayed socket is closed once it has been quiet this long after its last captured chunk
+const double kLinger = 0.2;
+
+struct replay_options {
+    int threads = 1;
+    int loops = 1;                // Passes over the capture per thread
+    bool paced = false;
+    double speed = 1.0;           // With --paced: 2 replays twice as fast as recorded
+    std::string host;             // Empty: in-process
+    int port = 0;
+};
+
+struct replay_event {
+    int64_t time_us;
+    uint32_t conn;
+    uint32_t chunk;
+};
+
+struct thread_result {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t bytes_out = 0;
+    uint64_t failed = 0;
+    double cpu_seconds = 0;
+};
+
+double thread_cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Requests in a client byte stream: HEADERS frames opening a new stream
+uint32_t count_requests(const capture_connection &conn)
+{
+    std::string bytes;
+    for (const capture_chunk &chunk : conn.chunks) {
+        bytes += chunk.bytes;
+    }
+    static const char kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    size_t pos = bytes.compare(0, sizeof kPreface - 1, kPreface) == 0 ? sizeof kPreface - 1 : 0;
+    uint32_t requests = 0;
+    uint32_t last_stream = 0;
+    const uint8_t *p = (const uint8_t *)bytes.data();
+    while (pos + 9 <= bytes.size()) {
+        size_t length = (p[pos] << 16) | (p[pos + 1] << 8) | p[pos + 2];
+        uint8_t type = p[pos + 3];
+        uint32_t stream_id = ((p[pos + 5] & 0x7f) << 24) | (p[pos + 6] << 16) | (p[pos + 7] << 8) | p[pos + 8];
+        if (type == NGHTTP2_HEADERS && (stream_id & 1) && stream_id > last_stream) {
+            requests++;
+            last_stream = stream_id;
+        }
+        pos += 9 + length;
+    }
+    return requests;
+}
+
+// ---- targets: an in-process session or a socket per captured connection ----
+
+struct replay_target {
+    virtual ~replay_target() {}
+    virtual bool open(uint32_t conn) = 0;
+    virtual bool feed(uint32_t conn, const std::string &bytes) = 0;
+    // The connection's last chunk was sent
+    virtual void finish(uint32_t conn) = 0;
+    // Give the server's output a chance to be read; returns when every connection is closed if wait
+    virtual void poll(bool wait) {}
+    uint64_t bytes_out = 0;
+};
+
+struct inprocess_target : replay_target {
+    std::vector<all_data *> sessions;
+    std::vector<std::unique_ptr<muduo::net::Buffer>> outputs;
+    muduo::net::Buffer in;
+
+    explicit inprocess_target(size_t n) : sessions(n, NULL), outputs(n) {}
+
+    bool open(uint32_t conn) override
+    {
+        outputs[conn].reset(new muduo::net::Buffer);
+        sessions[conn] = http2_session_create(muduo::net::TcpConnectionPtr(), outputs[conn].get());
+        return true;
+    }
+
+    bool feed(uint32_t conn, const std::string &bytes) override
+    {
+        in.append(bytes.data(), bytes.size());
+        int rv = http2_session_on_input(sessions[conn], &in);
+        in.retrieveAll();
+        bytes_out += outputs[conn]->readableBytes();
+        outputs[conn]->retrieveAll();
+        return rv >= 0;
+    }
+
+    void finish(uint32_t conn) override
+    {
+        http2_session_destroy(sessions[conn]);
+        sessions[conn] = NULL;
+        outputs[conn].reset();
+    }
+};
+
+struct socket_target : replay_target {
+    struct peer {
+        int fd = -1;
+        bool finished = false;
+        double last_activity = 0;
+    };
+    const replay_options &opts;
+    std::vector<peer> peers;
+    std::vector<uint32_t> open_conns;
+
+    socket_target(const replay_options &o, size_t n) : opts(o), peers(n) {}
+
+    bool open(uint32_t conn) override
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opts.port);
+        inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr);
+        if (fd < 0 || ::connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+            perror("connect");
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        peers[conn].fd = fd;
+        peers[conn].finished = false;
+        peers[conn].last_activity = wall_seconds();
+        open_conns.push_back(conn);
+        return true;
+    }
+
+    bool feed(uint32_t conn, const std::string &bytes) override
+    {
+        const char *p = bytes.data();
+        size_t left = bytes.size();
+        while (left > 0) {
+            ssize_t n = ::send(peers[conn].fd, p, left, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        peers[conn].last_activity = wall_seconds();
+        return true;
+    }
+
+    void finish(uint32_t conn) override
+    {
+        peers[conn].finished = true;
+    }
+
+    // Read whatever responses arrived; close finished connections that went quiet
+    void poll(bool wait) override
+    {
+        char buf[65536];
+        do {
+            double now = wall_seconds();
+            for (size_t i = 0; i < open_conns.size();) {
+                peer &c = peers[open_conns[i]];
+                ssize_t n;
+                bool closed = false;
+                while ((n = ::recv(c.fd, buf, sizeof buf, MSG_DONTWAIT)) > 0) {
+                    bytes_out += n;
+                    c.last_activity = now;
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    closed = true;
+                }
+                if (closed || (c.finished && now - c.last_activity > kLinger)) {
+                    ::close(c.fd);
+                    c.fd = -1;
+                    open_conns[i] = open_conns.back();
+                    open_conns.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            if (wait && !open_conns.empty()) {
+                usleep(1000);
+            }
+        } while (wait && !open_conns.empty());
+    }
+};
+
+void sleep_until(double when)
+{
+    double delay = when - wall_seconds();
+    if (delay > 0) {
+        struct timespec ts = {(time_t)delay, (long)((delay - (time_t)delay) * 1e9)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+void replay_thread(const std::vector<capture_connection> &capture, const std::vector<uint32_t> &requests,
+                   int index, const replay_options &opts, thread_result *result)
+{
+    // This thread's connections, merged into one timeline so their interleaving is kept
+    std::vector<replay_event> events;
+    for (size_t i = index; i < capture.size(); i += opts.threads) {
+        for (size_t j = 0; j < capture[i].chunks.size(); ++j) {
+            events.push_back(replay_event{capture[i].chunks[j].time_us, (uint32_t)i, (uint32_t)j});
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const replay_event &a, const replay_event &b) { return a.time_us < b.time_us; });
+    if (events.empty()) {
+        return;
+    }
+
+    std::unique_ptr<replay_target> target;
+    if (opts.host.empty()) {
+        target.reset(new inprocess_target(capture.size()));
+    } else {
+        target.reset(new socket_target(opts, capture.size()));
+    }
+    std::vector<bool> failed(capture.size());
+    double cpu_start = thread_cpu_seconds();
+    for (int loop = 0; loop < opts.loops; ++loop) {
+        std::fill(failed.begin(), failed.end(), false);
+        double start = wall_seconds();
+        int64_t base_us = events.front().time_us;
+        for (const replay_event &ev : events) {
+            const capture_connection &conn = capture[ev.conn];
+            if (failed[ev.conn]) {
+                continue;
+            }
+            if (opts.paced) {
+                sleep_until(start + (ev.time_us - base_us) / 1e6 / opts.speed);
+            }
+            if (ev.chunk == 0 && !target->open(ev.conn)) {
+                failed[ev.conn] = true;
+                result->failed++;
+                continue;
+            }
+            bool ok = target->feed(ev.conn, conn.chunks[ev.chunk].bytes);
+            if (!ok || ev.chunk + 1 == conn.chunks.size()) {
+                target->finish(ev.conn);
+                failed[ev.conn] = !ok;
+                result->failed += !ok;
+                result->connections += ok;
+                result->requests += ok ? requests[ev.conn] : 0;
+            }
+            target->poll(false);
+        }
+        target->poll(true);
+    }
+    result->cpu_seconds = thread_cpu_seconds() - cpu_start;
+    result->bytes_out = target->bytes_out;
+}
+
+void usage()
+{
+    std::cout << "usage: h2replay capture_file [-t threads] [-n loops] [--paced] [--speed x]\n"
+                 "                [--connect host:port]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    replay_options opts;
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"loops", required_argument, NULL, 'n'},
+        {"paced", no_argument, NULL, 'p'},
+        {"speed", required_argument, NULL, 's'},
+        {"connect", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "t:n:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 't': opts.threads = atoi(optarg); break;
+        case 'n': opts.loops = atoi(optarg); break;
+        case 'p': opts.paced = true; break;
+        case 's': opts.speed = atof(optarg); break;
+        case 'c': {
+            std::string target = optarg;
+            size_t colon = target.rfind(':');
+            if (colon == std::string::npos) {
+                usage();
+                return 1;
+            }
+            opts.host = target.substr(0, colon);
+            opts.port = atoi(target.c_str() + colon + 1);
+            break;
+        }
+        default: usage(); return 1;
+        }
+    }
+    if (optind + 1 != argc || opts.threads < 1 || opts.loops < 1 || opts.speed <= 0) {
+        usage();
+        return 1;
+    }
+
+    std::vector<capture_connection> capture;
+    if (!capture_load(argv[optind], &capture)) {
+        std::cerr << "cannot load " << argv[optind] << std::endl;
+        return 1;
+    }
+    std::vector<uint32_t> requests;
+    uint64_t total_requests = 0, bytes_in = 0;
+    size_t truncated = 0;
+    for (const capture_connection &conn : capture) {
+        requests.push_back(count_requests(conn));
+        total_requests += requests.back();
+        for (const capture_chunk &chunk : conn.chunks) {
+            bytes_in += chunk.bytes.size();
+        }
+        truncated += !conn.closed;
+    }
+
+    std::vector<thread_result> results(opts.threads);
+    std::vector<std::thread> threads;
+    double wall_start = wall_seconds();
+    for (int i = 0; i < opts.threads; ++i) {
+        threads.emplace_back(replay_thread, std::cref(capture), std::cref(requests), i, std::cref(opts), &results[i]);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double wall = wall_seconds() - wall_start;
+
+    thread_result total;
+    for (const auto &r : results) {
+        total.connections += r.connections;
+        total.requests += r.requests;
+        total.bytes_out += r.bytes_out;
+        total.failed += r.failed;
+        total.cpu_seconds += r.cpu_seconds;
+    }
+    printf("capture:     %zu connections (%zu cut short), %llu requests, %.1f MB in\n", capture.size(), truncated,
+           (unsigned long long)total_requests, bytes_in / 1e6);
+    printf("threads:     %d, wall %.2fs, cpu %.2fs, %s%s\n", opts.threads, wall, total.cpu_seconds,
+           opts.host.empty() ? "in-process" : "socket", opts.paced ? ", paced" : "");
+    printf("replayed:    %llu connections, %llu requests, %.1f MB out\n",
+           (unsigned long long)total.connections, (unsigned long long)total.requests, total.bytes_out / 1e6);
+    printf("throughput:  %.0f req/s wall\n", total.requests / wall);
+    if (opts.host.empty()) {
+        printf("efficiency:  %.0f req/core-second\n", total.requests / total.cpu_seconds);
+    }
+    if (total.failed) {
+        printf("failed:      %llu connections\n", (unsigned long long)total.failed);
+    }
+    return 0;
+}
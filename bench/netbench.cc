@@ -0,0 +1,437 @@
+// 网络压测：真实 TCP 连接上跑 nghttp2 客户端，用来比较服务端的 epoll 与 --io-uring 后端。
+// 每个线程持有若干连接，每个连接保持 -m 个并发流，统计请求速率；给出 --pid 时还从 /proc
+// 读服务端进程的 CPU 时间和上下文切换次数，折算成每请求开销。
+//
+//   ./muduohttp 8443 --threads 2 &                 ./netbench -p 8443 --pid $!
+//   ./muduohttp 8443 --threads 2 --io-uring &      ./netbench -p 8443 --pid $!
+//
+// 同机 sidecar 场景下比较回环 TCP 与 Unix socket：
+//   ./muduohttp 8443 --threads 2 --unix /tmp/h2.sock &   ./netbench -p 8443 --pid $!
+//                                                        ./netbench --unix /tmp/h2.sock --pid $!
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nghttp2/nghttp2.h>
+
+namespace
+{
+
+// How long in-flight requests may take to finish once the duration is over
+const double kStopGrace = 5.0;
+
+struct bench_options {
+    std::string host = "127.0.0.1";
+    int port = 8443;
+    std::string unix_path;        // Connect here instead of host:port; "@name" is abstract
+    int threads = 1;
+    int connections = 4;          // per thread
+    int streams = 16;             // concurrent requests per connection
+    double duration = 5.0;
+    std::string path = "/";
+    size_t body = 0;              // POST this many bytes instead of GET
+    int server_pid = 0;
+};
+
+struct server_usage {
+    double cpu_seconds = 0;
+    uint64_t context_switches = 0;
+};
+
+double wall_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// utime + stime of the whole process, and the context switches summed over its threads
+bool read_server_usage(int pid, server_usage *usage)
+{
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    char line[1024];
+    bool ok = fgets(line, sizeof line, fp) != NULL;
+    fclose(fp);
+    // Fields after the command name, which may itself contain spaces
+    const char *p = ok ? strrchr(line, ')') : NULL;
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return false;
+    }
+    usage->cpu_seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    usage->context_switches = 0;
+    snprintf(path, sizeof path, "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string status = std::string(path) + "/" + entry->d_name + "/status";
+        fp = fopen(status.c_str(), "r");
+        if (!fp) {
+            continue;
+        }
+        unsigned long long n;
+        while (fgets(line, sizeof line, fp)) {
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &n) == 1
+                || sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1) {
+                usage->context_switches += n;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return true;
+}
+
+// ---- one client connection ----
+
+struct client_conn {
+    const bench_options *opts;
+    const std::string *body;
+    int fd;
+    nghttp2_session *session;
+    int inflight;
+    bool stopping;
+    bool failed;
+    uint64_t completed;
+    uint64_t errors;
+    std::vector<size_t> offsets;  // Body bytes sent, indexed by stream ID / 2
+};
+
+ssize_t client_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+    client_conn *conn = (client_conn *)user_data;
+    ssize_t n = ::send(conn->fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+        return errno == EAGAIN ? NGHTTP2_ERR_WOULDBLOCK : NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return n;
+}
+
+int client_stream_close_callback(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    client_conn *conn = (client_conn *)user_data;
+    conn->inflight--;
+    if (error_code == NGHTTP2_NO_ERROR) {
+        conn->completed++;
+    } else {
+        conn->errors++;
+    }
+    return 0;
+}
+
+ssize_t client_body_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                                  uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    client_conn *conn = (client_conn *)user_data;
+    size_t &offset = conn->offsets[stream_id / 2];
+    size_t n = conn->body->size() - offset < length ? conn->body->size() - offset : length;
+    memcpy(buf, conn->body->data() + offset, n);
+    offset += n;
+    if (offset == conn->body->size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+}
+
+nghttp2_nv make_nv(const char *name, const std::string &value)
+{
+    nghttp2_nv nv = {(uint8_t *)name, (uint8_t *)value.data(), strlen(name), value.size(), NGHTTP2_NV_FLAG_NONE};
+    return nv;
+}
+
+void submit_requests(client_conn *conn)
+{
+    static const std::string kGet = "GET", kPost = "POST", kScheme = "http", kAuthority = "bench";
+    while (!conn->stopping && conn->inflight < conn->opts->streams) {
+        nghttp2_nv nva[4] = {
+            make_nv(":method", conn->opts->body ? kPost : kGet),
+            make_nv(":scheme", kScheme),
+            make_nv(":authority", kAuthority),
+            make_nv(":path", conn->opts->path),
+        };
+        int32_t stream_id;
+        if (conn->opts->body) {
+            nghttp2_data_provider data_prd;
+            data_prd.source.ptr = NULL;
+            data_prd.read_callback = client_body_read_callback;
+            stream_id = nghttp2_submit_request(conn->session, NULL, nva, 4, &data_prd, NULL);
+            if (stream_id > 0) {
+                conn->offsets.resize(stream_id / 2 + 1, 0);
+            }
+        } else {
+            stream_id = nghttp2_submit_request(conn->session, NULL, nva, 4, NULL, NULL);
+        }
+        if (stream_id < 0) {
+            // Stream IDs exhausted; finish this connection
+            conn->stopping = true;
+            break;
+        }
+        conn->inflight++;
+    }
+}
+
+bool connect_unix(client_conn *conn)
+{
+    const std::string &path = conn->opts->unix_path;
+    conn->fd = -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        fprintf(stderr, "path too long: %s\n", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    bool abstract = path[0] == '@';
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+    }
+    conn->fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    socklen_t addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + (abstract ? 0 : 1));
+    if (::connect(conn->fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        perror("connect");
+        return false;
+    }
+    return true;
+}
+
+bool connect_tcp(client_conn *conn)
+{
+    conn->fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(conn->opts->port);
+    inet_pton(AF_INET, conn->opts->host.c_str(), &addr.sin_addr);
+    if (::connect(conn->fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror("connect");
+        return false;
+    }
+    int on = 1;
+    ::setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    return true;
+}
+
+bool connect_conn(client_conn *conn)
+{
+    if (!(conn->opts->unix_path.empty() ? connect_tcp(conn) : connect_unix(conn))) {
+        return false;
+    }
+
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, client_send_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, client_stream_close_callback);
+    nghttp2_session_client_new(&conn->session, callbacks, conn);
+    nghttp2_session_callbacks_del(callbacks);
+
+    nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, NGHTTP2_MAX_WINDOW_SIZE};
+    nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, &iv, 1);
+    nghttp2_submit_window_update(conn->session, NGHTTP2_FLAG_NONE, 0,
+                                 NGHTTP2_MAX_WINDOW_SIZE - NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE);
+    submit_requests(conn);
+    return nghttp2_session_send(conn->session) == 0;
+}
+
+struct thread_result {
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    int failed_connections = 0;
+};
+
+void run_thread(const bench_options &opts, const std::string &body, const std::atomic<bool> &stop,
+                thread_result *result)
+{
+    std::vector<client_conn> conns(opts.connections);
+    std::vector<struct pollfd> pfds(opts.connections);
+    for (int i = 0; i < opts.connections; ++i) {
+        client_conn &conn = conns[i];
+        conn.opts = &opts;
+        conn.body = &body;
+        conn.session = NULL;
+        conn.inflight = 0;
+        conn.stopping = false;
+        conn.completed = 0;
+        conn.errors = 0;
+        conn.failed = !connect_conn(&conn);
+        pfds[i].fd = conn.failed ? -1 : conn.fd;
+    }
+
+    uint8_t buf[65536];
+    double stopped_at = 0;
+    for (;;) {
+        if (stop && stopped_at == 0) {
+            stopped_at = wall_seconds();
+        } else if (stopped_at > 0 && wall_seconds() - stopped_at > kStopGrace) {
+            break;
+        }
+        bool live = false;
+        for (int i = 0; i < opts.connections; ++i) {
+            client_conn &conn = conns[i];
+            if (conn.failed) {
+                pfds[i].fd = -1;
+                continue;
+            }
+            conn.stopping = conn.stopping || stop;
+            if (conn.stopping && conn.inflight == 0) {
+                pfds[i].fd = -1;
+                continue;
+            }
+            live = true;
+            pfds[i].events = POLLIN | (nghttp2_session_want_write(conn.session) ? POLLOUT : 0);
+        }
+        if (!live) {
+            break;
+        }
+        if (::poll(pfds.data(), pfds.size(), 100) < 0) {
+            continue;
+        }
+        for (int i = 0; i < opts.connections; ++i) {
+            client_conn &conn = conns[i];
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) {
+                continue;
+            }
+            if (pfds[i].revents & POLLIN) {
+                ssize_t n = ::recv(conn.fd, buf, sizeof buf, MSG_DONTWAIT);
+                if (n <= 0 || nghttp2_session_mem_recv(conn.session, buf, n) < 0) {
+                    conn.failed = true;
+                    continue;
+                }
+            } else if (pfds[i].revents & (POLLERR | POLLHUP)) {
+                conn.failed = true;
+                continue;
+            }
+            submit_requests(&conn);
+            if (nghttp2_session_send(conn.session) != 0) {
+                conn.failed = true;
+            }
+        }
+    }
+
+    for (client_conn &conn : conns) {
+        result->completed += conn.completed;
+        result->errors += conn.errors;
+        result->failed_connections += conn.failed;
+        if (conn.session) {
+            nghttp2_session_del(conn.session);
+        }
+        if (conn.fd >= 0) {
+            ::close(conn.fd);
+        }
+    }
+}
+
+void usage()
+{
+    std::cout << "./netbench [-h host] [-p port] [-t threads] [-c connections] [-m streams] [-d seconds]"
+                 " [--unix path] [--path p] [--body bytes] [--pid server-pid]" << std::endl;
+    std::cout << "  --unix path   connect to a Unix socket instead of host:port (\"@name\" for abstract)" << std::endl;
+    std::cout << "  -c n          connections per thread (default 4)" << std::endl;
+    std::cout << "  -m n          concurrent streams per connection (default 16)" << std::endl;
+    std::cout << "  --body bytes  POST a body of this size instead of GET" << std::endl;
+    std::cout << "  --pid pid     report the server's CPU time and context switches per request" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    bench_options opts;
+    static const struct option long_options[] = {
+        {"unix", required_argument, NULL, 'u'},
+        {"path", required_argument, NULL, 'P'},
+        {"body", required_argument, NULL, 'b'},
+        {"pid", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, '?'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "h:p:t:c:m:d:", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'c': opts.connections = atoi(optarg); break;
+        case 'm': opts.streams = atoi(optarg); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'u': opts.unix_path = optarg; break;
+        case 'P': opts.path = optarg; break;
+        case 'b': opts.body = strtoul(optarg, NULL, 10); break;
+        case 's': opts.server_pid = atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    std::string body(opts.body, 'b');
+
+    server_usage before, after;
+    if (opts.server_pid && !read_server_usage(opts.server_pid, &before)) {
+        std::cerr << "cannot read /proc/" << opts.server_pid << std::endl;
+        return 1;
+    }
+    std::atomic<bool> stop(false);
+    std::vector<thread_result> results(opts.threads);
+    std::vector<std::thread> threads;
+    double start = wall_seconds();
+    for (int i = 0; i < opts.threads; ++i) {
+        threads.emplace_back(run_thread, std::cref(opts), std::cref(body), std::cref(stop), &results[i]);
+    }
+    usleep((useconds_t)(opts.duration * 1e6));
+    stop = true;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double elapsed = wall_seconds() - start;
+    if (opts.server_pid) {
+        read_server_usage(opts.server_pid, &after);
+    }
+
+    thread_result total;
+    for (const thread_result &r : results) {
+        total.completed += r.completed;
+        total.errors += r.errors;
+        total.failed_connections += r.failed_connections;
+    }
+    printf("requests     %llu in %.2fs, %.0f req/s\n", (unsigned long long)total.completed, elapsed,
+           total.completed / elapsed);
+    if (total.errors || total.failed_connections) {
+        printf("errors       %llu reset streams, %d failed connections\n",
+               (unsigned long long)total.errors, total.failed_connections);
+    }
+    if (opts.server_pid && total.completed > 0) {
+        double cpu = after.cpu_seconds - before.cpu_seconds;
+        uint64_t switches = after.context_switches - before.context_switches;
+        printf("server cpu   %.2fs, %.2f us/request\n", cpu, cpu * 1e6 / total.completed);
+        printf("server csw   %llu, %.3f per request\n", (unsigned long long)switches,
+               (double)switches / total.completed);
+    }
+    return total.completed > 0 ? 0 : 1;
+}
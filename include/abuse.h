@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+#include "util.h"
+
+// 滥用防护：按连接统计每秒的 RST_STREAM、控制帧、CONTINUATION、空 DATA 和头部字节，
+// 超出预算的连接收到 GOAWAY(ENHANCE_YOUR_CALM) 并被关闭（如 CVE-2023-44487 的快速重置）
+
+struct abuse_policy {
+    bool enabled;
+    // Per connection, per second
+    uint32_t max_resets;
+    uint32_t max_control_frames;
+    uint32_t max_continuations;
+    uint32_t max_empty_data;
+    uint64_t max_header_bytes;
+};
+
+extern abuse_policy g_abuse_policy;
+
+// nghttp2 on_begin_frame callback: charges each frame header to the connection's budget
+// before its payload is processed.
+int on_begin_frame_callback(nghttp2_session *session, const nghttp2_frame_hd *hd, void *user_data);
@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "util.h"
+
+// 访问日志：每个 IO 线程把请求记录写进自己预先分配的环形缓冲（单生产者单消费者，无锁、无系统调用），
+// 后台线程按 muduo AsyncLogging 的方式定期批量取出、格式化并写盘；环满时丢弃并计数，从不阻塞 IO 线程
+
+struct access_log_policy {
+    bool enabled;
+    std::string path;           // "-" writes to stdout
+    uint32_t sample;            // Log one in sample successful requests per thread; errors are always logged
+    size_t ring_records;        // Records per thread, rounded up to a power of two
+    double flush_interval;      // Seconds between batches
+};
+
+extern access_log_policy g_access_log_policy;
+
+// Open the log and start the writer thread. Returns false when the file cannot be opened.
+bool access_log_start();
+
+// Write out what is queued and stop the writer thread
+void access_log_stop();
+
+// Queue the record of a stream that is closing. Called from stream_data_close.
+void access_log_stream(const stream_data *sdata, uint32_t error_code);
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+
+// CPU 亲和性：IO 线程数默认取可用核数，可把每个 IO 线程绑到固定 CPU，
+// 按 NUMA 节点和物理核排序分配，也可以给 acceptor（主循环）单独留一个核
+
+struct cpu_placement_options {
+    int threads;                // IO threads; <= 0 means one per usable CPU
+    const char *cpu_list;       // "0-7,16" restricts the CPUs used; NULL for the process affinity mask
+    int numa_node;              // Only use CPUs of this node; -1 for any
+    int acceptor_cpu;           // Dedicated CPU for the acceptor loop; -1 to share
+    bool pin;                   // Pin each IO thread to one CPU
+};
+
+struct cpu_placement {
+    int threads;
+    std::vector<int> io_cpus;   // IO thread i runs on io_cpus[i % size] when pinning, on any of them otherwise
+    int acceptor_cpu;
+    bool pin;
+};
+
+// Parse a CPU list such as "0-3,8,10-11". Returns false when malformed.
+bool parse_cpu_list(const char *list, std::vector<int> *cpus);
+
+// Work out the thread count and CPU order. IO CPUs are ordered one hyperthread per physical
+// core first, grouped by NUMA node, so a smaller thread count neither shares cores nor
+// straddles nodes needlessly. Returns false when no usable CPU is left.
+bool plan_cpu_placement(const cpu_placement_options &options, cpu_placement *placement);
+
+// Pin the calling thread to cpu. Memory it touches afterwards is then allocated on that
+// CPU's node by the kernel's default first-touch policy.
+bool pin_current_thread(int cpu);
+
+// Let the calling thread run on any of cpus, e.g. an IO thread that is not pinned but must keep
+// off the acceptor's CPU and within --cpus / --numa-node
+bool confine_current_thread(const std::vector<int> &cpus);
@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// 分段响应体：由若干段组成（静态字面量、借用的请求缓冲、自有缓冲），
+// 发送时按段读取，拼接时不再复制整块数据
+
+typedef enum {
+    SEGMENT_STATIC,     // Literal that outlives the stream
+    SEGMENT_BORROWED,   // Points into a buffer the stream owns (sdata->headers, sdata->body), valid until close
+    SEGMENT_OWNED,      // malloc'd, freed with the chain
+} segment_kind;
+
+typedef struct body_segment body_segment;
+typedef struct body_chain body_chain;
+
+struct body_segment {
+    const char *data;
+    size_t len;
+    segment_kind kind;
+    body_segment *next;
+};
+
+struct body_chain {
+    body_segment *head, *tail;
+    body_segment *cur;          // Segment being read
+    size_t cur_offset;
+    size_t size;                // Total bytes
+    size_t consumed;            // Bytes read so far
+};
+
+body_chain *body_chain_new();
+
+// Append len bytes; empty segments are skipped. An OWNED segment's data is freed with the
+// chain even when appending fails. Returns false when out of memory.
+bool body_chain_append(body_chain *chain, const char *data, size_t len, segment_kind kind);
+
+size_t body_chain_remaining(const body_chain *chain);
+
+// Unread bytes of the current segment, 0 at the end
+size_t body_chain_peek(const body_chain *chain, const char **data);
+
+void body_chain_advance(body_chain *chain, size_t n);
+
+// Copy up to len unread bytes into buf, across segments
+size_t body_chain_read(body_chain *chain, uint8_t *buf, size_t len);
+
+// Move every segment of src to the end of dst and free src. src must be unread.
+void body_chain_splice(body_chain *dst, body_chain *src);
+
+// Free the segments already read, for chains that keep growing while they are sent
+void body_chain_release_read(body_chain *chain);
+
+void body_chain_free(body_chain *chain);
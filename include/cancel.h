@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+
+// 取消令牌：流被重置、连接断开或超过期限时触发，交给工作线程或其他异步路径的任务
+// 据此尽早停下，不再为没人要的结果耗 CPU，也不会把结果写进已经释放的流。
+// 任务可以随时轮询 cancel_requested()（任意线程，一次原子读），也可以用
+// cancel_subscribe() 在触发时得到回调。令牌按引用计数，比流活得久也没关系
+
+enum cancel_reason {
+    CANCEL_NONE = 0,
+    CANCEL_RESET,               // Closed before its response was complete: RST_STREAM with any code, or refused
+    CANCEL_DISCONNECT,          // The connection went away with the stream open
+    CANCEL_DEADLINE,            // The request ran out of time
+    CANCEL_DONE,                // The response went out complete. Not a cancellation: cancel_requested()
+                                // stays false, subscribers still hear of it.
+};
+
+typedef struct cancel_token cancel_token;
+
+// A new token holding one reference
+cancel_token *cancel_token_new();
+cancel_token *cancel_token_ref(cancel_token *token);
+void cancel_token_unref(cancel_token *token);
+
+// True once the token fired for anything but CANCEL_DONE
+bool cancel_requested(const cancel_token *token);
+cancel_reason cancel_reason_of(const cancel_token *token);
+
+// Fire the token; only the first call counts. Subscribers run on the calling thread before
+// it returns.
+void cancel_fire(cancel_token *token, cancel_reason reason);
+
+// Call cb(reason) when the token fires, or right away when it already has (then 0 is returned).
+// Otherwise returns an id for cancel_unsubscribe(). cb must not unsubscribe itself.
+uint64_t cancel_subscribe(cancel_token *token, std::function<void (cancel_reason)> cb);
+// Drop a subscription. A callback already running on another thread is not waited for.
+void cancel_unsubscribe(cancel_token *token, uint64_t id);
+
+typedef struct stream_data stream_data;
+
+// The stream's token, created on first use; borrowed, so take a reference to keep it past
+// the stream. Only on the stream's loop.
+cancel_token *stream_cancel_token(stream_data *sdata);
+
+// Fire the stream's token if anyone asked for it
+void stream_cancel(stream_data *sdata, cancel_reason reason);
@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// 流量录制：按连接抽样，把客户端发来的原始字节连同到达时间写进紧凑的二进制文件，供 h2replay 回放。
+// IO 线程只把记录拷进本线程预先分配的字节环（单生产者单消费者，无锁、无系统调用），
+// 后台线程定期批量写盘；环满时该连接停止录制（已录下的仍是完整可回放的前缀），从不阻塞 IO 线程
+//
+// 文件格式：8 字节魔数 "H2CAPTR1"、8 字节开始时间（微秒），之后是一条条记录：
+//   type(1 字节) conn_id(varint) time_us(varint, 相对开始时间) [len(varint) bytes]  —— 只有 DATA 带数据
+
+struct capture_policy {
+    bool enabled;
+    std::string path;
+    uint32_t sample;            // Capture one in sample connections per thread
+    size_t ring_bytes;          // Per thread, rounded up to a power of two
+    uint64_t max_bytes;         // No new connections are sampled once the file holds this much; 0 = no limit
+    double flush_interval;      // Seconds between batches
+};
+
+extern capture_policy g_capture_policy;
+
+enum capture_record_type {
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA = 2,
+    CAPTURE_CLOSE = 3,
+};
+
+// Open the file and start the writer thread. Returns false when the file cannot be created.
+bool capture_start();
+
+// Write out what is queued and stop the writer thread
+void capture_stop();
+
+// A session was created: decide whether the connection is sampled
+void capture_connection_open(connection_data *conn_data);
+
+// Bytes read from a sampled connection, before they are processed
+void capture_input(connection_data *conn_data, const void *data, size_t len);
+
+void capture_connection_close(connection_data *conn_data);
+
+// ---- reading, for the replayer ----
+
+struct capture_chunk {
+    int64_t time_us;            // Since the capture started
+    std::string bytes;
+};
+
+struct capture_connection {
+    uint64_t id;
+    int64_t open_us;
+    bool closed;                // False when the capture stopped early; the chunks are still a valid prefix
+    std::vector<capture_chunk> chunks;
+};
+
+// Read a capture file; connections come back in the order they were opened
+bool capture_load(const std::string &path, std::vector<capture_connection> *connections);
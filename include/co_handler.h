@@ -0,0 +1,335 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <muduo/net/EventLoop.h>
+
+#include "cancel.h"
+#include "util.h"
+
+// 协程 handler：Task<Response> handle(Request&)。handler 可以 co_await 请求体分块、定时器、
+// 工作线程池任务或任意回调式的异步调用（例如上游请求），恢复总在流所属的 IO 线程上进行；
+// 流式响应用 co_yield 逐块产出。流被重置或连接断开时协程帧直接销毁，挂起中的等待被丢弃；
+// 还排在线程池里没开始的 run_blocking 任务不再执行，已在执行的可通过取消令牌提前收手。
+//
+//   Task<Response> hello(Request &req)
+//   {
+//       std::string name = co_await req.body();
+//       co_await sleep_for(0.1);
+//       Response r;
+//       r.headers.emplace_back("content-type", "text/plain");
+//       r.body = "hello " + name;
+//       co_return r;
+//   }
+//   RequestHandler hello_handler_impl = make_co_handler(hello);
+
+typedef std::vector<std::pair<std::string, std::string>> header_list;
+
+struct Response {
+    int status = 200;
+    header_list headers;        // Lowercase names, no pseudo headers
+    std::string body;
+    header_list trailers;       // Sent after the body
+};
+
+struct co_stream;
+
+// Where a suspended coroutine resumes. stream is cleared when the stream closes, which
+// turns later resumptions into no-ops; only touched on loop.
+struct co_link {
+    muduo::net::EventLoop *loop;        // NULL in-process: everything resumes inline
+    co_stream *stream;
+    cancel_token *cancel;               // The stream's token, one reference held; readable from any thread
+
+    ~co_link() { cancel_token_unref(cancel); }
+};
+
+// Thrown from co_await run_blocking(...) when the stream was cancelled before the job ran
+struct request_cancelled : std::runtime_error {
+    request_cancelled() : std::runtime_error("request cancelled") {}
+};
+typedef std::shared_ptr<co_link> co_link_ptr;
+
+// Resume h on the link's loop after the current callback. Safe from any thread.
+void co_resume(const co_link_ptr &link, std::coroutine_handle<> h);
+
+// Run job on the shared worker pool (started on first use)
+void co_run_in_pool(std::function<void()> job);
+// Worker pool size; takes effect when called before the first co_run_in_pool
+void co_set_worker_threads(int threads);
+
+// Streaming response plumbing used by Task<Response>::promise_type
+bool co_stream_yield_head(co_stream *stream, Response &&head);
+bool co_stream_yield_chunk(co_stream *stream, std::string &&chunk);
+void co_stream_wait_writable(co_stream *stream, std::coroutine_handle<> h);
+
+template <typename T>
+class Task
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    // Suspends after a co_yield until most of the queued body has been sent
+    struct yield_awaiter {
+        co_stream *stream;
+        bool wait;
+        bool await_ready() const noexcept { return !wait; }
+        void await_suspend(std::coroutine_handle<> h) { co_stream_wait_writable(stream, h); }
+        void await_resume() const noexcept {}
+    };
+
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        co_link_ptr link;                       // Inherited from the awaiting coroutine
+        co_stream *stream = nullptr;
+        std::coroutine_handle<> continuation;
+        std::optional<T> value;
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+        void return_value(T v) { value.emplace(std::move(v)); }
+        void unhandled_exception() { error = std::current_exception(); }
+
+        // co_yield Response{...} starts a streamed response with its status and headers (and
+        // body as the first chunk); co_yield std::string appends a chunk. co_return ends it.
+        template <typename U = T>
+        requires std::is_same_v<U, Response>
+        yield_awaiter yield_value(Response head)
+        {
+            return yield_awaiter{stream, co_stream_yield_head(stream, std::move(head))};
+        }
+        template <typename U = T>
+        requires std::is_same_v<U, Response>
+        yield_awaiter yield_value(std::string chunk)
+        {
+            return yield_awaiter{stream, co_stream_yield_chunk(stream, std::move(chunk))};
+        }
+    };
+
+    Task(Task &&other) noexcept : _h(std::exchange(other._h, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (_h) {
+            _h.destroy();
+        }
+    }
+
+    // The caller takes over destroying the frame
+    handle_type release() { return std::exchange(_h, nullptr); }
+
+    // co_await on a Task runs it to completion and yields its value
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> parent)
+    {
+        _h.promise().link = parent.promise().link;
+        _h.promise().stream = parent.promise().stream;
+        _h.promise().continuation = parent;
+        return _h;
+    }
+    T await_resume()
+    {
+        if (_h.promise().error) {
+            std::rethrow_exception(_h.promise().error);
+        }
+        return std::move(*_h.promise().value);
+    }
+
+private:
+    explicit Task(handle_type h) : _h(h) {}
+
+    handle_type _h;
+};
+
+// co_await sleep_for(seconds): resume on the loop after a timer
+struct sleep_for {
+    double seconds;
+
+    bool await_ready() const noexcept { return seconds <= 0; }
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        co_link_ptr link = h.promise().link;
+        if (!link->loop) {
+            return false;   // No timers in-process
+        }
+        link->loop->runAfter(seconds, [link, h]() { co_resume(link, h); });
+        return true;
+    }
+    void await_resume() const noexcept {}
+};
+
+template <typename F, bool = std::is_invocable_v<F &, const cancel_token *>>
+struct blocking_result {
+    typedef std::invoke_result_t<F &> type;
+};
+template <typename F>
+struct blocking_result<F, true> {
+    typedef std::invoke_result_t<F &, const cancel_token *> type;
+};
+
+// co_await run_blocking(f): call f() on the worker pool and return its result on the loop.
+// A job still queued when its stream is cancelled is skipped. Long jobs can take the token,
+// f(const cancel_token *), and stop early once cancel_requested() turns true.
+template <typename F>
+struct blocking_call {
+    typedef typename blocking_result<F>::type result_type;
+    static_assert(!std::is_void_v<result_type>, "run_blocking needs a function returning a value");
+
+    // Outlives the coroutine frame if the stream closes while the job runs
+    struct state {
+        F f;
+        std::optional<result_type> result;
+        std::exception_ptr error;
+
+        void run(const cancel_token *cancel)
+        {
+            if (cancel_requested(cancel)) {
+                error = std::make_exception_ptr(request_cancelled());
+                return;
+            }
+            try {
+                if constexpr (std::is_invocable_v<F &, const cancel_token *>) {
+                    result.emplace(f(cancel));
+                } else {
+                    result.emplace(f());
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+    };
+    std::shared_ptr<state> st;
+
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        co_link_ptr link = h.promise().link;
+        if (!link->loop) {
+            st->run(link->cancel);
+            return false;
+        }
+        std::shared_ptr<state> job = st;
+        co_run_in_pool([job, link, h]() {
+            job->run(link->cancel);
+            co_resume(link, h);
+        });
+        return true;
+    }
+    result_type await_resume()
+    {
+        if (st->error) {
+            std::rethrow_exception(st->error);
+        }
+        return std::move(*st->result);
+    }
+};
+
+template <typename F>
+blocking_call<F> run_blocking(F f)
+{
+    return blocking_call<F>{std::make_shared<typename blocking_call<F>::state>(
+        typename blocking_call<F>::state{std::move(f), std::nullopt, nullptr})};
+}
+
+// co_await await_callback<T>(start): start(done) begins any callback-style operation (an
+// upstream request, a lookup on another thread) and calls done(value) exactly once, from any thread.
+template <typename T>
+struct callback_call {
+    std::function<void (std::function<void (T)>)> start;
+    std::shared_ptr<std::optional<T>> result;
+
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> h)
+    {
+        co_link_ptr link = h.promise().link;
+        std::shared_ptr<std::optional<T>> out = result;
+        start([link, h, out](T value) {
+            out->emplace(std::move(value));
+            co_resume(link, h);
+        });
+        return true;
+    }
+    T await_resume() { return std::move(**result); }
+};
+
+template <typename T>
+callback_call<T> await_callback(std::function<void (std::function<void (T)>)> start)
+{
+    return callback_call<T>{std::move(start), std::make_shared<std::optional<T>>()};
+}
+
+// The request as the coroutine sees it. The body arrives through read() or body(); until
+// the handler reads a chunk its bytes stay unacknowledged, so the client is flow controlled.
+class Request
+{
+public:
+    struct body_read {
+        co_stream *stream;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> h);
+        std::string await_resume();
+    };
+
+    const std::string &method() const { return _method; }
+    const std::string &path() const { return _path; }
+    const std::string &authority() const { return _authority; }
+    const header_list &headers() const { return _headers; }
+    // First value of a regular header, NULL when absent
+    const std::string *header(const std::string &name) const;
+    int32_t streamId() const { return _streamId; }
+    // Fires on reset, disconnect or deadline. Take a reference for work that may outlive the
+    // coroutine; the frame itself is destroyed when the stream closes.
+    cancel_token *cancelToken() const;
+    bool cancelled() const { return cancel_requested(cancelToken()); }
+    // Seconds left before the deadline (0 once it passed), nullopt when the request has none.
+    // Hand it on to downstream calls so they give up in time too.
+    std::optional<double> timeRemaining() const;
+
+    // Next body chunk; empty once the body is complete
+    body_read read() { return body_read{_stream}; }
+    // The rest of the body
+    Task<std::string> body();
+
+private:
+    friend struct co_stream;
+
+    co_stream *_stream;
+    int32_t _streamId;
+    std::string _method;
+    std::string _path;
+    std::string _authority;
+    header_list _headers;
+};
+
+typedef Task<Response> (*co_handler_fn)(Request &req);
+
+// Route entry running fn as a coroutine for each request
+RequestHandler make_co_handler(co_handler_fn fn);
+
+// Example: streams a line every 100ms (count from the request body, default 5) with a trailer
+extern RequestHandler ticks_handler_impl;
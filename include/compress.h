@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+// 响应压缩：在 handler 之后、data_read_callback 之前按 accept-encoding 选择编码
+
+// Content codings, used as a bit set for what a client accepts
+enum {
+    ENCODING_GZIP   = 1 << 0,
+    ENCODING_BROTLI = 1 << 1,   // only when built with MUDUOHTTP_HAVE_BROTLI
+    ENCODING_ZSTD   = 1 << 2,   // only when built with MUDUOHTTP_HAVE_ZSTD
+};
+
+struct compression_policy {
+    bool enabled;
+    size_t min_size;            // Bodies smaller than this go out as identity
+    size_t stream_threshold;    // Bodies at least this large are compressed chunk by chunk while sending
+    size_t cache_entries;       // Max precompressed variants kept per thread
+};
+
+extern compression_policy g_compression_policy;
+
+// Parse an accept-encoding value into ENCODING_* bits (codings with q=0 are excluded)
+int parse_accept_encoding(const uint8_t *value, size_t len);
+
+// True when the per content-type rules allow compressing this type
+bool is_compressible_type(const char *content_type, size_t len);
+
+// "gzip", "br" or "zstd"
+const char *encoding_name(int encoding);
+
+// Decide whether sdata's response body should be compressed and prepare it:
+// small bodies are replaced by their compressed form, large ones get sdata->encoder.
+// With cache_key the body must be immutable content; its compressed variants are built
+// once per thread at maximum level and reused (bodies under min_size are never compressed,
+// so a key only matters for larger ones). Returns the chosen encoding, or 0 for identity.
+int compress_response(stream_data *sdata, const char *content_type, size_t content_type_len,
+                      const char *cache_key);
+
+// Streaming encoder used by data_read_callback: compresses the unread part of in, which must
+// stay valid until the encoder is freed
+response_encoder *response_encoder_new(int encoding, int level, body_chain *in);
+
+ssize_t response_encoder_read(response_encoder *enc, uint8_t *buf, size_t length, uint32_t *data_flags);
+
+void response_encoder_free(response_encoder *enc);
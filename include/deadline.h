@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// 请求期限：路由可以声明延迟预算，客户端可以用 grpc-timeout 给出自己的期限，取两者中较早的。
+// 每个 IO 线程一个时间轮（10ms 一格）管理本线程的期限，只有一个定时器等最早有流的那一格，不做周期 tick；到期时先触发流的取消令牌，
+// 还没发响应的回 504（gRPC 请求回 grpc-status DEADLINE_EXCEEDED），已经开始发的 RST_STREAM(CANCEL)。
+// handler 可以查询剩余预算，转发给下游（代理会改写 grpc-timeout）。进程内会话没有定时器，只记录不执行
+
+struct deadline_policy {
+    double default_timeout;     // Seconds, for routes without their own budget; 0 = none
+    bool honor_grpc_timeout;    // Apply a grpc-timeout request header (it can only shorten the budget)
+    uint16_t status;            // Answer to expired requests that have no response yet: 504 or 503
+};
+
+extern deadline_policy g_deadline_policy;
+
+// Parse a grpc-timeout value ("100m", "5S", ...). Returns false when it is malformed.
+bool parse_grpc_timeout(const uint8_t *value, size_t len, int64_t *us);
+
+// A grpc-timeout header seen on the request; kept until the header block is complete
+void deadline_on_request_header(stream_data *sdata, const uint8_t *value, size_t len);
+
+// Request header block complete: settle the stream's deadline (route budget, default, client
+// header) and arm it on the loop's timer wheel
+void deadline_arm(nghttp2_session *session, stream_data *sdata);
+
+// Take the stream off the wheel; it is closing
+void deadline_disarm(stream_data *sdata);
+
+// Microseconds left before the stream's deadline: 0 once it passed, -1 when it has none
+int64_t deadline_remaining_us(const stream_data *sdata);
+
+// The remaining budget as a grpc-timeout value for a downstream call. Returns false when the
+// stream has no deadline.
+bool deadline_grpc_timeout(const stream_data *sdata, char *buf, size_t len);
@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// gRPC 终结：按 5 字节前缀从 DATA 分块里增量切出消息（整条落在一个分块里时直接给指向接收缓冲的视图，
+// 跨分块时才拼接），按 :path 分发到各方法的回调，支持一元、客户端流、服务端流和双向流，
+// 结束时用 nghttp2_submit_trailer 发送 grpc-status / grpc-message。不支持消息压缩。
+
+typedef enum {
+    GRPC_OK = 0,
+    GRPC_CANCELLED = 1,
+    GRPC_UNKNOWN = 2,
+    GRPC_INVALID_ARGUMENT = 3,
+    GRPC_DEADLINE_EXCEEDED = 4,
+    GRPC_NOT_FOUND = 5,
+    GRPC_ALREADY_EXISTS = 6,
+    GRPC_PERMISSION_DENIED = 7,
+    GRPC_RESOURCE_EXHAUSTED = 8,
+    GRPC_FAILED_PRECONDITION = 9,
+    GRPC_ABORTED = 10,
+    GRPC_OUT_OF_RANGE = 11,
+    GRPC_UNIMPLEMENTED = 12,
+    GRPC_INTERNAL = 13,
+    GRPC_UNAVAILABLE = 14,
+    GRPC_DATA_LOSS = 15,
+    GRPC_UNAUTHENTICATED = 16,
+} grpc_status_code;
+
+typedef enum {
+    GRPC_UNARY,                 // One request, one response
+    GRPC_CLIENT_STREAMING,      // Many requests, one response
+    GRPC_SERVER_STREAMING,      // One request, many responses
+    GRPC_BIDI_STREAMING,
+} grpc_method_kind;
+
+typedef struct grpc_call grpc_call;
+
+// One method of a service. Everything runs on the connection's loop.
+typedef struct {
+    const char *name;           // Method name, e.g. "SayHello"; NULL ends the table
+    grpc_method_kind kind;
+    // A request message. msg may point into the receive buffer: it is only valid during the call.
+    void (*on_message)(grpc_call *call, const char *msg, size_t len);
+    // Optional: the client sent its last message
+    void (*on_half_close)(grpc_call *call);
+    // Optional: the call went away before grpc_finish (reset, connection closed); call is freed afterwards
+    void (*on_cancel)(grpc_call *call);
+} grpc_method;
+
+struct grpc_policy {
+    size_t max_message;         // Larger request messages fail the call with RESOURCE_EXHAUSTED
+};
+
+extern grpc_policy g_grpc_policy;
+
+// Prefix route entry for one service: mount it at "/package.Service/" and list its methods
+RequestHandler make_grpc_service(const grpc_method *methods);
+
+// Queue a response message (copied). Returns false once the call is finished, or when a unary
+// or client-streaming method already sent its response.
+bool grpc_send_message(grpc_call *call, const char *msg, size_t len);
+
+// End the call with trailers; message may be NULL. A call finished before any message gets a
+// trailers-only response.
+void grpc_finish(grpc_call *call, grpc_status_code status, const char *message);
+
+void grpc_set_user_data(grpc_call *call, void *user_data);
+void *grpc_user_data(const grpc_call *call);
+// Request metadata of the call, such as its headers
+stream_data *grpc_call_stream(const grpc_call *call);
+
+// The request's content-type is application/grpc or one of its +proto style variants
+bool content_type_is_grpc(const stream_data *sdata);
+
+// Example service muduohttp.Echo: Unary returns the request, Bidi echoes each message
+extern RequestHandler grpc_echo_service_impl;
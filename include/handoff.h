@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// 平滑升级：旧进程通过 Unix socket 用 SCM_RIGHTS 把监听 fd 交给新进程
+// The new process connects to the handoff path, the old one answers with 'F' plus the
+// listening fds, and the new one replies 'A' once it is accepting on them. When other
+// descriptors go along (the HTTP/3 steering map), the tag is 'G' followed by a byte with the
+// number of listening fds, which come first.
+
+// Unix listening socket at path, replacing a stale socket file. Returns the fd or -1.
+int handoff_listen(const std::string& path);
+
+// Connect to the handoff socket of the running process. Returns the fd or -1.
+int handoff_connect(const std::string& path);
+
+// Old process side: pass the listening fds and the extra ones to the peer. Returns 0 or -1.
+int handoff_send_fds(int sock, const std::vector<int>& fds, const std::vector<int>& extra);
+
+// New process side: receive the listening fds into fds and the rest into extra, waiting up to
+// timeout seconds. Returns 0 or -1.
+int handoff_recv_fds(int sock, std::vector<int>* fds, std::vector<int>* extra, double timeout);
+
+// New process side: tell the old process we are accepting. Returns 0 or -1.
+int handoff_send_ack(int sock);
+
+// Old process side: wait up to timeout seconds for the ack. Returns 0 or -1.
+int handoff_wait_ack(int sock, double timeout);
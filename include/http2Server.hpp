@@ -1,101 +1,117 @@
+#pragma once
 #include <iostream>
 #include <string>
 #include <muduo/net/EventLoop.h>
-#include <muduo/net/TcpServer.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <muduo/net/TcpConnection.h>
+#include <atomic>
 #include <functional>
-#include <unordered_map>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
-#include "util.h"
+#include "http2Session.h"
+#include "listener.h"
 
-struct all_data{
-    nghttp2_session_callbacks *callbacks;
-    connection_data *conn_data;
-    nghttp2_session *session;
-};
+class UringTransport;
 
+// 连接管理与 muduo 的 TcpServer 相同，但监听 socket 由自己的 Listener 持有，
+// 这样平滑升级时可以把它交给新进程或从旧进程接管
 class http2Server
 {
 public:
     http2Server(muduo::net::EventLoop* loop,
         const muduo::net::InetAddress& listenAddr,
-        const std::string& nameArg):_tcpServer(loop,listenAddr,nameArg),_loop(loop)
-        {
-            _tcpServer.setConnectionCallback(std::bind(&http2Server::ConnectionCallback, this  ,std::placeholders::_1));
-            _tcpServer.setMessageCallback(std::bind(&http2Server::MessageCallback,this, std::placeholders::_1,std::placeholders::_2,std::placeholders::_3));
-        }
+        const std::string& nameArg);
+    ~http2Server();
+
     void setThreadNum(int num = 2)
     {
-        _tcpServer.setThreadNum(num);
+        _threadPool->setThreadNum(num);
     }
-    void start()
+
+    // Runs in each IO thread before its loop starts, e.g. to pin it to a CPU
+    void setThreadInitCallback(const muduo::net::EventLoopThreadPool::ThreadInitCallback& cb)
     {
-        _tcpServer.start();
+        _threadInitCallback = cb;
     }
 
+    // Accept upgrade requests on a Unix socket at path: the new process receives our
+    // listening sockets, then we drain for at most drainTimeout seconds and quit the loop.
+    void enableHandoff(const std::string& path, double drainTimeout);
+
+    // Take the listening sockets over from the process serving path instead of binding.
+    // Call before start(); returns false when no process answered.
+    bool takeOver(const std::string& path);
+
+    // Descriptors that come along with the listening sockets on a handoff, e.g. the HTTP/3
+    // steering map. The new process finds them in inheritedFds() after takeOver().
+    void addHandoffFd(int fd) { _handoffExtraFds.push_back(fd); }
+    const std::vector<int>& inheritedFds() const { return _inheritedFds; }
+
+    // Serve connections through io_uring instead of muduo's epoll TcpConnection: each IO
+    // thread accepts on the listening sockets itself. Call before start(); returns false and
+    // keeps epoll when the kernel or the build lacks multishot accept/recv.
+    bool enableIoUring();
+
+    // Also accept on a Unix stream socket, for sidecars on the same host (see Listener::bindUnix
+    // for "@name" and mode). Its connections share the IO threads and session setup with TCP
+    // ones. Call before start(); after a takeover the inherited sockets are used instead.
+    void listenUnix(const std::string& path, mode_t mode);
+
+    // Do not bind the TCP address, so only the Unix sockets serve. Call before start().
+    void disableTcp() { _listenTcp = false; }
+
+    void start();
+
+    // The IO loops, valid after start(); HTTP/3 puts its UDP sockets on the same ones
+    std::vector<muduo::net::EventLoop*> ioLoops() const { return _threadPool->getAllLoops(); }
+
+    // Stop accepting, send GOAWAY with the last processed stream ID on every session and
+    // quit the loop once they are all closed or drainTimeout expires.
+    void drain(double drainTimeout);
+
+    // Runs in the base loop when draining starts, after the listeners stopped; e.g. to send
+    // GOAWAY on the HTTP/3 connections and give the UDP port to the next process
+    void setDrainCallback(const std::function<void ()>& cb) { _drainCallback = cb; }
+
 private:
-    void ConnectionCallback(const muduo::net::TcpConnectionPtr& conn)
-    {
-        if(!conn->connected())
-        {
-            if(all_data_map.find(conn) != all_data_map.end())
-            {
-                all_data *data = all_data_map[conn];
-                nghttp2_session_del(data->session);
-                nghttp2_session_callbacks_del(data->callbacks);
-                free(data->conn_data);
-                delete data;
-                all_data_map.erase(conn);
-            }
-            conn->shutdown();
-        }
-        else
-        {
-            nghttp2_session_callbacks *callbacks; 
-            nghttp2_session_callbacks_new(&callbacks);
-            nghttp2_session_callbacks_set_send_callback(callbacks, send_callback);
-            nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_callback);
-            nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_callback);
-            nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_callback);
-            nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_callback);
-
-            connection_data *conn_data = (connection_data *)malloc(sizeof(connection_data));
-            conn_data->client_fd = conn;
-            conn_data->default_handler = &default_handler_impl; // Set default handler
-
-            nghttp2_session *session;
-            nghttp2_session_server_new(&session, callbacks, conn_data);
-
-            // Set default handler if not set
-            if (!conn_data->default_handler) {
-                conn_data->default_handler = &default_handler_impl;
-            }
-
-            nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100}; 
-            nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, &iv, 1);
-
-            all_data *data = new all_data;
-            data->callbacks = callbacks;
-            data->conn_data = conn_data;
-            data->session = session;
-            all_data_map[conn] = data;
-        }
-    }
-    
-    void MessageCallback(const muduo::net::TcpConnectionPtr& conn,muduo::net::Buffer*buffer,muduo::Timestamp time)
-    {
-        uint8_t* begin = (uint8_t *)buffer->peek();
-        ssize_t processed_len = nghttp2_session_mem_recv(all_data_map[conn]->session, begin, buffer->readableBytes());
-        if (processed_len < 0) {
-            std::cerr << "Error processing HTTP/2 data: " << nghttp2_strerror(processed_len) << std::endl;
-            conn->shutdown();
-            return;
-        }
-        buffer->retrieve(processed_len);
-        nghttp2_session_send(all_data_map[conn]->session);
+    void newConnection(int sockfd, const muduo::net::InetAddress& peerAddr);
+    void removeConnection(const muduo::net::TcpConnectionPtr& conn);
+    void removeConnectionInLoop(const muduo::net::TcpConnectionPtr& conn);
+    void openHandoff();
+    void handleHandoff();
+    void goawayInLoop(const muduo::net::TcpConnectionPtr& conn);
+    void startTransport(size_t index, const std::vector<int>& listenFds);
+    void quitIfDrained();
+
+    void ConnectionCallback(const muduo::net::TcpConnectionPtr& conn);
+    void MessageCallback(const muduo::net::TcpConnectionPtr& conn,muduo::net::Buffer*buffer,muduo::Timestamp time);
 
-    }
-    muduo::net::TcpServer _tcpServer;
     muduo::net::EventLoop* _loop;
+    muduo::net::InetAddress _listenAddr;
+    const std::string _name;
+    std::shared_ptr<muduo::net::EventLoopThreadPool> _threadPool;
+    muduo::net::EventLoopThreadPool::ThreadInitCallback _threadInitCallback;
+    std::vector<std::unique_ptr<Listener>> _listeners;
+    bool _listenTcp;
+    std::vector<std::pair<std::string, mode_t>> _unixPaths;   // Bound in start()
+    std::map<std::string, muduo::net::TcpConnectionPtr> _connections;  // only touched in _loop
+    int _nextConnId;
+    bool _started;
+
+    std::string _handoffPath;
+    double _drainTimeout;
+    int _handoffFd;
+    std::unique_ptr<muduo::net::Channel> _handoffChannel;
+    int _takeoverFd;                     // Link to the previous process, acked once we accept
+    std::vector<int> _handoffExtraFds;   // Passed on after the listening sockets
+    std::vector<int> _inheritedFds;      // The previous process's extra descriptors
+    std::atomic<bool> _draining;
+    std::function<void ()> _drainCallback;
 
-    std::unordered_map<muduo::net::TcpConnectionPtr, all_data*> all_data_map;
+    bool _useIoUring;
+    std::vector<UringTransport*> _transports;   // One per IO loop, each only touched in its loop
+    std::atomic<int> _uringConnections;
 };
@@ -0,0 +1,50 @@
+#pragma once
+#include <muduo/net/Buffer.h>
+#include <muduo/net/TcpConnection.h>
+
+#include "util.h"
+
+// 单个 http2 连接的全部状态
+struct all_data{
+    nghttp2_session_callbacks *callbacks;
+    connection_data *conn_data;
+    nghttp2_session *session;
+};
+
+// Create the nghttp2 server session for one connection and queue our SETTINGS.
+// Frames go to conn, or are appended to output when it is non-NULL (in-process use).
+all_data *http2_session_create(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *output);
+
+// Same for transports that own their sockets (io_uring): frames are appended to output, and
+// send_soon must queue nghttp2_session_send plus a flush of output on loop, then clear
+// conn_data->send_scheduled.
+all_data *http2_session_create_on(muduo::net::EventLoop *loop, const muduo::net::InetAddress &peer,
+                                  muduo::net::Buffer *output, const std::function<void()> &send_soon);
+
+void http2_session_destroy(all_data *data);
+
+// Feed inbound bytes into the session and flush whatever it wants to send.
+// Consumed bytes are retrieved from buffer. Returns 0, or a negative nghttp2 error code.
+int http2_session_on_input(all_data *data, muduo::net::Buffer *buffer);
+
+// Same for bytes not held in a Buffer; nghttp2 takes all of them unless it fails. held is what the
+// caller's own buffers for the connection take up, charged to its memory budget.
+int http2_session_on_bytes(all_data *data, const uint8_t *in, size_t len, size_t held);
+
+// Send GOAWAY carrying the last stream ID we processed; streams up to it still complete.
+void http2_session_goaway(all_data *data);
+
+// The peer broke the protocol (on_input/on_bytes failed): queue GOAWAY(PROTOCOL_ERROR) unless one
+// is queued already, and write out what the session still holds so it reaches the peer before
+// the connection closes.
+void http2_session_fail(all_data *data);
+
+// True when nghttp2 has nothing left to read or write, e.g. after GOAWAY once every stream closed.
+bool http2_session_finished(all_data *data);
+
+// Session attached to a connection by http2Server, or NULL
+all_data *http2_session_of(const muduo::net::TcpConnectionPtr &conn);
+
+// Flush the session from the connection's loop once the current callback returns. For
+// responses produced outside MessageCallback (streaming and asynchronous handlers).
+void http2_session_schedule_send(connection_data *conn_data);
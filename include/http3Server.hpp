@@ -0,0 +1,109 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+
+#include "util.h"
+
+// HTTP/3 端点：UDP 端口上跑 QUIC（ngtcp2 + nghttp3，TLS 用 quictls）。nghttp3 的回调直接驱动
+// stream_data 和 HTTP/2 共用的请求步骤（路由、请求限制、限流、deadline、handler、访问日志），
+// handler 对流的操作经 stream_transport 落到 nghttp3/ngtcp2 上。每个 IO 线程一个 SO_REUSEPORT 的 UDP socket，
+// recvmmsg/GRO 收、GSO/sendmmsg 发；服务端签发的连接 ID 首字节是进程代号加所属线程的序号，
+// 内核用 reuseport eBPF 按连接 ID 选 socket（不支持时由收到的线程转给所属线程），
+// 连接迁移后也落在同一个线程上；平滑升级时新旧进程各收各的连接。新连接先用 Retry 验证客户端地址（握手完成后发 NEW_TOKEN，
+// 同一地址再来时免掉这一个来回），伪造源地址的 Initial 既换不来放大的回包，也占不了连接状态。
+// 未开启 MUDUOHTTP_HTTP3（默认关闭）构建时 start() 返回 false，只提供 HTTP/2
+
+struct http3_policy {
+    // Advertised to HTTP/2 clients in an ALTSVC frame, 0 = not advertised. Set before the IO
+    // threads start; only cleared later, when the HTTP/3 sockets could not be set up.
+    std::atomic<uint16_t> alt_svc_port;
+    uint64_t max_streams;           // Concurrent request streams per connection
+    uint64_t stream_window;         // Request body bytes a stream may send ahead
+    uint64_t connection_window;
+    double idle_timeout;            // Seconds
+    double drain_grace;             // Seconds connections get after goaway() before the UDP sockets close
+    bool validate_address;          // Answer Initials without a token from us with Retry before any state exists
+};
+
+extern http3_policy g_http3_policy;
+
+// Connection IDs we issue start with one byte: the process generation in the top bit, the
+// owning loop's index in the other seven. Processes replacing each other on a handoff alternate
+// generations, so while the old one drains both can tell whose connection a packet belongs to.
+const size_t kQuicMaxLoops = 128;
+
+// Which of nloops IO loops owns the QUIC packet: the low seven bits of the first byte of its
+// destination connection ID, modulo nloops. Client-chosen IDs of new connections spread over the
+// loops the same way. Returns nloops for a packet too short to tell.
+size_t quic_packet_owner(const uint8_t *data, size_t len, size_t nloops);
+
+// Kernel steering of the port's SO_REUSEPORT group. The sockets sit in a BPF sockarray keyed by
+// their connection ID byte; the map is passed to the next process on a handoff, which registers its
+// sockets under the other generation and attaches a program that sends long-header packets (new
+// connections) to itself and short-header ones to whichever generation issued their ID, falling
+// back to itself once that process is gone.
+struct quic_steering {
+    int map;                        // BPF_MAP_TYPE_REUSEPORT_SOCKARRAY, -1 without eBPF support
+    unsigned generation;            // 0 or 1
+};
+
+// Reuse the previous process's map when one of inherited (fds passed on a handoff) is it, taking
+// the generation it does not use; otherwise create a map and start at generation 0. On kernels
+// without the map type, map is -1 and quic_steer_by_cid() falls back to classic BPF.
+void quic_steering_init(quic_steering *steering, const std::vector<int>& inherited);
+
+// Register fd, the socket of loop index, under our generation. Returns false without eBPF.
+bool quic_steering_add(const quic_steering *steering, size_t index, int fd);
+
+// Attach the steering program to fd's SO_REUSEPORT group so the kernel hands each packet to the
+// socket quic_packet_owner() names. Without eBPF this is a classic BPF program that picks the
+// socket by its position in the group, which is only right while the group holds nothing but
+// our sockets, bound in loop order; a handoff then leaves packets on the old sockets. Returns
+// false where neither is supported; packets are then forwarded in user space.
+bool quic_steer_by_cid(const quic_steering *steering, int fd, size_t nloops);
+
+// Point an HTTP/2 connection at the HTTP/3 port with an ALTSVC frame on its first request
+void http3_advertise(nghttp2_session *session, int32_t stream_id, connection_data *conn_data);
+
+class QuicEndpoint;
+
+class http3Server
+{
+public:
+    http3Server(muduo::net::EventLoop* loop, const muduo::net::InetAddress& listenAddr,
+                const std::string& certFile, const std::string& keyFile);
+    ~http3Server();
+
+    // Bind one UDP socket per IO loop and serve HTTP/3 on them. Call from loop's thread after
+    // the HTTP/2 server started its IO threads. inherited are the descriptors the previous
+    // process passed on a handoff (http2Server::inheritedFds()); its steering map is among them.
+    // Returns false when built without HTTP/3 support or when the certificate cannot be loaded.
+    bool start(const std::vector<muduo::net::EventLoop*>& ioLoops,
+               const std::vector<int>& inherited = std::vector<int>());
+
+    // The steering map, to pass on to the next process on a handoff (http2Server::addHandoffFd());
+    // -1 when the kernel has no eBPF reuseport support
+    int steeringFd() const { return _steering.map; }
+
+    // Send GOAWAY on every connection and accept no new ones. Each UDP socket closes once its
+    // connections are gone, at the latest after g_http3_policy.drain_grace; the rest are closed
+    // with H3_NO_ERROR then. Once the next process attached its steering program, our sockets
+    // only get the packets of our own connections; without eBPF they also take new clients'
+    // packets until they close, so the grace is kept short.
+    void goaway();
+
+private:
+    muduo::net::EventLoop* _loop;
+    muduo::net::InetAddress _listenAddr;
+    std::string _certFile;
+    std::string _keyFile;
+    void* _sslCtx;                          // SSL_CTX, shared by the endpoints
+    quic_steering _steering;
+    std::vector<QuicEndpoint*> _endpoints;  // One per IO loop, each only touched in its loop
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <sys/types.h>
+#include <functional>
+#include <string>
+#include <muduo/base/noncopyable.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+
+// 监听 socket：与 muduo 的 Acceptor 相同，但可以接管一个已存在的 fd（平滑升级时从旧进程传过来）
+class Listener : muduo::noncopyable
+{
+public:
+    typedef std::function<void (int sockfd, const muduo::net::InetAddress&)> NewConnectionCallback;
+
+    // Takes ownership of listenfd, which must already be bound.
+    Listener(muduo::net::EventLoop* loop, int listenfd);
+    ~Listener();
+
+    // Create a nonblocking TCP socket bound to addr. Aborts like muduo's Acceptor on failure.
+    static int bindTcp(const muduo::net::InetAddress& addr, bool reusePort);
+    // Create a nonblocking Unix stream socket bound to path; "@name" binds in the abstract
+    // namespace. A file left behind by a process that is gone is replaced and gets mode;
+    // a path some process still accepts on is an error. Aborts on failure too.
+    static int bindUnix(const std::string& path, mode_t mode);
+
+    void setNewConnectionCallback(const NewConnectionCallback& cb) { _newConnectionCallback = cb; }
+
+    // listen() and start accepting in the loop. With watch false the socket only listens and
+    // something else accepts on it (the io_uring transports).
+    void listen(bool watch = true);
+    // Stop accepting; the socket stays open so it can still be handed to another process
+    void stop();
+
+    int fd() const { return _listenfd; }
+    bool listening() const { return _listening; }
+
+private:
+    void handleRead();
+
+    muduo::net::EventLoop* _loop;
+    int _listenfd;
+    muduo::net::Channel _channel;
+    NewConnectionCallback _newConnectionCallback;
+    bool _listening;
+    int _idleFd;
+};
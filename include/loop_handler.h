@@ -0,0 +1,28 @@
+#pragma once
+#include <muduo/net/EventLoop.h>
+
+#include "util.h"
+
+// 每个 IO 线程一个 handler 实例：路由表和默认 handler 里登记的是 make_loop_handler() 生成的占位 handler，
+// 流开始时换成当前线程自己的实例。实例在 IO 线程启动时（CPU 绑定之后）由工厂创建，之后只在本线程使用，
+// 里面的缓存、计数、连接池都不用加锁；self->data 就是本线程的上下文。线程退出时销毁。
+// 进程内会话在调用线程上第一次用到时创建
+
+struct handler_factory {
+    // Build the instance for the calling thread; loop is its IO loop, NULL for in-process sessions
+    RequestHandler *(*create)(void *arg, muduo::net::EventLoop *loop);
+    // Optional: free an instance when its thread exits
+    void (*destroy)(void *arg, RequestHandler *handler);
+    void *arg;
+};
+
+// Placeholder for route tables and connection defaults. Register before the server starts,
+// typically as a global initializer; factory must outlive the process.
+RequestHandler make_loop_handler(const handler_factory *factory);
+
+// The calling thread's instance behind handler, created on first use; handler itself when it
+// is not a placeholder
+RequestHandler *loop_handler_resolve(RequestHandler *handler, muduo::net::EventLoop *loop);
+
+// Create the instances of every registered factory for this IO thread; run from its init callback
+void loop_handlers_init(muduo::net::EventLoop *loop);
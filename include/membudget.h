@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// 内存预算：每个连接累计 nghttp2 会话（经自定义 nghttp2_mem 分配）、请求头/请求体/响应体缓冲
+// 和收发 Buffer 占用的字节，汇总到所在 IO 线程和整个进程。超过软上限时缩小流控窗口、
+// 以 REFUSED_STREAM 拒绝新流；超过硬上限时给本线程占用最多的连接发 GOAWAY 并关闭。
+// 宁可按预期丢弃负载，也不要在高峰时被 OOM kill
+
+struct memory_budget_policy {
+    size_t soft_limit;          // Whole process; 0 disables the soft limit
+    size_t hard_limit;          // Whole process; 0 disables the hard limit
+    size_t loop_soft_limit;     // Per IO thread, 0 = only the process limits apply
+    size_t loop_hard_limit;
+    int32_t pressure_window;    // Stream and connection window advertised while over the soft limit
+};
+
+extern memory_budget_policy g_memory_budget_policy;
+
+enum memory_pressure {
+    MEMORY_NORMAL,
+    MEMORY_SOFT,                // New streams refused, windows shrunk
+    MEMORY_HARD,                // Largest connections shed
+};
+
+// Allocator for the connection's nghttp2 session; every allocation is charged to conn_data.
+// nghttp2 copies the struct, so it can be passed as a temporary.
+nghttp2_mem memory_budget_allocator(connection_data *conn_data);
+
+// Start and stop accounting a connection. Detaching releases whatever it is still charged.
+void memory_budget_attach(connection_data *conn_data);
+void memory_budget_detach(connection_data *conn_data);
+
+// Recompute what the stream's buffers hold (headers, in-memory body, spool batch, response body)
+// and charge the difference to its connection. Called after each step that may grow them.
+void memory_budget_update_stream(stream_data *sdata);
+
+// The stream is being freed: give back what it was charged
+void memory_budget_release_stream(stream_data *sdata);
+
+// Input was processed: charge the connection's output buffer plus held, what the transport keeps
+// for it besides (the muduo input Buffer, or the io_uring buffers in use), then shrink or restore
+// its windows and shed connections of this loop as the pressure requires.
+void memory_budget_check(connection_data *conn_data, size_t held);
+
+// Request header block complete: refuse the stream with RST_STREAM(REFUSED_STREAM) while over the
+// soft limit. Returns true when refused; the stream's DATA is then dropped.
+bool memory_budget_refuse(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+
+memory_pressure memory_budget_pressure();
+
+// Bytes charged in the whole process, accurate to a few KB per thread
+int64_t memory_budget_used();
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+#include "util.h"
+
+// 运行指标：每个 IO 线程各自计数（只有本线程写，不争用缓存行），读取时汇总
+
+enum metric_id {
+    METRIC_CONNECTIONS,         // Sessions created
+    METRIC_REQUESTS,            // Request header blocks received
+    METRIC_RATE_LIMITED,        // Streams rejected by the rate limiter
+    METRIC_RESETS_RECEIVED,     // RST_STREAM frames from clients
+    METRIC_CALM_GOAWAYS,        // Connections closed with GOAWAY(ENHANCE_YOUR_CALM)
+    METRIC_ACCESS_LOG_DROPPED,  // Access log records dropped because the writer fell behind
+    METRIC_REQUESTS_TOO_LARGE,  // Streams rejected by request size limits
+    METRIC_MEMORY_REFUSED,      // Streams refused over the soft memory limit
+    METRIC_MEMORY_SHED,         // Connections closed over the hard memory limit
+    METRIC_CAPTURE_DROPPED,     // Captured connections cut short because the writer fell behind
+    METRIC_DEADLINE_EXCEEDED,   // Streams answered 504 or reset when their deadline passed
+    METRIC_RESPONSES_2XX,       // Responses by status class, counted by the ResponseMetrics middleware
+    METRIC_RESPONSES_3XX,
+    METRIC_RESPONSES_4XX,
+    METRIC_RESPONSES_5XX,
+    METRIC_COUNT
+};
+
+void metrics_add(metric_id id, uint64_t n = 1);
+
+// Sum over all threads
+uint64_t metrics_get(metric_id id);
+
+// Remember a connection that broke a budget; the most recent few are listed in the report
+void metrics_report_offender(const connection_data *conn_data, const char *reason);
+
+// Admin routes answer only these: loopback and Unix socket peers, and in-process sessions
+bool is_admin_client(const connection_data *conn_data);
+
+// Plain-text report, one "name value" per line
+std::string metrics_render();
+
+// Serves metrics_render() to loopback clients, 404 to everyone else
+extern RequestHandler metrics_handler_impl;
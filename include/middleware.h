@@ -0,0 +1,201 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "loop_handler.h"
+#include "util.h"
+
+// 中间件：鉴权、CORS、响应头改写、压缩开关、指标这类横切逻辑按模板链在编译期组合到 handler 外面，
+// 不用再复制到每个 handler 里。每个阶段是只有静态成员函数的类型，没有定义的钩子在编译期跳过，
+// 阶段之间的调用全部内联；整条链对请求只是把原来那一次 on_request_headers 分发换成链的入口，
+// 之后流直接交给内层 handler。需要运行时配置的阶段放进 middleware_list，用 Dynamic<&list> 挂进链。
+//
+// 阶段可以定义：
+//   static bool on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+//       请求头收齐时按链的顺序调用；已经用 middleware_respond() 作答则返回 false，后面的阶段和 handler 都不再运行
+//   static void on_response(stream_data *sdata, response_headers &headers);
+//       响应头提交前按相反顺序调用，流上的每个响应都会经过（submit_response_headers()），包括 404、
+//       请求体超限的 413 和超时的 504；只有选路之前就拒绝的流不经过，见 ResponseMetrics
+
+// Response headers as the stages see them. Names must be lowercase literals; values added here
+// are copied and live until the response is submitted.
+struct response_headers {
+    std::vector<nghttp2_nv> nva;
+    std::deque<std::string> storage;
+
+    const nghttp2_nv *find(const char *name) const;
+    void add(const char *name, const std::string &value);
+    // Replace every field called name with one holding value
+    void set(const char *name, const std::string &value);
+    void remove(const char *name);
+    // :status as a number, 0 when missing
+    uint16_t status() const;
+};
+
+// First value of a request header (name lowercase), false when absent
+bool request_header_value(const stream_data *sdata, const char *name, std::string *value);
+
+// Answer the request from a stage: a headers-only response with status and extra, passed through
+// the response stages. The stream then counts as rejected: its DATA is dropped and no handler runs.
+void middleware_respond(nghttp2_session *session, stream_data *sdata, uint16_t status,
+                        const nghttp2_nv *extra = NULL, size_t nextra = 0);
+
+// Stages configured at run time, e.g. from command line flags. Fill the list before the server starts.
+struct middleware {
+    bool (*on_request)(void *arg, nghttp2_session *session, int32_t stream_id, stream_data *sdata);     // Optional
+    void (*on_response)(void *arg, stream_data *sdata, response_headers &headers);                     // Optional
+    void *arg;
+};
+
+struct middleware_list {
+    std::vector<middleware> stages;
+};
+
+struct cors_policy {
+    const char *allow_origin;       // Access-Control-Allow-Origin, e.g. "*"; NULL = Cors stage does nothing
+    const char *allow_methods;      // For preflight requests
+    const char *allow_headers;
+    int max_age;                    // Seconds a preflight answer may be cached
+};
+
+struct auth_policy {
+    std::string bearer_token;       // Expected "authorization: Bearer <token>"; empty = BearerAuth lets everyone in
+    const char *realm;
+};
+
+extern cors_policy g_cors_policy;
+extern auth_policy g_auth_policy;
+
+// Answer CORS preflight requests and add Access-Control-Allow-Origin to responses of cross-origin requests
+struct Cors {
+    static bool on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+    static void on_response(stream_data *sdata, response_headers &headers);
+};
+
+// 401 unless the request carries g_auth_policy.bearer_token
+struct BearerAuth {
+    static bool on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+};
+
+// nosniff and a strict referrer policy on every response
+struct SecurityHeaders {
+    static void on_response(stream_data *sdata, response_headers &headers);
+};
+
+// Send the response uncompressed whatever the client accepts, e.g. for bodies that are compressed already
+struct NoCompression {
+    static bool on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+    {
+        sdata->accept_encoding = 0;
+        return true;
+    }
+};
+
+// Count responses by status class (muduohttp_responses_Nxx_total). Streams turned away before the
+// route is known never reach the stages and are not counted here: REFUSED_STREAM under memory
+// pressure or the rate limit, its 429, and the 413/431 for oversized headers or a declared body.
+// Those have their own counters.
+struct ResponseMetrics {
+    static void on_response(stream_data *sdata, response_headers &headers);
+};
+
+// Run the stages of *List in order; response stages in reverse
+template <middleware_list *List>
+struct Dynamic {
+    static bool on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+    {
+        for (const middleware &m : List->stages) {
+            if (m.on_request && !m.on_request(m.arg, session, stream_id, sdata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static void on_response(stream_data *sdata, response_headers &headers)
+    {
+        for (auto it = List->stages.rbegin(); it != List->stages.rend(); ++it) {
+            if (it->on_response) {
+                it->on_response(it->arg, sdata, headers);
+            }
+        }
+    }
+};
+
+template <typename... Stages>
+struct pipeline {
+    static constexpr bool has_response =
+        (requires(stream_data *sdata, response_headers &headers) { Stages::on_response(sdata, headers); } || ...);
+
+    static bool request(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+    {
+        return (request_stage<Stages>(session, stream_id, sdata) && ...);
+    }
+
+    static void response(stream_data *sdata, response_headers *headers)
+    {
+        response_from<Stages...>(sdata, *headers);
+    }
+
+    // Entry of the chain: runs the stages, then hands the stream over to the inner handler
+    static void on_request_headers(RequestHandler *self, nghttp2_session *session, int32_t stream_id,
+                                   stream_data *sdata)
+    {
+        if constexpr (has_response) {
+            sdata->response_stage = response;
+        }
+        // A stream answered by a stage never becomes the inner handler's, not even for on_stream_close
+        if (!request(session, stream_id, sdata)) {
+            return;
+        }
+        RequestHandler *inner = loop_handler_resolve((RequestHandler *)self->data, sdata->conn->loop);
+        sdata->handler = inner;
+        if (inner->on_request_headers) {
+            inner->on_request_headers(inner, session, stream_id, sdata);
+        }
+    }
+
+    // Only reached when the pipeline is used without on_request_headers having run
+    static void handle_request(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+    {
+        RequestHandler *inner = loop_handler_resolve((RequestHandler *)self->data, sdata->conn->loop);
+        inner->handle_request(inner, session, stream_id, sdata);
+    }
+
+private:
+    template <typename S>
+    static bool request_stage(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+    {
+        if constexpr (requires { S::on_request(session, stream_id, sdata); }) {
+            return S::on_request(session, stream_id, sdata);
+        } else {
+            return true;
+        }
+    }
+
+    template <typename S = void, typename... Rest>
+    static void response_from(stream_data *sdata, response_headers &headers)
+    {
+        if constexpr (!std::is_void_v<S>) {
+            response_from<Rest...>(sdata, headers);
+            if constexpr (requires { S::on_response(sdata, headers); }) {
+                S::on_response(sdata, headers);
+            }
+        }
+    }
+};
+
+// Wrap inner in the stages, outermost first: make_pipeline<Cors, BearerAuth>(&api_handler_impl).
+// inner may be a make_loop_handler() placeholder.
+template <typename... Stages>
+RequestHandler make_pipeline(RequestHandler *inner)
+{
+    RequestHandler handler = {};
+    handler.handle_request = pipeline<Stages...>::handle_request;
+    handler.data = inner;
+    handler.on_request_headers = pipeline<Stages...>::on_request_headers;
+    return handler;
+}
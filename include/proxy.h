@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <muduo/net/InetAddress.h>
+
+#include "util.h"
+
+// 反向代理：把 /proxy/ 下的流转发给上游 HTTP/2 服务。每个 IO 线程维护少量到上游的
+// 持久 nghttp2 客户端连接（make_loop_handler() 的每线程实例，线程启动时就连上游），多个下游流复用其上；请求和响应体边收边转发，
+// 窗口只在数据被另一侧发出后才归还，因此流控是端到端的。
+
+struct proxy_config {
+    bool enabled;
+    muduo::net::InetAddress address;    // Upstream server
+    std::string authority;              // host:port as given, for logging
+    int connections;                    // Upstream connections per IO loop
+    std::string strip_prefix;           // Removed from :path before forwarding
+    double pending_timeout;             // Seconds a stream may wait for an upstream connection
+};
+
+extern proxy_config g_proxy_config;
+
+// Set the upstream from "host:port" (resolved once, at startup). Returns false if invalid.
+bool proxy_set_upstream(const char *hostport);
+
+extern RequestHandler proxy_handler_impl;
@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <muduo/net/InetAddress.h>
+
+#include "util.h"
+
+// 限流：每个 IO 线程一张令牌桶表，按客户端地址（或指定请求头的值）计数，
+// 在请求头块收完时检查，超限的流不会进入 handler，也不会缓存请求体
+
+enum rate_limit_action {
+    RATE_LIMIT_REFUSE,      // RST_STREAM(REFUSED_STREAM); clients may retry it safely
+    RATE_LIMIT_429,         // 429 Too Many Requests with retry-after
+};
+
+struct rate_limit_policy {
+    bool enabled;
+    double rate;                // Tokens added per second
+    double burst;               // Bucket size
+    std::string key_header;     // When set and present, key by this header's value instead of the peer
+    rate_limit_action action;
+    size_t table_size;          // Buckets per thread, rounded up to a power of two
+};
+
+extern rate_limit_policy g_rate_limit_policy;
+
+// Bucket key for a peer address; computed once per connection
+uint64_t rate_limit_peer_key(const muduo::net::InetAddress &peer);
+
+// Charge one request to the stream's bucket. When it is empty, reject the stream as the
+// policy says and return true; the stream's handler is replaced so nothing else runs.
+bool rate_limit_reject(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// 请求大小限制：每条路由可以有自己的上限（请求体字节数、请求头个数、请求头总字节数），
+// 请求头边收边计数，content-length 在请求头块收完时就检查，没有 content-length 时按已收到的 DATA 累计，
+// 超限立即回 431/413（已交给流式 handler 的流直接 RST_STREAM），不会把超限的数据缓存下来
+
+struct request_limit_policy {
+    uint64_t max_body;          // Request body bytes; 0 is unlimited
+    size_t max_header_count;    // Header fields, pseudo-headers included; 0 is unlimited
+    size_t max_header_bytes;    // Sum of name + value + 32 per field, as HPACK sizes a header list; 0 is unlimited
+};
+
+// Limits of routes that do not set their own
+extern request_limit_policy g_request_limit_policy;
+
+// Limits that apply to the stream: its route's, or the default ones
+const request_limit_policy *request_limits(const stream_data *sdata);
+
+// Count one request header field. Returns false once the header limits are exceeded; the
+// caller stops collecting headers and the stream is answered 431 when its block is complete.
+bool request_limit_header(stream_data *sdata, size_t namelen, size_t valuelen);
+
+// Request header block complete: answer 431 for oversized headers, or 413 when content-length
+// is over the body limit. Returns true when the stream was rejected; nothing else should run.
+bool request_limit_reject(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+
+// Count a DATA chunk against the body limit before it is buffered or handed to a handler.
+// Returns true when the chunk must be dropped: the stream was rejected now or earlier.
+bool request_limit_data(nghttp2_session *session, int32_t stream_id, stream_data *sdata, size_t len);
+
+// The stream's response ended. For a rejected request the client may still be sending; it gets
+// RST_STREAM(NO_ERROR) so the rest of the upload is never sent (RFC 9113 section 8.1).
+void request_limit_response_sent(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+
+#include "reqlimit.h"
+#include "util.h"
+
+// 路由表：:path -> handler，以及每条路由的附加配置
+
+// A resource the client should start fetching before the final response arrives
+typedef struct {
+    const char *path;
+    const char *as;                 // Preload destination: style, script, font, image ...
+} preload_link;
+
+struct route_config {
+    const char *path;
+    bool prefix;                    // Match path as a prefix instead of exactly
+    RequestHandler *handler;
+    const preload_link *preload;    // Optional; sent as 103 Early Hints, ends at path == NULL
+    bool push;                      // Also PUSH_PROMISE preloaded static assets when the peer enables push
+    const request_limit_policy *limits; // Optional; g_request_limit_policy when NULL
+    double timeout;                 // Latency budget in seconds; 0 = g_deadline_policy's default, < 0 = none
+    std::string link_header;        // Link value built from preload at startup
+};
+
+// Static content served under /static/ and available for push
+typedef struct {
+    const char *path;
+    const char *content_type;
+    const char *body;
+    size_t len;
+} static_asset;
+
+// Route for a :path value, or NULL when the connection's default handler applies
+const route_config *find_route(const uint8_t *path, size_t len);
+
+// Asset served at path; a query string or fragment is ignored
+const static_asset *find_static_asset(const char *path, size_t len);
+
+// Send a 103 Early Hints response with link as its Link header. Must come before the final response.
+int submit_early_hints(stream_data *sdata, const char *link, size_t linklen);
+
+// Request header block complete: send the route's early hints and, on HTTP/2, push its assets if allowed
+void route_on_request_headers(nghttp2_session *session, int32_t stream_id, stream_data *sdata);
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "util.h"
+
+// 请求体落盘：缓存的请求体超过阈值后，后续数据攒批写进无名临时文件（O_TMPFILE），
+// 请求收完时把文件 mmap 成 sdata->body，handler 照常按内存读取，常驻内存不再随上传大小增长
+
+struct body_spool_policy {
+    size_t threshold;           // Bodies larger than this go to disk; 0 never spools
+    std::string dir;            // Where the unnamed temp files live
+    size_t write_batch;         // Bytes collected before each write()
+};
+
+extern body_spool_policy g_body_spool_policy;
+
+// Spooled body of one stream (sdata->spool)
+struct body_spool {
+    int fd;
+    size_t file_len;            // Bytes written to fd
+    char *batch;                // Not yet written
+    size_t batch_len;
+    void *map;                  // Set once the body is complete
+    bool failed;
+};
+
+// Add a DATA chunk to the stream's buffered body, moving it to disk once it passes the
+// threshold. Returns false when the disk write failed; the stream should be reset.
+bool spool_body_append(stream_data *sdata, const uint8_t *data, size_t len);
+
+// END_STREAM: map a spooled body so sdata->body/body_len cover all of it. Returns false on failure.
+bool spool_body_finish(stream_data *sdata);
+
+// File holding the stream's body, or -1 when it is in memory
+int spool_body_fd(const stream_data *sdata);
+
+// Unmap and close; called from stream_data_close instead of freeing sdata->body
+void spool_body_free(stream_data *sdata);
@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+// 请求阶段计时：抽样的流在收到 HEADERS、请求结束、handler 开始/结束、首个 DATA 发出和关闭时
+// 记下单调时钟时间，关闭时写进本线程的环形缓冲（无锁，覆盖最旧的），
+// /_admin/trace 把最近的记录导出为 Chrome trace / Perfetto 可以打开的 JSON
+
+enum trace_phase {
+    TRACE_HEADERS,          // First request HEADERS
+    TRACE_REQUEST_END,      // END_STREAM received
+    TRACE_HANDLER_START,
+    TRACE_HANDLER_END,      // Synchronous part of the handler returned
+    TRACE_FIRST_DATA,       // First response DATA frame sent
+    TRACE_CLOSE,
+    TRACE_PHASE_COUNT
+};
+
+struct trace_policy {
+    bool enabled;
+    uint32_t sample;            // Trace one in sample streams per thread
+    size_t ring_records;        // Most recent streams kept per thread, rounded up to a power of two
+};
+
+extern trace_policy g_trace_policy;
+
+// Lives in stream_data; all zero for streams that are not sampled
+struct stream_trace {
+    bool on;
+    int64_t ns[TRACE_PHASE_COUNT];
+};
+
+inline int64_t trace_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);    // vDSO, no syscall
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Record the first time a sampled stream reaches phase
+inline void trace_stamp(stream_trace *trace, trace_phase phase)
+{
+    if (trace->on && !trace->ns[phase]) {
+        trace->ns[phase] = trace_now_ns();
+    }
+}
+
+struct stream_data;
+struct RequestHandler;
+
+// Sample a new stream and stamp TRACE_HEADERS when it is picked
+void trace_stream_begin(stream_data *sdata);
+
+// Stamp TRACE_CLOSE and keep the stream's timings. Called from stream_data_close.
+void trace_stream_end(stream_data *sdata);
+
+// Chrome trace JSON of the kept streams of every thread
+std::string trace_render();
+
+// Serves trace_render() to loopback clients, 404 to everyone else
+extern RequestHandler trace_handler_impl;
@@ -0,0 +1,71 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <muduo/base/noncopyable.h>
+#include <muduo/net/InetAddress.h>
+
+// UDP 批量收发：recvmmsg 一次取多个报文，内核开了 GRO 时一个缓冲里是若干等长的报文段；
+// 发送端把发往同一地址的等长报文攒成一个 GSO 报文（UDP_SEGMENT），再用 sendmmsg 一次交给内核。
+// 监听通配地址时用 IP_PKTINFO 记下报文的目的地址，回复从同一个本地地址发出。
+// 只在所属 IO 线程里使用
+class UdpSocket : muduo::noncopyable
+{
+public:
+    typedef std::function<void (const uint8_t* data, size_t len,
+                                const muduo::net::InetAddress& peer,
+                                const muduo::net::InetAddress& local)> PacketCallback;
+
+    // Create a nonblocking UDP socket bound to addr, with GRO and packet info enabled where the
+    // kernel has them. reusePort lets one socket per IO loop share the port. Aborts on failure.
+    static int bind(const muduo::net::InetAddress& addr, bool reusePort);
+
+    // Most datagrams one GSO train may carry (the kernel's UDP_MAX_SEGMENTS)
+    static const size_t kMaxSegments = 64;
+
+    // Takes ownership of fd
+    explicit UdpSocket(int fd);
+    ~UdpSocket();
+
+    int fd() const { return _fd; }
+    bool gso() const { return _gso; }
+
+    // Read until the socket is empty or maxBatches recvmmsg calls were made, calling cb once
+    // per datagram (GRO trains are split back into their segments). Returns the datagram count.
+    size_t receive(const PacketCallback& cb, int maxBatches = 4);
+
+    // Queue len bytes for peer: one datagram, or a train of segmentSize-byte datagrams where
+    // only the last may be shorter. local is the source address, or the bound one when unset.
+    void send(const muduo::net::InetAddress& peer, const muduo::net::InetAddress& local,
+              const uint8_t* data, size_t len, size_t segmentSize);
+
+    // Hand queued datagrams to the kernel. Returns false when the socket buffer filled up;
+    // what is left stays queued for the next flush (wait for POLLOUT).
+    bool flush();
+
+    bool hasPending() const { return _sent < _pending.size(); }
+
+    // Close the socket now, dropping whatever is still queued. It leaves the port's SO_REUSEPORT
+    // group, so the kernel stops handing it packets.
+    void close();
+
+private:
+    struct Outgoing {
+        muduo::net::InetAddress peer;
+        muduo::net::InetAddress local;
+        bool hasLocal;
+        std::string data;
+        size_t segmentSize;         // 0 or len: a single datagram
+    };
+
+    void splitTrain(size_t index);
+
+    int _fd;
+    bool _gso;
+    bool _wildcard;                 // Bound to 0.0.0.0 or ::, replies need an explicit source
+    std::vector<uint8_t> _recvBuffers;
+    std::vector<Outgoing> _pending;
+    size_t _sent;                   // _pending before this are in the kernel
+};
@@ -0,0 +1,104 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <muduo/base/noncopyable.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// 精简的 io_uring 封装：直接用系统调用，不依赖 liburing。
+// 只有创建它的线程可以提交和收割（SINGLE_ISSUER），每个 IO 线程一个实例。
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define MUDUOHTTP_HAVE_IO_URING 1
+
+class Uring : muduo::noncopyable
+{
+public:
+    explicit Uring(unsigned entries);
+    ~Uring();
+
+    // False when the kernel refused the ring (too old, or io_uring disabled)
+    bool ok() const { return _fd >= 0; }
+    // Readable while completions are waiting, so it can sit in a muduo Channel
+    int fd() const { return _fd; }
+
+    // Next free SQE, zeroed. Submits queued ones first when the queue is full; NULL when the
+    // kernel still takes none, e.g. until the completions behind EBUSY are reaped.
+    struct io_uring_sqe *getSqe();
+    // Hand queued SQEs to the kernel without waiting. Returns how many, or -errno.
+    int submit();
+    // Submit and block until at least one completion is ready. Returns how many were submitted, or -errno.
+    int submitAndWait();
+
+    // Call f(const io_uring_cqe&) for each ready completion and mark them seen.
+    template <typename F>
+    unsigned reap(F f)
+    {
+        unsigned seen = 0;
+        for (;;) {
+            unsigned head = *_cqHead;
+            unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (!cqOverflowed()) {
+                    break;
+                }
+                flushOverflow();
+                continue;
+            }
+            for (; head != tail; ++head, ++seen) {
+                f(_cqes[head & _cqMask]);
+            }
+            __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+        }
+        return seen;
+    }
+
+    // Provided buffer ring for multishot recv: entries buffers of bufSize bytes in group bgid.
+    // entries must be a power of two.
+    bool setupBufferRing(uint16_t bgid, unsigned entries, size_t bufSize);
+    char *buffer(uint16_t bid) const { return _bufBase + (size_t)bid * _bufSize; }
+    // Give a buffer back to the kernel once its bytes are consumed
+    void recycleBuffer(uint16_t bid);
+
+    // Kernel probe: can this process create a ring with multishot accept/recv and buffer rings?
+    static bool supported();
+
+private:
+    bool sqFull() const;
+    bool cqOverflowed() const;
+    void flushOverflow();
+
+    int _fd;
+    unsigned _sqEntries;
+    void *_sqRing;
+    size_t _sqRingSize;
+    void *_cqRing;
+    size_t _cqRingSize;
+    struct io_uring_sqe *_sqes;
+    size_t _sqesSize;
+
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned *_sqFlags;
+    unsigned *_sqArray;
+    unsigned _sqMask;
+    unsigned _sqeTail;          // Local tail, published on submit
+    unsigned _sqeSubmitted;
+
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe *_cqes;
+
+    struct io_uring_buf *_bufRing;      // Tail overlays _bufRing[0].resv
+    size_t _bufRingSize;
+    unsigned _bufMask;
+    uint16_t _bufTail;
+    char *_bufBase;
+    size_t _bufSize;
+    uint16_t _bgid;
+};
+
+#endif
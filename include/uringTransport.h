@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <muduo/base/noncopyable.h>
+#include <muduo/net/Buffer.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TimerId.h>
+
+#include "uring.h"
+
+// io_uring 连接后端：每个 IO 线程一个 ring，自己在共享的监听 fd 上 multishot accept，
+// 用 multishot recv + provided buffer ring 收数据，每个连接同时只有一个 send 在途。
+// ring fd 挂在 muduo 的 Channel 上，所以定时器、queueInLoop 和上游连接照常工作。
+
+#ifdef MUDUOHTTP_HAVE_IO_URING
+
+struct all_data;
+
+class UringTransport : muduo::noncopyable
+{
+public:
+    typedef std::function<void ()> ConnectionCountCallback;
+
+    // Must be constructed, used and destroyed in loop's thread
+    explicit UringTransport(muduo::net::EventLoop* loop);
+    ~UringTransport();
+
+    bool ok() const { return _ring.ok() && _buffersReady; }
+
+    // Called after each accepted connection and after each closed one
+    void setOpenCallback(const ConnectionCountCallback& cb) { _openCallback = cb; }
+    void setCloseCallback(const ConnectionCountCallback& cb) { _closeCallback = cb; }
+
+    // Accept connections on listenfd, which must already be listening
+    void accept(int listenfd);
+    // Cancel the accepts; the listening sockets themselves stay open
+    void stopAccepting();
+    // Send GOAWAY on every session; connections close once their streams finish
+    void goawayAll();
+
+    size_t connections() const { return _conns.size(); }
+
+private:
+    struct Conn;
+    typedef std::shared_ptr<Conn> ConnPtr;
+
+    enum Op { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_CANCEL };
+
+    void handleRead();
+    void handleCompletion(uint64_t userData, int res, uint32_t flags);
+    void onAccept(size_t index, int res, uint32_t flags);
+    void onRecv(const ConnPtr& conn, int res, uint32_t flags);
+    void onSend(const ConnPtr& conn, int res);
+
+    void armAccept(size_t index);
+    void retryAcceptLater(size_t index);
+    void retryAccepts();
+    void cancelAccepts();
+    void armRecv(const ConnPtr& conn);
+    void flush(const ConnPtr& conn);
+    void sendSoon(const std::weak_ptr<Conn>& weak);
+    void shutdown(const ConnPtr& conn);
+    void beginClose(const ConnPtr& conn);
+    void releaseIfIdle(const ConnPtr& conn);
+    // The ring had no free SQE for conn's recv or send: retried once completions were reaped
+    void stall(const ConnPtr& conn);
+    void resumeStalled();
+
+    muduo::net::EventLoop* _loop;
+    Uring _ring;
+    bool _buffersReady;
+    muduo::net::Channel _channel;
+    std::vector<int> _listenFds;
+    bool _accepting;
+    std::vector<size_t> _acceptsToRetry;
+    muduo::net::TimerId _acceptRetry;   // Valid while _acceptsToRetry is non-empty
+    bool _cancelPending;                // stopAccepting() found the ring full
+    std::vector<ConnPtr> _stalled;
+    muduo::net::TimerId _stallRetry;    // Valid while _stalled is non-empty
+    bool _draining;
+    uint64_t _nextId;
+    std::unordered_map<uint64_t, ConnPtr> _conns;
+    ConnectionCountCallback _openCallback;
+    ConnectionCountCallback _closeCallback;
+};
+
+#endif
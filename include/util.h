@@ -1,8 +1,11 @@
+#pragma once
 #include <string.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <functional>
+#include <muduo/net/InetAddress.h>
 #include <muduo/net/TcpConnection.h>
 
 #include <stdlib.h>
@@ -11,29 +14,120 @@
 #include <sys/socket.h>
 #include <nghttp2/nghttp2.h>
 
+#include "body_chain.h"
+#include "trace.h"
+
 
 // http2 相关处理
 typedef struct RequestHandler RequestHandler;
+typedef struct response_encoder response_encoder;
+typedef struct route_config route_config;
+
+typedef struct stream_data stream_data;
+typedef struct connection_data connection_data;
+typedef struct body_spool body_spool;
+typedef struct cancel_token cancel_token;
+typedef struct handler_factory handler_factory;
+typedef struct response_headers response_headers;
+typedef struct stream_transport stream_transport;
+
+// A stream's deadline and its place on the loop's timer wheel (deadline.cc)
+struct stream_deadline {
+    int64_t at_us;                 // Absolute, 0 = none
+    int64_t client_us;             // From grpc-timeout, 0 = none
+    stream_data *prev, *next;      // Streams sharing the wheel slot
+    uint32_t slot;
+    bool armed;
+};
 
-typedef struct {
+struct stream_data {
     char *headers;         // Collected request headers
     size_t headers_len;
-    char *body;            // Collected request body
+    char *body;            // Collected request body; mapped from spool once complete when spooled
     size_t body_len;
+    size_t body_cap;       // Allocated size of body while it is in memory
+    int64_t content_length;        // From the request headers, -1 when absent
+    uint64_t body_received;        // Request DATA bytes so far, buffered or streamed
+    size_t header_count;           // Request header fields and their HPACK size, for request limits
+    size_t header_bytes;
+    uint16_t reject_status;        // Set once the stream was turned away: 413/431 answered, 503 when refused
+                                   // under memory pressure, or the deadline answer. Its DATA is dropped and
+                                   // no handler runs.
+    size_t mem_charged;            // Buffer bytes charged to the connection's memory budget
+    body_spool *spool;     // Set once the body passed g_body_spool_policy.threshold
     
     char *response_body;   // Response body to send
     size_t response_len;
     size_t response_offset;
+    body_chain *response_chain;    // Segmented response body, sent instead of response_body when set
+    
+    int accept_encoding;           // ENCODING_* bits from the request's accept-encoding
+    response_encoder *encoder;     // Set when the body is compressed while it is sent
+    void (*response_stage)(stream_data *sdata, response_headers *headers); // Middleware rewriting the response headers
+    
+    char method[8];                // :method of the request, truncated
+    char *path;                    // :path of the request
+    char *authority;               // :authority of the request, for PUSH_PROMISE
+    const route_config *route;     // Matched route, NULL for the default handler
+    
+    int32_t stream_id;             // On HTTP/3 the QUIC stream ID, kept below 2^31 by the transport
+    connection_data *conn;         // Owning connection
+    bool request_done;             // END_STREAM received from the client
+    int64_t start_us;              // When the request's first frame arrived
+    uint16_t status;               // Final response status, once sent (access log and tracing only)
+    bool response_submitted;       // Final response headers queued, maybe not sent yet; see submit_response_headers
+    bool response_done;            // END_STREAM of the response sent: the stream finished normally
+    uint64_t bytes_sent;           // Response DATA payload sent (access log and tracing only)
+    stream_trace trace;            // Phase timings when sampled
+    void *handler_state;           // Per-stream state of a streaming handler
+    cancel_token *cancel;          // Created by stream_cancel_token(), fired when the stream closes
+    stream_deadline deadline;
+    stream_data *prev, *next;      // Live streams of the connection
     
     RequestHandler *handler;
-} stream_data;
+};
+
 
+// Frames a connection sent in the current one-second window, checked against g_abuse_policy
+struct frame_budget {
+    int64_t window_start_us;
+    uint32_t resets;                    // RST_STREAM
+    uint32_t control_frames;            // PING, SETTINGS, PRIORITY, WINDOW_UPDATE
+    uint32_t continuations;
+    uint32_t empty_data;                // DATA without payload or END_STREAM
+    uint64_t header_bytes;              // HEADERS and CONTINUATION payload
+    bool exceeded;                      // GOAWAY(ENHANCE_YOUR_CALM) already queued
+};
+
+// Memory charged to a connection, checked against g_memory_budget_policy
+struct memory_account {
+    int64_t bytes;                      // nghttp2 allocations, stream buffers and the muduo buffers
+    size_t buffers;                     // muduo Buffer capacity at the last check
+    bool windows_shrunk;                // Advertising the smaller pressure window
+    bool shed;                          // GOAWAY queued to free the memory
+    connection_data *prev, *next;       // Connections of the same loop
+};
 
 // Per-connection data structure
-typedef struct {
-    muduo::net::TcpConnectionPtr client_fd;                      // Client file descriptor
+struct connection_data {
+    muduo::net::TcpConnectionPtr client_fd;                      // Client file descriptor (epoll backend)
+    muduo::net::Buffer *output;         // Frames are appended here instead of sent on client_fd (io_uring, in-process)
+    muduo::net::EventLoop *loop;        // Owning IO loop, NULL in-process
+    muduo::net::InetAddress peer;
+    std::function<void()> send_soon;    // Transport hook queueing a flush on the loop; unset in-process
     RequestHandler *default_handler;    // Default request handler
-} connection_data;
+    nghttp2_session *session;           // NULL when transport is set
+    const stream_transport *transport;  // Streams that are not nghttp2's (HTTP/3), NULL otherwise
+    void *transport_data;               // The transport's connection
+    stream_data *streams;               // Live streams; nghttp2_session_del does not report them closed
+    bool send_scheduled;                // A deferred nghttp2_session_send is queued on the loop
+    uint64_t peer_key;                  // Rate limit bucket of the peer address, 0 in-process
+    int64_t input_us;                   // When the bytes being processed arrived
+    frame_budget budget;
+    memory_account memory;
+    uint64_t capture_id;                // Non-zero while the connection's input is being captured
+    bool alt_svc_done;                  // HTTP/3 was advertised, or needs no advertising (HTTP/3's own sessions)
+};
 
 // Request handler interface
 struct RequestHandler {
@@ -45,14 +139,82 @@ struct RequestHandler {
     
     // Optional: additional data for handler
     void *data;
+    
+    // Optional streaming hooks. on_request_headers runs when the request header block is
+    // complete. When on_request_data is set, request DATA is passed to it instead of being
+    // collected in sdata->body, and the handler must stream_consume() what it uses.
+    void (*on_request_headers)(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+    int (*on_request_data)(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                           const uint8_t *data, size_t len);
+    // Optional: the stream is closing (completed, reset or connection gone); sdata is freed afterwards
+    void (*on_stream_close)(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                            uint32_t error_code);
+    
+    // Set by make_loop_handler(): a placeholder, each stream gets its thread's instance instead
+    const handler_factory *factory;
+};
+
+// What a connection whose streams are not nghttp2's (HTTP/3, http3Server.cc) does for the stream_*
+// calls below. Error codes are HTTP/2's; the transport maps them onto its own.
+struct stream_transport {
+    int (*submit_response)(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen, const nghttp2_data_provider *prd);
+    int (*submit_info)(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen);
+    int (*submit_trailer)(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen);
+    void (*resume)(stream_data *sdata);
+    // n request body bytes were used; connection_only once the stream is closing
+    void (*consume)(stream_data *sdata, size_t n, bool connection_only);
+    void (*reset)(stream_data *sdata, uint32_t error_code);
 };
 
+// Stream operations for handlers and the request pipeline, done on the connection's nghttp2
+// session or its transport. Code that sticks to these, submit_response_headers() and
+// submit_stream_response() serves HTTP/3 as well; the session it is handed is NULL there.
+int stream_submit_info(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen);      // 1xx, before the response
+int stream_submit_trailer(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen);   // From a data provider at EOF
+void stream_resume(stream_data *sdata);             // The data provider has more after NGHTTP2_ERR_DEFERRED
+void stream_consume(stream_data *sdata, size_t n);
+void stream_consume_connection(stream_data *sdata, size_t n);     // From on_stream_close hooks
+void stream_reset(stream_data *sdata, uint32_t error_code);
+
+// The protocol-neutral steps of a request, run by the nghttp2 callbacks below and by HTTP/3
+void stream_on_request_header(stream_data *sdata, const uint8_t *name, size_t namelen, const uint8_t *value,
+                              size_t valuelen);
+void stream_on_request_headers(nghttp2_session *session, stream_data *sdata, bool end_stream);
+int stream_on_request_data(nghttp2_session *session, stream_data *sdata, const uint8_t *data, size_t len);
+void stream_on_request_end(nghttp2_session *session, stream_data *sdata);
+// The final status among nva, for the access log and tracing; 1xx and trailers are skipped
+void stream_on_response_headers(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen);
+// The response went out completely
+void stream_on_response_end(nghttp2_session *session, stream_data *sdata);
+
+// Peer address for logs: ip:port, or "unix" for clients of a Unix socket listener
+std::string peer_address(const muduo::net::InetAddress &peer);
+
+// Allocate stream data for a new stream and attach it to the session (when not NULL) and connection
+stream_data *stream_data_new(nghttp2_session *session, connection_data *conn_data, int32_t stream_id);
+
+// Run the handler's close hook and free the stream data
+void stream_data_close(nghttp2_session *session, stream_data *sdata, uint32_t error_code);
+
 void default_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata);
 
 void api_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata);
 
 void root_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata);
 
+void static_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata);
+
+// Submit the response headers plus sdata->response_body, compressing the body when the
+// client accepts it. cache_key marks the body as immutable so its compressed form is reused.
+int submit_stream_response(nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                           const nghttp2_nv *nva, size_t nvlen, const char *cache_key);
+
+// Submit the final response headers, the body coming from prd (NULL for none), after the
+// middleware response stages. Responses go out through here or submit_stream_response(), so the
+// stream counts as answered from the moment its HEADERS are queued rather than sent.
+int submit_response_headers(nghttp2_session *session, stream_data *sdata, const nghttp2_nv *nva, size_t nvlen,
+                            const nghttp2_data_provider *prd);
+
 ssize_t send_callback(nghttp2_session *session, const uint8_t *data,size_t length, int flags, void *user_data);
 
 ssize_t data_read_callback(nghttp2_session *session, int32_t stream_id,uint8_t *buf, size_t length,
@@ -66,10 +228,15 @@ int on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags,int32_t
 
 int on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data);
 
+// Notes the response status, body bytes and first DATA of each stream for the access log and
+// tracing, and stops the upload of requests rejected by their size limits once answered.
+int on_frame_send_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data);
+
 int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,uint32_t error_code, void *user_data);
 
 extern RequestHandler default_handler_impl;
 extern RequestHandler api_handler_impl;
 extern RequestHandler root_handler_impl;
+extern RequestHandler static_handler_impl;
 
 
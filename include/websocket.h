@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// WebSocket over HTTP/2（RFC 8441 扩展 CONNECT）：服务器在 SETTINGS 里声明 ENABLE_CONNECT_PROTOCOL，
+// 客户端用 :method CONNECT + :protocol websocket 打开一个流，之后该流的 DATA 就是 WebSocket 帧。
+// 同一条 TCP 连接上可以复用任意多个 WebSocket。收到的负载在拷出 nghttp2 缓冲时按 8 字节一组去掩码，
+// 分片消息的各片作为 body_chain 的段交给回调，不再拼接复制。文本消息不做 UTF-8 校验。
+
+typedef enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa,
+} websocket_opcode;
+
+typedef struct websocket websocket;
+
+// Callbacks of one kind of socket. Everything runs on the connection's loop.
+typedef struct {
+    // Optional: the CONNECT was accepted
+    void (*on_open)(websocket *ws);
+    // A whole text or binary message, one segment per received fragment. The callback owns
+    // message: free it with body_chain_free or pass it on to websocket_send_chain.
+    void (*on_message)(websocket *ws, websocket_opcode opcode, body_chain *message);
+    // Optional: the stream is gone. code is the peer's close code, 1005 when it sent none,
+    // 1006 when the stream ended without a close frame. ws is freed afterwards.
+    void (*on_close)(websocket *ws, uint16_t code);
+} websocket_callbacks;
+
+struct websocket_policy {
+    size_t max_message;         // Larger messages close the socket with 1009
+};
+
+extern websocket_policy g_websocket_policy;
+
+// Route entry accepting WebSocket CONNECT streams with these callbacks; anything else gets 400
+RequestHandler make_websocket_handler(const websocket_callbacks *callbacks);
+
+// Queue a text or binary message (copied)
+bool websocket_send(websocket *ws, websocket_opcode opcode, const char *data, size_t len);
+
+// Queue a message without copying it; takes ownership of payload
+bool websocket_send_chain(websocket *ws, websocket_opcode opcode, body_chain *payload);
+
+// Start the closing handshake; the stream ends once the peer answers
+void websocket_close(websocket *ws, uint16_t code, const char *reason);
+
+void websocket_set_user_data(websocket *ws, void *user_data);
+void *websocket_user_data(const websocket *ws);
+int32_t websocket_stream_id(const websocket *ws);
+
+// Unmask len bytes of a client frame while copying them; offset is the position within the
+// frame's payload, so a payload split across DATA frames unmasks correctly.
+void websocket_unmask_copy(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t mask[4], size_t offset);
+
+// Example: echoes every message back, at /ws/echo
+extern RequestHandler websocket_echo_handler_impl;
@@ -1,19 +1,277 @@
+#include <getopt.h>
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <vector>
+#include <accesslog.h>
+#include <affinity.h>
+#include <capture.h>
+#include <deadline.h>
 #include <http2Server.hpp>
+#include <http3Server.hpp>
+#include <membudget.h>
+#include <middleware.h>
+#include <proxy.h>
+#include <ratelimit.h>
+#include <reqlimit.h>
+#include <spool.h>
+#include <trace.h>
+
+static void usage()
+{
+    std::cout << "./muduohttp port [--unix path] [--unix-mode mode] [--no-tcp] [--handoff path] [--takeover] [--drain-timeout seconds]"
+                 " [--upstream host:port] [--upstream-connections n]"
+                 " [--rate-limit r] [--rate-burst n] [--rate-key-header name] [--rate-limit-429]"
+                 " [--threads n] [--cpus list] [--pin] [--numa-node n] [--acceptor-cpu c] [--io-uring]"
+                 " [--access-log path] [--access-log-sample n] [--trace-sample n]"
+                 " [--spool-threshold bytes] [--spool-dir dir] [--max-body bytes] [--max-header-bytes bytes]"
+                 " [--memory-soft-limit bytes] [--memory-hard-limit bytes] [--loop-memory-soft-limit bytes]"
+                 " [--loop-memory-hard-limit bytes] [--capture path] [--capture-sample n]"
+                 " [--http3 port --tls-cert file --tls-key file] [--request-timeout seconds] [--deadline-503]"
+                 " [--cors-origin origin] [--api-token token]"
+              << std::endl;
+    std::cout << "  --unix path        also listen on this Unix socket (\"@name\" for the abstract namespace)" << std::endl;
+    std::cout << "  --unix-mode mode   permissions of the --unix socket file, octal (default 0660)" << std::endl;
+    std::cout << "  --no-tcp           serve only the --unix socket; port may then be omitted" << std::endl;
+    std::cout << "  --handoff path     accept binary upgrades on this Unix socket" << std::endl;
+    std::cout << "  --takeover         take the listening socket over from the process on --handoff" << std::endl;
+    std::cout << "  --drain-timeout s  how long an upgraded-away process serves in-flight streams (default 30)" << std::endl;
+    std::cout << "  --upstream h:p     forward /proxy/* to this HTTP/2 (h2c) server" << std::endl;
+    std::cout << "  --upstream-connections n  upstream connections per IO thread (default 2)" << std::endl;
+    std::cout << "  --rate-limit r     allow r requests per second per client address" << std::endl;
+    std::cout << "  --rate-burst n     bucket size for --rate-limit (default 2r)" << std::endl;
+    std::cout << "  --rate-key-header name  count by this request header instead, when present" << std::endl;
+    std::cout << "  --rate-limit-429   answer 429 instead of RST_STREAM(REFUSED_STREAM)" << std::endl;
+    std::cout << "  --threads n        IO threads (default: one per usable CPU)" << std::endl;
+    std::cout << "  --cpus list        CPUs for IO threads, e.g. 0-7,16 (default: the process affinity mask)" << std::endl;
+    std::cout << "  --pin              pin each IO thread to one of those CPUs" << std::endl;
+    std::cout << "  --numa-node n      only use CPUs of NUMA node n" << std::endl;
+    std::cout << "  --acceptor-cpu c   run the acceptor loop alone on CPU c" << std::endl;
+    std::cout << "  --io-uring         serve connections through io_uring (falls back to epoll when unsupported)" << std::endl;
+    std::cout << "  --access-log path  write one line per request to path (\"-\" for stdout)" << std::endl;
+    std::cout << "  --access-log-sample n  log one in n successful requests; errors are always logged" << std::endl;
+    std::cout << "  --trace-sample n   time the phases of one in n streams, served at /_admin/trace" << std::endl;
+    std::cout << "  --spool-threshold b  buffer request bodies past b bytes in a temp file (default 1MB, 0 = never)" << std::endl;
+    std::cout << "  --spool-dir dir    directory for those temp files (default /tmp)" << std::endl;
+    std::cout << "  --max-body b       answer 413 to request bodies over b bytes (default 1GB, 0 = no limit)" << std::endl;
+    std::cout << "  --max-header-bytes b  answer 431 to request headers over b bytes (default 64KB)" << std::endl;
+    std::cout << "  --memory-soft-limit b  over b bytes buffered, refuse new streams and shrink windows" << std::endl;
+    std::cout << "  --memory-hard-limit b  over b bytes, close the connections holding the most" << std::endl;
+    std::cout << "  --loop-memory-soft-limit b  the soft limit for the connections of each IO thread" << std::endl;
+    std::cout << "  --loop-memory-hard-limit b  the hard limit for the connections of each IO thread" << std::endl;
+    std::cout << "  --capture path     record the inbound bytes of sampled connections for h2replay" << std::endl;
+    std::cout << "  --capture-sample n  capture one in n connections (default 100)" << std::endl;
+    std::cout << "  --http3 port       also serve HTTP/3 on this UDP port and advertise it with Alt-Svc" << std::endl;
+    std::cout << "  --tls-cert file    certificate chain (PEM) for --http3" << std::endl;
+    std::cout << "  --tls-key file     private key (PEM) for --http3" << std::endl;
+    std::cout << "  --request-timeout s  answer 504 to requests still unanswered after s seconds (routes may set their own)" << std::endl;
+    std::cout << "  --deadline-503     answer 503 instead of 504 when a deadline passes" << std::endl;
+    std::cout << "  --cors-origin o    allow cross-origin requests to /api from o (\"*\" for any)" << std::endl;
+    std::cout << "  --api-token t      answer 401 to /api requests without \"authorization: Bearer t\"" << std::endl;
+}
 
 int main(int argc, char* argv[])
 {
-    if(argc <2)
+    std::string handoffPath;
+    std::vector<std::string> unixPaths;
+    mode_t unixMode = 0660;
+    bool tcp = true;
+    bool takeover = false;
+    bool ioUring = false;
+    double drainTimeout = 30.0;
+    double rateBurst = 0;
+    unsigned short http3Port = 0;
+    std::string tlsCert, tlsKey;
+    cpu_placement_options cpuOptions = {0, NULL, -1, -1, false};
+
+    static const struct option long_options[] = {
+        {"unix", required_argument, NULL, 'N'},
+        {"unix-mode", required_argument, NULL, 'M'},
+        {"no-tcp", no_argument, NULL, 'O'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"takeover", no_argument, NULL, 'T'},
+        {"drain-timeout", required_argument, NULL, 'D'},
+        {"upstream", required_argument, NULL, 'U'},
+        {"upstream-connections", required_argument, NULL, 'C'},
+        {"rate-limit", required_argument, NULL, 'R'},
+        {"rate-burst", required_argument, NULL, 'B'},
+        {"rate-key-header", required_argument, NULL, 'K'},
+        {"rate-limit-429", no_argument, NULL, '4'},
+        {"threads", required_argument, NULL, 't'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"pin", no_argument, NULL, 'p'},
+        {"numa-node", required_argument, NULL, 'n'},
+        {"acceptor-cpu", required_argument, NULL, 'a'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"access-log", required_argument, NULL, 'L'},
+        {"access-log-sample", required_argument, NULL, 'S'},
+        {"trace-sample", required_argument, NULL, 'P'},
+        {"spool-threshold", required_argument, NULL, 'b'},
+        {"spool-dir", required_argument, NULL, 'd'},
+        {"max-body", required_argument, NULL, 'm'},
+        {"max-header-bytes", required_argument, NULL, 'x'},
+        {"memory-soft-limit", required_argument, NULL, 'y'},
+        {"memory-hard-limit", required_argument, NULL, 'z'},
+        {"loop-memory-soft-limit", required_argument, NULL, 'Y'},
+        {"loop-memory-hard-limit", required_argument, NULL, 'Z'},
+        {"capture", required_argument, NULL, 'w'},
+        {"capture-sample", required_argument, NULL, 'W'},
+        {"http3", required_argument, NULL, 'q'},
+        {"tls-cert", required_argument, NULL, 'e'},
+        {"tls-key", required_argument, NULL, 'k'},
+        {"request-timeout", required_argument, NULL, 'g'},
+        {"deadline-503", no_argument, NULL, '5'},
+        {"cors-origin", required_argument, NULL, 'o'},
+        {"api-token", required_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1)
     {
-        std::cout << "./muduohttp port "<< std::endl; 
+        switch (c)
+        {
+        case 'N': unixPaths.push_back(optarg); break;
+        case 'M': unixMode = (mode_t)strtoul(optarg, NULL, 8); break;
+        case 'O': tcp = false; break;
+        case 'H': handoffPath = optarg; break;
+        case 'T': takeover = true; break;
+        case 'D': drainTimeout = atof(optarg); break;
+        case 'U':
+            if (!proxy_set_upstream(optarg))
+            {
+                std::cout << "bad upstream " << optarg << std::endl;
+                return 1;
+            }
+            break;
+        case 'C': g_proxy_config.connections = atoi(optarg); break;
+        case 'R':
+            g_rate_limit_policy.enabled = true;
+            g_rate_limit_policy.rate = atof(optarg);
+            if (rateBurst <= 0)
+            {
+                g_rate_limit_policy.burst = 2 * g_rate_limit_policy.rate;
+            }
+            break;
+        case 'B': rateBurst = atof(optarg); g_rate_limit_policy.burst = rateBurst; break;
+        case 'K': g_rate_limit_policy.key_header = optarg; break;
+        case '4': g_rate_limit_policy.action = RATE_LIMIT_429; break;
+        case 't': cpuOptions.threads = atoi(optarg); break;
+        case 'c': cpuOptions.cpu_list = optarg; break;
+        case 'p': cpuOptions.pin = true; break;
+        case 'n': cpuOptions.numa_node = atoi(optarg); break;
+        case 'a': cpuOptions.acceptor_cpu = atoi(optarg); break;
+        case 'u': ioUring = true; break;
+        case 'L': g_access_log_policy.enabled = true; g_access_log_policy.path = optarg; break;
+        case 'S': g_access_log_policy.sample = atoi(optarg); break;
+        case 'P':
+            g_trace_policy.enabled = true;
+            g_trace_policy.sample = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'b': g_body_spool_policy.threshold = strtoull(optarg, NULL, 10); break;
+        case 'd': g_body_spool_policy.dir = optarg; break;
+        case 'm': g_request_limit_policy.max_body = strtoull(optarg, NULL, 10); break;
+        case 'x': g_request_limit_policy.max_header_bytes = strtoull(optarg, NULL, 10); break;
+        case 'y': g_memory_budget_policy.soft_limit = strtoull(optarg, NULL, 10); break;
+        case 'z': g_memory_budget_policy.hard_limit = strtoull(optarg, NULL, 10); break;
+        case 'Y': g_memory_budget_policy.loop_soft_limit = strtoull(optarg, NULL, 10); break;
+        case 'Z': g_memory_budget_policy.loop_hard_limit = strtoull(optarg, NULL, 10); break;
+        case 'w': g_capture_policy.enabled = true; g_capture_policy.path = optarg; break;
+        case 'W': g_capture_policy.sample = atoi(optarg); break;
+        case 'q': http3Port = atoi(optarg); break;
+        case 'e': tlsCert = optarg; break;
+        case 'k': tlsKey = optarg; break;
+        case 'g': g_deadline_policy.default_timeout = atof(optarg); break;
+        case '5': g_deadline_policy.status = 503; break;
+        case 'o': g_cors_policy.allow_origin = optarg; break;
+        case 'A': g_auth_policy.bearer_token = optarg; break;
+        default: usage(); return 0;
+        }
+    }
+    if((tcp && optind >= argc) || (!tcp && unixPaths.empty()) || (takeover && handoffPath.empty()) ||
+       (http3Port && (tlsCert.empty() || tlsKey.empty())))
+    {
+        usage();
         return 0;
     }
-    unsigned short port = atoi(argv[1]);
+    unsigned short port = optind < argc ? atoi(argv[optind]) : 0;
+    cpu_placement placement;
+    if (!plan_cpu_placement(cpuOptions, &placement))
+    {
+        return 1;
+    }
+    if (placement.acceptor_cpu >= 0)
+    {
+        // Before the loop exists, so its allocations land on the acceptor's node
+        pin_current_thread(placement.acceptor_cpu);
+    }
+    if (!access_log_start() || !capture_start())
+    {
+        return 1;
+    }
     muduo::net::EventLoop loop;
     muduo::net::InetAddress addr("0.0.0.0", port);
     http2Server httpserver(&loop,addr,"myHTTPserver");
-    httpserver.setThreadNum(4);
+    httpserver.setThreadNum(placement.threads);
+    std::atomic<int> nextThread(0);
+    // Every IO thread sets its own mask: they are created by the main thread, which may already
+    // be pinned to the acceptor's CPU
+    httpserver.setThreadInitCallback([&placement, &nextThread](muduo::net::EventLoop*) {
+        if (placement.pin)
+        {
+            int index = nextThread++;
+            pin_current_thread(placement.io_cpus[index % placement.io_cpus.size()]);
+        }
+        else if (!placement.io_cpus.empty())
+        {
+            confine_current_thread(placement.io_cpus);
+        }
+    });
+    if (ioUring)
+    {
+        httpserver.enableIoUring();
+    }
+    if (!tcp)
+    {
+        httpserver.disableTcp();
+    }
+    for (const std::string& path : unixPaths)
+    {
+        httpserver.listenUnix(path, unixMode);
+    }
+    if (takeover && !httpserver.takeOver(handoffPath))
+    {
+        std::cout << "no server answered on " << handoffPath << ", binding port " << port << std::endl;
+    }
+    std::unique_ptr<http3Server> http3;
+    if (!handoffPath.empty())
+    {
+        httpserver.enableHandoff(handoffPath, drainTimeout);
+        // The new process binds its own UDP sockets and steers new connections to them; ours
+        // only get the packets of our connections and close once those are gone
+        httpserver.setDrainCallback([&http3]() {
+            if (http3)
+            {
+                http3->goaway();
+            }
+        });
+    }
+    // Before the IO threads run, so even the first connections get the ALTSVC frame
+    g_http3_policy.alt_svc_port = http3Port;
     httpserver.start();
+    if (http3Port)
+    {
+        http3.reset(new http3Server(&loop, muduo::net::InetAddress("0.0.0.0", http3Port), tlsCert, tlsKey));
+        if (!http3->start(httpserver.ioLoops(), httpserver.inheritedFds()))
+        {
+            g_http3_policy.alt_svc_port = 0;
+        }
+        else if (!handoffPath.empty() && http3->steeringFd() >= 0)
+        {
+            httpserver.addHandoffFd(http3->steeringFd());
+        }
+    }
     loop.loop();
+    capture_stop();
+    access_log_stop();
     return 0;
-}
\ No newline at end of file
+}
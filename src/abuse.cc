@@ -0,0 +1,89 @@
+#include "abuse.h"
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include "metrics.h"
+
+abuse_policy g_abuse_policy = {
+    .enabled = true,
+    .max_resets = 200,
+    .max_control_frames = 1000,
+    .max_continuations = 200,
+    .max_empty_data = 200,
+    .max_header_bytes = 4 * 1024 * 1024,
+};
+
+namespace
+{
+
+void calm_down(nghttp2_session *session, connection_data *conn_data, const char *reason)
+{
+    conn_data->budget.exceeded = true;
+    metrics_add(METRIC_CALM_GOAWAYS);
+    metrics_report_offender(conn_data, reason);
+    if (conn_data->loop) {
+        LOG_WARN << peer_address(conn_data->peer) << " exceeded " << reason << " budget, closing";
+    }
+    // GOAWAY goes out on the next send; want_read/want_write then turn false and the server closes
+    nghttp2_session_terminate_session(session, NGHTTP2_ENHANCE_YOUR_CALM);
+}
+
+} // namespace
+
+int on_begin_frame_callback(nghttp2_session *session, const nghttp2_frame_hd *hd, void *user_data)
+{
+    connection_data *conn_data = (connection_data *)user_data;
+    frame_budget &budget = conn_data->budget;
+    if (hd->type == NGHTTP2_RST_STREAM) {
+        metrics_add(METRIC_RESETS_RECEIVED);
+    }
+    if (!g_abuse_policy.enabled || budget.exceeded) {
+        return 0;
+    }
+
+    // One-second windows, clocked by when the input arrived rather than per frame
+    if (conn_data->input_us - budget.window_start_us >= muduo::Timestamp::kMicroSecondsPerSecond) {
+        budget = frame_budget();
+        budget.window_start_us = conn_data->input_us;
+    }
+
+    switch (hd->type) {
+    case NGHTTP2_RST_STREAM:
+        if (++budget.resets > g_abuse_policy.max_resets) {
+            calm_down(session, conn_data, "stream reset");
+        }
+        break;
+    case NGHTTP2_PING:
+    case NGHTTP2_SETTINGS:
+    case NGHTTP2_PRIORITY:
+    case NGHTTP2_WINDOW_UPDATE:
+        if ((hd->flags & NGHTTP2_FLAG_ACK) && hd->type != NGHTTP2_WINDOW_UPDATE && hd->type != NGHTTP2_PRIORITY) {
+            break;      // Answers to our own PING/SETTINGS
+        }
+        if (++budget.control_frames > g_abuse_policy.max_control_frames) {
+            calm_down(session, conn_data, "control frame");
+        }
+        break;
+    case NGHTTP2_CONTINUATION:
+        if (++budget.continuations > g_abuse_policy.max_continuations) {
+            calm_down(session, conn_data, "continuation");
+            break;
+        }
+        // fall through
+    case NGHTTP2_HEADERS:
+        budget.header_bytes += hd->length;
+        if (budget.header_bytes > g_abuse_policy.max_header_bytes) {
+            calm_down(session, conn_data, "header bytes");
+        }
+        break;
+    case NGHTTP2_DATA:
+        if (hd->length == 0 && !(hd->flags & NGHTTP2_FLAG_END_STREAM) &&
+            ++budget.empty_data > g_abuse_policy.max_empty_data) {
+            calm_down(session, conn_data, "empty data");
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "accesslog.h"
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include "metrics.h"
+
+access_log_policy g_access_log_policy = {
+    .enabled = false,
+    .path = "-",
+    .sample = 1,
+    .ring_records = 4096,
+    .flush_interval = 1.0,
+};
+
+namespace
+{
+
+const size_t kMaxPath = 200;
+// The writer hands this much formatted text to the file at a time
+const size_t kBatchBytes = 256 * 1024;
+
+// Fixed-size so the IO thread only copies; the writer turns it into text
+struct access_record {
+    int64_t time_us;
+    int64_t latency_us;
+    uint64_t bytes;
+    int32_t stream_id;
+    uint32_t error_code;
+    uint16_t status;
+    uint16_t path_len;
+    char method[8];
+    struct sockaddr_in6 peer;   // sin6_family is 0 in-process
+    char path[kMaxPath];
+};
+
+// Single producer (the IO thread) and single consumer (the writer)
+struct access_ring {
+    access_record *records;
+    size_t mask;
+    uint64_t seen;                                  // Producer only, for sampling
+    alignas(64) std::atomic<uint64_t> head;         // Next slot the producer fills
+    alignas(64) std::atomic<uint64_t> tail;         // Next slot the writer reads
+};
+
+// Threads live as long as the process, so registered rings are never freed
+std::mutex g_rings_mutex;
+std::vector<access_ring *> g_rings;
+
+thread_local access_ring *t_ring = NULL;
+
+FILE *g_file = NULL;
+std::thread g_writer;
+std::mutex g_writer_mutex;
+std::condition_variable g_writer_cond;
+bool g_stopping = false;
+
+access_ring *local_ring()
+{
+    if (!t_ring) {
+        size_t records = 1;
+        while (records < g_access_log_policy.ring_records) {
+            records <<= 1;
+        }
+        access_ring *ring = new access_ring();
+        ring->records = (access_record *)calloc(records, sizeof(access_record));
+        ring->mask = records - 1;
+        ring->seen = 0;
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        g_rings.push_back(ring);
+        t_ring = ring;
+    }
+    return t_ring;
+}
+
+// Formatting the date is the slow part, so it is redone only when the second changes
+void format_record(const access_record &r, std::string *out)
+{
+    static time_t last_second = 0;
+    static char date[32];
+    time_t seconds = (time_t)(r.time_us / muduo::Timestamp::kMicroSecondsPerSecond);
+    if (seconds != last_second) {
+        struct tm tm_time;
+        gmtime_r(&seconds, &tm_time);
+        strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", &tm_time);
+        last_second = seconds;
+    }
+    std::string peer = "-";
+    if (r.peer.sin6_family != 0) {
+        peer = peer_address(muduo::net::InetAddress(r.peer));
+    }
+    char line[512];
+    int n = snprintf(line, sizeof line, "%s.%06dZ %s %d %s %.*s %u %llu %.3f",
+                     date, (int)(r.time_us % muduo::Timestamp::kMicroSecondsPerSecond), peer.c_str(),
+                     r.stream_id, r.method[0] ? r.method : "-", (int)r.path_len, r.path,
+                     (unsigned)r.status, (unsigned long long)r.bytes, r.latency_us / 1000.0);
+    if (n < 0) {
+        return;
+    }
+    out->append(line, std::min((size_t)n, sizeof line - 1));
+    if (r.error_code) {
+        snprintf(line, sizeof line, " rst=%u", r.error_code);
+        out->append(line);
+    }
+    out->push_back('\n');
+}
+
+// Drain every ring once; returns whether anything was written
+bool write_batch(std::string *batch)
+{
+    std::vector<access_ring *> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        rings = g_rings;
+    }
+    bool wrote = false;
+    for (access_ring *ring : rings) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            format_record(ring->records[tail & ring->mask], batch);
+            ++tail;
+            // Hand slots back as we go, so a busy thread is not held off by a long batch
+            if (batch->size() >= kBatchBytes) {
+                ring->tail.store(tail, std::memory_order_release);
+                fwrite(batch->data(), 1, batch->size(), g_file);
+                batch->clear();
+                wrote = true;
+            }
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    if (!batch->empty()) {
+        fwrite(batch->data(), 1, batch->size(), g_file);
+        batch->clear();
+        wrote = true;
+    }
+    if (wrote) {
+        fflush(g_file);
+    }
+    return wrote;
+}
+
+void writer_thread()
+{
+    std::string batch;
+    batch.reserve(kBatchBytes + 1024);
+    std::chrono::microseconds interval((int64_t)(g_access_log_policy.flush_interval * 1e6));
+    std::unique_lock<std::mutex> lock(g_writer_mutex);
+    while (!g_stopping) {
+        // IO threads never signal; the writer just wakes up every interval
+        g_writer_cond.wait_for(lock, interval);
+        lock.unlock();
+        write_batch(&batch);
+        lock.lock();
+    }
+    lock.unlock();
+    write_batch(&batch);
+}
+
+} // namespace
+
+bool access_log_start()
+{
+    if (!g_access_log_policy.enabled || g_file) {
+        return true;
+    }
+    if (g_access_log_policy.path == "-") {
+        g_file = stdout;
+    } else {
+        g_file = fopen(g_access_log_policy.path.c_str(), "ae");
+        if (!g_file) {
+            LOG_SYSERR << "cannot open access log " << g_access_log_policy.path;
+            g_access_log_policy.enabled = false;
+            return false;
+        }
+    }
+    if (g_access_log_policy.sample == 0) {
+        g_access_log_policy.sample = 1;
+    }
+    g_stopping = false;
+    g_writer = std::thread(writer_thread);
+    return true;
+}
+
+void access_log_stop()
+{
+    if (!g_file) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_writer_mutex);
+        g_stopping = true;
+    }
+    g_writer_cond.notify_one();
+    g_writer.join();
+    // Streams closing from here on are queued but never written
+    if (g_file != stdout) {
+        fclose(g_file);
+    }
+    g_file = NULL;
+}
+
+void access_log_stream(const stream_data *sdata, uint32_t error_code)
+{
+    if (!g_access_log_policy.enabled) {
+        return;
+    }
+    access_ring *ring = local_ring();
+    bool failed = error_code != 0 || sdata->status == 0 || sdata->status >= 400;
+    if (!failed && ring->seen++ % g_access_log_policy.sample != 0) {
+        return;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) > ring->mask) {
+        // The writer is behind: drop rather than wait for it
+        metrics_add(METRIC_ACCESS_LOG_DROPPED);
+        return;
+    }
+    access_record &r = ring->records[head & ring->mask];
+    int64_t now = muduo::Timestamp::now().microSecondsSinceEpoch();
+    r.time_us = now;
+    r.latency_us = sdata->start_us ? now - sdata->start_us : 0;
+    r.bytes = sdata->bytes_sent;
+    r.stream_id = sdata->stream_id;
+    r.error_code = error_code;
+    r.status = sdata->status;
+    memcpy(r.method, sdata->method, sizeof r.method);
+    if (sdata->conn->loop) {
+        memcpy(&r.peer, sdata->conn->peer.getSockAddr(), sizeof r.peer);
+    } else {
+        r.peer.sin6_family = 0;
+    }
+    size_t path_len = sdata->path ? strlen(sdata->path) : 0;
+    r.path_len = (uint16_t)std::min(path_len, kMaxPath);
+    if (r.path_len) {
+        memcpy(r.path, sdata->path, r.path_len);
+    }
+    ring->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,197 @@
+#include "affinity.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <muduo/base/Logging.h>
+
+namespace
+{
+
+// First line of a sysfs file, empty when it does not exist
+std::string read_sysfs(const std::string &path)
+{
+    char line[4096];
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        return std::string();
+    }
+    std::string value;
+    if (fgets(line, sizeof line, fp)) {
+        value = line;
+        while (!value.empty() && (value.back() == '\n' || value.back() == ' ')) {
+            value.pop_back();
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof set, &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> node_cpus(int node)
+{
+    std::vector<int> cpus;
+    std::string list = read_sysfs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    parse_cpu_list(list.c_str(), &cpus);
+    return cpus;
+}
+
+// CPU -> NUMA node for the online nodes; empty when the kernel has no NUMA info
+std::map<int, int> cpu_nodes()
+{
+    std::map<int, int> nodes_of;
+    std::vector<int> nodes;
+    parse_cpu_list(read_sysfs("/sys/devices/system/node/online").c_str(), &nodes);
+    for (int node : nodes) {
+        for (int cpu : node_cpus(node)) {
+            nodes_of[cpu] = node;
+        }
+    }
+    return nodes_of;
+}
+
+// True for the second and later hyperthreads of a physical core
+bool is_sibling_thread(int cpu)
+{
+    std::vector<int> siblings;
+    std::string list = read_sysfs("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+    if (!parse_cpu_list(list.c_str(), &siblings) || siblings.empty()) {
+        return false;
+    }
+    return *std::min_element(siblings.begin(), siblings.end()) != cpu;
+}
+
+} // namespace
+
+bool parse_cpu_list(const char *list, std::vector<int> *cpus)
+{
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus->push_back((int)cpu);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool plan_cpu_placement(const cpu_placement_options &options, cpu_placement *placement)
+{
+    std::vector<int> cpus;
+    if (options.cpu_list) {
+        if (!parse_cpu_list(options.cpu_list, &cpus)) {
+            LOG_ERROR << "bad cpu list " << options.cpu_list;
+            return false;
+        }
+    } else {
+        cpus = allowed_cpus();
+    }
+    if (options.numa_node >= 0) {
+        std::vector<int> local = node_cpus(options.numa_node);
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&local](int cpu) {
+            return std::find(local.begin(), local.end(), cpu) == local.end();
+        }), cpus.end());
+    }
+    cpus.erase(std::remove(cpus.begin(), cpus.end(), options.acceptor_cpu), cpus.end());
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+    struct ranked { bool sibling; int node; int cpu; };
+    std::map<int, int> nodes_of = cpu_nodes();
+    std::vector<ranked> order;
+    for (int cpu : cpus) {
+        order.push_back({is_sibling_thread(cpu), nodes_of.count(cpu) ? nodes_of[cpu] : 0, cpu});
+    }
+    std::sort(order.begin(), order.end(), [](const ranked &a, const ranked &b) {
+        if (a.sibling != b.sibling) return !a.sibling;
+        if (a.node != b.node) return a.node < b.node;
+        return a.cpu < b.cpu;
+    });
+
+    placement->io_cpus.clear();
+    for (const ranked &r : order) {
+        placement->io_cpus.push_back(r.cpu);
+    }
+    placement->acceptor_cpu = options.acceptor_cpu;
+    placement->pin = options.pin;
+    placement->threads = options.threads;
+    if (placement->threads <= 0) {
+        placement->threads = placement->io_cpus.empty() ? (int)std::thread::hardware_concurrency()
+                                                         : (int)placement->io_cpus.size();
+    }
+    if (placement->threads <= 0) {
+        placement->threads = 1;
+    }
+    if (placement->pin && placement->io_cpus.empty()) {
+        LOG_ERROR << "no CPU left for IO threads";
+        return false;
+    }
+    return true;
+}
+
+bool pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv != 0) {
+        LOG_ERROR << "pinning to cpu " << cpu << " failed: " << strerror(rv);
+        return false;
+    }
+    return true;
+}
+
+bool confine_current_thread(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv != 0) {
+        LOG_ERROR << "restricting to " << cpus.size() << " cpus failed: " << strerror(rv);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,136 @@
+#include "body_chain.h"
+#include <stdlib.h>
+#include <string.h>
+
+body_chain *body_chain_new()
+{
+    return (body_chain *)calloc(1, sizeof(body_chain));
+}
+
+bool body_chain_append(body_chain *chain, const char *data, size_t len, segment_kind kind)
+{
+    if (len == 0) {
+        if (kind == SEGMENT_OWNED) {
+            free((void *)data);
+        }
+        return true;
+    }
+    body_segment *seg = (body_segment *)malloc(sizeof(body_segment));
+    if (!seg) {
+        if (kind == SEGMENT_OWNED) {
+            free((void *)data);
+        }
+        return false;
+    }
+    seg->data = data;
+    seg->len = len;
+    seg->kind = kind;
+    seg->next = NULL;
+    if (chain->tail) {
+        chain->tail->next = seg;
+    } else {
+        chain->head = seg;
+    }
+    chain->tail = seg;
+    if (!chain->cur) {
+        chain->cur = seg;
+        chain->cur_offset = 0;
+    }
+    chain->size += len;
+    return true;
+}
+
+size_t body_chain_remaining(const body_chain *chain)
+{
+    return chain->size - chain->consumed;
+}
+
+size_t body_chain_peek(const body_chain *chain, const char **data)
+{
+    if (!chain->cur) {
+        return 0;
+    }
+    *data = chain->cur->data + chain->cur_offset;
+    return chain->cur->len - chain->cur_offset;
+}
+
+void body_chain_advance(body_chain *chain, size_t n)
+{
+    chain->consumed += n;
+    while (n > 0 && chain->cur) {
+        size_t avail = chain->cur->len - chain->cur_offset;
+        if (n < avail) {
+            chain->cur_offset += n;
+            return;
+        }
+        n -= avail;
+        chain->cur = chain->cur->next;
+        chain->cur_offset = 0;
+    }
+}
+
+size_t body_chain_read(body_chain *chain, uint8_t *buf, size_t len)
+{
+    size_t copied = 0;
+    const char *data;
+    size_t avail;
+    while (copied < len && (avail = body_chain_peek(chain, &data)) > 0) {
+        size_t n = avail < len - copied ? avail : len - copied;
+        memcpy(buf + copied, data, n);
+        body_chain_advance(chain, n);
+        copied += n;
+    }
+    return copied;
+}
+
+void body_chain_splice(body_chain *dst, body_chain *src)
+{
+    if (src->head) {
+        if (dst->tail) {
+            dst->tail->next = src->head;
+        } else {
+            dst->head = src->head;
+        }
+        dst->tail = src->tail;
+        if (!dst->cur) {
+            dst->cur = src->head;
+            dst->cur_offset = 0;
+        }
+        dst->size += src->size;
+    }
+    free(src);
+}
+
+void body_chain_release_read(body_chain *chain)
+{
+    while (chain->head && chain->head != chain->cur) {
+        body_segment *seg = chain->head;
+        chain->head = seg->next;
+        chain->size -= seg->len;
+        chain->consumed -= seg->len;
+        if (seg->kind == SEGMENT_OWNED) {
+            free((void *)seg->data);
+        }
+        free(seg);
+    }
+    if (!chain->head) {
+        chain->tail = NULL;
+    }
+}
+
+void body_chain_free(body_chain *chain)
+{
+    if (!chain) {
+        return;
+    }
+    body_segment *seg = chain->head;
+    while (seg) {
+        body_segment *next = seg->next;
+        if (seg->kind == SEGMENT_OWNED) {
+            free((void *)seg->data);
+        }
+        free(seg);
+        seg = next;
+    }
+    free(chain);
+}
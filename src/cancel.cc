@@ -0,0 +1,105 @@
+#include "cancel.h"
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+struct cancel_token {
+    std::atomic<int> refs;
+    std::atomic<int> reason;
+    std::mutex mutex;                   // Guards subscribers and next_id
+    std::vector<std::pair<uint64_t, std::function<void (cancel_reason)>>> subscribers;
+    uint64_t next_id;
+};
+
+cancel_token *cancel_token_new()
+{
+    cancel_token *token = new cancel_token();
+    token->refs.store(1, std::memory_order_relaxed);
+    token->reason.store(CANCEL_NONE, std::memory_order_relaxed);
+    token->next_id = 0;
+    return token;
+}
+
+cancel_token *cancel_token_ref(cancel_token *token)
+{
+    token->refs.fetch_add(1, std::memory_order_relaxed);
+    return token;
+}
+
+void cancel_token_unref(cancel_token *token)
+{
+    if (token->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete token;
+    }
+}
+
+bool cancel_requested(const cancel_token *token)
+{
+    int reason = token->reason.load(std::memory_order_acquire);
+    return reason != CANCEL_NONE && reason != CANCEL_DONE;
+}
+
+cancel_reason cancel_reason_of(const cancel_token *token)
+{
+    return (cancel_reason)token->reason.load(std::memory_order_acquire);
+}
+
+void cancel_fire(cancel_token *token, cancel_reason reason)
+{
+    int expected = CANCEL_NONE;
+    if (!token->reason.compare_exchange_strong(expected, reason, std::memory_order_acq_rel)) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, std::function<void (cancel_reason)>>> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(token->mutex);
+        subscribers.swap(token->subscribers);
+    }
+    for (auto &s : subscribers) {
+        s.second(reason);
+    }
+}
+
+uint64_t cancel_subscribe(cancel_token *token, std::function<void (cancel_reason)> cb)
+{
+    {
+        std::lock_guard<std::mutex> lock(token->mutex);
+        // Checked under the lock: cancel_fire() takes the list only after setting the reason
+        if (cancel_reason_of(token) == CANCEL_NONE) {
+            uint64_t id = ++token->next_id;
+            token->subscribers.emplace_back(id, std::move(cb));
+            return id;
+        }
+    }
+    cb(cancel_reason_of(token));
+    return 0;
+}
+
+void cancel_unsubscribe(cancel_token *token, uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(token->mutex);
+    for (auto it = token->subscribers.begin(); it != token->subscribers.end(); ++it) {
+        if (it->first == id) {
+            token->subscribers.erase(it);
+            return;
+        }
+    }
+}
+
+cancel_token *stream_cancel_token(stream_data *sdata)
+{
+    if (!sdata->cancel) {
+        sdata->cancel = cancel_token_new();
+    }
+    return sdata->cancel;
+}
+
+void stream_cancel(stream_data *sdata, cancel_reason reason)
+{
+    if (sdata->cancel) {
+        cancel_fire(sdata->cancel, reason);
+    }
+}
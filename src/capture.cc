@@ -0,0 +1,306 @@
+#include "capture.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include "metrics.h"
+
+capture_policy g_capture_policy = {
+    .enabled = false,
+    .path = std::string(),
+    .sample = 100,
+    .ring_bytes = 4 * 1024 * 1024,
+    .max_bytes = 1ULL << 30,
+    .flush_interval = 1.0,
+};
+
+namespace
+{
+
+const char kMagic[8] = {'H', '2', 'C', 'A', 'P', 'T', 'R', '1'};
+// type + three varints
+const size_t kMaxRecordHeader = 1 + 3 * 10;
+
+// Bytes of variable-length records; single producer (the IO thread) and single consumer (the writer)
+struct capture_ring {
+    char *bytes;
+    size_t mask;
+    uint64_t seen;                                  // Producer only, for sampling
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+// Threads live as long as the process, so registered rings are never freed
+std::mutex g_rings_mutex;
+std::vector<capture_ring *> g_rings;
+
+thread_local capture_ring *t_ring = NULL;
+
+FILE *g_file = NULL;
+std::thread g_writer;
+std::mutex g_writer_mutex;
+std::condition_variable g_writer_cond;
+bool g_stopping = false;
+int64_t g_start_us = 0;
+std::atomic<bool> g_running(false);             // Started and not yet past max_bytes
+std::atomic<uint64_t> g_next_id(1);
+
+capture_ring *local_ring()
+{
+    if (!t_ring) {
+        size_t size = 4096;
+        while (size < g_capture_policy.ring_bytes) {
+            size <<= 1;
+        }
+        capture_ring *ring = new capture_ring();
+        ring->bytes = (char *)malloc(size);
+        ring->mask = size - 1;
+        ring->seen = 0;
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        g_rings.push_back(ring);
+        t_ring = ring;
+    }
+    return t_ring;
+}
+
+size_t put_varint(char *out, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char)v;
+    return n;
+}
+
+bool get_varint(FILE *fp, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(fp);
+        if (c == EOF) {
+            return false;
+        }
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ring_copy_in(capture_ring *ring, uint64_t pos, const char *data, size_t len)
+{
+    size_t offset = pos & ring->mask;
+    size_t first = std::min(len, ring->mask + 1 - offset);
+    memcpy(ring->bytes + offset, data, first);
+    memcpy(ring->bytes, data + first, len - first);
+}
+
+// Queue one record of a sampled connection. When it does not fit the connection stops being
+// captured, so what reached the file stays a prefix the replayer can use.
+void put_record(connection_data *conn_data, capture_record_type type, const void *data, size_t len)
+{
+    capture_ring *ring = local_ring();
+    char header[kMaxRecordHeader];
+    size_t n = 0;
+    header[n++] = (char)type;
+    n += put_varint(header + n, conn_data->capture_id);
+    int64_t now_us = conn_data->input_us ? conn_data->input_us : muduo::Timestamp::now().microSecondsSinceEpoch();
+    n += put_varint(header + n, now_us > g_start_us ? now_us - g_start_us : 0);
+    if (type == CAPTURE_DATA) {
+        n += put_varint(header + n, len);
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t used = head - ring->tail.load(std::memory_order_acquire);
+    if (used + n + len > ring->mask + 1) {
+        metrics_add(METRIC_CAPTURE_DROPPED);
+        conn_data->capture_id = 0;
+        return;
+    }
+    ring_copy_in(ring, head, header, n);
+    if (len) {
+        ring_copy_in(ring, head + n, (const char *)data, len);
+    }
+    ring->head.store(head + n + len, std::memory_order_release);
+}
+
+// Drain every ring once, straight from the ring memory into the file
+void write_batch(uint64_t *written)
+{
+    std::vector<capture_ring *> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        rings = g_rings;
+    }
+    bool wrote = false;
+    for (capture_ring *ring : rings) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            size_t offset = tail & ring->mask;
+            size_t n = std::min((size_t)(head - tail), ring->mask + 1 - offset);
+            fwrite(ring->bytes + offset, 1, n, g_file);
+            tail += n;
+            *written += n;
+            wrote = true;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    if (wrote) {
+        fflush(g_file);
+    }
+    if (g_capture_policy.max_bytes && *written >= g_capture_policy.max_bytes &&
+        g_running.exchange(false, std::memory_order_relaxed)) {
+        LOG_WARN << "capture " << g_capture_policy.path << " reached " << *written
+                 << " bytes, no more connections are sampled";
+    }
+}
+
+void writer_thread()
+{
+    uint64_t written = sizeof kMagic + sizeof g_start_us;
+    std::chrono::microseconds interval((int64_t)(g_capture_policy.flush_interval * 1e6));
+    std::unique_lock<std::mutex> lock(g_writer_mutex);
+    while (!g_stopping) {
+        // IO threads never signal; the writer just wakes up every interval
+        g_writer_cond.wait_for(lock, interval);
+        lock.unlock();
+        write_batch(&written);
+        lock.lock();
+    }
+    lock.unlock();
+    write_batch(&written);
+}
+
+} // namespace
+
+bool capture_start()
+{
+    if (!g_capture_policy.enabled || g_file) {
+        return true;
+    }
+    g_file = fopen(g_capture_policy.path.c_str(), "we");
+    if (!g_file) {
+        LOG_SYSERR << "cannot create capture file " << g_capture_policy.path;
+        g_capture_policy.enabled = false;
+        return false;
+    }
+    g_start_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+    fwrite(kMagic, sizeof kMagic, 1, g_file);
+    fwrite(&g_start_us, sizeof g_start_us, 1, g_file);
+    if (g_capture_policy.sample == 0) {
+        g_capture_policy.sample = 1;
+    }
+    g_stopping = false;
+    g_running.store(true, std::memory_order_relaxed);
+    g_writer = std::thread(writer_thread);
+    return true;
+}
+
+void capture_stop()
+{
+    if (!g_file) {
+        return;
+    }
+    g_running.store(false, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(g_writer_mutex);
+        g_stopping = true;
+    }
+    g_writer_cond.notify_one();
+    g_writer.join();
+    fclose(g_file);
+    g_file = NULL;
+}
+
+void capture_connection_open(connection_data *conn_data)
+{
+    if (!g_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (local_ring()->seen++ % g_capture_policy.sample != 0) {
+        return;
+    }
+    conn_data->capture_id = g_next_id.fetch_add(1, std::memory_order_relaxed);
+    put_record(conn_data, CAPTURE_OPEN, NULL, 0);
+}
+
+void capture_input(connection_data *conn_data, const void *data, size_t len)
+{
+    if (conn_data->capture_id && len) {
+        put_record(conn_data, CAPTURE_DATA, data, len);
+    }
+}
+
+void capture_connection_close(connection_data *conn_data)
+{
+    if (conn_data->capture_id) {
+        put_record(conn_data, CAPTURE_CLOSE, NULL, 0);
+        conn_data->capture_id = 0;
+    }
+}
+
+bool capture_load(const std::string &path, std::vector<capture_connection> *connections)
+{
+    FILE *fp = fopen(path.c_str(), "rbe");
+    if (!fp) {
+        return false;
+    }
+    char magic[sizeof kMagic];
+    int64_t start_us;
+    if (fread(magic, sizeof magic, 1, fp) != 1 || memcmp(magic, kMagic, sizeof magic) != 0 ||
+        fread(&start_us, sizeof start_us, 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+    std::unordered_map<uint64_t, size_t> index;
+    bool ok = true;
+    int type;
+    while ((type = getc(fp)) != EOF) {
+        uint64_t id, time_us, len = 0;
+        if (!get_varint(fp, &id) || !get_varint(fp, &time_us) ||
+            (type == CAPTURE_DATA && !get_varint(fp, &len))) {
+            ok = false;     // Cut off mid-record: keep what came before
+            break;
+        }
+        if (type == CAPTURE_OPEN) {
+            index[id] = connections->size();
+            connections->push_back(capture_connection{id, (int64_t)time_us, false, {}});
+            continue;
+        }
+        auto it = index.find(id);
+        if (type == CAPTURE_DATA) {
+            std::string bytes(len, '\0');
+            if (len && fread(&bytes[0], 1, len, fp) != len) {
+                ok = false;
+                break;
+            }
+            if (it != index.end()) {
+                (*connections)[it->second].chunks.push_back(capture_chunk{(int64_t)time_us, std::move(bytes)});
+            }
+        } else if (type == CAPTURE_CLOSE) {
+            if (it != index.end()) {
+                (*connections)[it->second].closed = true;
+            }
+        } else {
+            ok = false;
+            break;
+        }
+    }
+    fclose(fp);
+    // Threads drain into the file in turns, so file order is only per connection
+    std::stable_sort(connections->begin(), connections->end(),
+                     [](const capture_connection &a, const capture_connection &b) { return a.open_us < b.open_us; });
+    // A truncated tail still leaves every connection a usable prefix
+    return ok || !connections->empty();
+}
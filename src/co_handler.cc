@@ -0,0 +1,448 @@
+#include "co_handler.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <muduo/base/Logging.h>
+#include <muduo/base/ThreadPool.h>
+#include <muduo/net/Buffer.h>
+
+#include "deadline.h"
+#include "http2Session.h"
+
+namespace
+{
+
+// A streamed response suspends co_yield while more than this is queued, and resumes below the low mark
+const size_t kYieldHighWater = 64 * 1024;
+const size_t kYieldLowWater = 16 * 1024;
+
+int g_worker_threads = 2;
+
+} // namespace
+
+// One request run by a coroutine. Owned by the stream (sdata->handler_state).
+struct co_stream {
+    Request request;
+    co_link_ptr link;
+    nghttp2_session *session;
+    stream_data *sdata;
+    Task<Response>::handle_type top;
+
+    // Request body not yet read by the coroutine; not acknowledged to the peer either
+    std::deque<std::string> body;
+    size_t body_queued;
+    bool body_ended;
+    bool body_abandoned;                // Handler finished: later DATA is acknowledged right away
+    bool finished;                      // Final response submitted
+    std::coroutine_handle<> reader;
+
+    // Streamed response
+    bool head_sent;
+    bool ended;
+    muduo::net::Buffer pending;
+    header_list trailers;
+    std::coroutine_handle<> writer;
+
+    void parse_request();
+};
+
+void co_stream::parse_request()
+{
+    Request *req = &request;
+    req->_stream = this;
+    req->_streamId = sdata->stream_id;
+    if (sdata->path) {
+        req->_path = sdata->path;
+    }
+    if (sdata->authority) {
+        req->_authority = sdata->authority;
+    }
+    // sdata->headers holds "name: value\n" lines, pseudo headers included
+    const char *p = sdata->headers;
+    const char *end = p ? p + strlen(p) : p;
+    while (p && p < end) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        const char *sep = p + 1 < eol ? (const char *)memmem(p + 1, eol - p - 1, ": ", 2) : NULL;
+        if (sep) {
+            std::string name(p, sep - p);
+            std::string value(sep + 2, eol - sep - 2);
+            if (name == ":method") {
+                req->_method = value;
+            } else if (name[0] != ':') {
+                req->_headers.emplace_back(std::move(name), std::move(value));
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+namespace
+{
+
+void wake(const co_link_ptr &link, std::coroutine_handle<> *h)
+{
+    if (*h) {
+        co_resume(link, std::exchange(*h, nullptr));
+    }
+}
+
+// nghttp2 copies names and values on submit, so the strings only need to outlive the call
+void append_nva(const header_list &headers, std::vector<nghttp2_nv> *nva)
+{
+    for (const auto &h : headers) {
+        nva->push_back({(uint8_t *)h.first.data(), (uint8_t *)h.second.data(), h.first.size(), h.second.size(),
+                        NGHTTP2_NV_FLAG_NONE});
+    }
+}
+
+std::vector<nghttp2_nv> make_nva(const std::string &status, const header_list &headers)
+{
+    std::vector<nghttp2_nv> nva;
+    nva.push_back({(uint8_t *)":status", (uint8_t *)status.data(), 7, status.size(), NGHTTP2_NV_FLAG_NONE});
+    append_nva(headers, &nva);
+    return nva;
+}
+
+ssize_t co_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                         uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    co_stream *st = (co_stream *)source->ptr;
+    size_t n = st->pending.readableBytes() < length ? st->pending.readableBytes() : length;
+    if (n == 0 && !st->ended) {
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    memcpy(buf, st->pending.peek(), n);
+    st->pending.retrieve(n);
+    if (st->ended && st->pending.readableBytes() == 0) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        if (!st->trailers.empty()) {
+            std::vector<nghttp2_nv> nva;
+            append_nva(st->trailers, &nva);
+            if (stream_submit_trailer(st->sdata, nva.data(), nva.size()) == 0) {
+                *data_flags |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
+            }
+        }
+    } else if (st->pending.readableBytes() < kYieldLowWater) {
+        wake(st->link, &st->writer);
+    }
+    return n;
+}
+
+void submit_streamed_head(co_stream *st, int status, const header_list &headers)
+{
+    std::string code = std::to_string(status);
+    std::vector<nghttp2_nv> nva = make_nva(code, headers);
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = st;
+    data_prd.read_callback = co_read_callback;
+    submit_response_headers(st->session, st->sdata, nva.data(), nva.size(), &data_prd);
+    st->head_sent = true;
+}
+
+// Whatever the handler left unread is acknowledged so the connection window recovers
+void abandon_body(co_stream *st)
+{
+    st->body_abandoned = true;
+    if (st->body_queued > 0) {
+        stream_consume(st->sdata, st->body_queued);
+        st->body_queued = 0;
+    }
+    st->body.clear();
+}
+
+void finish(co_stream *st)
+{
+    Task<Response>::promise_type &promise = st->top.promise();
+    st->finished = true;
+    abandon_body(st);
+    if (st->sdata->reject_status) {
+        // The deadline passed and the stream was answered without us
+        return;
+    }
+    if (promise.error) {
+        try {
+            std::rethrow_exception(promise.error);
+        } catch (const request_cancelled &) {
+            // Nobody waits for an answer
+            stream_reset(st->sdata, NGHTTP2_CANCEL);
+            return;
+        } catch (const std::exception &e) {
+            LOG_ERROR << "coroutine handler for " << st->request.path() << " failed: " << e.what();
+        } catch (...) {
+            LOG_ERROR << "coroutine handler for " << st->request.path() << " failed";
+        }
+        if (st->head_sent) {
+            stream_reset(st->sdata, NGHTTP2_INTERNAL_ERROR);
+        } else {
+            const nghttp2_nv headers[] = {
+                {(uint8_t*)":status", (uint8_t*)"500", 7, 3, NGHTTP2_NV_FLAG_NONE}
+            };
+            submit_response_headers(st->session, st->sdata, headers, 1, NULL);
+        }
+        return;
+    }
+
+    Response &r = *promise.value;
+    if (!st->head_sent && r.trailers.empty()) {
+        // Whole response at once: the same path as the built-in handlers, compression included
+        stream_data *sdata = st->sdata;
+        if (!r.body.empty()) {
+            sdata->response_body = (char *)malloc(r.body.size());
+            memcpy(sdata->response_body, r.body.data(), r.body.size());
+            sdata->response_len = r.body.size();
+            sdata->response_offset = 0;
+        }
+        std::string code = std::to_string(r.status);
+        std::vector<nghttp2_nv> nva = make_nva(code, r.headers);
+        if (sdata->response_body) {
+            submit_stream_response(st->session, sdata->stream_id, sdata, nva.data(), nva.size(), NULL);
+        } else {
+            submit_response_headers(st->session, sdata, nva.data(), nva.size(), NULL);
+        }
+        return;
+    }
+    if (!st->head_sent) {
+        submit_streamed_head(st, r.status, r.headers);
+    }
+    st->pending.append(r.body);
+    st->trailers = std::move(r.trailers);
+    st->ended = true;
+    stream_resume(st->sdata);
+}
+
+void step(co_stream *st, std::coroutine_handle<> h)
+{
+    h.resume();
+    if (st->top.done() && !st->finished) {
+        finish(st);
+    }
+    http2_session_schedule_send(st->sdata->conn);
+}
+
+void co_request_headers(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    co_stream *st = new co_stream();
+    st->session = session;
+    st->sdata = sdata;
+    st->link.reset(new co_link{sdata->conn->loop, st, cancel_token_ref(stream_cancel_token(sdata))});
+    st->parse_request();
+    st->body_ended = sdata->request_done;
+    sdata->handler_state = st;
+
+    co_handler_fn fn = reinterpret_cast<co_handler_fn>(self->data);
+    st->top = fn(st->request).release();
+    st->top.promise().link = st->link;
+    st->top.promise().stream = st;
+    step(st, st->top);
+}
+
+int co_request_data(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                    const uint8_t *data, size_t len)
+{
+    co_stream *st = (co_stream *)sdata->handler_state;
+    if (!st || st->body_abandoned) {
+        stream_consume(sdata, len);
+        return 0;
+    }
+    st->body.emplace_back((const char *)data, len);
+    st->body_queued += len;
+    wake(st->link, &st->reader);
+    return 0;
+}
+
+void co_request_end(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    co_stream *st = (co_stream *)sdata->handler_state;
+    if (st) {
+        st->body_ended = true;
+        wake(st->link, &st->reader);
+    }
+}
+
+void co_stream_close(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                     uint32_t error_code)
+{
+    co_stream *st = (co_stream *)sdata->handler_state;
+    if (!st) {
+        return;
+    }
+    sdata->handler_state = NULL;
+    // Pending timers, pool jobs and callbacks now resume nothing
+    st->link->stream = NULL;
+    if (st->top) {
+        st->top.destroy();
+    }
+    // The stream is gone, so unread body bytes only count against the connection window
+    if (st->body_queued > 0) {
+        stream_consume_connection(sdata, st->body_queued);
+    }
+    delete st;
+}
+
+muduo::ThreadPool *worker_pool()
+{
+    static std::once_flag once;
+    static muduo::ThreadPool *pool;
+    std::call_once(once, []() {
+        pool = new muduo::ThreadPool("co-worker");
+        pool->start(g_worker_threads);
+    });
+    return pool;
+}
+
+// ---- example ----
+
+Task<Response> ticks(Request &req)
+{
+    std::string body = co_await req.body();
+    int count = body.empty() ? 5 : atoi(body.c_str());
+    Response r;
+    r.headers.emplace_back("content-type", "text/plain");
+    if (count < 1 || count > 100) {
+        r.status = 400;
+        r.body = "count must be 1..100\n";
+        co_return r;
+    }
+    co_yield r;
+    for (int i = 1; i <= count; ++i) {
+        co_await sleep_for(0.1);
+        std::string line = co_await run_blocking([i]() { return "tick " + std::to_string(i) + "\n"; });
+        co_yield line;
+    }
+    Response end;
+    end.trailers.emplace_back("x-ticks", std::to_string(count));
+    co_return end;
+}
+
+} // namespace
+
+void co_resume(const co_link_ptr &link, std::coroutine_handle<> h)
+{
+    if (!link->loop) {
+        if (link->stream) {
+            step(link->stream, h);
+        }
+        return;
+    }
+    link->loop->queueInLoop([link, h]() {
+        if (link->stream) {
+            step(link->stream, h);
+        }
+    });
+}
+
+void co_run_in_pool(std::function<void()> job)
+{
+    worker_pool()->run(std::move(job));
+}
+
+void co_set_worker_threads(int threads)
+{
+    g_worker_threads = threads > 0 ? threads : 1;
+}
+
+bool co_stream_yield_head(co_stream *st, Response &&head)
+{
+    if (st->head_sent) {
+        // A second head only contributes its body
+        return co_stream_yield_chunk(st, std::move(head.body));
+    }
+    submit_streamed_head(st, head.status, head.headers);
+    return co_stream_yield_chunk(st, std::move(head.body));
+}
+
+bool co_stream_yield_chunk(co_stream *st, std::string &&chunk)
+{
+    if (!st->head_sent) {
+        submit_streamed_head(st, 200, header_list());
+    }
+    if (!chunk.empty()) {
+        st->pending.append(chunk);
+        stream_resume(st->sdata);
+        http2_session_schedule_send(st->sdata->conn);
+    }
+    return st->pending.readableBytes() >= kYieldHighWater;
+}
+
+void co_stream_wait_writable(co_stream *st, std::coroutine_handle<> h)
+{
+    st->writer = h;
+}
+
+cancel_token *Request::cancelToken() const
+{
+    return _stream->link->cancel;
+}
+
+std::optional<double> Request::timeRemaining() const
+{
+    int64_t us = deadline_remaining_us(_stream->sdata);
+    if (us < 0) {
+        return std::nullopt;
+    }
+    return us / 1e6;
+}
+
+const std::string *Request::header(const std::string &name) const
+{
+    for (const auto &h : _headers) {
+        if (h.first == name) {
+            return &h.second;
+        }
+    }
+    return NULL;
+}
+
+bool Request::body_read::await_ready()
+{
+    return !stream->body.empty() || stream->body_ended;
+}
+
+void Request::body_read::await_suspend(std::coroutine_handle<> h)
+{
+    // Resumed by the next DATA frame or END_STREAM
+    stream->reader = h;
+}
+
+std::string Request::body_read::await_resume()
+{
+    if (stream->body.empty()) {
+        return std::string();
+    }
+    std::string chunk = std::move(stream->body.front());
+    stream->body.pop_front();
+    stream->body_queued -= chunk.size();
+    // Only now does the peer get the window back
+    stream_consume(stream->sdata, chunk.size());
+    return chunk;
+}
+
+Task<std::string> Request::body()
+{
+    std::string all;
+    for (;;) {
+        std::string chunk = co_await read();
+        if (chunk.empty()) {
+            co_return all;
+        }
+        all += chunk;
+    }
+}
+
+RequestHandler make_co_handler(co_handler_fn fn)
+{
+    RequestHandler handler = {
+        .handle_request = co_request_end,
+        .data = reinterpret_cast<void *>(fn),
+        .on_request_headers = co_request_headers,
+        .on_request_data = co_request_data,
+        .on_stream_close = co_stream_close,
+        .factory = NULL,
+    };
+    return handler;
+}
+
+RequestHandler ticks_handler_impl = make_co_handler(ticks);
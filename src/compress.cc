@@ -0,0 +1,450 @@
+#include "compress.h"
+#include <zlib.h>
+#include <string>
+#include <unordered_map>
+#ifdef MUDUOHTTP_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+compression_policy g_compression_policy = {
+    .enabled = true,
+    .min_size = 256,
+    .stream_threshold = 64 * 1024,
+    .cache_entries = 256,
+};
+
+namespace
+{
+
+// Per content-type rules. Types not listed here (images, archives, ...) are sent as is.
+struct compression_rule {
+    const char *prefix;
+    size_t prefix_len;
+    int level;              // gzip level; brotli and zstd levels are derived from it
+};
+
+const compression_rule kRules[] = {
+    {"text/", 5, 6},
+    {"application/json", 16, 6},
+    {"application/javascript", 22, 6},
+    {"application/xml", 15, 6},
+    {"image/svg+xml", 13, 6},
+};
+
+const compression_rule *match_rule(const char *content_type, size_t len)
+{
+    if (!content_type) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(kRules) / sizeof(kRules[0]); ++i) {
+        if (len >= kRules[i].prefix_len && strncasecmp(content_type, kRules[i].prefix, kRules[i].prefix_len) == 0) {
+            return &kRules[i];
+        }
+    }
+    return NULL;
+}
+
+int available_encodings()
+{
+    int mask = ENCODING_GZIP;
+#ifdef MUDUOHTTP_HAVE_BROTLI
+    mask |= ENCODING_BROTLI;
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+    mask |= ENCODING_ZSTD;
+#endif
+    return mask;
+}
+
+// Server preference among what the client accepts
+int pick_encoding(int accepted)
+{
+    accepted &= available_encodings();
+    if (accepted & ENCODING_ZSTD) return ENCODING_ZSTD;
+    if (accepted & ENCODING_BROTLI) return ENCODING_BROTLI;
+    if (accepted & ENCODING_GZIP) return ENCODING_GZIP;
+    return 0;
+}
+
+const int kMaxLevel = 9;
+
+// One-shot compression into a malloc'd buffer. Returns NULL on failure.
+uint8_t *compress_all(int encoding, int level, const uint8_t *in, size_t in_len, size_t *out_len)
+{
+    if (encoding == ENCODING_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        size_t bound = deflateBound(&zs, in_len);
+        uint8_t *out = (uint8_t *)malloc(bound);
+        if (!out) {
+            deflateEnd(&zs);
+            return NULL;
+        }
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = in_len;
+        zs.next_out = out;
+        zs.avail_out = bound;
+        int rv = deflate(&zs, Z_FINISH);
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+        if (rv != Z_STREAM_END) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+#ifdef MUDUOHTTP_HAVE_BROTLI
+    if (encoding == ENCODING_BROTLI) {
+        // gzip 1..9 maps onto brotli quality 1..11
+        int quality = level >= kMaxLevel ? BROTLI_MAX_QUALITY : level > 1 ? level - 1 : 1;
+        size_t bound = BrotliEncoderMaxCompressedSize(in_len);
+        uint8_t *out = (uint8_t *)malloc(bound);
+        if (!out) {
+            return NULL;
+        }
+        *out_len = bound;
+        if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in_len, in, out_len, out)) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+    if (encoding == ENCODING_ZSTD) {
+        int zlevel = level >= kMaxLevel ? 19 : level - 3 > 1 ? level - 3 : 1;
+        size_t bound = ZSTD_compressBound(in_len);
+        uint8_t *out = (uint8_t *)malloc(bound);
+        if (!out) {
+            return NULL;
+        }
+        size_t rv = ZSTD_compress(out, bound, in, in_len, zlevel);
+        if (ZSTD_isError(rv)) {
+            free(out);
+            return NULL;
+        }
+        *out_len = rv;
+        return out;
+    }
+#endif
+    return NULL;
+}
+
+// Precompressed variants of immutable bodies, one table per IO thread so no locking is needed
+struct cached_variant {
+    bool identity;          // Compression did not pay off; send the original
+    std::string bytes;
+};
+
+thread_local std::unordered_map<std::string, cached_variant> variant_cache;
+
+void replace_body(stream_data *sdata, uint8_t *body, size_t len)
+{
+    free(sdata->response_body);
+    sdata->response_body = (char *)body;
+    sdata->response_len = len;
+    sdata->response_offset = 0;
+}
+
+} // namespace
+
+struct response_encoder {
+    int encoding;
+    body_chain *in;         // Not owned; read as the frames are produced
+    bool finished;
+    z_stream zs;
+#ifdef MUDUOHTTP_HAVE_BROTLI
+    BrotliEncoderState *brotli;
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+int parse_accept_encoding(const uint8_t *value, size_t len)
+{
+    int accepted = 0;           // Named with a non-zero q
+    int named = 0;              // Named at all, q=0 included
+    bool wildcard = false;      // "*" with a non-zero q
+    const char *p = (const char *)value;
+    const char *end = p + len;
+    while (p < end) {
+        // One element: token [; q=value]
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') ++p;
+        size_t token_len = p - token;
+        bool acceptable = true;
+        while (p < end && *p != ',') {
+            if (*p == 'q' && p + 1 < end && p[1] == '=') {
+                // q=0, q=0.0, q=0.000 all mean "not acceptable"
+                const char *q = p + 2;
+                acceptable = false;
+                for (; q < end && *q != ',' && *q != ';' && *q != ' '; ++q) {
+                    if (*q >= '1' && *q <= '9') {
+                        acceptable = true;
+                    }
+                }
+                p = q;
+            } else {
+                ++p;
+            }
+        }
+        int coding = 0;
+        if (token_len == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            coding = ENCODING_GZIP;
+        } else if (token_len == 2 && strncasecmp(token, "br", 2) == 0) {
+            coding = ENCODING_BROTLI;
+        } else if (token_len == 4 && strncasecmp(token, "zstd", 4) == 0) {
+            coding = ENCODING_ZSTD;
+        } else if (token_len == 1 && *token == '*') {
+            wildcard = acceptable;
+            continue;
+        }
+        named |= coding;
+        if (acceptable) {
+            accepted |= coding;
+        }
+    }
+    // "*" stands for the codings not listed by name; a listed one keeps its own q, q=0 excluding it
+    int mask = accepted;
+    if (wildcard) {
+        mask |= (ENCODING_GZIP | ENCODING_BROTLI | ENCODING_ZSTD) & ~named;
+    }
+    return mask;
+}
+
+bool is_compressible_type(const char *content_type, size_t len)
+{
+    return match_rule(content_type, len) != NULL;
+}
+
+const char *encoding_name(int encoding)
+{
+    switch (encoding) {
+    case ENCODING_GZIP: return "gzip";
+    case ENCODING_BROTLI: return "br";
+    case ENCODING_ZSTD: return "zstd";
+    default: return "identity";
+    }
+}
+
+int compress_response(stream_data *sdata, const char *content_type, size_t content_type_len,
+                      const char *cache_key)
+{
+    if (!g_compression_policy.enabled || !sdata->accept_encoding) {
+        return 0;
+    }
+    if (!sdata->response_body && !sdata->response_chain) {
+        return 0;
+    }
+    size_t body_size = sdata->response_chain ? body_chain_remaining(sdata->response_chain) : sdata->response_len;
+    if (body_size < g_compression_policy.min_size) {
+        return 0;
+    }
+    const compression_rule *rule = match_rule(content_type, content_type_len);
+    if (!rule) {
+        return 0;
+    }
+    int encoding = pick_encoding(sdata->accept_encoding);
+    if (!encoding) {
+        return 0;
+    }
+
+    if (sdata->response_chain) {
+        // Segmented bodies are never joined; they are always compressed while sending
+        sdata->encoder = response_encoder_new(encoding, rule->level, sdata->response_chain);
+        return sdata->encoder ? encoding : 0;
+    }
+
+    const uint8_t *body = (const uint8_t *)sdata->response_body;
+    size_t body_len = sdata->response_len;
+
+    if (cache_key) {
+        std::string key(cache_key);
+        key += '\0';
+        key += encoding_name(encoding);
+        auto it = variant_cache.find(key);
+        if (it == variant_cache.end()) {
+            // Compressed once, so spend the maximum level on it
+            cached_variant variant;
+            size_t out_len = 0;
+            uint8_t *out = compress_all(encoding, kMaxLevel, body, body_len, &out_len);
+            variant.identity = !out || out_len >= body_len;
+            if (out) {
+                if (!variant.identity) {
+                    variant.bytes.assign((const char *)out, out_len);
+                }
+                free(out);
+            }
+            if (variant_cache.size() >= g_compression_policy.cache_entries) {
+                variant_cache.clear();
+            }
+            it = variant_cache.emplace(key, std::move(variant)).first;
+        }
+        if (it->second.identity) {
+            return 0;
+        }
+        uint8_t *copy = (uint8_t *)malloc(it->second.bytes.size());
+        if (!copy) {
+            return 0;
+        }
+        memcpy(copy, it->second.bytes.data(), it->second.bytes.size());
+        replace_body(sdata, copy, it->second.bytes.size());
+        return encoding;
+    }
+
+    if (body_len >= g_compression_policy.stream_threshold) {
+        // Large body: compress into each DATA frame as it is sent instead of all up front
+        body_chain *chain = body_chain_new();
+        if (!chain || !body_chain_append(chain, sdata->response_body, body_len, SEGMENT_BORROWED)) {
+            body_chain_free(chain);
+            return 0;
+        }
+        sdata->response_chain = chain;
+        sdata->encoder = response_encoder_new(encoding, rule->level, chain);
+        return sdata->encoder ? encoding : 0;
+    }
+
+    size_t out_len = 0;
+    uint8_t *out = compress_all(encoding, rule->level, body, body_len, &out_len);
+    if (!out) {
+        return 0;
+    }
+    if (out_len >= body_len) {
+        free(out);
+        return 0;
+    }
+    replace_body(sdata, out, out_len);
+    return encoding;
+}
+
+response_encoder *response_encoder_new(int encoding, int level, body_chain *in)
+{
+    response_encoder *enc = (response_encoder *)calloc(1, sizeof(response_encoder));
+    if (!enc) {
+        return NULL;
+    }
+    enc->encoding = encoding;
+    enc->in = in;
+    bool ok = false;
+    if (encoding == ENCODING_GZIP) {
+        ok = deflateInit2(&enc->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+#ifdef MUDUOHTTP_HAVE_BROTLI
+    if (encoding == ENCODING_BROTLI) {
+        enc->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        ok = enc->brotli
+            && BrotliEncoderSetParameter(enc->brotli, BROTLI_PARAM_QUALITY, level > 1 ? level - 1 : 1)
+            && BrotliEncoderSetParameter(enc->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT)
+            && BrotliEncoderSetParameter(enc->brotli, BROTLI_PARAM_SIZE_HINT,
+                                         body_chain_remaining(in) > (1u << 30) ? 0 : body_chain_remaining(in));
+    }
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+    if (encoding == ENCODING_ZSTD) {
+        enc->zstd = ZSTD_createCCtx();
+        ok = enc->zstd
+            && !ZSTD_isError(ZSTD_CCtx_setParameter(enc->zstd, ZSTD_c_compressionLevel, level - 3 > 1 ? level - 3 : 1))
+            && !ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(enc->zstd, body_chain_remaining(in)));
+    }
+#endif
+    if (!ok) {
+        response_encoder_free(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+ssize_t response_encoder_read(response_encoder *enc, uint8_t *buf, size_t length, uint32_t *data_flags)
+{
+    if (enc->finished) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        return 0;
+    }
+    size_t produced = 0;
+    // Feed the chain one segment at a time until the frame is full; the last segment finishes the stream
+    for (;;) {
+        const char *in = NULL;
+        size_t in_len = body_chain_peek(enc->in, &in);
+        bool last = in_len == body_chain_remaining(enc->in);
+        size_t consumed = 0;
+        size_t out_before = produced;
+        if (enc->encoding == ENCODING_GZIP) {
+            enc->zs.next_in = (Bytef *)in;
+            enc->zs.avail_in = in_len;
+            enc->zs.next_out = buf + produced;
+            enc->zs.avail_out = length - produced;
+            int rv = deflate(&enc->zs, last ? Z_FINISH : Z_NO_FLUSH);
+            if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+            consumed = in_len - enc->zs.avail_in;
+            produced = length - enc->zs.avail_out;
+            enc->finished = (rv == Z_STREAM_END);
+        }
+#ifdef MUDUOHTTP_HAVE_BROTLI
+        if (enc->encoding == ENCODING_BROTLI) {
+            size_t avail_in = in_len;
+            const uint8_t *next_in = (const uint8_t *)in;
+            size_t avail_out = length - produced;
+            uint8_t *next_out = buf + produced;
+            if (!BrotliEncoderCompressStream(enc->brotli, last ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                             &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+            consumed = in_len - avail_in;
+            produced = length - avail_out;
+            enc->finished = BrotliEncoderIsFinished(enc->brotli);
+        }
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+        if (enc->encoding == ENCODING_ZSTD) {
+            ZSTD_inBuffer input = {in, in_len, 0};
+            ZSTD_outBuffer output = {buf, length, produced};
+            size_t remaining = ZSTD_compressStream2(enc->zstd, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+            consumed = input.pos;
+            produced = output.pos;
+            enc->finished = last && remaining == 0;
+        }
+#endif
+        body_chain_advance(enc->in, consumed);
+        if (enc->finished || produced == length || (consumed == 0 && produced == out_before)) {
+            break;
+        }
+    }
+    if (enc->finished) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return produced;
+}
+
+void response_encoder_free(response_encoder *enc)
+{
+    if (!enc) {
+        return;
+    }
+    if (enc->encoding == ENCODING_GZIP) {
+        deflateEnd(&enc->zs);
+    }
+#ifdef MUDUOHTTP_HAVE_BROTLI
+    if (enc->brotli) {
+        BrotliEncoderDestroyInstance(enc->brotli);
+    }
+#endif
+#ifdef MUDUOHTTP_HAVE_ZSTD
+    if (enc->zstd) {
+        ZSTD_freeCCtx(enc->zstd);
+    }
+#endif
+    free(enc);
+}
@@ -0,0 +1,284 @@
+#include "deadline.h"
+#include <stdio.h>
+#include <vector>
+#include <muduo/base/Timestamp.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TimerId.h>
+
+#include "cancel.h"
+#include "grpc.h"
+#include "http2Session.h"
+#include "metrics.h"
+#include "route.h"
+
+deadline_policy g_deadline_policy = {
+    .default_timeout = 0,
+    .honor_grpc_timeout = true,
+    .status = 504,
+};
+
+namespace
+{
+
+// Granularity of the wheel, and its size: one revolution covers 5.12s, later deadlines
+// stay in their slot and are looked at again each revolution
+const int64_t kTickUs = 10 * 1000;
+const size_t kSlots = 512;
+
+// Per IO loop. Loops live as long as the process, so the wheel is never freed. There is no
+// periodic tick: one timer waits for the earliest occupied slot, so a loop whose streams
+// finish well within their budget is woken about once per budget, not every 10ms.
+struct timer_wheel {
+    muduo::net::EventLoop *loop;
+    stream_data *slots[kSlots];
+    int64_t tick;                       // Last tick processed, in kTickUs since the epoch
+    size_t armed;
+    bool running;                       // The timer is scheduled
+    int64_t timer_tick;                 // Tick it fires at, while running
+    muduo::net::TimerId timer;
+};
+
+thread_local timer_wheel *t_wheel = NULL;
+
+const nghttp2_nv kGrpcDeadlineExceeded[] = {
+    {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+    {(uint8_t*)"content-type", (uint8_t*)"application/grpc", 12, 16,
+     NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+    {(uint8_t*)"grpc-status", (uint8_t*)"4", 11, 1, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+    {(uint8_t*)"grpc-message", (uint8_t*)"deadline exceeded", 12, 17,
+     NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+};
+
+int64_t now_us()
+{
+    return muduo::Timestamp::now().microSecondsSinceEpoch();
+}
+
+// Returns the tick of the slot it went into
+int64_t link(timer_wheel *w, stream_data *sdata)
+{
+    int64_t t = sdata->deadline.at_us / kTickUs;
+    if (t <= w->tick) {
+        t = w->tick + 1;
+    }
+    // Further out than a revolution: the slot is visited earlier and the stream linked again
+    if (t - w->tick > (int64_t)kSlots) {
+        t = w->tick + (int64_t)kSlots;
+    }
+    size_t slot = (size_t)(t % (int64_t)kSlots);
+    sdata->deadline.slot = (uint32_t)slot;
+    sdata->deadline.prev = NULL;
+    sdata->deadline.next = w->slots[slot];
+    if (w->slots[slot]) {
+        w->slots[slot]->deadline.prev = sdata;
+    }
+    w->slots[slot] = sdata;
+    return t;
+}
+
+void on_tick(timer_wheel *w);
+
+// Make sure the timer fires by tick t
+void schedule(timer_wheel *w, int64_t t)
+{
+    if (w->running) {
+        if (w->timer_tick <= t) {
+            return;
+        }
+        w->loop->cancel(w->timer);
+    }
+    w->timer = w->loop->runAt(muduo::Timestamp(t * kTickUs), std::bind(on_tick, w));
+    w->running = true;
+    w->timer_tick = t;
+}
+
+// The deadline passed: stop the handler's work, then answer or reset the stream
+void expire(stream_data *sdata)
+{
+    nghttp2_session *session = sdata->conn->session;
+    metrics_add(METRIC_DEADLINE_EXCEEDED);
+    stream_cancel(sdata, CANCEL_DEADLINE);
+    if (!sdata->response_submitted) {
+        // Like a rejected request from here on: DATA is dropped, no handler runs, and a client
+        // still uploading is told to stop once the answer is out
+        bool grpc = content_type_is_grpc(sdata);
+        sdata->reject_status = grpc ? 200 : g_deadline_policy.status;
+        if (grpc) {
+            submit_response_headers(session, sdata, kGrpcDeadlineExceeded, 4, NULL);
+        } else {
+            char status[8];    // Room for any uint16_t, not just three digits
+            snprintf(status, sizeof status, "%03u", (unsigned)g_deadline_policy.status);
+            const nghttp2_nv headers[] = {
+                {(uint8_t*)":status", (uint8_t*)status, 7, 3, NGHTTP2_NV_FLAG_NONE},
+            };
+            submit_response_headers(session, sdata, headers, 1, NULL);
+        }
+    } else {
+        stream_reset(sdata, NGHTTP2_CANCEL);
+    }
+    http2_session_schedule_send(sdata->conn);
+}
+
+void on_tick(timer_wheel *w)
+{
+    w->running = false;
+    int64_t now = now_us();
+    int64_t now_tick = now / kTickUs;
+    // A late timer catches up, but one revolution already visits every slot
+    int64_t from = w->tick + 1;
+    if (now_tick - from >= (int64_t)kSlots) {
+        from = now_tick - (int64_t)kSlots + 1;
+    }
+    w->tick = now_tick;
+    std::vector<stream_data *> expired;
+    for (int64_t t = from; t <= now_tick; ++t) {
+        size_t slot = (size_t)(t % (int64_t)kSlots);
+        stream_data *list = w->slots[slot];
+        w->slots[slot] = NULL;
+        while (list) {
+            stream_data *sdata = list;
+            list = sdata->deadline.next;
+            if (sdata->deadline.at_us <= now) {
+                sdata->deadline.armed = false;
+                sdata->deadline.prev = sdata->deadline.next = NULL;
+                w->armed -= 1;
+                expired.push_back(sdata);
+            } else {
+                link(w, sdata);
+            }
+        }
+    }
+    // Off the wheel before anything runs: cancellation callbacks may touch other streams
+    for (stream_data *sdata : expired) {
+        expire(sdata);
+    }
+    // Sleep until the next occupied slot; with nothing armed the timer stays off
+    for (size_t i = 1; i <= kSlots && w->armed > 0; ++i) {
+        if (w->slots[(size_t)((w->tick + (int64_t)i) % (int64_t)kSlots)]) {
+            schedule(w, w->tick + (int64_t)i);
+            break;
+        }
+    }
+}
+
+} // namespace
+
+bool parse_grpc_timeout(const uint8_t *value, size_t len, int64_t *us)
+{
+    // TimeoutValue is at most 8 digits, followed by one unit
+    if (len < 2 || len > 9) {
+        return false;
+    }
+    int64_t n = 0;
+    for (size_t i = 0; i + 1 < len; ++i) {
+        if (value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    switch (value[len - 1]) {
+    case 'H': *us = n * 3600 * 1000000; break;
+    case 'M': *us = n * 60 * 1000000; break;
+    case 'S': *us = n * 1000000; break;
+    case 'm': *us = n * 1000; break;
+    case 'u': *us = n; break;
+    case 'n': *us = (n + 999) / 1000; break;
+    default: return false;
+    }
+    return true;
+}
+
+void deadline_on_request_header(stream_data *sdata, const uint8_t *value, size_t len)
+{
+    int64_t us;
+    if (g_deadline_policy.honor_grpc_timeout && parse_grpc_timeout(value, len, &us)) {
+        // Zero would read as "none"; a timeout of zero has passed already
+        sdata->deadline.client_us = us > 0 ? us : 1;
+    }
+}
+
+void deadline_arm(nghttp2_session *session, stream_data *sdata)
+{
+    // A route's own budget wins over the default; a negative one means none (long-lived streams)
+    double timeout = g_deadline_policy.default_timeout;
+    if (sdata->route && sdata->route->timeout != 0) {
+        timeout = sdata->route->timeout;
+    }
+    int64_t at = 0;
+    if (timeout > 0) {
+        at = sdata->start_us + (int64_t)(timeout * 1000000);
+    }
+    if (sdata->deadline.client_us > 0) {
+        int64_t client_at = sdata->start_us + sdata->deadline.client_us;
+        if (!at || client_at < at) {
+            at = client_at;
+        }
+    }
+    sdata->deadline.at_us = at;
+    muduo::net::EventLoop *loop = sdata->conn->loop;
+    if (!at || !loop || sdata->deadline.armed) {
+        return;
+    }
+    if (!t_wheel) {
+        t_wheel = new timer_wheel();
+        t_wheel->loop = loop;
+    }
+    timer_wheel *w = t_wheel;
+    if (w->armed == 0) {
+        // Every slot is empty, so no tick can be skipped
+        w->tick = now_us() / kTickUs;
+    }
+    schedule(w, link(w, sdata));
+    sdata->deadline.armed = true;
+    w->armed += 1;
+}
+
+void deadline_disarm(stream_data *sdata)
+{
+    if (!sdata->deadline.armed) {
+        return;
+    }
+    timer_wheel *w = t_wheel;
+    if (sdata->deadline.prev) {
+        sdata->deadline.prev->deadline.next = sdata->deadline.next;
+    } else {
+        w->slots[sdata->deadline.slot] = sdata->deadline.next;
+    }
+    if (sdata->deadline.next) {
+        sdata->deadline.next->deadline.prev = sdata->deadline.prev;
+    }
+    sdata->deadline.prev = sdata->deadline.next = NULL;
+    sdata->deadline.armed = false;
+    // A timer left waiting for an emptied slot finds nothing there and goes back to sleep
+    w->armed -= 1;
+}
+
+int64_t deadline_remaining_us(const stream_data *sdata)
+{
+    if (!sdata->deadline.at_us) {
+        return -1;
+    }
+    int64_t left = sdata->deadline.at_us - now_us();
+    return left > 0 ? left : 0;
+}
+
+bool deadline_grpc_timeout(const stream_data *sdata, char *buf, size_t len)
+{
+    int64_t left = deadline_remaining_us(sdata);
+    if (left < 0) {
+        return false;
+    }
+    // The finest unit whose value fits the 8 digits grpc-timeout allows, rounded down
+    static const struct {
+        int64_t us;
+        char unit;
+    } kUnits[] = {{1, 'u'}, {1000, 'm'}, {1000000, 'S'}, {60 * 1000000LL, 'M'}, {3600 * 1000000LL, 'H'}};
+    for (const auto &u : kUnits) {
+        if (left / u.us <= 99999999) {
+            snprintf(buf, len, "%lld%c", (long long)(left / u.us), u.unit);
+            return true;
+        }
+    }
+    snprintf(buf, len, "99999999H");
+    return true;
+}
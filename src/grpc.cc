@@ -0,0 +1,412 @@
+#include "grpc.h"
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "http2Session.h"
+
+grpc_policy g_grpc_policy = {
+    .max_message = 4 * 1024 * 1024,
+};
+
+// One call; owned by its stream (sdata->handler_state)
+struct grpc_call {
+    nghttp2_session *session;
+    stream_data *sdata;
+    int32_t stream_id;
+    const grpc_method *method;          // NULL when the call was refused at once
+    void *user_data;
+
+    // Message being received
+    uint8_t prefix[5];
+    size_t prefix_len;
+    size_t msg_len;
+    char *msg;                          // Only for messages split across DATA chunks
+    size_t msg_got;
+    uint32_t received;
+
+    body_chain *out;                    // Response messages waiting for the data provider
+    bool headers_sent;
+    bool deferred;
+    uint32_t sent;
+    bool finished;
+    grpc_status_code status;
+    char *status_message;               // Percent-encoded
+};
+
+namespace
+{
+
+const size_t kPrefixLen = 5;
+
+void wake(grpc_call *call)
+{
+    if (call->deferred) {
+        call->deferred = false;
+        stream_resume(call->sdata);
+    }
+    http2_session_schedule_send(call->sdata->conn);
+}
+
+// grpc-message is percent-encoded, leaving printable ASCII other than '%' as is
+char *encode_status_message(const char *message)
+{
+    size_t len = strlen(message);
+    char *out = (char *)malloc(len * 3 + 1);
+    if (!out) {
+        return NULL;
+    }
+    char *p = out;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)message[i];
+        if (c >= 0x20 && c <= 0x7e && c != '%') {
+            *p++ = (char)c;
+        } else {
+            p += sprintf(p, "%%%02X", c);
+        }
+    }
+    *p = '\0';
+    return out;
+}
+
+void status_headers(grpc_call *call, std::vector<nghttp2_nv> *nva, char *status)
+{
+    snprintf(status, 4, "%d", (int)call->status);
+    nva->push_back({(uint8_t*)"grpc-status", (uint8_t*)status, 11, strlen(status), NGHTTP2_NV_FLAG_NO_COPY_NAME});
+    if (call->status_message) {
+        nva->push_back({(uint8_t*)"grpc-message", (uint8_t*)call->status_message, 12, strlen(call->status_message),
+                        NGHTTP2_NV_FLAG_NO_COPY_NAME});
+    }
+}
+
+ssize_t grpc_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                           uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    grpc_call *call = (grpc_call *)source->ptr;
+    size_t n = body_chain_read(call->out, buf, length);
+    body_chain_release_read(call->out);
+    if (body_chain_remaining(call->out) > 0) {
+        return n;
+    }
+    if (!call->finished) {
+        if (n == 0) {
+            call->deferred = true;
+            return NGHTTP2_ERR_DEFERRED;
+        }
+        return n;
+    }
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    std::vector<nghttp2_nv> nva;
+    char status[4];
+    status_headers(call, &nva, status);
+    if (stream_submit_trailer(call->sdata, nva.data(), nva.size()) == 0) {
+        *data_flags |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
+    }
+    return n;
+}
+
+void submit_headers(grpc_call *call)
+{
+    call->headers_sent = true;
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)"application/grpc", 12, 16, NGHTTP2_NV_FLAG_NONE}
+    };
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = call;
+    data_prd.read_callback = grpc_read_callback;
+    submit_response_headers(call->session, call->sdata, headers, 2, &data_prd);
+}
+
+void deliver(grpc_call *call, const char *msg, size_t len)
+{
+    ++call->received;
+    grpc_method_kind kind = call->method->kind;
+    if (call->received > 1 && (kind == GRPC_UNARY || kind == GRPC_SERVER_STREAMING)) {
+        grpc_finish(call, GRPC_INTERNAL, "more than one request message for a unary request");
+        return;
+    }
+    call->method->on_message(call, msg, len);
+}
+
+void reset_message(grpc_call *call)
+{
+    call->prefix_len = 0;
+    free(call->msg);
+    call->msg = NULL;
+    call->msg_got = 0;
+}
+
+const grpc_method *find_method(const grpc_method *methods, const char *path)
+{
+    // :path is /package.Service/Method; the route already matched the service part
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    if (!slash) {
+        return NULL;
+    }
+    for (const grpc_method *m = methods; m->name; ++m) {
+        if (strcmp(m->name, slash + 1) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+void grpc_request_headers(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (strcmp(sdata->method, "POST") != 0 || !content_type_is_grpc(sdata)) {
+        const nghttp2_nv headers[] = {
+            {(uint8_t*)":status", (uint8_t*)"415", 7, 3, NGHTTP2_NV_FLAG_NONE}
+        };
+        submit_response_headers(session, sdata, headers, 1, NULL);
+        return;
+    }
+    grpc_call *call = (grpc_call *)calloc(1, sizeof(grpc_call));
+    if (!call) {
+        return;
+    }
+    call->out = body_chain_new();
+    if (!call->out) {
+        free(call);
+        return;
+    }
+    call->session = session;
+    call->sdata = sdata;
+    call->stream_id = stream_id;
+    call->method = find_method((const grpc_method *)self->data, sdata->path);
+    sdata->handler_state = call;
+    if (!call->method) {
+        grpc_finish(call, GRPC_UNIMPLEMENTED, "unknown method");
+    }
+}
+
+int grpc_request_data(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                      const uint8_t *data, size_t len)
+{
+    // Messages are handed over (or copied) before this returns
+    stream_consume(sdata, len);
+    grpc_call *call = (grpc_call *)sdata->handler_state;
+    const char *p = (const char *)data;
+    while (call && len > 0 && !call->finished) {
+        if (call->prefix_len < kPrefixLen) {
+            size_t n = std::min(len, kPrefixLen - call->prefix_len);
+            memcpy(call->prefix + call->prefix_len, p, n);
+            call->prefix_len += n;
+            p += n;
+            len -= n;
+            if (call->prefix_len < kPrefixLen) {
+                break;
+            }
+            if (call->prefix[0] != 0) {
+                // We advertise no grpc-encoding, so a compressed message is the client's mistake
+                grpc_finish(call, GRPC_INTERNAL, "compressed messages are not supported");
+                break;
+            }
+            call->msg_len = ((size_t)call->prefix[1] << 24) | ((size_t)call->prefix[2] << 16) |
+                            ((size_t)call->prefix[3] << 8) | call->prefix[4];
+            if (call->msg_len > g_grpc_policy.max_message) {
+                grpc_finish(call, GRPC_RESOURCE_EXHAUSTED, "request message too large");
+                break;
+            }
+            if (len >= call->msg_len) {
+                // Whole message in this chunk: hand out a view of the receive buffer
+                const char *msg = p;
+                size_t msg_len = call->msg_len;
+                p += msg_len;
+                len -= msg_len;
+                reset_message(call);
+                deliver(call, msg, msg_len);
+                continue;
+            }
+            call->msg = (char *)malloc(call->msg_len);
+            if (!call->msg) {
+                grpc_finish(call, GRPC_RESOURCE_EXHAUSTED, "out of memory");
+                break;
+            }
+            call->msg_got = 0;
+        }
+        size_t n = std::min(len, call->msg_len - call->msg_got);
+        memcpy(call->msg + call->msg_got, p, n);
+        call->msg_got += n;
+        p += n;
+        len -= n;
+        if (call->msg_got == call->msg_len) {
+            char *msg = call->msg;
+            size_t msg_len = call->msg_len;
+            call->msg = NULL;
+            reset_message(call);
+            deliver(call, msg, msg_len);
+            free(msg);
+        }
+    }
+    return 0;
+}
+
+// END_STREAM from the client
+void grpc_request_end(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    grpc_call *call = (grpc_call *)sdata->handler_state;
+    if (!call || call->finished) {
+        return;
+    }
+    if (call->prefix_len > 0) {
+        grpc_finish(call, GRPC_INTERNAL, "truncated request message");
+        return;
+    }
+    grpc_method_kind kind = call->method->kind;
+    if (call->received == 0 && (kind == GRPC_UNARY || kind == GRPC_SERVER_STREAMING)) {
+        grpc_finish(call, GRPC_INTERNAL, "missing request message");
+        return;
+    }
+    if (call->method->on_half_close) {
+        call->method->on_half_close(call);
+    }
+}
+
+void grpc_stream_close(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                       uint32_t error_code)
+{
+    grpc_call *call = (grpc_call *)sdata->handler_state;
+    if (!call) {
+        return;
+    }
+    sdata->handler_state = NULL;
+    if (!call->finished && call->method && call->method->on_cancel) {
+        call->method->on_cancel(call);
+    }
+    free(call->msg);
+    free(call->status_message);
+    body_chain_free(call->out);
+    free(call);
+}
+
+void echo_unary(grpc_call *call, const char *msg, size_t len)
+{
+    grpc_send_message(call, msg, len);
+    grpc_finish(call, GRPC_OK, NULL);
+}
+
+void echo_bidi(grpc_call *call, const char *msg, size_t len)
+{
+    grpc_send_message(call, msg, len);
+}
+
+void echo_half_close(grpc_call *call)
+{
+    grpc_finish(call, GRPC_OK, NULL);
+}
+
+const grpc_method kEchoMethods[] = {
+    {"Unary", GRPC_UNARY, echo_unary, NULL, NULL},
+    {"Bidi", GRPC_BIDI_STREAMING, echo_bidi, echo_half_close, NULL},
+    {NULL, GRPC_UNARY, NULL, NULL, NULL},
+};
+
+} // namespace
+
+bool content_type_is_grpc(const stream_data *sdata)
+{
+    // "application/grpc+proto" and the like count too
+    static const char kPrefix[] = "content-type: application/grpc";
+    const size_t n = sizeof kPrefix - 1;
+    for (const char *p = sdata->headers; p && *p; ) {
+        if (strncmp(p, kPrefix, n) == 0) {
+            char next = p[n];
+            return next == '\n' || next == '+' || next == ';' || next == '\0';
+        }
+        const char *eol = strchr(p, '\n');
+        if (!eol) {
+            break;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+RequestHandler make_grpc_service(const grpc_method *methods)
+{
+    RequestHandler handler = {
+        .handle_request = grpc_request_end,
+        .data = (void *)methods,
+        .on_request_headers = grpc_request_headers,
+        .on_request_data = grpc_request_data,
+        .on_stream_close = grpc_stream_close,
+        .factory = NULL,
+    };
+    return handler;
+}
+
+bool grpc_send_message(grpc_call *call, const char *msg, size_t len)
+{
+    if (call->finished) {
+        return false;
+    }
+    grpc_method_kind kind = call->method->kind;
+    if (call->sent > 0 && (kind == GRPC_UNARY || kind == GRPC_CLIENT_STREAMING)) {
+        return false;
+    }
+    char *framed = (char *)malloc(kPrefixLen + len);
+    if (!framed) {
+        return false;
+    }
+    framed[0] = 0;
+    framed[1] = (char)(len >> 24);
+    framed[2] = (char)(len >> 16);
+    framed[3] = (char)(len >> 8);
+    framed[4] = (char)len;
+    if (len) {
+        memcpy(framed + kPrefixLen, msg, len);
+    }
+    if (!body_chain_append(call->out, framed, kPrefixLen + len, SEGMENT_OWNED)) {
+        return false;
+    }
+    ++call->sent;
+    if (!call->headers_sent) {
+        submit_headers(call);
+    }
+    wake(call);
+    return true;
+}
+
+void grpc_finish(grpc_call *call, grpc_status_code status, const char *message)
+{
+    if (call->finished) {
+        return;
+    }
+    call->finished = true;
+    call->status = status;
+    call->status_message = message ? encode_status_message(message) : NULL;
+    reset_message(call);
+    if (call->headers_sent) {
+        // The data provider sends the trailers once the queued messages are out
+        wake(call);
+        return;
+    }
+    // Trailers-only response
+    call->headers_sent = true;
+    std::vector<nghttp2_nv> nva = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)"application/grpc", 12, 16, NGHTTP2_NV_FLAG_NONE},
+    };
+    char status_buf[4];
+    status_headers(call, &nva, status_buf);
+    submit_response_headers(call->session, call->sdata, nva.data(), nva.size(), NULL);
+    http2_session_schedule_send(call->sdata->conn);
+}
+
+void grpc_set_user_data(grpc_call *call, void *user_data)
+{
+    call->user_data = user_data;
+}
+
+void *grpc_user_data(const grpc_call *call)
+{
+    return call->user_data;
+}
+
+stream_data *grpc_call_stream(const grpc_call *call)
+{
+    return call->sdata;
+}
+
+RequestHandler grpc_echo_service_impl = make_grpc_service(kEchoMethods);
@@ -0,0 +1,168 @@
+#include "handoff.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <muduo/base/Logging.h>
+
+namespace
+{
+
+const int kMaxHandoffFds = 16;
+
+bool make_address(const std::string& path, struct sockaddr_un* addr)
+{
+    if (path.size() >= sizeof(addr->sun_path)) {
+        LOG_ERROR << "handoff path too long: " << path;
+        return false;
+    }
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.data(), path.size());
+    return true;
+}
+
+bool wait_readable(int sock, double timeout)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int rv;
+    do {
+        rv = ::poll(&pfd, 1, (int)(timeout * 1000));
+    } while (rv < 0 && errno == EINTR);
+    return rv > 0;
+}
+
+} // namespace
+
+int handoff_listen(const std::string& path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(path, &addr)) {
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_SYSERR << "handoff socket";
+        return -1;
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || ::listen(fd, 1) < 0) {
+        LOG_SYSERR << "handoff bind " << path;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const std::string& path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(path, &addr)) {
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send_fds(int sock, const std::vector<int>& fds, const std::vector<int>& extra)
+{
+    size_t total = fds.size() + extra.size();
+    if (fds.empty() || total > (size_t)kMaxHandoffFds) {
+        return -1;
+    }
+    // Plain 'F' without extras, so a process from before they existed can still take over
+    char header[2] = {extra.empty() ? 'F' : 'G', (char)fds.size()};
+    struct iovec iov = {header, extra.empty() ? (size_t)1 : (size_t)2};
+    char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)];
+    memset(control, 0, sizeof control);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * total);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * total);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg) + sizeof(int) * fds.size(), extra.data(), sizeof(int) * extra.size());
+
+    ssize_t n;
+    do {
+        n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+int handoff_recv_fds(int sock, std::vector<int>* fds, std::vector<int>* extra, double timeout)
+{
+    if (!wait_readable(sock, timeout)) {
+        return -1;
+    }
+    char header[2] = {0, 0};
+    struct iovec iov = {header, sizeof header};
+    char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t n;
+    do {
+        n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (!((n == 1 && header[0] == 'F') || (n == 2 && header[0] == 'G'))) {
+        return -1;
+    }
+    std::vector<int> received;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = (const int *)CMSG_DATA(cmsg);
+            received.insert(received.end(), data, data + count);
+        }
+    }
+    size_t listeners = header[0] == 'F' ? received.size() : (size_t)(unsigned char)header[1];
+    if (listeners == 0 || listeners > received.size()) {
+        for (int fd : received) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    fds->insert(fds->end(), received.begin(), received.begin() + listeners);
+    extra->insert(extra->end(), received.begin() + listeners, received.end());
+    return 0;
+}
+
+int handoff_send_ack(int sock)
+{
+    char tag = 'A';
+    return ::send(sock, &tag, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int handoff_wait_ack(int sock, double timeout)
+{
+    if (!wait_readable(sock, timeout)) {
+        return -1;
+    }
+    char tag = 0;
+    ssize_t n;
+    do {
+        n = ::recv(sock, &tag, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    return (n == 1 && tag == 'A') ? 0 : -1;
+}
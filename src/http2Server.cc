@@ -0,0 +1,370 @@
+#include "http2Server.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/base/Logging.h>
+#include <muduo/net/SocketsOps.h>
+
+#include "handoff.h"
+#include "loop_handler.h"
+#include "uringTransport.h"
+
+namespace
+{
+
+// How long the old process waits for the new one to start accepting
+const double kHandoffAckTimeout = 10.0;
+
+} // namespace
+
+http2Server::http2Server(muduo::net::EventLoop* loop,
+    const muduo::net::InetAddress& listenAddr,
+    const std::string& nameArg)
+    : _loop(loop),
+      _listenAddr(listenAddr),
+      _name(nameArg),
+      _threadPool(new muduo::net::EventLoopThreadPool(loop, nameArg)),
+      _listenTcp(true),
+      _nextConnId(1),
+      _started(false),
+      _drainTimeout(0),
+      _handoffFd(-1),
+      _takeoverFd(-1),
+      _draining(false),
+      _useIoUring(false),
+      _uringConnections(0)
+{
+}
+
+http2Server::~http2Server()
+{
+    _loop->assertInLoopThread();
+    for (auto& item : _connections) {
+        muduo::net::TcpConnectionPtr conn(item.second);
+        item.second.reset();
+        conn->getLoop()->runInLoop(std::bind(&muduo::net::TcpConnection::connectDestroyed, conn));
+    }
+#ifdef MUDUOHTTP_HAVE_IO_URING
+    if (!_transports.empty()) {
+        // Transports close their sockets in their own loops; wait so none outlives the server
+        std::vector<muduo::net::EventLoop*> loops = _threadPool->getAllLoops();
+        muduo::CountDownLatch latch((int)loops.size());
+        for (size_t i = 0; i < loops.size(); ++i) {
+            loops[i]->runInLoop([this, i, &latch]() {
+                delete _transports[i];
+                _transports[i] = NULL;
+                latch.countDown();
+            });
+        }
+        latch.wait();
+    }
+#endif
+    if (_handoffChannel) {
+        _handoffChannel->disableAll();
+        _handoffChannel->remove();
+        ::close(_handoffFd);
+        ::unlink(_handoffPath.c_str());
+    }
+    if (_takeoverFd >= 0) {
+        ::close(_takeoverFd);
+    }
+}
+
+void http2Server::enableHandoff(const std::string& path, double drainTimeout)
+{
+    _handoffPath = path;
+    _drainTimeout = drainTimeout;
+}
+
+bool http2Server::takeOver(const std::string& path)
+{
+    int sock = handoff_connect(path);
+    if (sock < 0) {
+        return false;
+    }
+    std::vector<int> fds;
+    if (handoff_recv_fds(sock, &fds, &_inheritedFds, kHandoffAckTimeout) < 0) {
+        ::close(sock);
+        return false;
+    }
+    for (int fd : fds) {
+        _listeners.emplace_back(new Listener(_loop, fd));
+    }
+    _takeoverFd = sock;
+    LOG_INFO << _name << " took over " << fds.size() << " listening socket(s) from " << path;
+    return true;
+}
+
+void http2Server::listenUnix(const std::string& path, mode_t mode)
+{
+    _unixPaths.emplace_back(path, mode);
+}
+
+bool http2Server::enableIoUring()
+{
+#ifdef MUDUOHTTP_HAVE_IO_URING
+    if (Uring::supported()) {
+        _useIoUring = true;
+        return true;
+    }
+    LOG_WARN << _name << ": io_uring with multishot accept/recv unavailable, using epoll";
+#else
+    LOG_WARN << _name << ": built without io_uring, using epoll";
+#endif
+    return false;
+}
+
+void http2Server::start()
+{
+    if (_started) {
+        return;
+    }
+    _started = true;
+    // Per-loop handlers are built after the user's callback, so a pinned thread allocates them
+    // on its own NUMA node
+    muduo::net::EventLoopThreadPool::ThreadInitCallback init = _threadInitCallback;
+    _threadPool->start([init](muduo::net::EventLoop* loop) {
+        if (init) {
+            init(loop);
+        }
+        loop_handlers_init(loop);
+    });
+
+    if (_listeners.empty()) {
+        if (_listenTcp) {
+            _listeners.emplace_back(new Listener(_loop, Listener::bindTcp(_listenAddr, false)));
+        }
+        for (const auto& unixPath : _unixPaths) {
+            _listeners.emplace_back(new Listener(_loop, Listener::bindUnix(unixPath.first, unixPath.second)));
+            LOG_INFO << _name << " listening on unix:" << unixPath.first;
+        }
+    }
+    for (auto& listener : _listeners) {
+        listener->setNewConnectionCallback(std::bind(&http2Server::newConnection, this,
+                                                     std::placeholders::_1, std::placeholders::_2));
+        _loop->runInLoop(std::bind(&Listener::listen, listener.get(), !_useIoUring));
+    }
+    if (_useIoUring) {
+        std::vector<int> fds;
+        for (auto& listener : _listeners) {
+            fds.push_back(listener->fd());
+        }
+        std::vector<muduo::net::EventLoop*> loops = _threadPool->getAllLoops();
+        _transports.assign(loops.size(), NULL);
+        // Queued behind listen() so no accept is armed on a socket that is not listening yet
+        _loop->runInLoop([this, loops, fds]() {
+            for (size_t i = 0; i < loops.size(); ++i) {
+                loops[i]->runInLoop(std::bind(&http2Server::startTransport, this, i, fds));
+            }
+        });
+    }
+
+    if (_takeoverFd >= 0) {
+        // We accept on the shared sockets now; the old process may stop and drain
+        _loop->runInLoop([this]() {
+            handoff_send_ack(_takeoverFd);
+            ::close(_takeoverFd);
+            _takeoverFd = -1;
+        });
+    }
+    if (!_handoffPath.empty()) {
+        _loop->runInLoop(std::bind(&http2Server::openHandoff, this));
+    }
+}
+
+void http2Server::newConnection(int sockfd, const muduo::net::InetAddress& peerAddr)
+{
+    _loop->assertInLoopThread();
+    muduo::net::EventLoop* ioLoop = _threadPool->getNextLoop();
+    char buf[64];
+    snprintf(buf, sizeof buf, "-%s#%d", _listenAddr.toIpPort().c_str(), _nextConnId);
+    ++_nextConnId;
+    std::string connName = _name + buf;
+
+    muduo::net::InetAddress localAddr(muduo::net::sockets::getLocalAddr(sockfd));
+    muduo::net::TcpConnectionPtr conn(new muduo::net::TcpConnection(ioLoop, connName, sockfd, localAddr, peerAddr));
+    _connections[connName] = conn;
+    conn->setConnectionCallback(std::bind(&http2Server::ConnectionCallback, this, std::placeholders::_1));
+    conn->setMessageCallback(std::bind(&http2Server::MessageCallback, this,
+                                       std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    conn->setCloseCallback(std::bind(&http2Server::removeConnection, this, std::placeholders::_1));
+    ioLoop->runInLoop(std::bind(&muduo::net::TcpConnection::connectEstablished, conn));
+}
+
+void http2Server::startTransport(size_t index, const std::vector<int>& listenFds)
+{
+#ifdef MUDUOHTTP_HAVE_IO_URING
+    muduo::net::EventLoop* ioLoop = _threadPool->getAllLoops()[index];
+    UringTransport* transport = new UringTransport(ioLoop);
+    if (!transport->ok()) {
+        LOG_ERROR << _name << ": no io_uring for IO thread " << index << ", it serves no connections";
+        delete transport;
+        return;
+    }
+    transport->setOpenCallback([this]() { ++_uringConnections; });
+    transport->setCloseCallback([this]() {
+        if (--_uringConnections == 0 && _draining) {
+            _loop->runInLoop(std::bind(&http2Server::quitIfDrained, this));
+        }
+    });
+    for (int fd : listenFds) {
+        transport->accept(fd);
+    }
+    _transports[index] = transport;
+#endif
+}
+
+void http2Server::removeConnection(const muduo::net::TcpConnectionPtr& conn)
+{
+    _loop->runInLoop(std::bind(&http2Server::removeConnectionInLoop, this, conn));
+}
+
+void http2Server::removeConnectionInLoop(const muduo::net::TcpConnectionPtr& conn)
+{
+    _loop->assertInLoopThread();
+    _connections.erase(conn->name());
+    conn->getLoop()->queueInLoop(std::bind(&muduo::net::TcpConnection::connectDestroyed, conn));
+    if (_draining) {
+        quitIfDrained();
+    }
+}
+
+void http2Server::quitIfDrained()
+{
+    if (_connections.empty() && _uringConnections == 0) {
+        LOG_INFO << _name << " drained, exiting";
+        _loop->quit();
+    }
+}
+
+void http2Server::openHandoff()
+{
+    _handoffFd = handoff_listen(_handoffPath);
+    if (_handoffFd < 0) {
+        return;
+    }
+    _handoffChannel.reset(new muduo::net::Channel(_loop, _handoffFd));
+    _handoffChannel->setReadCallback(std::bind(&http2Server::handleHandoff, this));
+    _handoffChannel->enableReading();
+}
+
+void http2Server::handleHandoff()
+{
+    int sock = ::accept4(_handoffFd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        return;
+    }
+    // Release the path first so the new process can bind it for the next upgrade
+    _handoffChannel->disableAll();
+    _handoffChannel->remove();
+    _handoffChannel.reset();
+    ::close(_handoffFd);
+    _handoffFd = -1;
+    ::unlink(_handoffPath.c_str());
+
+    std::vector<int> fds;
+    for (auto& listener : _listeners) {
+        fds.push_back(listener->fd());
+    }
+    bool ok = handoff_send_fds(sock, fds, _handoffExtraFds) == 0 && handoff_wait_ack(sock, kHandoffAckTimeout) == 0;
+    ::close(sock);
+    if (!ok) {
+        LOG_ERROR << _name << " handoff failed, still serving";
+        openHandoff();
+        return;
+    }
+    LOG_INFO << _name << " handed listening sockets over, draining " << _connections.size() << " connection(s)";
+    drain(_drainTimeout);
+}
+
+void http2Server::drain(double drainTimeout)
+{
+    _loop->assertInLoopThread();
+    if (_draining.exchange(true)) {
+        return;
+    }
+    for (auto& listener : _listeners) {
+        listener->stop();
+    }
+    if (_drainCallback) {
+        _drainCallback();
+    }
+#ifdef MUDUOHTTP_HAVE_IO_URING
+    std::vector<muduo::net::EventLoop*> loops = _threadPool->getAllLoops();
+    for (size_t i = 0; i < _transports.size(); ++i) {
+        loops[i]->runInLoop([this, i]() {
+            if (_transports[i]) {
+                _transports[i]->stopAccepting();
+                _transports[i]->goawayAll();
+            }
+        });
+    }
+#endif
+    if (_connections.empty() && _uringConnections == 0) {
+        _loop->quit();
+        return;
+    }
+    for (auto& item : _connections) {
+        muduo::net::TcpConnectionPtr conn = item.second;
+        conn->getLoop()->runInLoop(std::bind(&http2Server::goawayInLoop, this, conn));
+    }
+    _loop->runAfter(drainTimeout, [this]() {
+        LOG_WARN << _name << " drain deadline expired, closing "
+                 << _connections.size() + _uringConnections << " connection(s)";
+        for (auto& item : _connections) {
+            item.second->forceClose();
+        }
+        _loop->quit();
+    });
+}
+
+void http2Server::goawayInLoop(const muduo::net::TcpConnectionPtr& conn)
+{
+    all_data *data = http2_session_of(conn);
+    if (!data) {
+        return;
+    }
+    http2_session_goaway(data);
+    if (http2_session_finished(data)) {
+        conn->shutdown();
+    }
+}
+
+void http2Server::ConnectionCallback(const muduo::net::TcpConnectionPtr& conn)
+{
+    if(!conn->connected())
+    {
+        all_data *data = http2_session_of(conn);
+        if (data)
+        {
+            http2_session_destroy(data);
+            conn->setContext(boost::any());
+        }
+        conn->shutdown();
+    }
+    else
+    {
+        all_data *data = http2_session_create(conn, NULL);
+        conn->setContext(data);
+        if (_draining) {
+            // Accepted just before the listeners stopped
+            goawayInLoop(conn);
+        }
+    }
+}
+
+void http2Server::MessageCallback(const muduo::net::TcpConnectionPtr& conn,muduo::net::Buffer*buffer,muduo::Timestamp time)
+{
+    all_data *data = http2_session_of(conn);
+    int rv = http2_session_on_input(data, buffer);
+    if (rv < 0) {
+        std::cerr << "Error processing HTTP/2 data: " << nghttp2_strerror(rv) << std::endl;
+        http2_session_fail(data);
+        conn->shutdown();
+        return;
+    }
+    if (http2_session_finished(data)) {
+        // GOAWAY sent (draining, or the peer broke its budget) and the last in-flight stream is done
+        conn->shutdown();
+    }
+}
@@ -0,0 +1,177 @@
+#include "http2Session.h"
+#include <muduo/net/EventLoop.h>
+
+#include "abuse.h"
+#include "cancel.h"
+#include "capture.h"
+#include "membudget.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+namespace
+{
+
+all_data *session_new(connection_data *conn_data)
+{
+    nghttp2_session_callbacks *callbacks; 
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, send_callback);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_callback);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_callback);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_callback);
+    nghttp2_session_callbacks_set_on_begin_frame_callback(callbacks, on_begin_frame_callback);
+    nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, on_frame_send_callback);
+
+    conn_data->default_handler = &default_handler_impl; // Set default handler
+    if (conn_data->loop) {
+        conn_data->peer_key = rate_limit_peer_key(conn_data->peer);
+    }
+
+    // Window updates follow what handlers consume, so streamed bodies are flow controlled end to end
+    nghttp2_option *option;
+    nghttp2_option_new(&option);
+    nghttp2_option_set_no_auto_window_update(option, 1);
+    // nghttp2's allocations are charged to the connection's memory budget
+    memory_budget_attach(conn_data);
+    nghttp2_mem mem = memory_budget_allocator(conn_data);
+    nghttp2_session *session;
+    nghttp2_session_server_new3(&session, callbacks, conn_data, option, &mem);
+    nghttp2_option_del(option);
+    conn_data->session = session;
+
+    // Extended CONNECT (RFC 8441) lets clients open WebSockets as streams of this connection
+    nghttp2_settings_entry iv[] = {
+        {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100},
+        {NGHTTP2_SETTINGS_ENABLE_CONNECT_PROTOCOL, 1},
+    };
+    nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, iv, 2);
+
+    metrics_add(METRIC_CONNECTIONS);
+    capture_connection_open(conn_data);
+    all_data *data = new all_data;
+    data->callbacks = callbacks;
+    data->conn_data = conn_data;
+    data->session = session;
+    return data;
+}
+
+} // namespace
+
+all_data *http2_session_create(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *output)
+{
+    // connection_data holds a shared_ptr, so it has to be constructed rather than malloc'd
+    connection_data *conn_data = new connection_data();
+    conn_data->client_fd = conn;
+    conn_data->output = output;
+    if (conn) {
+        conn_data->loop = conn->getLoop();
+        conn_data->peer = conn->peerAddress();
+        muduo::net::EventLoop *loop = conn->getLoop();
+        std::weak_ptr<muduo::net::TcpConnection> weak(conn);
+        conn_data->send_soon = [loop, weak]() {
+            loop->queueInLoop([weak]() {
+                muduo::net::TcpConnectionPtr conn = weak.lock();
+                all_data *data = conn ? http2_session_of(conn) : NULL;
+                if (!data) {
+                    return;
+                }
+                data->conn_data->send_scheduled = false;
+                nghttp2_session_send(data->session);
+                if (http2_session_finished(data)) {
+                    conn->shutdown();
+                }
+            });
+        };
+    }
+    return session_new(conn_data);
+}
+
+all_data *http2_session_create_on(muduo::net::EventLoop *loop, const muduo::net::InetAddress &peer,
+                                  muduo::net::Buffer *output, const std::function<void()> &send_soon)
+{
+    connection_data *conn_data = new connection_data();
+    conn_data->output = output;
+    conn_data->loop = loop;
+    conn_data->peer = peer;
+    conn_data->send_soon = send_soon;
+    return session_new(conn_data);
+}
+
+void http2_session_destroy(all_data *data)
+{
+    // Streams still open when the connection goes away get no close callback from nghttp2
+    while (data->conn_data->streams) {
+        stream_cancel(data->conn_data->streams, CANCEL_DISCONNECT);
+        stream_data_close(data->session, data->conn_data->streams, NGHTTP2_CANCEL);
+    }
+    nghttp2_session_del(data->session);
+    nghttp2_session_callbacks_del(data->callbacks);
+    memory_budget_detach(data->conn_data);
+    capture_connection_close(data->conn_data);
+    delete data->conn_data;
+    delete data;
+}
+
+int http2_session_on_input(all_data *data, muduo::net::Buffer *buffer)
+{
+    data->conn_data->input_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+    capture_input(data->conn_data, buffer->peek(), buffer->readableBytes());
+    uint8_t* begin = (uint8_t *)buffer->peek();
+    ssize_t processed_len = nghttp2_session_mem_recv(data->session, begin, buffer->readableBytes());
+    if (processed_len < 0) {
+        return (int)processed_len;
+    }
+    buffer->retrieve(processed_len);
+    memory_budget_check(data->conn_data, buffer->internalCapacity());
+    return nghttp2_session_send(data->session);
+}
+
+int http2_session_on_bytes(all_data *data, const uint8_t *in, size_t len, size_t held)
+{
+    data->conn_data->input_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+    capture_input(data->conn_data, in, len);
+    ssize_t processed_len = nghttp2_session_mem_recv(data->session, in, len);
+    if (processed_len < 0) {
+        return (int)processed_len;
+    }
+    memory_budget_check(data->conn_data, held);
+    return nghttp2_session_send(data->session);
+}
+
+void http2_session_goaway(all_data *data)
+{
+    nghttp2_submit_goaway(data->session, NGHTTP2_FLAG_NONE,
+                          nghttp2_session_get_last_proc_stream_id(data->session),
+                          NGHTTP2_NO_ERROR, NULL, 0);
+    nghttp2_session_send(data->session);
+}
+
+void http2_session_fail(all_data *data)
+{
+    nghttp2_session_terminate_session(data->session, NGHTTP2_PROTOCOL_ERROR);
+    nghttp2_session_send(data->session);
+}
+
+bool http2_session_finished(all_data *data)
+{
+    return !nghttp2_session_want_read(data->session) && !nghttp2_session_want_write(data->session);
+}
+
+all_data *http2_session_of(const muduo::net::TcpConnectionPtr &conn)
+{
+    if (conn->getContext().empty()) {
+        return NULL;
+    }
+    return boost::any_cast<all_data *>(conn->getContext());
+}
+
+void http2_session_schedule_send(connection_data *conn_data)
+{
+    // In-process sessions are flushed by whoever feeds them input
+    if (conn_data->send_scheduled || !conn_data->send_soon) {
+        return;
+    }
+    conn_data->send_scheduled = true;
+    conn_data->send_soon();
+}
@@ -0,0 +1,1961 @@
+#include "http3Server.hpp"
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <muduo/base/Logging.h>
+
+#ifdef MUDUOHTTP_HAVE_HTTP3
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <ngtcp2/ngtcp2.h>
+#include <ngtcp2/ngtcp2_crypto.h>
+#include <ngtcp2/ngtcp2_crypto_quictls.h>
+#include <nghttp3/nghttp3.h>
+#include <deque>
+#include <unordered_map>
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/TimerId.h>
+
+#include "cancel.h"
+#include "ratelimit.h"
+#include "udpSocket.h"
+#endif
+
+http3_policy g_http3_policy = {
+    .alt_svc_port = 0,
+    .max_streams = 100,
+    .stream_window = 256 * 1024,
+    .connection_window = 4 * 1024 * 1024,
+    .idle_timeout = 30.0,
+    .drain_grace = 2.0,
+    .validate_address = true,
+};
+
+size_t quic_packet_owner(const uint8_t *data, size_t len, size_t nloops)
+{
+    if (len < 2 || nloops == 0) {
+        return nloops;
+    }
+    if (data[0] & 0x80) {
+        // Long header: flags, version(4), DCID length, DCID
+        if (len < 7 || data[5] == 0) {
+            return nloops;
+        }
+        return (data[6] & 0x7f) % nloops;
+    }
+    // Short header: flags, then our DCID
+    return (data[1] & 0x7f) % nloops;
+}
+
+namespace
+{
+
+const uint32_t kSteeringSlots = 2 * kQuicMaxLoops;
+
+long bpf(int cmd, union bpf_attr *attr)
+{
+    return ::syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+struct bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn i;
+    memset(&i, 0, sizeof i);
+    i.code = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off = off;
+    i.imm = imm;
+    return i;
+}
+
+bool is_steering_map(int fd)
+{
+    struct bpf_map_info info;
+    memset(&info, 0, sizeof info);
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = sizeof info;
+    attr.info.info = (uint64_t)(uintptr_t)&info;
+    return bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) == 0 && info.type == BPF_MAP_TYPE_REUSEPORT_SOCKARRAY &&
+           info.key_size == 4 && info.value_size == 8 && info.max_entries == kSteeringSlots;
+}
+
+// Socket cookie registered under key, 0 for an empty slot. Cookies grow with each socket
+// created, so the larger one belongs to the younger process.
+uint64_t steering_cookie(int map, uint32_t key)
+{
+    uint64_t cookie = 0;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&cookie;
+    return bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0 ? cookie : 0;
+}
+
+// SK_REUSEPORT program: long-header packets start connections and go to our socket for the low
+// seven bits of their DCID's first byte; short-header ones go to the socket registered for that
+// byte when it names the other generation and it is still open, otherwise to ours like the rest.
+bool attach_steering_program(const quic_steering *steering, int fd, size_t nloops)
+{
+    const int32_t ours = (int32_t)(steering->generation << 7);
+    const struct bpf_insn code[] = {
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),           // r6 = ctx
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, 8),           // Skip the UDP header
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0),
+        insn(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -8),
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 7),
+        insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes),
+        insn(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 30, 0),           // Too short: kernel's hash
+        insn(BPF_LDX | BPF_MEM | BPF_B, 2, 10, -8, 0),
+        insn(BPF_JMP | BPF_JSET | BPF_K, 2, 0, 14, 0x80),       // Long header
+        insn(BPF_LDX | BPF_MEM | BPF_B, 7, 10, -7, 0),          // r7 = short header DCID byte
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 7, 0, 0),
+        insn(BPF_ALU64 | BPF_RSH | BPF_K, 3, 0, 0, 7),
+        insn(BPF_JMP | BPF_JEQ | BPF_K, 3, 0, 13, ours >> 7),   // Our generation
+        insn(BPF_STX | BPF_MEM | BPF_W, 10, 7, -12, 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0),
+        insn(BPF_LD | BPF_DW | BPF_IMM, 2, BPF_PSEUDO_MAP_FD, 0, steering->map),
+        insn(0, 0, 0, 0, 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0),
+        insn(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -12),
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 0),
+        insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+        insn(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 15, 0),           // The other process has it
+        insn(BPF_JMP | BPF_JA, 0, 0, 3, 0),                     // Gone: treat it as ours
+        insn(BPF_LDX | BPF_MEM | BPF_B, 3, 10, -3, 0),          // Long header: DCID length
+        insn(BPF_JMP | BPF_JEQ | BPF_K, 3, 0, 12, 0),
+        insn(BPF_LDX | BPF_MEM | BPF_B, 7, 10, -2, 0),          // r7 = DCID byte
+        insn(BPF_ALU64 | BPF_AND | BPF_K, 7, 0, 0, 0x7f),
+        insn(BPF_ALU64 | BPF_MOD | BPF_K, 7, 0, 0, (int32_t)nloops),
+        insn(BPF_ALU64 | BPF_OR | BPF_K, 7, 0, 0, ours),
+        insn(BPF_STX | BPF_MEM | BPF_W, 10, 7, -12, 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0),
+        insn(BPF_LD | BPF_DW | BPF_IMM, 2, BPF_PSEUDO_MAP_FD, 0, steering->map),
+        insn(0, 0, 0, 0, 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0),
+        insn(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -12),
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 0),
+        insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, SK_PASS),
+        insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    static const char license[] = "Dual MIT/GPL";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+    attr.insns = (uint64_t)(uintptr_t)code;
+    attr.insn_cnt = sizeof code / sizeof code[0];
+    attr.license = (uint64_t)(uintptr_t)license;
+    int prog = (int)bpf(BPF_PROG_LOAD, &attr);
+    if (prog < 0) {
+        return false;
+    }
+    // The group holds on to the program; our descriptor is not needed after this
+    bool ok = ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog, sizeof prog) == 0;
+    ::close(prog);
+    return ok;
+}
+
+} // namespace
+
+void quic_steering_init(quic_steering *steering, const std::vector<int>& inherited)
+{
+    steering->map = -1;
+    steering->generation = 0;
+    for (int fd : inherited) {
+        if (is_steering_map(fd)) {
+            steering->map = fd;
+            break;
+        }
+    }
+    if (steering->map < 0) {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+        attr.key_size = 4;
+        attr.value_size = 8;            // Lookups then return socket cookies
+        attr.max_entries = kSteeringSlots;
+        steering->map = (int)bpf(BPF_MAP_CREATE, &attr);
+        return;
+    }
+    // Take the generation the previous process does not use; closed sockets leave the map on
+    // their own. Should both still be taken, replace the older one.
+    uint64_t newest[2] = {0, 0};
+    for (uint32_t key = 0; key < kSteeringSlots; ++key) {
+        newest[key >> 7] = std::max(newest[key >> 7], steering_cookie(steering->map, key));
+    }
+    steering->generation = newest[0] <= newest[1] ? 0 : 1;
+    if (newest[0] && newest[1]) {
+        LOG_WARN << "http3: two processes still serve the port, taking over the connections of the older one";
+    }
+}
+
+bool quic_steering_add(const quic_steering *steering, size_t index, int fd)
+{
+    if (steering->map < 0) {
+        return false;
+    }
+    uint32_t key = (uint32_t)((steering->generation << 7) | index);
+    uint64_t value = (uint64_t)fd;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = steering->map;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+bool quic_steer_by_cid(const quic_steering *steering, int fd, size_t nloops)
+{
+    if (steering->map >= 0 && attach_steering_program(steering, fd, nloops)) {
+        return true;
+    }
+    // Same choice as quic_packet_owner(), made by the kernel on the UDP payload. Sockets of a
+    // SO_REUSEPORT group are numbered in the order they were bound.
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 0, 2),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+        BPF_STMT(BPF_JMP | BPF_JA, 1),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x7f),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)nloops),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {(unsigned short)(sizeof code / sizeof code[0]), code};
+    return ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0;
+}
+
+void http3_advertise(nghttp2_session *session, int32_t stream_id, connection_data *conn_data)
+{
+    uint16_t port = g_http3_policy.alt_svc_port.load(std::memory_order_relaxed);
+    if (!port || conn_data->alt_svc_done) {
+        return;
+    }
+    conn_data->alt_svc_done = true;
+    char field[32];
+    int n = snprintf(field, sizeof field, "h3=\":%u\"; ma=86400", (unsigned)port);
+    // On a request stream the origin field stays empty: it is the stream's own
+    nghttp2_submit_altsvc(session, NGHTTP2_FLAG_NONE, stream_id, NULL, 0, (const uint8_t *)field, n);
+}
+
+#ifdef MUDUOHTTP_HAVE_HTTP3
+
+namespace
+{
+
+// Length of the connection IDs we issue; the first byte is generation and loop index
+const size_t kCidLength = NGTCP2_SV_SCIDLEN;
+const size_t kSendBufferSize = 64 * 1024;
+const size_t kMaxStreamVecs = 16;
+// Response bytes asked of a data provider at a time, the most nghttp2 would ask for one DATA frame
+const size_t kReadChunk = 16 * 1024;
+
+// How long the token of a Retry, and one sent in NEW_TOKEN, stays good
+const ngtcp2_duration kRetryTokenTimeout = 10 * NGTCP2_SECONDS;
+const ngtcp2_duration kRegularTokenTimeout = 3600 * NGTCP2_SECONDS;
+
+uint8_t g_reset_secret[32];
+uint8_t g_token_secret[32];             // Address validation tokens; shared by the loops
+
+ngtcp2_tstamp quic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ngtcp2_tstamp)ts.tv_sec * NGTCP2_SECONDS + (ngtcp2_tstamp)ts.tv_nsec;
+}
+
+socklen_t address_len(const muduo::net::InetAddress& addr)
+{
+    return addr.family() == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+muduo::net::InetAddress to_inet(const ngtcp2_addr& addr)
+{
+    struct sockaddr_in6 storage;
+    memset(&storage, 0, sizeof storage);
+    memcpy(&storage, addr.addr, std::min((size_t)addr.addrlen, sizeof storage));
+    return muduo::net::InetAddress(storage);
+}
+
+bool same_address(const muduo::net::InetAddress& a, const muduo::net::InetAddress& b)
+{
+    return a.family() == b.family() && memcmp(a.getSockAddr(), b.getSockAddr(), address_len(a)) == 0;
+}
+
+// ngtcp2 wants writable sockaddrs that outlive the call
+struct path_storage {
+    struct sockaddr_in6 local;
+    struct sockaddr_in6 remote;
+    ngtcp2_path path;
+
+    path_storage(const muduo::net::InetAddress& localAddr, const muduo::net::InetAddress& peer)
+    {
+        memcpy(&local, localAddr.getSockAddr(), sizeof local);
+        memcpy(&remote, peer.getSockAddr(), sizeof remote);
+        path.local.addr = (ngtcp2_sockaddr *)&local;
+        path.local.addrlen = address_len(localAddr);
+        path.remote.addr = (ngtcp2_sockaddr *)&remote;
+        path.remote.addrlen = address_len(peer);
+        path.user_data = NULL;
+    }
+};
+
+int select_h3(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+              unsigned int inlen, void *arg)
+{
+    for (const unsigned char *p = in; p < in + inlen && p + 1 + *p <= in + inlen; p += 1 + *p) {
+        if (*p == 2 && memcmp(p + 1, "h3", 2) == 0) {
+            *out = p + 1;
+            *outlen = 2;
+            return SSL_TLSEXT_ERR_OK;
+        }
+    }
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+// Handlers and the request steps speak HTTP/2 error codes
+uint64_t h3_error_of(uint32_t h2_error)
+{
+    switch (h2_error) {
+    case NGHTTP2_REFUSED_STREAM: return NGHTTP3_H3_REQUEST_REJECTED;
+    case NGHTTP2_CANCEL: return NGHTTP3_H3_REQUEST_CANCELLED;
+    case NGHTTP2_ENHANCE_YOUR_CALM: return NGHTTP3_H3_EXCESSIVE_LOAD;
+    case NGHTTP2_PROTOCOL_ERROR: return NGHTTP3_H3_MESSAGE_ERROR;
+    default: return NGHTTP3_H3_INTERNAL_ERROR;
+    }
+}
+
+uint32_t h2_error_of(uint64_t h3_error)
+{
+    switch (h3_error) {
+    case NGHTTP3_H3_NO_ERROR: return NGHTTP2_NO_ERROR;
+    case NGHTTP3_H3_REQUEST_REJECTED: return NGHTTP2_REFUSED_STREAM;
+    case NGHTTP3_H3_REQUEST_CANCELLED: return NGHTTP2_CANCEL;
+    case NGHTTP3_H3_EXCESSIVE_LOAD: return NGHTTP2_ENHANCE_YOUR_CALM;
+    case NGHTTP3_H3_GENERAL_PROTOCOL_ERROR:
+    case NGHTTP3_H3_MESSAGE_ERROR: return NGHTTP2_PROTOCOL_ERROR;
+    default: return NGHTTP2_INTERNAL_ERROR;
+    }
+}
+
+// nghttp3 copies names and values either way; only the QPACK never-index hint carries over
+std::vector<nghttp3_nv> to_nv(const nghttp2_nv* nva, size_t nvlen)
+{
+    std::vector<nghttp3_nv> out;
+    out.reserve(nvlen);
+    for (size_t i = 0; i < nvlen; ++i) {
+        uint8_t flags = (nva[i].flags & NGHTTP2_NV_FLAG_NO_INDEX) ? NGHTTP3_NV_FLAG_NEVER_INDEX : NGHTTP3_NV_FLAG_NONE;
+        out.push_back({nva[i].name, nva[i].value, nva[i].namelen, nva[i].valuelen, flags});
+    }
+    return out;
+}
+
+} // namespace
+
+class QuicConnection;
+typedef std::shared_ptr<QuicConnection> QuicConnectionPtr;
+
+// UDP socket and connections of one IO loop
+class QuicEndpoint : muduo::noncopyable
+{
+public:
+    QuicEndpoint(muduo::net::EventLoop* loop, size_t index, uint8_t cidTag,
+                 const std::vector<QuicEndpoint*>* endpoints, SSL_CTX* sslCtx, int fd);
+    ~QuicEndpoint();
+
+    void start();
+    void goaway();
+    // Close every connection with H3_NO_ERROR and the UDP socket
+    void close();
+
+    muduo::net::EventLoop* loop() const { return _loop; }
+    size_t index() const { return _index; }
+    int fd() const { return _socket.fd(); }
+    SSL_CTX* sslCtx() const { return _sslCtx; }
+    bool gso() const { return _socket.gso(); }
+    uint8_t* sendBuffer() { return _sendBuffer; }
+
+    void onPacket(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                  const muduo::net::InetAddress& local);
+    void send(const muduo::net::InetAddress& peer, const muduo::net::InetAddress& local,
+              const uint8_t* data, size_t len, size_t segmentSize);
+    void scheduleWrite(const QuicConnectionPtr& conn);
+
+    // A fresh connection ID owned by this loop, registered for conn
+    void newCid(ngtcp2_cid* cid, size_t len, const QuicConnectionPtr& conn);
+    void addCid(const ngtcp2_cid& cid, const QuicConnectionPtr& conn);
+    void removeCid(const ngtcp2_cid& cid);
+    // Forget conn; it is freed once the current callbacks returned
+    void remove(const QuicConnectionPtr& conn);
+
+private:
+    void handleRead();
+    void handleWrite();
+    void flush();
+    void dispatch(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                  const muduo::net::InetAddress& local);
+    void sendVersionNegotiation(const ngtcp2_version_cid& vc, const muduo::net::InetAddress& peer,
+                                const muduo::net::InetAddress& local);
+    bool validateAddress(const ngtcp2_pkt_hd& hd, const muduo::net::InetAddress& peer,
+                         const muduo::net::InetAddress& local, ngtcp2_cid* odcid, ngtcp2_token_type* tokenType);
+    void sendRetry(const ngtcp2_pkt_hd& hd, const muduo::net::InetAddress& peer,
+                   const muduo::net::InetAddress& local);
+
+    muduo::net::EventLoop* _loop;
+    size_t _index;
+    uint8_t _cidTag;                                               // First byte of our connection IDs
+    const std::vector<QuicEndpoint*>* _endpoints;
+    SSL_CTX* _sslCtx;
+    UdpSocket _socket;
+    muduo::net::Channel _channel;
+    std::unordered_map<std::string, QuicConnectionPtr> _conns;     // By every live connection ID
+    std::vector<QuicConnectionPtr> _dirty;                         // Have packets to write
+    bool _flushQueued;
+    bool _draining;                                                // goaway() ran; no new connections
+    bool _closed;                                                  // close() ran; the socket goes at its end
+    muduo::net::TimerId _graceTimer;                               // Valid while _graceArmed
+    bool _graceArmed;
+    uint8_t _sendBuffer[kSendBufferSize];
+};
+
+// One QUIC connection: ngtcp2 for the transport, nghttp3 for HTTP/3 framing and QPACK. Request
+// streams get a stream_data of their own and go through the same request steps and handlers as
+// HTTP/2 ones; what the handlers do to a stream comes back through kH3Transport.
+class QuicConnection : public std::enable_shared_from_this<QuicConnection>, muduo::noncopyable
+{
+public:
+    QuicConnection(QuicEndpoint* endpoint, const muduo::net::InetAddress& peer,
+                   const muduo::net::InetAddress& local);
+    ~QuicConnection();
+
+    // odcid is the client's original destination ID when it came back from our Retry
+    bool init(const ngtcp2_pkt_hd& hd, const ngtcp2_cid* odcid, ngtcp2_token_type tokenType);
+    void onPacket(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                  const muduo::net::InetAddress& local);
+    void write();
+    void goaway();
+    void close();
+    void cancelTimer();
+
+    // stream_transport of the connection's streams
+    int submitResponse(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen, const nghttp2_data_provider* prd);
+    int submitInfo(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen);
+    int submitTrailer(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen);
+    void resumeStream(stream_data* sdata);
+    void consume(stream_data* sdata, size_t n, bool connectionOnly);
+    void resetStream(stream_data* sdata, uint32_t errorCode);
+
+    bool writeQueued;
+    std::vector<std::string> cids;      // Registered with the endpoint
+
+private:
+    enum State { kActive, kClosing, kDraining, kGone };
+
+    // A request stream. nghttp3 holds it as the stream's user data; the response body handed to
+    // nghttp3 stays here until the peer acknowledges it.
+    struct Stream {
+        int64_t id;
+        stream_data* sdata;
+        nghttp2_data_provider provider;     // Response body, read_callback NULL for none
+        bool requestEnded;                  // stream_on_request_end ran
+        bool blocked;                       // Held back by the unacknowledged limit
+        std::deque<std::string> chunks;     // Handed to nghttp3, not yet acknowledged
+        size_t ackedInFront;                // Acknowledged bytes of chunks.front()
+        size_t unacked;
+    };
+
+    Stream* findStream(const stream_data* sdata);
+    void closeStream(int64_t streamId, uint32_t errorCode);
+    void rejectStream(int64_t streamId);
+
+    int setupHttp3();
+    void closeWithError();
+    void startDraining();
+    void armTimer();
+    void onTimer();
+    void removeAfterPto();
+
+    // ngtcp2 callbacks
+    static ngtcp2_conn* getConn(ngtcp2_crypto_conn_ref* ref);
+    static int onHandshakeCompleted(ngtcp2_conn* conn, void* userData);
+    static int onRecvStreamData(ngtcp2_conn* conn, uint32_t flags, int64_t streamId, uint64_t offset,
+                                const uint8_t* data, size_t datalen, void* userData, void* streamUserData);
+    static int onAckedStreamDataOffset(ngtcp2_conn* conn, int64_t streamId, uint64_t offset, uint64_t datalen,
+                                       void* userData, void* streamUserData);
+    static int onStreamClose(ngtcp2_conn* conn, uint32_t flags, int64_t streamId, uint64_t appErrorCode,
+                             void* userData, void* streamUserData);
+    static int onStreamReset(ngtcp2_conn* conn, int64_t streamId, uint64_t finalSize, uint64_t appErrorCode,
+                             void* userData, void* streamUserData);
+    static int onStreamStopSending(ngtcp2_conn* conn, int64_t streamId, uint64_t appErrorCode,
+                                   void* userData, void* streamUserData);
+    static int onExtendMaxRemoteStreamsBidi(ngtcp2_conn* conn, uint64_t maxStreams, void* userData);
+    static int onExtendMaxStreamData(ngtcp2_conn* conn, int64_t streamId, uint64_t maxData, void* userData,
+                                     void* streamUserData);
+    static void onRand(uint8_t* dest, size_t destlen, const ngtcp2_rand_ctx* randCtx);
+    static int onGetNewConnectionId(ngtcp2_conn* conn, ngtcp2_cid* cid, uint8_t* token, size_t cidlen,
+                                    void* userData);
+    static int onRemoveConnectionId(ngtcp2_conn* conn, const ngtcp2_cid* cid, void* userData);
+
+    // nghttp3 callbacks; streamUserData is the Stream
+    static int onH3AckedStreamData(nghttp3_conn* conn, int64_t streamId, uint64_t datalen, void* connUserData,
+                                   void* streamUserData);
+    static int onH3StreamClose(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode, void* connUserData,
+                               void* streamUserData);
+    static int onH3RecvData(nghttp3_conn* conn, int64_t streamId, const uint8_t* data, size_t datalen,
+                            void* connUserData, void* streamUserData);
+    static int onH3DeferredConsume(nghttp3_conn* conn, int64_t streamId, size_t consumed, void* connUserData,
+                                   void* streamUserData);
+    static int onH3BeginHeaders(nghttp3_conn* conn, int64_t streamId, void* connUserData, void* streamUserData);
+    static int onH3RecvHeader(nghttp3_conn* conn, int64_t streamId, int32_t token, nghttp3_rcbuf* name,
+                              nghttp3_rcbuf* value, uint8_t flags, void* connUserData, void* streamUserData);
+    static int onH3EndHeaders(nghttp3_conn* conn, int64_t streamId, int fin, void* connUserData,
+                              void* streamUserData);
+    static int onH3EndStream(nghttp3_conn* conn, int64_t streamId, void* connUserData, void* streamUserData);
+    static int onH3StopSending(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode, void* connUserData,
+                               void* streamUserData);
+    static int onH3ResetStream(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode, void* connUserData,
+                               void* streamUserData);
+    static nghttp3_ssize readResponse(nghttp3_conn* conn, int64_t streamId, nghttp3_vec* vec, size_t veccnt,
+                                      uint32_t* pflags, void* connUserData, void* streamUserData);
+
+    QuicEndpoint* _endpoint;
+    muduo::net::InetAddress _peer;
+    muduo::net::InetAddress _local;
+    State _state;
+    ngtcp2_conn* _conn;
+    nghttp3_conn* _h3;
+    SSL* _ssl;
+    ngtcp2_crypto_conn_ref _connRef;
+    ngtcp2_ccerr _ccerr;
+    bool _errorSet;                     // _ccerr holds the reason already
+    connection_data _connData;          // What the request steps and handlers see of the connection
+    std::unordered_map<int64_t, std::unique_ptr<Stream>> _streams;
+    bool _goawaySent;
+    int64_t _lastStreamId;              // Highest request stream seen; later ones are refused after GOAWAY
+    muduo::net::TimerId _timer;
+    bool _timerArmed;
+    ngtcp2_tstamp _armedExpiry;
+    std::string _closePacket;
+};
+
+namespace
+{
+
+QuicConnection* connection_of(stream_data *sdata)
+{
+    return (QuicConnection *)sdata->conn->transport_data;
+}
+
+int h3_submit_response(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen, const nghttp2_data_provider *prd)
+{
+    return connection_of(sdata)->submitResponse(sdata, nva, nvlen, prd);
+}
+
+int h3_submit_info(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen)
+{
+    return connection_of(sdata)->submitInfo(sdata, nva, nvlen);
+}
+
+int h3_submit_trailer(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen)
+{
+    return connection_of(sdata)->submitTrailer(sdata, nva, nvlen);
+}
+
+void h3_resume(stream_data *sdata)
+{
+    connection_of(sdata)->resumeStream(sdata);
+}
+
+void h3_consume(stream_data *sdata, size_t n, bool connection_only)
+{
+    connection_of(sdata)->consume(sdata, n, connection_only);
+}
+
+void h3_reset(stream_data *sdata, uint32_t error_code)
+{
+    connection_of(sdata)->resetStream(sdata, error_code);
+}
+
+const stream_transport kH3Transport = {
+    .submit_response = h3_submit_response,
+    .submit_info = h3_submit_info,
+    .submit_trailer = h3_submit_trailer,
+    .resume = h3_resume,
+    .consume = h3_consume,
+    .reset = h3_reset,
+};
+
+} // namespace
+
+// ---- QuicConnection ----
+
+QuicConnection::QuicConnection(QuicEndpoint* endpoint, const muduo::net::InetAddress& peer,
+                               const muduo::net::InetAddress& local)
+    : writeQueued(false),
+      _endpoint(endpoint),
+      _peer(peer),
+      _local(local),
+      _state(kActive),
+      _conn(NULL),
+      _h3(NULL),
+      _ssl(NULL),
+      _errorSet(false),
+      _connData(),
+      _goawaySent(false),
+      _lastStreamId(-1),
+      _timerArmed(false),
+      _armedExpiry(UINT64_MAX)
+{
+    ngtcp2_ccerr_default(&_ccerr);
+    _connRef.get_conn = getConn;
+    _connRef.user_data = this;
+}
+
+QuicConnection::~QuicConnection()
+{
+    cancelTimer();
+    // Before nghttp3 goes, as it points at response data the streams hold. Whatever the handlers
+    // still do to their streams while closing finds the connection gone and is dropped.
+    _state = kGone;
+    for (auto& item : _streams) {
+        stream_data* sdata = item.second->sdata;
+        if (sdata) {
+            item.second->sdata = NULL;
+            stream_cancel(sdata, CANCEL_DISCONNECT);
+            stream_data_close(NULL, sdata, NGHTTP2_CANCEL);
+        }
+    }
+    _streams.clear();
+    if (_h3) {
+        nghttp3_conn_del(_h3);
+    }
+    if (_conn) {
+        ngtcp2_conn_del(_conn);
+    }
+    if (_ssl) {
+        SSL_free(_ssl);
+    }
+}
+
+bool QuicConnection::init(const ngtcp2_pkt_hd& hd, const ngtcp2_cid* odcid, ngtcp2_token_type tokenType)
+{
+    ngtcp2_callbacks callbacks;
+    memset(&callbacks, 0, sizeof callbacks);
+    callbacks.recv_client_initial = ngtcp2_crypto_recv_client_initial_cb;
+    callbacks.recv_crypto_data = ngtcp2_crypto_recv_crypto_data_cb;
+    callbacks.encrypt = ngtcp2_crypto_encrypt_cb;
+    callbacks.decrypt = ngtcp2_crypto_decrypt_cb;
+    callbacks.hp_mask = ngtcp2_crypto_hp_mask_cb;
+    callbacks.update_key = ngtcp2_crypto_update_key_cb;
+    callbacks.delete_crypto_aead_ctx = ngtcp2_crypto_delete_crypto_aead_ctx_cb;
+    callbacks.delete_crypto_cipher_ctx = ngtcp2_crypto_delete_crypto_cipher_ctx_cb;
+    callbacks.get_path_challenge_data = ngtcp2_crypto_get_path_challenge_data_cb;
+    callbacks.version_negotiation = ngtcp2_crypto_version_negotiation_cb;
+    callbacks.handshake_completed = onHandshakeCompleted;
+    callbacks.recv_stream_data = onRecvStreamData;
+    callbacks.acked_stream_data_offset = onAckedStreamDataOffset;
+    callbacks.stream_close = onStreamClose;
+    callbacks.stream_reset = onStreamReset;
+    callbacks.stream_stop_sending = onStreamStopSending;
+    callbacks.extend_max_remote_streams_bidi = onExtendMaxRemoteStreamsBidi;
+    callbacks.extend_max_stream_data = onExtendMaxStreamData;
+    callbacks.rand = onRand;
+    callbacks.get_new_connection_id = onGetNewConnectionId;
+    callbacks.remove_connection_id = onRemoveConnectionId;
+
+    ngtcp2_settings settings;
+    ngtcp2_settings_default(&settings);
+    settings.initial_ts = quic_now();
+    if (tokenType != NGTCP2_TOKEN_TYPE_UNKNOWN) {
+        // The address is validated already: no anti-amplification limit for this handshake
+        settings.token = hd.token;
+        settings.tokenlen = hd.tokenlen;
+        settings.token_type = tokenType;
+    }
+
+    const http3_policy& policy = g_http3_policy;
+    ngtcp2_transport_params params;
+    ngtcp2_transport_params_default(&params);
+    params.initial_max_stream_data_bidi_local = policy.stream_window;
+    params.initial_max_stream_data_bidi_remote = policy.stream_window;
+    params.initial_max_stream_data_uni = policy.stream_window;
+    params.initial_max_data = policy.connection_window;
+    params.initial_max_streams_bidi = policy.max_streams;
+    params.initial_max_streams_uni = 3;
+    params.max_idle_timeout = (ngtcp2_duration)(policy.idle_timeout * NGTCP2_SECONDS);
+    params.original_dcid = odcid ? *odcid : hd.dcid;
+    params.original_dcid_present = 1;
+    if (odcid) {
+        // The client checks that what it was told in the Retry matches
+        params.retry_scid = hd.dcid;
+        params.retry_scid_present = 1;
+    }
+
+    QuicConnectionPtr self = shared_from_this();
+    ngtcp2_cid scid;
+    _endpoint->newCid(&scid, kCidLength, self);
+    params.stateless_reset_token_present = 1;
+    ngtcp2_crypto_generate_stateless_reset_token(params.stateless_reset_token, g_reset_secret,
+                                                 sizeof g_reset_secret, &scid);
+
+    path_storage path(_local, _peer);
+    int rv = ngtcp2_conn_server_new(&_conn, &hd.scid, &scid, &path.path, hd.version, &callbacks, &settings,
+                                    &params, NULL, this);
+    if (rv != 0) {
+        LOG_ERROR << "http3: ngtcp2_conn_server_new: " << ngtcp2_strerror(rv);
+        _endpoint->remove(self);
+        return false;
+    }
+    _ssl = SSL_new(_endpoint->sslCtx());
+    SSL_set_app_data(_ssl, &_connRef);
+    SSL_set_accept_state(_ssl);
+    ngtcp2_conn_set_tls_native_handle(_conn, _ssl);
+    // Retransmitted Initials still carry the ID the client picked
+    _endpoint->addCid(hd.dcid, self);
+
+    // Not in the memory budget's connection list (no nghttp2 session or windows to shrink and
+    // shed); the streams' buffers are charged all the same
+    _connData.loop = _endpoint->loop();
+    _connData.peer = _peer;
+    std::weak_ptr<QuicConnection> weak(self);
+    QuicEndpoint* endpoint = _endpoint;
+    _connData.send_soon = [weak, endpoint]() {
+        QuicConnectionPtr conn = weak.lock();
+        if (conn) {
+            // scheduleWrite defers and dedups the write itself
+            conn->_connData.send_scheduled = false;
+            endpoint->scheduleWrite(conn);
+        }
+    };
+    _connData.default_handler = &default_handler_impl;
+    _connData.peer_key = rate_limit_peer_key(_peer);
+    _connData.transport = &kH3Transport;
+    _connData.transport_data = this;
+    _connData.alt_svc_done = true;
+    return true;
+}
+
+int QuicConnection::setupHttp3()
+{
+    if (_h3) {
+        return 0;
+    }
+    if (ngtcp2_conn_get_streams_uni_left(_conn) < 3) {
+        return -1;
+    }
+    nghttp3_callbacks callbacks;
+    memset(&callbacks, 0, sizeof callbacks);
+    callbacks.acked_stream_data = onH3AckedStreamData;
+    callbacks.stream_close = onH3StreamClose;
+    callbacks.recv_data = onH3RecvData;
+    callbacks.deferred_consume = onH3DeferredConsume;
+    callbacks.begin_headers = onH3BeginHeaders;
+    callbacks.recv_header = onH3RecvHeader;
+    callbacks.end_headers = onH3EndHeaders;
+    callbacks.end_stream = onH3EndStream;
+    callbacks.stop_sending = onH3StopSending;
+    callbacks.reset_stream = onH3ResetStream;
+
+    nghttp3_settings settings;
+    nghttp3_settings_default(&settings);
+    settings.qpack_max_dtable_capacity = 4096;
+    settings.qpack_blocked_streams = 100;
+    if (nghttp3_conn_server_new(&_h3, &callbacks, &settings, NULL, this) != 0) {
+        return -1;
+    }
+    const ngtcp2_transport_params* params = ngtcp2_conn_get_local_transport_params(_conn);
+    nghttp3_conn_set_max_client_streams_bidi(_h3, params->initial_max_streams_bidi);
+
+    int64_t control, qpackEncoder, qpackDecoder;
+    if (ngtcp2_conn_open_uni_stream(_conn, &control, NULL) != 0 ||
+        nghttp3_conn_bind_control_stream(_h3, control) != 0 ||
+        ngtcp2_conn_open_uni_stream(_conn, &qpackEncoder, NULL) != 0 ||
+        ngtcp2_conn_open_uni_stream(_conn, &qpackDecoder, NULL) != 0 ||
+        nghttp3_conn_bind_qpack_streams(_h3, qpackEncoder, qpackDecoder) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void QuicConnection::onPacket(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                              const muduo::net::InetAddress& local)
+{
+    if (_state == kClosing) {
+        // Whatever the peer still sends gets our CONNECTION_CLOSE again
+        if (!_closePacket.empty()) {
+            _endpoint->send(_peer, _local, (const uint8_t *)_closePacket.data(), _closePacket.size(), 0);
+        }
+        return;
+    }
+    if (_state != kActive) {
+        return;
+    }
+    QuicConnectionPtr self = shared_from_this();
+    _connData.input_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+    path_storage path(local, peer);
+    ngtcp2_pkt_info pi;
+    memset(&pi, 0, sizeof pi);
+    int rv = ngtcp2_conn_read_pkt(_conn, &path.path, &pi, data, len, quic_now());
+    if (rv != 0) {
+        switch (rv) {
+        case NGTCP2_ERR_DRAINING:
+            startDraining();
+            return;
+        case NGTCP2_ERR_DROP_CONN:
+            _state = kGone;
+            _endpoint->remove(self);
+            return;
+        case NGTCP2_ERR_CRYPTO:
+            if (!_errorSet) {
+                ngtcp2_ccerr_set_tls_alert(&_ccerr, ngtcp2_conn_get_tls_alert(_conn), NULL, 0);
+            }
+            break;
+        default:
+            if (!_errorSet) {
+                ngtcp2_ccerr_set_liberr(&_ccerr, rv, NULL, 0);
+            }
+            break;
+        }
+        _errorSet = true;
+        closeWithError();
+        return;
+    }
+    _endpoint->scheduleWrite(self);
+}
+
+// Write everything ngtcp2 and nghttp3 have, grouping equal-sized packets to the same peer into
+// GSO trains. Stops at the send quantum; the pacing timer continues from there.
+void QuicConnection::write()
+{
+    writeQueued = false;
+    if (_state != kActive) {
+        return;
+    }
+    ngtcp2_tstamp ts = quic_now();
+    ngtcp2_path_storage ps;
+    ngtcp2_path_storage_zero(&ps);
+    ngtcp2_pkt_info pi;
+    size_t maxPacket = ngtcp2_conn_get_path_max_tx_udp_payload_size(_conn);
+    size_t maxPackets = std::min(UdpSocket::kMaxSegments,
+                                 std::max((size_t)1, ngtcp2_conn_get_send_quantum(_conn) / maxPacket));
+    maxPackets = std::min(maxPackets, kSendBufferSize / maxPacket);
+    if (!_endpoint->gso()) {
+        maxPackets = std::min(maxPackets, (size_t)16);
+    }
+    uint8_t* buf = _endpoint->sendBuffer();
+    size_t used = 0;
+    size_t packets = 0;
+    size_t segment = 0;
+    muduo::net::InetAddress trainPeer, trainLocal;
+
+    for (;;) {
+        int64_t streamId = -1;
+        int fin = 0;
+        nghttp3_vec vec[kMaxStreamVecs];
+        nghttp3_ssize veccnt = 0;
+        if (_h3 && ngtcp2_conn_get_max_data_left(_conn)) {
+            veccnt = nghttp3_conn_writev_stream(_h3, &streamId, &fin, vec, kMaxStreamVecs);
+            if (veccnt < 0) {
+                ngtcp2_ccerr_set_application_error(&_ccerr, nghttp3_err_infer_quic_app_error_code((int)veccnt),
+                                                   NULL, 0);
+                _errorSet = true;
+                closeWithError();
+                return;
+            }
+        }
+        ngtcp2_ssize datalen;
+        uint32_t flags = NGTCP2_WRITE_STREAM_FLAG_MORE;
+        if (fin) {
+            flags |= NGTCP2_WRITE_STREAM_FLAG_FIN;
+        }
+        ngtcp2_ssize nwrite = ngtcp2_conn_writev_stream(_conn, &ps.path, &pi, buf + used, maxPacket, &datalen, flags,
+                                                        streamId, (const ngtcp2_vec *)vec, (size_t)veccnt, ts);
+        if (nwrite < 0) {
+            switch (nwrite) {
+            case NGTCP2_ERR_STREAM_DATA_BLOCKED:
+                nghttp3_conn_block_stream(_h3, streamId);
+                continue;
+            case NGTCP2_ERR_STREAM_SHUT_WR:
+                nghttp3_conn_shutdown_stream_write(_h3, streamId);
+                continue;
+            case NGTCP2_ERR_WRITE_MORE:
+                // More stream data fits into this packet
+                if (nghttp3_conn_add_write_offset(_h3, streamId, datalen) == 0) {
+                    continue;
+                }
+                break;
+            default:
+                break;
+            }
+            ngtcp2_ccerr_set_liberr(&_ccerr, (int)nwrite, NULL, 0);
+            _errorSet = true;
+            closeWithError();
+            return;
+        }
+        if (datalen >= 0 && streamId >= 0) {
+            nghttp3_conn_add_write_offset(_h3, streamId, datalen);
+        }
+        if (nwrite == 0) {
+            break;
+        }
+        muduo::net::InetAddress packetPeer = to_inet(ps.path.remote);
+        if (packets > 0 && ((size_t)nwrite > segment || !same_address(packetPeer, trainPeer))) {
+            // Cannot join the train: send it and start a new one with this packet
+            _endpoint->send(trainPeer, trainLocal, buf, used, segment);
+            memmove(buf, buf + used, nwrite);
+            used = 0;
+            packets = 0;
+        }
+        if (packets == 0) {
+            segment = nwrite;
+            trainPeer = packetPeer;
+            trainLocal = to_inet(ps.path.local);
+        }
+        used += nwrite;
+        ++packets;
+        if ((size_t)nwrite < segment || packets >= maxPackets) {
+            // A short packet ends the train
+            _endpoint->send(trainPeer, trainLocal, buf, used, segment);
+            used = 0;
+            if (packets >= maxPackets) {
+                packets = 0;
+                break;
+            }
+            packets = 0;
+        }
+    }
+    if (used > 0) {
+        _endpoint->send(trainPeer, trainLocal, buf, used, segment);
+    }
+    ngtcp2_conn_update_pkt_tx_time(_conn, ts);
+    armTimer();
+}
+
+void QuicConnection::goaway()
+{
+    if (_state != kActive) {
+        return;
+    }
+    if (_h3) {
+        // Running requests complete; nghttp3 names the last one it takes in the GOAWAY
+        nghttp3_conn_shutdown(_h3);
+        _goawaySent = true;
+    }
+    _endpoint->scheduleWrite(shared_from_this());
+}
+
+void QuicConnection::close()
+{
+    if (_state != kActive) {
+        return;
+    }
+    if (!_errorSet) {
+        ngtcp2_ccerr_set_application_error(&_ccerr, NGHTTP3_H3_NO_ERROR, NULL, 0);
+        _errorSet = true;
+    }
+    closeWithError();
+}
+
+void QuicConnection::closeWithError()
+{
+    QuicConnectionPtr self = shared_from_this();
+    if (ngtcp2_conn_in_closing_period(_conn) || ngtcp2_conn_in_draining_period(_conn)) {
+        startDraining();
+        return;
+    }
+    _state = kClosing;
+    ngtcp2_path_storage ps;
+    ngtcp2_path_storage_zero(&ps);
+    ngtcp2_pkt_info pi;
+    uint8_t* buf = _endpoint->sendBuffer();
+    ngtcp2_ssize n = ngtcp2_conn_write_connection_close(_conn, &ps.path, &pi, buf, NGTCP2_MAX_UDP_PAYLOAD_SIZE,
+                                                        &_ccerr, quic_now());
+    if (n <= 0) {
+        // Nothing to say before the handshake keys exist
+        _state = kGone;
+        _endpoint->remove(self);
+        return;
+    }
+    _closePacket.assign((const char *)buf, n);
+    _endpoint->send(_peer, _local, buf, n, 0);
+    removeAfterPto();
+}
+
+void QuicConnection::startDraining()
+{
+    _state = kDraining;
+    removeAfterPto();
+}
+
+void QuicConnection::removeAfterPto()
+{
+    cancelTimer();
+    double delay = 3.0 * ngtcp2_conn_get_pto(_conn) / NGTCP2_SECONDS;
+    std::weak_ptr<QuicConnection> weak(shared_from_this());
+    QuicEndpoint* endpoint = _endpoint;
+    _endpoint->loop()->runAfter(delay, [weak, endpoint]() {
+        QuicConnectionPtr self = weak.lock();
+        if (self) {
+            self->_state = kGone;
+            endpoint->remove(self);
+        }
+    });
+}
+
+void QuicConnection::armTimer()
+{
+    ngtcp2_tstamp expiry = ngtcp2_conn_get_expiry(_conn);
+    if (_timerArmed && expiry == _armedExpiry) {
+        return;
+    }
+    cancelTimer();
+    if (expiry == UINT64_MAX) {
+        return;
+    }
+    ngtcp2_tstamp now = quic_now();
+    double delay = expiry > now ? (double)(expiry - now) / NGTCP2_SECONDS : 0;
+    std::weak_ptr<QuicConnection> weak(shared_from_this());
+    _timer = _endpoint->loop()->runAfter(delay, [weak]() {
+        QuicConnectionPtr self = weak.lock();
+        if (self) {
+            self->onTimer();
+        }
+    });
+    _timerArmed = true;
+    _armedExpiry = expiry;
+}
+
+void QuicConnection::cancelTimer()
+{
+    if (_timerArmed) {
+        _endpoint->loop()->cancel(_timer);
+        _timerArmed = false;
+        _armedExpiry = UINT64_MAX;
+    }
+}
+
+void QuicConnection::onTimer()
+{
+    _timerArmed = false;
+    _armedExpiry = UINT64_MAX;
+    if (_state != kActive) {
+        return;
+    }
+    int rv = ngtcp2_conn_handle_expiry(_conn, quic_now());
+    if (rv == NGTCP2_ERR_IDLE_CLOSE) {
+        _state = kGone;
+        _endpoint->remove(shared_from_this());
+        return;
+    }
+    if (rv != 0) {
+        ngtcp2_ccerr_set_liberr(&_ccerr, rv, NULL, 0);
+        _errorSet = true;
+        closeWithError();
+        return;
+    }
+    write();
+}
+
+// ---- ngtcp2 callbacks ----
+
+ngtcp2_conn* QuicConnection::getConn(ngtcp2_crypto_conn_ref* ref)
+{
+    return ((QuicConnection *)ref->user_data)->_conn;
+}
+
+int QuicConnection::onHandshakeCompleted(ngtcp2_conn* conn, void* userData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    // Lets the client skip the Retry when it comes back from the same address
+    uint8_t token[NGTCP2_CRYPTO_MAX_REGULAR_TOKENLEN];
+    ngtcp2_ssize tokenlen = ngtcp2_crypto_generate_regular_token(token, g_token_secret, sizeof g_token_secret,
+                                                                 self->_peer.getSockAddr(), address_len(self->_peer),
+                                                                 quic_now());
+    if (tokenlen > 0) {
+        ngtcp2_conn_submit_new_token(conn, token, (size_t)tokenlen);
+    }
+    return self->setupHttp3() == 0 ? 0 : NGTCP2_ERR_CALLBACK_FAILURE;
+}
+
+int QuicConnection::onRecvStreamData(ngtcp2_conn* conn, uint32_t flags, int64_t streamId, uint64_t offset,
+                                     const uint8_t* data, size_t datalen, void* userData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->setupHttp3() != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    nghttp3_ssize consumed = nghttp3_conn_read_stream(self->_h3, streamId, data, datalen,
+                                                      flags & NGTCP2_STREAM_DATA_FLAG_FIN);
+    if (consumed < 0) {
+        ngtcp2_ccerr_set_application_error(&self->_ccerr, nghttp3_err_infer_quic_app_error_code((int)consumed),
+                                           NULL, 0);
+        self->_errorSet = true;
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    // Framing and QPACK bytes; body bytes come back once the handler side took them
+    ngtcp2_conn_extend_max_stream_offset(conn, streamId, consumed);
+    ngtcp2_conn_extend_max_offset(conn, consumed);
+    return 0;
+}
+
+int QuicConnection::onAckedStreamDataOffset(ngtcp2_conn* conn, int64_t streamId, uint64_t offset,
+                                            uint64_t datalen, void* userData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->_h3 && nghttp3_conn_add_ack_offset(self->_h3, streamId, datalen) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onStreamClose(ngtcp2_conn* conn, uint32_t flags, int64_t streamId, uint64_t appErrorCode,
+                                  void* userData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (!(flags & NGTCP2_STREAM_CLOSE_FLAG_APP_ERROR_CODE_SET)) {
+        appErrorCode = NGHTTP3_H3_NO_ERROR;
+    }
+    if (!self->_h3) {
+        return 0;
+    }
+    int rv = nghttp3_conn_close_stream(self->_h3, streamId, appErrorCode);
+    if (rv == NGHTTP3_ERR_STREAM_NOT_FOUND) {
+        // Never became a request; the client may open another one instead
+        if (ngtcp2_is_bidi_stream(streamId)) {
+            ngtcp2_conn_extend_max_streams_bidi(conn, 1);
+        }
+        return 0;
+    }
+    if (rv != 0) {
+        ngtcp2_ccerr_set_application_error(&self->_ccerr, nghttp3_err_infer_quic_app_error_code(rv), NULL, 0);
+        self->_errorSet = true;
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onStreamReset(ngtcp2_conn* conn, int64_t streamId, uint64_t finalSize, uint64_t appErrorCode,
+                                  void* userData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->_h3 && nghttp3_conn_shutdown_stream_read(self->_h3, streamId) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onStreamStopSending(ngtcp2_conn* conn, int64_t streamId, uint64_t appErrorCode,
+                                        void* userData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->_h3 && nghttp3_conn_shutdown_stream_read(self->_h3, streamId) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onExtendMaxRemoteStreamsBidi(ngtcp2_conn* conn, uint64_t maxStreams, void* userData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->_h3) {
+        nghttp3_conn_set_max_client_streams_bidi(self->_h3, maxStreams);
+    }
+    return 0;
+}
+
+int QuicConnection::onExtendMaxStreamData(ngtcp2_conn* conn, int64_t streamId, uint64_t maxData, void* userData,
+                                          void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    if (self->_h3 && nghttp3_conn_unblock_stream(self->_h3, streamId) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+void QuicConnection::onRand(uint8_t* dest, size_t destlen, const ngtcp2_rand_ctx* randCtx)
+{
+    RAND_bytes(dest, (int)destlen);
+}
+
+int QuicConnection::onGetNewConnectionId(ngtcp2_conn* conn, ngtcp2_cid* cid, uint8_t* token, size_t cidlen,
+                                         void* userData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    self->_endpoint->newCid(cid, cidlen, self->shared_from_this());
+    if (ngtcp2_crypto_generate_stateless_reset_token(token, g_reset_secret, sizeof g_reset_secret, cid) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onRemoveConnectionId(ngtcp2_conn* conn, const ngtcp2_cid* cid, void* userData)
+{
+    QuicConnection* self = (QuicConnection *)userData;
+    std::string key((const char *)cid->data, cid->datalen);
+    self->cids.erase(std::remove(self->cids.begin(), self->cids.end(), key), self->cids.end());
+    self->_endpoint->removeCid(*cid);
+    return 0;
+}
+
+// ---- nghttp3 callbacks ----
+
+int QuicConnection::onH3AckedStreamData(nghttp3_conn* conn, int64_t streamId, uint64_t datalen,
+                                        void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream) {
+        return 0;
+    }
+    stream->unacked -= datalen;
+    size_t n = stream->ackedInFront + datalen;
+    while (!stream->chunks.empty() && n >= stream->chunks.front().size()) {
+        n -= stream->chunks.front().size();
+        stream->chunks.pop_front();
+    }
+    stream->ackedInFront = n;
+    if (stream->blocked && stream->unacked < g_http3_policy.stream_window) {
+        stream->blocked = false;
+        nghttp3_conn_resume_stream(self->_h3, streamId);
+    }
+    return 0;
+}
+
+int QuicConnection::onH3StreamClose(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode,
+                                    void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    self->closeStream(streamId, h2_error_of(appErrorCode));
+    if (ngtcp2_is_bidi_stream(streamId)) {
+        ngtcp2_conn_extend_max_streams_bidi(self->_conn, 1);
+    }
+    return 0;
+}
+
+int QuicConnection::onH3RecvData(nghttp3_conn* conn, int64_t streamId, const uint8_t* data, size_t datalen,
+                                 void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream || !stream->sdata) {
+        // Refused before it had a stream_data: nobody will consume the body
+        ngtcp2_conn_extend_max_stream_offset(self->_conn, streamId, datalen);
+        ngtcp2_conn_extend_max_offset(self->_conn, datalen);
+        return 0;
+    }
+    // The body is consumed as the handler takes it (stream_consume), as on HTTP/2
+    if (stream_on_request_data(NULL, stream->sdata, data, datalen) != 0) {
+        return NGHTTP3_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+int QuicConnection::onH3DeferredConsume(nghttp3_conn* conn, int64_t streamId, size_t consumed,
+                                        void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    ngtcp2_conn_extend_max_stream_offset(self->_conn, streamId, consumed);
+    ngtcp2_conn_extend_max_offset(self->_conn, consumed);
+    return 0;
+}
+
+int QuicConnection::onH3BeginHeaders(nghttp3_conn* conn, int64_t streamId, void* connUserData,
+                                     void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    // stream_data keeps 31-bit IDs like HTTP/2; past them, and past our GOAWAY, nothing new starts
+    if (streamId > INT32_MAX || (self->_goawaySent && streamId > self->_lastStreamId)) {
+        self->rejectStream(streamId);
+        return 0;
+    }
+    stream_data* sdata = stream_data_new(NULL, &self->_connData, (int32_t)streamId);
+    if (!sdata) {
+        self->rejectStream(streamId);
+        return 0;
+    }
+    std::unique_ptr<Stream> stream(new Stream());
+    stream->id = streamId;
+    stream->sdata = sdata;
+    stream->provider.read_callback = NULL;
+    stream->requestEnded = false;
+    stream->blocked = false;
+    stream->ackedInFront = 0;
+    stream->unacked = 0;
+    nghttp3_conn_set_stream_user_data(conn, streamId, stream.get());
+    self->_streams[streamId] = std::move(stream);
+    self->_lastStreamId = std::max(self->_lastStreamId, streamId);
+    return 0;
+}
+
+int QuicConnection::onH3RecvHeader(nghttp3_conn* conn, int64_t streamId, int32_t token, nghttp3_rcbuf* name,
+                                   nghttp3_rcbuf* value, uint8_t flags, void* connUserData, void* streamUserData)
+{
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream || !stream->sdata) {
+        return 0;
+    }
+    nghttp3_vec n = nghttp3_rcbuf_get_buf(name);
+    nghttp3_vec v = nghttp3_rcbuf_get_buf(value);
+    stream_on_request_header(stream->sdata, n.base, n.len, v.base, v.len);
+    return 0;
+}
+
+int QuicConnection::onH3EndHeaders(nghttp3_conn* conn, int64_t streamId, int fin, void* connUserData,
+                                   void* streamUserData)
+{
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream || !stream->sdata || stream->requestEnded) {
+        return 0;
+    }
+    stream_on_request_headers(NULL, stream->sdata, fin != 0);
+    if (fin && stream->sdata && !stream->requestEnded) {
+        stream->requestEnded = true;
+        stream_on_request_end(NULL, stream->sdata);
+    }
+    return 0;
+}
+
+int QuicConnection::onH3EndStream(nghttp3_conn* conn, int64_t streamId, void* connUserData, void* streamUserData)
+{
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream || !stream->sdata || stream->requestEnded) {
+        return 0;
+    }
+    stream->requestEnded = true;
+    stream_on_request_end(NULL, stream->sdata);
+    return 0;
+}
+
+int QuicConnection::onH3StopSending(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode,
+                                    void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    ngtcp2_conn_shutdown_stream_read(self->_conn, 0, streamId, appErrorCode);
+    return 0;
+}
+
+int QuicConnection::onH3ResetStream(nghttp3_conn* conn, int64_t streamId, uint64_t appErrorCode,
+                                    void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    ngtcp2_conn_shutdown_stream_write(self->_conn, 0, streamId, appErrorCode);
+    return 0;
+}
+
+// Response body out of the stream's data provider, the same one nghttp2 would read. Each read is
+// kept as a chunk that nghttp3 points at until the peer acknowledges it; past stream_window
+// unacknowledged bytes the stream waits for acknowledgements instead of buffering more.
+nghttp3_ssize QuicConnection::readResponse(nghttp3_conn* conn, int64_t streamId, nghttp3_vec* vec, size_t veccnt,
+                                           uint32_t* pflags, void* connUserData, void* streamUserData)
+{
+    QuicConnection* self = (QuicConnection *)connUserData;
+    Stream* stream = (Stream *)streamUserData;
+    if (!stream || !stream->sdata || !stream->provider.read_callback) {
+        *pflags |= NGHTTP3_DATA_FLAG_EOF;
+        return 0;
+    }
+    stream_data* sdata = stream->sdata;
+    const uint64_t window = g_http3_policy.stream_window;
+    uint8_t buf[kReadChunk];
+    size_t n = 0;
+    bool deferred = false;
+    for (size_t reads = 0; n < veccnt && reads < kMaxStreamVecs; ++reads) {
+        if (stream->unacked >= window) {
+            stream->blocked = true;
+            break;
+        }
+        size_t want = (size_t)std::min((uint64_t)kReadChunk, window - stream->unacked);
+        uint32_t flags = NGHTTP2_DATA_FLAG_NONE;
+        // Providers only use their source; there is no nghttp2 session behind this stream
+        ssize_t len = stream->provider.read_callback(NULL, sdata->stream_id, buf, want, &flags,
+                                                     &stream->provider.source, NULL);
+        if (len == NGHTTP2_ERR_DEFERRED) {
+            // Picked up again by stream_resume()
+            deferred = true;
+            break;
+        }
+        if (len < 0) {
+            ngtcp2_conn_shutdown_stream(self->_conn, 0, streamId, NGHTTP3_H3_INTERNAL_ERROR);
+            return NGHTTP3_ERR_WOULDBLOCK;
+        }
+        if (len > 0) {
+            // Sized to what was read: small writes (WebSocket, gRPC) would otherwise pin whole buffers
+            stream->chunks.emplace_back((const char *)buf, (size_t)len);
+            vec[n].base = (uint8_t *)stream->chunks.back().data();
+            vec[n].len = len;
+            ++n;
+            stream->unacked += len;
+            sdata->bytes_sent += len;
+            trace_stamp(&sdata->trace, TRACE_FIRST_DATA);
+        }
+        if (flags & NGHTTP2_DATA_FLAG_EOF) {
+            stream->provider.read_callback = NULL;
+            *pflags |= NGHTTP3_DATA_FLAG_EOF;
+            if (flags & NGHTTP2_DATA_FLAG_NO_END_STREAM) {
+                // The provider submitted trailers (stream_submit_trailer); they end the stream
+                *pflags |= NGHTTP3_DATA_FLAG_NO_END_STREAM;
+            }
+            stream_on_response_end(NULL, sdata);
+            return (nghttp3_ssize)n;
+        }
+    }
+    if (n == 0) {
+        if (!deferred && !stream->blocked) {
+            // Empty reads that promise more: try again once this write is over
+            std::weak_ptr<QuicConnection> weak(self->shared_from_this());
+            self->_endpoint->loop()->queueInLoop([weak, streamId]() {
+                QuicConnectionPtr conn = weak.lock();
+                if (conn && conn->_state == kActive && conn->_streams.count(streamId)) {
+                    nghttp3_conn_resume_stream(conn->_h3, streamId);
+                    conn->_endpoint->scheduleWrite(conn);
+                }
+            });
+        }
+        return NGHTTP3_ERR_WOULDBLOCK;
+    }
+    return (nghttp3_ssize)n;
+}
+
+// ---- streams ----
+
+QuicConnection::Stream* QuicConnection::findStream(const stream_data* sdata)
+{
+    if (_state != kActive || !_h3) {
+        return NULL;
+    }
+    auto it = _streams.find(sdata->stream_id);
+    return it == _streams.end() ? NULL : it->second.get();
+}
+
+void QuicConnection::closeStream(int64_t streamId, uint32_t errorCode)
+{
+    auto it = _streams.find(streamId);
+    if (it == _streams.end()) {
+        return;
+    }
+    std::unique_ptr<Stream> stream = std::move(it->second);
+    _streams.erase(it);
+    if (stream->sdata) {
+        stream_data_close(NULL, stream->sdata, errorCode);
+    }
+}
+
+// Turned away before it had a stream_data; the client may retry it on another connection
+void QuicConnection::rejectStream(int64_t streamId)
+{
+    if (streamId > INT32_MAX && !_goawaySent) {
+        nghttp3_conn_shutdown(_h3);
+        _goawaySent = true;
+    }
+    ngtcp2_conn_shutdown_stream(_conn, 0, streamId, NGHTTP3_H3_REQUEST_REJECTED);
+}
+
+int QuicConnection::submitResponse(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen,
+                                   const nghttp2_data_provider* prd)
+{
+    Stream* stream = findStream(sdata);
+    if (!stream) {
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    std::vector<nghttp3_nv> headers = to_nv(nva, nvlen);
+    nghttp3_data_reader reader = {readResponse};
+    if (prd) {
+        stream->provider = *prd;
+    }
+    int rv = nghttp3_conn_submit_response(_h3, stream->id, headers.data(), headers.size(), prd ? &reader : NULL);
+    if (rv != 0) {
+        stream->provider.read_callback = NULL;
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    // Noted when queued: nghttp3 reports no frames sent, and the read side may stop right away
+    stream_on_response_headers(sdata, nva, nvlen);
+    if (!prd) {
+        stream_on_response_end(NULL, sdata);
+    }
+    _endpoint->scheduleWrite(shared_from_this());
+    return 0;
+}
+
+int QuicConnection::submitInfo(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen)
+{
+    Stream* stream = findStream(sdata);
+    if (!stream) {
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    std::vector<nghttp3_nv> headers = to_nv(nva, nvlen);
+    if (nghttp3_conn_submit_info(_h3, stream->id, headers.data(), headers.size()) != 0) {
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    _endpoint->scheduleWrite(shared_from_this());
+    return 0;
+}
+
+int QuicConnection::submitTrailer(stream_data* sdata, const nghttp2_nv* nva, size_t nvlen)
+{
+    Stream* stream = findStream(sdata);
+    if (!stream) {
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    std::vector<nghttp3_nv> trailers = to_nv(nva, nvlen);
+    if (nghttp3_conn_submit_trailers(_h3, stream->id, trailers.data(), trailers.size()) != 0) {
+        return NGHTTP2_ERR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+void QuicConnection::resumeStream(stream_data* sdata)
+{
+    Stream* stream = findStream(sdata);
+    if (!stream || stream->blocked) {
+        // A blocked stream resumes once acknowledgements make room
+        return;
+    }
+    nghttp3_conn_resume_stream(_h3, stream->id);
+    _endpoint->scheduleWrite(shared_from_this());
+}
+
+void QuicConnection::consume(stream_data* sdata, size_t n, bool connectionOnly)
+{
+    if (_state != kActive || n == 0) {
+        return;
+    }
+    if (!connectionOnly) {
+        ngtcp2_conn_extend_max_stream_offset(_conn, sdata->stream_id, n);
+    }
+    ngtcp2_conn_extend_max_offset(_conn, n);
+    _endpoint->scheduleWrite(shared_from_this());
+}
+
+void QuicConnection::resetStream(stream_data* sdata, uint32_t errorCode)
+{
+    if (!findStream(sdata)) {
+        return;
+    }
+    if (errorCode == NGHTTP2_NO_ERROR) {
+        // The answer went out already (request_limit_response_sent): stop only the upload
+        ngtcp2_conn_shutdown_stream_read(_conn, 0, sdata->stream_id, NGHTTP3_H3_NO_ERROR);
+    } else {
+        ngtcp2_conn_shutdown_stream(_conn, 0, sdata->stream_id, h3_error_of(errorCode));
+    }
+    _endpoint->scheduleWrite(shared_from_this());
+}
+
+// ---- QuicEndpoint ----
+
+QuicEndpoint::QuicEndpoint(muduo::net::EventLoop* loop, size_t index, uint8_t cidTag,
+                           const std::vector<QuicEndpoint*>* endpoints, SSL_CTX* sslCtx, int fd)
+    : _loop(loop),
+      _index(index),
+      _cidTag(cidTag),
+      _endpoints(endpoints),
+      _sslCtx(sslCtx),
+      _socket(fd),
+      _channel(loop, fd),
+      _flushQueued(false),
+      _draining(false),
+      _closed(false),
+      _graceArmed(false)
+{
+}
+
+QuicEndpoint::~QuicEndpoint()
+{
+    // Peers learn the connections are gone instead of waiting for their idle timeout
+    close();
+    for (auto& item : _conns) {
+        item.second->cancelTimer();
+    }
+}
+
+void QuicEndpoint::start()
+{
+    _channel.setReadCallback(std::bind(&QuicEndpoint::handleRead, this));
+    _channel.setWriteCallback(std::bind(&QuicEndpoint::handleWrite, this));
+    _channel.enableReading();
+}
+
+void QuicEndpoint::goaway()
+{
+    if (_draining || _closed) {
+        return;
+    }
+    _draining = true;
+    std::vector<QuicConnection*> seen;
+    for (auto& item : _conns) {
+        QuicConnection* conn = item.second.get();
+        if (std::find(seen.begin(), seen.end(), conn) == seen.end()) {
+            seen.push_back(conn);
+            conn->goaway();
+        }
+    }
+    if (_conns.empty()) {
+        close();
+        return;
+    }
+    _graceTimer = _loop->runAfter(g_http3_policy.drain_grace, std::bind(&QuicEndpoint::close, this));
+    _graceArmed = true;
+}
+
+void QuicEndpoint::close()
+{
+    if (_closed) {
+        return;
+    }
+    _closed = true;
+    if (_graceArmed) {
+        _loop->cancel(_graceTimer);
+        _graceArmed = false;
+    }
+    std::vector<QuicConnectionPtr> conns;
+    for (auto& item : _conns) {
+        if (std::find(conns.begin(), conns.end(), item.second) == conns.end()) {
+            conns.push_back(item.second);
+        }
+    }
+    // Their CONNECTION_CLOSE is queued on the socket; what the kernel takes now is all that goes out
+    for (const QuicConnectionPtr& conn : conns) {
+        conn->close();
+    }
+    _socket.flush();
+    _channel.disableAll();
+    _channel.remove();
+    _socket.close();
+    LOG_INFO << "http3: udp socket " << _index << " closed";
+}
+
+void QuicEndpoint::handleRead()
+{
+    _socket.receive(std::bind(&QuicEndpoint::dispatch, this, std::placeholders::_1, std::placeholders::_2,
+                              std::placeholders::_3, std::placeholders::_4));
+}
+
+void QuicEndpoint::dispatch(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                            const muduo::net::InetAddress& local)
+{
+    size_t owner = quic_packet_owner(data, len, _endpoints->size());
+    if (owner >= _endpoints->size()) {
+        return;
+    }
+    if (owner != _index) {
+        // The kernel's steering missed (no BPF); hand the packet to the loop owning the ID
+        QuicEndpoint* endpoint = (*_endpoints)[owner];
+        std::string packet((const char *)data, len);
+        endpoint->loop()->runInLoop([endpoint, packet, peer, local]() {
+            endpoint->onPacket((const uint8_t *)packet.data(), packet.size(), peer, local);
+        });
+        return;
+    }
+    onPacket(data, len, peer, local);
+}
+
+void QuicEndpoint::onPacket(const uint8_t* data, size_t len, const muduo::net::InetAddress& peer,
+                            const muduo::net::InetAddress& local)
+{
+    ngtcp2_version_cid vc;
+    int rv = ngtcp2_pkt_decode_version_cid(&vc, data, len, kCidLength);
+    if (rv == NGTCP2_ERR_VERSION_NEGOTIATION) {
+        sendVersionNegotiation(vc, peer, local);
+        return;
+    }
+    if (rv != 0) {
+        return;
+    }
+    auto it = _conns.find(std::string((const char *)vc.dcid, vc.dcidlen));
+    if (it != _conns.end()) {
+        QuicConnectionPtr conn = it->second;
+        conn->onPacket(data, len, peer, local);
+        return;
+    }
+    if (!(data[0] & 0x80) || _draining) {
+        // Short header for a connection we do not know, e.g. from before a restart; or a new
+        // connection while the port is being handed to the next process
+        return;
+    }
+    ngtcp2_pkt_hd hd;
+    if (ngtcp2_accept(&hd, data, len) != 0) {
+        return;
+    }
+    ngtcp2_cid odcid;
+    ngtcp2_token_type tokenType = NGTCP2_TOKEN_TYPE_UNKNOWN;
+    if (!validateAddress(hd, peer, local, &odcid, &tokenType)) {
+        return;
+    }
+    QuicConnectionPtr conn = std::make_shared<QuicConnection>(this, peer, local);
+    if (conn->init(hd, tokenType == NGTCP2_TOKEN_TYPE_RETRY ? &odcid : NULL, tokenType)) {
+        conn->onPacket(data, len, peer, local);
+    }
+}
+
+// A handshake starts only for a client that showed it receives at its source address: it
+// echoes the token of our Retry, or one we sent it in NEW_TOKEN on an earlier connection.
+// Everyone else gets a Retry, which keeps no state here and is smaller than their Initial.
+bool QuicEndpoint::validateAddress(const ngtcp2_pkt_hd& hd, const muduo::net::InetAddress& peer,
+                                   const muduo::net::InetAddress& local, ngtcp2_cid* odcid,
+                                   ngtcp2_token_type* tokenType)
+{
+    const struct sockaddr* addr = peer.getSockAddr();
+    socklen_t addrlen = address_len(peer);
+    ngtcp2_tstamp now = quic_now();
+    if (hd.type != NGTCP2_PKT_INITIAL) {
+        // 0-RTT ahead of its Initial; the client sends it again
+        return false;
+    }
+    if (hd.tokenlen > 0 && hd.token[0] == NGTCP2_CRYPTO_TOKEN_MAGIC_RETRY) {
+        if (ngtcp2_crypto_verify_retry_token(odcid, hd.token, hd.tokenlen, g_token_secret, sizeof g_token_secret,
+                                             hd.version, addr, addrlen, &hd.dcid, kRetryTokenTimeout, now) != 0) {
+            // Expired, or not for this address: RFC 9000 8.1.3 wants INVALID_TOKEN, not another Retry
+            uint8_t buf[256];
+            ngtcp2_ssize n = ngtcp2_crypto_write_connection_close(buf, sizeof buf, hd.version, &hd.scid, &hd.dcid,
+                                                                  NGTCP2_INVALID_TOKEN, NULL, 0);
+            if (n > 0) {
+                send(peer, local, buf, n, 0);
+            }
+            return false;
+        }
+        *tokenType = NGTCP2_TOKEN_TYPE_RETRY;
+        return true;
+    }
+    if (hd.tokenlen > 0 && hd.token[0] == NGTCP2_CRYPTO_TOKEN_MAGIC_REGULAR &&
+        ngtcp2_crypto_verify_regular_token(hd.token, hd.tokenlen, g_token_secret, sizeof g_token_secret,
+                                           addr, addrlen, kRegularTokenTimeout, now) == 0) {
+        *tokenType = NGTCP2_TOKEN_TYPE_NEW_TOKEN;
+        return true;
+    }
+    if (!g_http3_policy.validate_address) {
+        return true;
+    }
+    sendRetry(hd, peer, local);
+    return false;
+}
+
+void QuicEndpoint::sendRetry(const ngtcp2_pkt_hd& hd, const muduo::net::InetAddress& peer,
+                             const muduo::net::InetAddress& local)
+{
+    // The client's next Initial is addressed to this ID, so it has to name our loop as well
+    ngtcp2_cid scid;
+    scid.datalen = kCidLength;
+    RAND_bytes(scid.data, (int)scid.datalen);
+    scid.data[0] = _cidTag;
+    uint8_t token[NGTCP2_CRYPTO_MAX_RETRY_TOKENLEN];
+    ngtcp2_ssize tokenlen = ngtcp2_crypto_generate_retry_token(token, g_token_secret, sizeof g_token_secret,
+                                                               hd.version, peer.getSockAddr(), address_len(peer),
+                                                               &scid, &hd.dcid, quic_now());
+    if (tokenlen < 0) {
+        return;
+    }
+    uint8_t buf[NGTCP2_MAX_UDP_PAYLOAD_SIZE];
+    ngtcp2_ssize n = ngtcp2_crypto_write_retry(buf, sizeof buf, hd.version, &hd.scid, &scid, &hd.dcid,
+                                               token, (size_t)tokenlen);
+    if (n > 0) {
+        send(peer, local, buf, n, 0);
+    }
+}
+
+void QuicEndpoint::sendVersionNegotiation(const ngtcp2_version_cid& vc, const muduo::net::InetAddress& peer,
+                                          const muduo::net::InetAddress& local)
+{
+    // Answering small packets would let spoofed ones amplify
+    uint8_t buf[256];
+    uint8_t unused;
+    RAND_bytes(&unused, 1);
+    const uint32_t versions[] = {NGTCP2_PROTO_VER_V1, NGTCP2_PROTO_VER_V2};
+    ngtcp2_ssize n = ngtcp2_pkt_write_version_negotiation(buf, sizeof buf, unused, vc.scid, vc.scidlen,
+                                                          vc.dcid, vc.dcidlen, versions, 2);
+    if (n > 0) {
+        send(peer, local, buf, n, 0);
+    }
+}
+
+void QuicEndpoint::send(const muduo::net::InetAddress& peer, const muduo::net::InetAddress& local,
+                        const uint8_t* data, size_t len, size_t segmentSize)
+{
+    if (_socket.fd() < 0) {
+        return;
+    }
+    _socket.send(peer, local, data, len, segmentSize);
+    if (!_flushQueued) {
+        _flushQueued = true;
+        _loop->queueInLoop(std::bind(&QuicEndpoint::flush, this));
+    }
+}
+
+void QuicEndpoint::scheduleWrite(const QuicConnectionPtr& conn)
+{
+    if (!conn->writeQueued) {
+        conn->writeQueued = true;
+        _dirty.push_back(conn);
+    }
+    if (!_flushQueued) {
+        _flushQueued = true;
+        // After this loop iteration's reads, so one write covers every packet they brought
+        _loop->queueInLoop(std::bind(&QuicEndpoint::flush, this));
+    }
+}
+
+void QuicEndpoint::flush()
+{
+    _flushQueued = false;
+    std::vector<QuicConnectionPtr> dirty;
+    dirty.swap(_dirty);
+    for (const QuicConnectionPtr& conn : dirty) {
+        conn->write();
+    }
+    if (_socket.fd() < 0) {
+        return;
+    }
+    if (!_socket.flush()) {
+        _channel.enableWriting();
+    }
+}
+
+void QuicEndpoint::handleWrite()
+{
+    if (_socket.flush()) {
+        _channel.disableWriting();
+    }
+}
+
+void QuicEndpoint::newCid(ngtcp2_cid* cid, size_t len, const QuicConnectionPtr& conn)
+{
+    cid->datalen = len;
+    RAND_bytes(cid->data, (int)len);
+    cid->data[0] = _cidTag;
+    addCid(*cid, conn);
+}
+
+void QuicEndpoint::addCid(const ngtcp2_cid& cid, const QuicConnectionPtr& conn)
+{
+    std::string key((const char *)cid.data, cid.datalen);
+    _conns[key] = conn;
+    conn->cids.push_back(key);
+}
+
+void QuicEndpoint::removeCid(const ngtcp2_cid& cid)
+{
+    _conns.erase(std::string((const char *)cid.data, cid.datalen));
+}
+
+void QuicEndpoint::remove(const QuicConnectionPtr& conn)
+{
+    for (const std::string& key : conn->cids) {
+        auto it = _conns.find(key);
+        if (it != _conns.end() && it->second == conn) {
+            _conns.erase(it);
+        }
+    }
+    conn->cids.clear();
+    conn->cancelTimer();
+    if (_draining && !_closed && _conns.empty()) {
+        // The last connection is gone: leave the port to the next process without waiting
+        _loop->queueInLoop(std::bind(&QuicEndpoint::close, this));
+    }
+    // Keep it alive until the callbacks that are on the stack now have returned
+    QuicConnectionPtr keep(conn);
+    _loop->queueInLoop([keep]() {});
+}
+
+#endif // MUDUOHTTP_HAVE_HTTP3
+
+// ---- http3Server ----
+
+http3Server::http3Server(muduo::net::EventLoop* loop, const muduo::net::InetAddress& listenAddr,
+                         const std::string& certFile, const std::string& keyFile)
+    : _loop(loop),
+      _listenAddr(listenAddr),
+      _certFile(certFile),
+      _keyFile(keyFile),
+      _sslCtx(NULL)
+{
+    _steering.map = -1;
+    _steering.generation = 0;
+}
+
+http3Server::~http3Server()
+{
+#ifdef MUDUOHTTP_HAVE_HTTP3
+    // Endpoints own channels of their loops, so each is destroyed there
+    muduo::CountDownLatch latch((int)_endpoints.size());
+    for (QuicEndpoint* endpoint : _endpoints) {
+        endpoint->loop()->runInLoop([endpoint, &latch]() {
+            delete endpoint;
+            latch.countDown();
+        });
+    }
+    latch.wait();
+    if (_sslCtx) {
+        SSL_CTX_free((SSL_CTX *)_sslCtx);
+    }
+#endif
+}
+
+bool http3Server::start(const std::vector<muduo::net::EventLoop*>& ioLoops, const std::vector<int>& inherited)
+{
+#ifdef MUDUOHTTP_HAVE_HTTP3
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx || ngtcp2_crypto_quictls_configure_server_context(ctx) != 0) {
+        LOG_ERROR << "http3: cannot set up TLS for QUIC";
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_alpn_select_cb(ctx, select_h3, NULL);
+    if (SSL_CTX_use_certificate_chain_file(ctx, _certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, _keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        LOG_ERROR << "http3: cannot load " << _certFile << " / " << _keyFile;
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    _sslCtx = ctx;
+    RAND_bytes(g_reset_secret, sizeof g_reset_secret);
+    RAND_bytes(g_token_secret, sizeof g_token_secret);
+
+    // Connection IDs name their loop in seven bits of the first byte
+    quic_steering_init(&_steering, inherited);
+    size_t n = std::min(ioLoops.size(), kQuicMaxLoops);
+    for (size_t i = 0; i < n; ++i) {
+        int fd = UdpSocket::bind(_listenAddr, true);
+        quic_steering_add(&_steering, i, fd);
+        uint8_t cidTag = (uint8_t)((_steering.generation << 7) | i);
+        _endpoints.push_back(new QuicEndpoint(ioLoops[i], i, cidTag, &_endpoints, ctx, fd));
+    }
+    // Once every socket is in the map, so the previous process keeps the port until then
+    if ((_steering.map >= 0 || n > 1) && !quic_steer_by_cid(&_steering, _endpoints[0]->fd(), n)) {
+        LOG_WARN << "http3: no reuseport BPF, packets reaching the wrong IO thread are forwarded";
+    } else if (_steering.map < 0) {
+        LOG_WARN << "http3: no eBPF reuseport steering, QUIC connections may break across a handoff";
+    }
+    for (QuicEndpoint* endpoint : _endpoints) {
+        endpoint->loop()->runInLoop(std::bind(&QuicEndpoint::start, endpoint));
+    }
+    LOG_INFO << "HTTP/3 on udp " << _listenAddr.toIpPort() << ", " << n << " socket(s), GSO "
+             << (_endpoints[0]->gso() ? "on" : "off");
+    return true;
+#else
+    LOG_WARN << "built without ngtcp2/nghttp3, no HTTP/3 on udp " << _listenAddr.toIpPort();
+    return false;
+#endif
+}
+
+void http3Server::goaway()
+{
+#ifdef MUDUOHTTP_HAVE_HTTP3
+    for (QuicEndpoint* endpoint : _endpoints) {
+        endpoint->loop()->runInLoop(std::bind(&QuicEndpoint::goaway, endpoint));
+    }
+#endif
+}
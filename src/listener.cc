@@ -0,0 +1,145 @@
+#include "listener.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <muduo/base/Logging.h>
+#include <muduo/net/SocketsOps.h>
+
+Listener::Listener(muduo::net::EventLoop* loop, int listenfd)
+    : _loop(loop),
+      _listenfd(listenfd),
+      _channel(loop, listenfd),
+      _listening(false),
+      _idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC))
+{
+    // Inherited fds may come in blocking
+    int flags = ::fcntl(_listenfd, F_GETFL, 0);
+    ::fcntl(_listenfd, F_SETFL, flags | O_NONBLOCK);
+    ::fcntl(_listenfd, F_SETFD, FD_CLOEXEC);
+    _channel.setReadCallback(std::bind(&Listener::handleRead, this));
+}
+
+Listener::~Listener()
+{
+    _channel.disableAll();
+    _channel.remove();
+    ::close(_listenfd);
+    ::close(_idleFd);
+}
+
+int Listener::bindTcp(const muduo::net::InetAddress& addr, bool reusePort)
+{
+    int fd = muduo::net::sockets::createNonblockingOrDie(addr.family());
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (reusePort) {
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on);
+    }
+    muduo::net::sockets::bindOrDie(fd, addr.getSockAddr());
+    return fd;
+}
+
+int Listener::bindUnix(const std::string& path, mode_t mode)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof addr.sun_path) {
+        LOG_FATAL << "bad Unix socket path " << path;
+    }
+    bool abstract = path[0] == '@';
+    memcpy(addr.sun_path, path.data(), path.size());
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+    }
+    // Abstract names are not NUL terminated; their length is the address length
+    socklen_t addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + (abstract ? 0 : 1));
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_SYSFATAL << "Listener::bindUnix";
+    }
+    if (!abstract) {
+        // A stale file refuses connections; a live server must not lose its path to us
+        int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = ::connect(probe, (struct sockaddr *)&addr, addrlen) == 0;
+        ::close(probe);
+        if (live) {
+            LOG_FATAL << path << " is in use by another server";
+        }
+        ::unlink(path.c_str());
+    }
+    // Linux creates the file with the socket's own mode (less the umask), so it is never reachable
+    // with looser bits; umask() is process-wide and would race with files other threads create
+    if (!abstract && ::fchmod(fd, mode) < 0) {
+        LOG_SYSERR << "fchmod " << path;
+    }
+    if (::bind(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        LOG_SYSFATAL << "Listener::bindUnix " << path;
+    }
+    if (!abstract && ::chmod(path.c_str(), mode) < 0) {
+        LOG_SYSERR << "chmod " << path;
+    }
+    return fd;
+}
+
+void Listener::listen(bool watch)
+{
+    _loop->assertInLoopThread();
+    // Harmless on a socket the previous process already put into listening state
+    if (::listen(_listenfd, SOMAXCONN) < 0) {
+        LOG_SYSFATAL << "Listener::listen";
+    }
+    _listening = true;
+    if (watch) {
+        _channel.enableReading();
+    }
+}
+
+void Listener::stop()
+{
+    _loop->assertInLoopThread();
+    if (_listening) {
+        _listening = false;
+        _channel.disableAll();
+    }
+}
+
+void Listener::handleRead()
+{
+    _loop->assertInLoopThread();
+    // Drain the accept queue; connections queued while we were busy arrive together
+    for (;;) {
+        struct sockaddr_in6 addr;
+        socklen_t addrlen = sizeof addr;
+        memset(&addr, 0, sizeof addr);
+        int connfd = ::accept4(_listenfd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd >= 0) {
+            muduo::net::InetAddress peerAddr(addr);
+            if (_newConnectionCallback) {
+                _newConnectionCallback(connfd, peerAddr);
+            } else {
+                ::close(connfd);
+            }
+            continue;
+        }
+        int savedErrno = errno;
+        if (savedErrno == EMFILE) {
+            // Same trick as muduo's Acceptor: free a descriptor to accept and close the peer
+            ::close(_idleFd);
+            _idleFd = ::accept(_listenfd, NULL, NULL);
+            ::close(_idleFd);
+            _idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        } else if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK && savedErrno != EINTR && savedErrno != ECONNABORTED) {
+            LOG_SYSERR << "Listener::handleRead";
+        }
+        if (savedErrno != EINTR && savedErrno != ECONNABORTED) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#include "loop_handler.h"
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// Filled by global initializers, read-only once IO threads run
+std::vector<const handler_factory *> &factories()
+{
+    static std::vector<const handler_factory *> registered;
+    return registered;
+}
+
+// The thread's instances; a handful at most, so a linear scan beats hashing
+struct loop_instances {
+    std::vector<std::pair<const handler_factory *, RequestHandler *>> items;
+
+    ~loop_instances()
+    {
+        for (auto &item : items) {
+            if (item.first->destroy) {
+                item.first->destroy(item.first->arg, item.second);
+            }
+        }
+    }
+};
+
+thread_local loop_instances t_instances;
+
+RequestHandler *instance(const handler_factory *factory, muduo::net::EventLoop *loop)
+{
+    for (auto &item : t_instances.items) {
+        if (item.first == factory) {
+            return item.second;
+        }
+    }
+    RequestHandler *handler = factory->create(factory->arg, loop);
+    t_instances.items.emplace_back(factory, handler);
+    return handler;
+}
+
+// Only reached when a placeholder is called directly instead of resolved
+void placeholder_request(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    RequestHandler *handler = instance((const handler_factory *)self->data, sdata->conn->loop);
+    handler->handle_request(handler, session, stream_id, sdata);
+}
+
+} // namespace
+
+RequestHandler make_loop_handler(const handler_factory *factory)
+{
+    factories().push_back(factory);
+    RequestHandler handler = {};
+    handler.handle_request = placeholder_request;
+    handler.data = (void *)factory;
+    handler.factory = factory;
+    return handler;
+}
+
+RequestHandler *loop_handler_resolve(RequestHandler *handler, muduo::net::EventLoop *loop)
+{
+    if (!handler || !handler->factory) {
+        return handler;
+    }
+    return instance(handler->factory, loop);
+}
+
+void loop_handlers_init(muduo::net::EventLoop *loop)
+{
+    for (const handler_factory *factory : factories()) {
+        instance(factory, loop);
+    }
+}
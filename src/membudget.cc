@@ -0,0 +1,244 @@
+#include "membudget.h"
+#include <stddef.h>
+#include <atomic>
+
+#include "http2Session.h"
+#include "metrics.h"
+#include "spool.h"
+
+memory_budget_policy g_memory_budget_policy = {
+    .soft_limit = 0,
+    .hard_limit = 0,
+    .loop_soft_limit = 0,
+    .loop_hard_limit = 0,
+    .pressure_window = 16 * 1024,
+};
+
+namespace
+{
+
+// A thread's charges reach the process total in steps of this much, so nghttp2's many small
+// allocations do not all write one shared cache line
+const int64_t kFlushBytes = 64 * 1024;
+
+// nghttp2 frees without a size, so each of its blocks starts with one
+const size_t kHeader = alignof(max_align_t);
+
+std::atomic<int64_t> g_used(0);
+
+struct loop_account {
+    int64_t bytes;                  // Charged by connections of this thread
+    int64_t unflushed;              // Part of bytes not yet in g_used
+    connection_data *connections;
+};
+
+thread_local loop_account t_loop = {0, 0, NULL};
+
+void charge(connection_data *conn_data, int64_t delta)
+{
+    conn_data->memory.bytes += delta;
+    t_loop.bytes += delta;
+    t_loop.unflushed += delta;
+    if (t_loop.unflushed >= kFlushBytes || t_loop.unflushed <= -kFlushBytes) {
+        g_used.fetch_add(t_loop.unflushed, std::memory_order_relaxed);
+        t_loop.unflushed = 0;
+    }
+}
+
+void *budget_malloc(size_t size, void *mem_user_data)
+{
+    char *p = (char *)malloc(kHeader + size);
+    if (!p) {
+        return NULL;
+    }
+    *(size_t *)p = size;
+    charge((connection_data *)mem_user_data, (int64_t)size);
+    return p + kHeader;
+}
+
+void budget_free(void *ptr, void *mem_user_data)
+{
+    if (!ptr) {
+        return;
+    }
+    char *p = (char *)ptr - kHeader;
+    charge((connection_data *)mem_user_data, -(int64_t)*(size_t *)p);
+    free(p);
+}
+
+void *budget_calloc(size_t nmemb, size_t size, void *mem_user_data)
+{
+    if (size && nmemb > (SIZE_MAX - kHeader) / size) {
+        return NULL;
+    }
+    char *p = (char *)calloc(1, kHeader + nmemb * size);
+    if (!p) {
+        return NULL;
+    }
+    *(size_t *)p = nmemb * size;
+    charge((connection_data *)mem_user_data, (int64_t)(nmemb * size));
+    return p + kHeader;
+}
+
+void *budget_realloc(void *ptr, size_t size, void *mem_user_data)
+{
+    if (!ptr) {
+        return budget_malloc(size, mem_user_data);
+    }
+    char *p = (char *)ptr - kHeader;
+    size_t old_size = *(size_t *)p;
+    char *q = (char *)realloc(p, kHeader + size);
+    if (!q) {
+        return NULL;
+    }
+    *(size_t *)q = size;
+    charge((connection_data *)mem_user_data, (int64_t)size - (int64_t)old_size);
+    return q + kHeader;
+}
+
+size_t stream_footprint(const stream_data *sdata)
+{
+    size_t bytes = sdata->headers_len + sdata->body_cap;
+    if (sdata->spool && sdata->spool->batch) {
+        bytes += g_body_spool_policy.write_batch;
+    }
+    if (sdata->response_body) {
+        bytes += sdata->response_len;
+    }
+    return bytes;
+}
+
+// Smaller windows make clients send less per stream until the pressure is gone
+void set_windows(connection_data *conn_data, bool shrink)
+{
+    int32_t window = shrink ? g_memory_budget_policy.pressure_window : NGHTTP2_INITIAL_WINDOW_SIZE;
+    nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, (uint32_t)window};
+    nghttp2_submit_settings(conn_data->session, NGHTTP2_FLAG_NONE, &iv, 1);
+    nghttp2_session_set_local_window_size(conn_data->session, NGHTTP2_FLAG_NONE, 0,
+                                          shrink ? window : NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE);
+    conn_data->memory.windows_shrunk = shrink;
+}
+
+// Close the connection of this loop holding the most. One at a time: until the last one shed is
+// gone its memory still counts, and shedding more for it would overshoot.
+void shed_largest(connection_data *current)
+{
+    connection_data *victim = NULL;
+    for (connection_data *c = t_loop.connections; c; c = c->memory.next) {
+        if (c->memory.shed) {
+            return;
+        }
+        if (!victim || c->memory.bytes > victim->memory.bytes) {
+            victim = c;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+    victim->memory.shed = true;
+    metrics_add(METRIC_MEMORY_SHED);
+    metrics_report_offender(victim, "memory budget");
+    nghttp2_session_terminate_session(victim->session, NGHTTP2_ENHANCE_YOUR_CALM);
+    if (victim != current) {
+        http2_session_schedule_send(victim);
+    }
+}
+
+} // namespace
+
+nghttp2_mem memory_budget_allocator(connection_data *conn_data)
+{
+    nghttp2_mem mem = {conn_data, budget_malloc, budget_free, budget_calloc, budget_realloc};
+    return mem;
+}
+
+void memory_budget_attach(connection_data *conn_data)
+{
+    conn_data->memory.prev = NULL;
+    conn_data->memory.next = t_loop.connections;
+    if (t_loop.connections) {
+        t_loop.connections->memory.prev = conn_data;
+    }
+    t_loop.connections = conn_data;
+}
+
+void memory_budget_detach(connection_data *conn_data)
+{
+    if (conn_data->memory.prev) {
+        conn_data->memory.prev->memory.next = conn_data->memory.next;
+    } else {
+        t_loop.connections = conn_data->memory.next;
+    }
+    if (conn_data->memory.next) {
+        conn_data->memory.next->memory.prev = conn_data->memory.prev;
+    }
+    charge(conn_data, -conn_data->memory.bytes);
+}
+
+void memory_budget_update_stream(stream_data *sdata)
+{
+    size_t bytes = stream_footprint(sdata);
+    if (bytes != sdata->mem_charged) {
+        charge(sdata->conn, (int64_t)bytes - (int64_t)sdata->mem_charged);
+        sdata->mem_charged = bytes;
+    }
+}
+
+void memory_budget_release_stream(stream_data *sdata)
+{
+    charge(sdata->conn, -(int64_t)sdata->mem_charged);
+    sdata->mem_charged = 0;
+}
+
+void memory_budget_check(connection_data *conn_data, size_t held)
+{
+    size_t buffers = held;
+    if (conn_data->output) {
+        buffers += conn_data->output->internalCapacity();
+    } else if (conn_data->client_fd) {
+        buffers += conn_data->client_fd->outputBuffer()->internalCapacity();
+    }
+    charge(conn_data, (int64_t)buffers - (int64_t)conn_data->memory.buffers);
+    conn_data->memory.buffers = buffers;
+
+    memory_pressure pressure = memory_budget_pressure();
+    bool shrink = pressure != MEMORY_NORMAL;
+    if (shrink != conn_data->memory.windows_shrunk) {
+        set_windows(conn_data, shrink);
+    }
+    if (pressure == MEMORY_HARD) {
+        shed_largest(conn_data);
+    }
+}
+
+bool memory_budget_refuse(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (memory_budget_pressure() == MEMORY_NORMAL) {
+        return false;
+    }
+    metrics_add(METRIC_MEMORY_REFUSED);
+    sdata->reject_status = 503;
+    stream_reset(sdata, NGHTTP2_REFUSED_STREAM);
+    return true;
+}
+
+memory_pressure memory_budget_pressure()
+{
+    const memory_budget_policy &policy = g_memory_budget_policy;
+    int64_t used = memory_budget_used();
+    if ((policy.hard_limit && used > (int64_t)policy.hard_limit) ||
+        (policy.loop_hard_limit && t_loop.bytes > (int64_t)policy.loop_hard_limit)) {
+        return MEMORY_HARD;
+    }
+    if ((policy.soft_limit && used > (int64_t)policy.soft_limit) ||
+        (policy.loop_soft_limit && t_loop.bytes > (int64_t)policy.loop_soft_limit)) {
+        return MEMORY_SOFT;
+    }
+    return MEMORY_NORMAL;
+}
+
+int64_t memory_budget_used()
+{
+    // This thread's pending part is known exactly; other threads' is at most kFlushBytes each
+    return g_used.load(std::memory_order_relaxed) + t_loop.unflushed;
+}
@@ -0,0 +1,164 @@
+#include "metrics.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <muduo/base/Timestamp.h>
+
+#include "membudget.h"
+
+namespace
+{
+
+const char *const kMetricNames[METRIC_COUNT] = {
+    "muduohttp_connections_total",
+    "muduohttp_requests_total",
+    "muduohttp_rate_limited_total",
+    "muduohttp_resets_received_total",
+    "muduohttp_calm_goaways_total",
+    "muduohttp_access_log_dropped_total",
+    "muduohttp_requests_too_large_total",
+    "muduohttp_memory_refused_streams_total",
+    "muduohttp_memory_shed_connections_total",
+    "muduohttp_capture_dropped_total",
+    "muduohttp_deadline_exceeded_total",
+    "muduohttp_responses_2xx_total",
+    "muduohttp_responses_3xx_total",
+    "muduohttp_responses_4xx_total",
+    "muduohttp_responses_5xx_total",
+};
+
+const size_t kMaxOffenders = 32;
+
+struct thread_metrics {
+    std::atomic<uint64_t> values[METRIC_COUNT];
+};
+
+struct offender {
+    muduo::Timestamp when;
+    std::string peer;
+    std::string reason;
+};
+
+// Threads live as long as the process, so registered counters are never freed
+std::mutex g_registry_mutex;
+std::vector<thread_metrics *> g_registry;
+std::deque<offender> g_offenders;
+
+thread_local thread_metrics *t_metrics = NULL;
+
+thread_metrics *local_metrics()
+{
+    if (!t_metrics) {
+        thread_metrics *m = new thread_metrics();
+        for (auto &v : m->values) {
+            v.store(0, std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> lock(g_registry_mutex);
+        g_registry.push_back(m);
+        t_metrics = m;
+    }
+    return t_metrics;
+}
+
+void metrics_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (!is_admin_client(sdata->conn)) {
+        const nghttp2_nv headers[] = {
+            {(uint8_t*)":status", (uint8_t*)"404", 7, 3, NGHTTP2_NV_FLAG_NONE}
+        };
+        submit_response_headers(session, sdata, headers, 1, NULL);
+        return;
+    }
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)"text/plain", 12, 10, NGHTTP2_NV_FLAG_NONE}
+    };
+    std::string report = metrics_render();
+    char *response_body = (char *)malloc(report.size());
+    if (!response_body) {
+        return;
+    }
+    memcpy(response_body, report.data(), report.size());
+    sdata->response_body = response_body;
+    sdata->response_len = report.size();
+    sdata->response_offset = 0;
+    submit_stream_response(session, stream_id, sdata, headers, 2, NULL);
+}
+
+} // namespace
+
+bool is_admin_client(const connection_data *conn_data)
+{
+    if (!conn_data->loop) {
+        return true;
+    }
+    const struct sockaddr *sa = conn_data->peer.getSockAddr();
+    if (sa->sa_family == AF_INET) {
+        return (ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (sa->sa_family == AF_INET6) {
+        return IN6_IS_ADDR_LOOPBACK(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+    }
+    return sa->sa_family == AF_UNIX;
+}
+
+void metrics_add(metric_id id, uint64_t n)
+{
+    // Only the owning thread writes, so a plain load/store is enough and avoids a locked add
+    std::atomic<uint64_t> &v = local_metrics()->values[id];
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+uint64_t metrics_get(metric_id id)
+{
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    uint64_t sum = 0;
+    for (thread_metrics *m : g_registry) {
+        sum += m->values[id].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void metrics_report_offender(const connection_data *conn_data, const char *reason)
+{
+    offender o;
+    o.when = muduo::Timestamp::now();
+    o.peer = conn_data->loop ? peer_address(conn_data->peer) : "in-process";
+    o.reason = reason;
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    g_offenders.push_back(o);
+    if (g_offenders.size() > kMaxOffenders) {
+        g_offenders.pop_front();
+    }
+}
+
+std::string metrics_render()
+{
+    std::string out;
+    char line[256];
+    for (int id = 0; id < METRIC_COUNT; ++id) {
+        snprintf(line, sizeof line, "%s %llu\n", kMetricNames[id],
+                 (unsigned long long)metrics_get((metric_id)id));
+        out += line;
+    }
+    snprintf(line, sizeof line, "muduohttp_memory_bytes %lld\nmuduohttp_memory_pressure %d\n",
+             (long long)memory_budget_used(), (int)memory_budget_pressure());
+    out += line;
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    for (const offender &o : g_offenders) {
+        snprintf(line, sizeof line, "# offender %s %s %s\n", o.when.toFormattedString(false).c_str(),
+                 o.peer.c_str(), o.reason.c_str());
+        out += line;
+    }
+    return out;
+}
+
+RequestHandler metrics_handler_impl = {
+    .handle_request = metrics_request_handler,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
@@ -0,0 +1,188 @@
+#include "middleware.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+cors_policy g_cors_policy = {
+    .allow_origin = NULL,
+    .allow_methods = "GET, POST, PUT, DELETE, OPTIONS",
+    .allow_headers = "authorization, content-type",
+    .max_age = 600,
+};
+
+auth_policy g_auth_policy = {
+    .bearer_token = std::string(),
+    .realm = "muduohttp",
+};
+
+namespace
+{
+
+nghttp2_nv make_nv(const char *name, const char *value, size_t valuelen)
+{
+    return {(uint8_t*)name, (uint8_t*)value, strlen(name), valuelen, NGHTTP2_NV_FLAG_NO_COPY_NAME};
+}
+
+bool name_is(const nghttp2_nv &nv, const char *name)
+{
+    size_t len = strlen(name);
+    return nv.namelen == len && memcmp(nv.name, name, len) == 0;
+}
+
+// Compare without stopping at the first difference, so the time taken says nothing about the token
+bool same_secret(const std::string &a, const std::string &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        diff |= (unsigned char)(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+} // namespace
+
+const nghttp2_nv *response_headers::find(const char *name) const
+{
+    for (const nghttp2_nv &nv : nva) {
+        if (name_is(nv, name)) {
+            return &nv;
+        }
+    }
+    return NULL;
+}
+
+void response_headers::add(const char *name, const std::string &value)
+{
+    storage.push_back(value);
+    const std::string &v = storage.back();
+    nva.push_back(make_nv(name, v.data(), v.size()));
+}
+
+void response_headers::set(const char *name, const std::string &value)
+{
+    remove(name);
+    add(name, value);
+}
+
+void response_headers::remove(const char *name)
+{
+    for (auto it = nva.begin(); it != nva.end(); ) {
+        if (name_is(*it, name)) {
+            it = nva.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+uint16_t response_headers::status() const
+{
+    const nghttp2_nv *nv = find(":status");
+    if (!nv || nv->valuelen != 3) {
+        return 0;
+    }
+    return (uint16_t)((nv->value[0] - '0') * 100 + (nv->value[1] - '0') * 10 + (nv->value[2] - '0'));
+}
+
+bool request_header_value(const stream_data *sdata, const char *name, std::string *value)
+{
+    // sdata->headers holds "name: value\n" lines
+    size_t len = strlen(name);
+    for (const char *p = sdata->headers; p && *p; ) {
+        const char *eol = strchr(p, '\n');
+        if (!eol) {
+            eol = p + strlen(p);
+        }
+        if ((size_t)(eol - p) >= len + 2 && memcmp(p, name, len) == 0 && p[len] == ':' && p[len + 1] == ' ') {
+            value->assign(p + len + 2, eol);
+            return true;
+        }
+        if (!*eol) {
+            break;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+void middleware_respond(nghttp2_session *session, stream_data *sdata, uint16_t status,
+                        const nghttp2_nv *extra, size_t nextra)
+{
+    char code[8];    // %03u of a uint16_t may need five digits
+    snprintf(code, sizeof code, "%03u", (unsigned)status);
+    std::vector<nghttp2_nv> headers;
+    headers.push_back(make_nv(":status", code, 3));
+    headers.insert(headers.end(), extra, extra + nextra);
+    // As for requests turned away by their size limits: no handler, and an unfinished upload is
+    // stopped once the answer is out
+    sdata->reject_status = status;
+    submit_response_headers(session, sdata, headers.data(), headers.size(), NULL);
+}
+
+bool Cors::on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    std::string method;
+    if (!g_cors_policy.allow_origin || strcmp(sdata->method, "OPTIONS") != 0 ||
+        !request_header_value(sdata, "access-control-request-method", &method)) {
+        return true;
+    }
+    // Preflight: answered here, the handler never sees it
+    std::string max_age = std::to_string(g_cors_policy.max_age);
+    const nghttp2_nv headers[] = {
+        make_nv("access-control-allow-methods", g_cors_policy.allow_methods, strlen(g_cors_policy.allow_methods)),
+        make_nv("access-control-allow-headers", g_cors_policy.allow_headers, strlen(g_cors_policy.allow_headers)),
+        make_nv("access-control-max-age", max_age.data(), max_age.size()),
+    };
+    middleware_respond(session, sdata, 204, headers, 3);
+    return false;
+}
+
+void Cors::on_response(stream_data *sdata, response_headers &headers)
+{
+    std::string origin;
+    if (!g_cors_policy.allow_origin || !request_header_value(sdata, "origin", &origin)) {
+        return;
+    }
+    headers.set("access-control-allow-origin", g_cors_policy.allow_origin);
+    if (strcmp(g_cors_policy.allow_origin, "*") != 0) {
+        headers.add("vary", "origin");
+    }
+}
+
+bool BearerAuth::on_request(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (g_auth_policy.bearer_token.empty()) {
+        return true;
+    }
+    std::string authorization;
+    static const char kScheme[] = "Bearer ";
+    if (request_header_value(sdata, "authorization", &authorization) &&
+        authorization.compare(0, sizeof kScheme - 1, kScheme) == 0 &&
+        same_secret(authorization.substr(sizeof kScheme - 1), g_auth_policy.bearer_token)) {
+        return true;
+    }
+    std::string challenge = std::string("Bearer realm=\"") + g_auth_policy.realm + "\"";
+    const nghttp2_nv headers[] = {
+        make_nv("www-authenticate", challenge.data(), challenge.size()),
+    };
+    middleware_respond(session, sdata, 401, headers, 1);
+    return false;
+}
+
+void SecurityHeaders::on_response(stream_data *sdata, response_headers &headers)
+{
+    headers.set("x-content-type-options", "nosniff");
+    headers.set("referrer-policy", "no-referrer");
+}
+
+void ResponseMetrics::on_response(stream_data *sdata, response_headers &headers)
+{
+    uint16_t status = headers.status();
+    if (status >= 200 && status < 600) {
+        metrics_add((metric_id)(METRIC_RESPONSES_2XX + status / 100 - 2));
+    }
+}
@@ -0,0 +1,616 @@
+#include "proxy.h"
+#include <list>
+#include <memory>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <muduo/base/Logging.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TcpClient.h>
+
+#include "deadline.h"
+#include "http2Session.h"
+#include "loop_handler.h"
+
+proxy_config g_proxy_config = {false, muduo::net::InetAddress(), std::string(), 2, "/proxy", 5.0};
+
+namespace
+{
+
+typedef std::vector<std::pair<std::string, std::string>> header_list;
+
+struct upstream_conn;
+struct upstream_pool;
+
+// One proxied request. Owned by the downstream stream (sdata->handler_state); the upstream
+// stream only points at it and is detached when the downstream side goes away first.
+struct proxy_stream {
+    stream_data *sdata;
+
+    upstream_conn *up;                  // NULL until submitted upstream and after the upstream stream closed
+    int32_t up_id;
+    bool pending;                       // Waiting in the pool for a connected upstream
+    std::list<proxy_stream *>::iterator pending_it;
+    muduo::Timestamp pending_since;
+
+    header_list request_headers;
+    muduo::net::Buffer request_body;    // Received from the client, not yet sent upstream
+    bool request_eof;
+
+    header_list response_headers;       // Header block being received from upstream
+    header_list trailers;
+    bool response_started;              // Response headers submitted downstream
+    muduo::net::Buffer response_body;   // Received from upstream, not yet sent to the client
+    bool response_eof;
+    bool failed;                        // Upstream gave up; request DATA is dropped
+};
+
+struct upstream_conn {
+    upstream_pool *pool;
+    std::unique_ptr<muduo::net::TcpClient> client;
+    muduo::net::TcpConnectionPtr conn;
+    nghttp2_session *session;           // NULL while disconnected
+    std::unordered_set<proxy_stream *> streams;
+    bool goaway;                        // Upstream is going away, no new streams
+    bool send_scheduled;
+};
+
+// The proxy handler's per-loop instance; handler.data points back here. Loops live as long as
+// the process, so the pool is never freed.
+struct upstream_pool {
+    RequestHandler handler;
+    muduo::net::EventLoop *loop;        // NULL in-process: no upstream connections
+    nghttp2_session_callbacks *callbacks;
+    std::vector<upstream_conn *> conns;
+    std::list<proxy_stream *> pending;
+};
+
+const char kVia[] = "2 muduohttp";
+
+bool is_hop_by_hop(const std::string &name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+void push_nv(std::vector<nghttp2_nv> &nva, const std::string &name, const std::string &value)
+{
+    nva.push_back({(uint8_t *)name.data(), (uint8_t *)value.data(), name.size(), value.size(), NGHTTP2_NV_FLAG_NONE});
+}
+
+void schedule_upstream_send(upstream_conn *up)
+{
+    if (up->send_scheduled || !up->session) {
+        return;
+    }
+    up->send_scheduled = true;
+    // Never re-enter nghttp2_session_send from the other session's callbacks
+    up->pool->loop->queueInLoop([up]() {
+        up->send_scheduled = false;
+        if (up->session) {
+            nghttp2_session_send(up->session);
+        }
+    });
+}
+
+void schedule_downstream_send(proxy_stream *ps)
+{
+    http2_session_schedule_send(ps->sdata->conn);
+}
+
+void respond_bad_gateway(stream_data *sdata)
+{
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"502", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)"text/plain", 12, 10, NGHTTP2_NV_FLAG_NONE}
+    };
+    static const char kBody[] = "bad gateway\n";
+    char *response_body = (char *)malloc(sizeof(kBody) - 1);
+    if (!response_body) {
+        stream_reset(sdata, NGHTTP2_INTERNAL_ERROR);
+        return;
+    }
+    memcpy(response_body, kBody, sizeof(kBody) - 1);
+    sdata->response_body = response_body;
+    sdata->response_len = sizeof(kBody) - 1;
+    sdata->response_offset = 0;
+    submit_stream_response(sdata->conn->session, sdata->stream_id, sdata, headers, 2, NULL);
+}
+
+// The upstream side is gone before the response completed
+void fail_downstream(proxy_stream *ps)
+{
+    ps->failed = true;
+    // Request bytes that will never be forwarded still count against the client's windows
+    stream_consume(ps->sdata, ps->request_body.readableBytes());
+    ps->request_body.retrieveAll();
+    if (!ps->response_started) {
+        ps->response_started = true;
+        respond_bad_gateway(ps->sdata);
+    } else {
+        stream_reset(ps->sdata, NGHTTP2_INTERNAL_ERROR);
+    }
+    schedule_downstream_send(ps);
+}
+
+// 上游 -> 客户端：把上游收到的响应体交给下游会话
+ssize_t response_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                               uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    proxy_stream *ps = (proxy_stream *)source->ptr;
+    size_t n = std::min(length, ps->response_body.readableBytes());
+    if (n == 0 && !ps->response_eof) {
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    memcpy(buf, ps->response_body.peek(), n);
+    ps->response_body.retrieve(n);
+    if (n > 0 && ps->up) {
+        // Bytes moved on, give the upstream its window back
+        nghttp2_session_consume(ps->up->session, ps->up_id, n);
+        schedule_upstream_send(ps->up);
+    }
+    if (ps->response_eof && ps->response_body.readableBytes() == 0) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        if (!ps->trailers.empty()) {
+            std::vector<nghttp2_nv> nva;
+            for (const auto &h : ps->trailers) {
+                push_nv(nva, h.first, h.second);
+            }
+            if (stream_submit_trailer(ps->sdata, nva.data(), nva.size()) == 0) {
+                *data_flags |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
+            }
+        }
+    }
+    return n;
+}
+
+// 客户端 -> 上游：请求体边收边发
+ssize_t request_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                              uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    proxy_stream *ps = (proxy_stream *)source->ptr;
+    size_t n = std::min(length, ps->request_body.readableBytes());
+    if (n == 0 && !ps->request_eof) {
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    memcpy(buf, ps->request_body.peek(), n);
+    ps->request_body.retrieve(n);
+    if (n > 0) {
+        stream_consume(ps->sdata, n);
+        schedule_downstream_send(ps);
+    }
+    if (ps->request_eof && ps->request_body.readableBytes() == 0) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+}
+
+void submit_upstream(upstream_conn *up, proxy_stream *ps)
+{
+    std::vector<nghttp2_nv> nva;
+    for (const auto &h : ps->request_headers) {
+        push_nv(nva, h.first, h.second);
+    }
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = ps;
+    data_prd.read_callback = request_read_callback;
+    bool has_body = !ps->request_eof || ps->request_body.readableBytes() > 0;
+    int32_t id = nghttp2_submit_request(up->session, NULL, nva.data(), nva.size(), has_body ? &data_prd : NULL, ps);
+    if (id < 0) {
+        LOG_ERROR << "proxy: submit to upstream failed: " << nghttp2_strerror(id);
+        fail_downstream(ps);
+        return;
+    }
+    ps->up = up;
+    ps->up_id = id;
+    up->streams.insert(ps);
+    schedule_upstream_send(up);
+}
+
+// Least-loaded connected upstream, or park the stream until one connects
+void dispatch(upstream_pool *pool, proxy_stream *ps)
+{
+    upstream_conn *best = NULL;
+    for (upstream_conn *up : pool->conns) {
+        if (up->session && !up->goaway && (!best || up->streams.size() < best->streams.size())) {
+            best = up;
+        }
+    }
+    if (!best) {
+        ps->pending = true;
+        ps->pending_since = muduo::Timestamp::now();
+        ps->pending_it = pool->pending.insert(pool->pending.end(), ps);
+        return;
+    }
+    submit_upstream(best, ps);
+}
+
+void flush_pending(upstream_pool *pool)
+{
+    std::list<proxy_stream *> pending;
+    pending.swap(pool->pending);
+    for (proxy_stream *ps : pending) {
+        ps->pending = false;
+        dispatch(pool, ps);
+    }
+}
+
+void expire_pending(upstream_pool *pool)
+{
+    muduo::Timestamp now = muduo::Timestamp::now();
+    while (!pool->pending.empty()) {
+        proxy_stream *ps = pool->pending.front();
+        if (muduo::timeDifference(now, ps->pending_since) < g_proxy_config.pending_timeout) {
+            break;
+        }
+        pool->pending.pop_front();
+        ps->pending = false;
+        fail_downstream(ps);
+    }
+}
+
+// upstream nghttp2 client callbacks; user_data is the upstream_conn
+ssize_t upstream_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+    upstream_conn *up = (upstream_conn *)user_data;
+    if (!up->conn) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    up->conn->send(data, length);
+    return length;
+}
+
+int upstream_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+    if (frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+    proxy_stream *ps = (proxy_stream *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!ps) {
+        return 0;
+    }
+    std::string n((const char *)name, namelen);
+    if (is_hop_by_hop(n)) {
+        return 0;
+    }
+    header_list &target = ps->response_started ? ps->trailers : ps->response_headers;
+    target.emplace_back(std::move(n), std::string((const char *)value, valuelen));
+    return 0;
+}
+
+void start_downstream_response(proxy_stream *ps, bool end_stream)
+{
+    const std::string &status = ps->response_headers.empty() ? std::string() : ps->response_headers.front().second;
+    if (!status.empty() && status[0] == '1') {
+        // Interim response; the final one follows
+        ps->response_headers.clear();
+        return;
+    }
+    ps->response_started = true;
+    ps->response_headers.emplace_back("via", kVia);
+    std::vector<nghttp2_nv> nva;
+    for (const auto &h : ps->response_headers) {
+        push_nv(nva, h.first, h.second);
+    }
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = ps;
+    data_prd.read_callback = response_read_callback;
+    int rv = submit_response_headers(ps->sdata->conn->session, ps->sdata, nva.data(), nva.size(),
+                                     end_stream ? NULL : &data_prd);
+    if (rv != 0) {
+        stream_reset(ps->sdata, NGHTTP2_INTERNAL_ERROR);
+    }
+    ps->response_headers.clear();
+    schedule_downstream_send(ps);
+}
+
+int upstream_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    upstream_conn *up = (upstream_conn *)user_data;
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        up->goaway = true;
+        return 0;
+    }
+    if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) {
+        return 0;
+    }
+    proxy_stream *ps = (proxy_stream *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!ps) {
+        return 0;
+    }
+    bool end_stream = frame->hd.flags & NGHTTP2_FLAG_END_STREAM;
+    if (frame->hd.type == NGHTTP2_HEADERS && !ps->response_started) {
+        start_downstream_response(ps, end_stream);
+        if (end_stream) {
+            ps->response_eof = true;
+        }
+        return 0;
+    }
+    if (end_stream) {
+        ps->response_eof = true;
+        stream_resume(ps->sdata);
+        schedule_downstream_send(ps);
+    }
+    return 0;
+}
+
+int upstream_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                         const uint8_t *data, size_t len, void *user_data)
+{
+    proxy_stream *ps = (proxy_stream *)nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!ps) {
+        // Nobody to forward to; don't let it hold the connection window
+        nghttp2_session_consume(session, stream_id, len);
+        return 0;
+    }
+    ps->response_body.append(data, len);
+    stream_resume(ps->sdata);
+    schedule_downstream_send(ps);
+    return 0;
+}
+
+int upstream_on_stream_close_callback(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    upstream_conn *up = (upstream_conn *)user_data;
+    proxy_stream *ps = (proxy_stream *)nghttp2_session_get_stream_user_data(session, stream_id);
+    if (ps) {
+        up->streams.erase(ps);
+        ps->up = NULL;
+        if (!ps->response_eof) {
+            LOG_WARN << "proxy: upstream stream " << stream_id << " closed early: " << nghttp2_http2_strerror(error_code);
+            fail_downstream(ps);
+        }
+    }
+    if (up->goaway && up->streams.empty() && up->conn) {
+        up->conn->shutdown();
+    }
+    return 0;
+}
+
+void upstream_on_connection(upstream_conn *up, const muduo::net::TcpConnectionPtr &conn)
+{
+    if (conn->connected()) {
+        nghttp2_option *option;
+        nghttp2_option_new(&option);
+        nghttp2_option_set_no_auto_window_update(option, 1);
+        int rv = nghttp2_session_client_new2(&up->session, up->pool->callbacks, up, option);
+        nghttp2_option_del(option);
+        if (rv != 0) {
+            up->session = NULL;
+            conn->shutdown();
+            return;
+        }
+        up->conn = conn;
+        up->goaway = false;
+        conn->setTcpNoDelay(true);
+        nghttp2_settings_entry iv[1] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0}};
+        nghttp2_submit_settings(up->session, NGHTTP2_FLAG_NONE, iv, 1);
+        LOG_INFO << "proxy: connected to upstream " << g_proxy_config.authority;
+        flush_pending(up->pool);
+        schedule_upstream_send(up);
+        return;
+    }
+
+    LOG_WARN << "proxy: lost upstream " << g_proxy_config.authority << " with " << up->streams.size() << " stream(s)";
+    std::vector<proxy_stream *> streams(up->streams.begin(), up->streams.end());
+    up->streams.clear();
+    for (proxy_stream *ps : streams) {
+        ps->up = NULL;
+        if (!ps->response_eof) {
+            fail_downstream(ps);
+        }
+    }
+    if (up->session) {
+        nghttp2_session_del(up->session);
+        up->session = NULL;
+    }
+    up->conn.reset();
+}
+
+void upstream_on_message(upstream_conn *up, const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buffer,
+                         muduo::Timestamp time)
+{
+    if (!up->session) {
+        buffer->retrieveAll();
+        return;
+    }
+    ssize_t rv = nghttp2_session_mem_recv(up->session, (const uint8_t *)buffer->peek(), buffer->readableBytes());
+    if (rv < 0) {
+        LOG_ERROR << "proxy: upstream protocol error: " << nghttp2_strerror((int)rv);
+        buffer->retrieveAll();
+        conn->shutdown();
+        return;
+    }
+    buffer->retrieve(rv);
+    nghttp2_session_send(up->session);
+}
+
+// Forward the client's header block, minus connection-specific fields
+void collect_request_headers(proxy_stream *ps, stream_data *sdata)
+{
+    const char *p = sdata->headers;
+    const char *end = p ? p + sdata->headers_len - 1 : NULL;
+    while (p && p < end) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        // Pseudo-header names start with ':', so look for the separator after it
+        const char *sep = (const char *)memmem(p + 1, eol - p - 1, ": ", 2);
+        if (sep) {
+            std::string name(p, sep);
+            std::string value(sep + 2, eol);
+            if (name == ":path" && !g_proxy_config.strip_prefix.empty() &&
+                value.compare(0, g_proxy_config.strip_prefix.size(), g_proxy_config.strip_prefix) == 0) {
+                value.erase(0, g_proxy_config.strip_prefix.size());
+                if (value.empty() || value[0] != '/') {
+                    value.insert(0, "/");
+                }
+            }
+            // grpc-timeout is replaced by what is left of the stream's deadline
+            if (!is_hop_by_hop(name) && !(name == "te" && value != "trailers") && name != "grpc-timeout") {
+                ps->request_headers.emplace_back(std::move(name), std::move(value));
+            }
+        }
+        p = eol + 1;
+    }
+    char timeout[16];
+    if (deadline_grpc_timeout(sdata, timeout, sizeof timeout)) {
+        ps->request_headers.emplace_back("grpc-timeout", timeout);
+    }
+    ps->request_headers.emplace_back("via", kVia);
+    if (sdata->conn->loop && sdata->conn->peer.getSockAddr()->sa_family != AF_UNIX) {
+        ps->request_headers.emplace_back("x-forwarded-for", sdata->conn->peer.toIp());
+    }
+}
+
+void proxy_request_headers(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    upstream_pool *pool = (upstream_pool *)self->data;
+    if (pool->conns.empty() || pool->loop != sdata->conn->loop) {
+        respond_bad_gateway(sdata);
+        return;
+    }
+    proxy_stream *ps = new proxy_stream();
+    ps->sdata = sdata;
+    ps->up = NULL;
+    ps->up_id = -1;
+    ps->pending = false;
+    ps->request_eof = sdata->request_done;
+    ps->response_started = false;
+    ps->response_eof = false;
+    ps->failed = false;
+    sdata->handler_state = ps;
+
+    collect_request_headers(ps, sdata);
+    dispatch(pool, ps);
+}
+
+int proxy_request_data(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                       const uint8_t *data, size_t len)
+{
+    proxy_stream *ps = (proxy_stream *)sdata->handler_state;
+    if (!ps || ps->failed) {
+        stream_consume(sdata, len);
+        return 0;
+    }
+    // Consumed only once sent upstream, so a slow upstream throttles the client
+    ps->request_body.append(data, len);
+    if (ps->up) {
+        nghttp2_session_resume_data(ps->up->session, ps->up_id);
+        schedule_upstream_send(ps->up);
+    }
+    return 0;
+}
+
+// END_STREAM from the client
+void proxy_request_end(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    proxy_stream *ps = (proxy_stream *)sdata->handler_state;
+    if (!ps) {
+        return;
+    }
+    ps->request_eof = true;
+    if (ps->up) {
+        nghttp2_session_resume_data(ps->up->session, ps->up_id);
+        schedule_upstream_send(ps->up);
+    }
+}
+
+void proxy_stream_close(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                        uint32_t error_code)
+{
+    proxy_stream *ps = (proxy_stream *)sdata->handler_state;
+    if (!ps) {
+        return;
+    }
+    sdata->handler_state = NULL;
+    // Unsent request bytes were never consumed; return them to the client's connection window
+    stream_consume_connection(sdata, ps->request_body.readableBytes());
+    if (ps->pending) {
+        ((upstream_pool *)self->data)->pending.erase(ps->pending_it);
+    }
+    if (ps->up) {
+        upstream_conn *up = ps->up;
+        // Response bytes still buffered hold the upstream connection window
+        nghttp2_session_consume(up->session, ps->up_id, ps->response_body.readableBytes());
+        nghttp2_session_set_stream_user_data(up->session, ps->up_id, NULL);
+        nghttp2_submit_rst_stream(up->session, NGHTTP2_FLAG_NONE, ps->up_id, NGHTTP2_CANCEL);
+        up->streams.erase(ps);
+        schedule_upstream_send(up);
+    }
+    delete ps;
+}
+
+// Build the loop's pool; it connects upstream right away, so the first requests find it ready
+RequestHandler *proxy_create(void *arg, muduo::net::EventLoop *loop)
+{
+    upstream_pool *pool = new upstream_pool();
+    pool->handler = {
+        .handle_request = proxy_request_end,
+        .data = pool,
+        .on_request_headers = proxy_request_headers,
+        .on_request_data = proxy_request_data,
+        .on_stream_close = proxy_stream_close,
+        .factory = NULL,
+    };
+    pool->loop = loop;
+    if (!loop || !g_proxy_config.enabled) {
+        return &pool->handler;
+    }
+    nghttp2_session_callbacks_new(&pool->callbacks);
+    nghttp2_session_callbacks_set_send_callback(pool->callbacks, upstream_send_callback);
+    nghttp2_session_callbacks_set_on_header_callback(pool->callbacks, upstream_on_header_callback);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(pool->callbacks, upstream_on_frame_recv_callback);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(pool->callbacks, upstream_on_data_chunk_recv_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(pool->callbacks, upstream_on_stream_close_callback);
+
+    for (int i = 0; i < std::max(1, g_proxy_config.connections); ++i) {
+        upstream_conn *up = new upstream_conn();
+        up->pool = pool;
+        up->session = NULL;
+        up->goaway = false;
+        up->send_scheduled = false;
+        up->client.reset(new muduo::net::TcpClient(loop, g_proxy_config.address, "upstream"));
+        up->client->setConnectionCallback(std::bind(upstream_on_connection, up, std::placeholders::_1));
+        up->client->setMessageCallback(std::bind(upstream_on_message, up, std::placeholders::_1,
+                                                  std::placeholders::_2, std::placeholders::_3));
+        up->client->enableRetry();
+        up->client->connect();
+        pool->conns.push_back(up);
+    }
+    loop->runEvery(1.0, std::bind(expire_pending, pool));
+    return &pool->handler;
+}
+
+const handler_factory kProxyFactory = {
+    .create = proxy_create,
+    .destroy = NULL,
+    .arg = NULL,
+};
+
+} // namespace
+
+bool proxy_set_upstream(const char *hostport)
+{
+    const char *colon = strrchr(hostport, ':');
+    if (!colon || colon == hostport) {
+        return false;
+    }
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+        return false;
+    }
+    std::string host(hostport, colon);
+    muduo::net::InetAddress addr(static_cast<uint16_t>(port));
+    if (!muduo::net::InetAddress::resolve(host, &addr)) {
+        return false;
+    }
+    g_proxy_config.address = addr;
+    g_proxy_config.authority = hostport;
+    g_proxy_config.enabled = true;
+    return true;
+}
+
+RequestHandler proxy_handler_impl = make_loop_handler(&kProxyFactory);
@@ -0,0 +1,191 @@
+#include "ratelimit.h"
+#include <vector>
+#include <muduo/base/Timestamp.h>
+
+#include "metrics.h"
+
+rate_limit_policy g_rate_limit_policy = {
+    .enabled = false,
+    .rate = 100.0,
+    .burst = 200.0,
+    .key_header = std::string(),
+    .action = RATE_LIMIT_REFUSE,
+    .table_size = 4096,
+};
+
+namespace
+{
+
+// Linear probing stops after this many slots; the stalest of them is then recycled
+const size_t kMaxProbe = 8;
+
+struct bucket {
+    uint64_t key;           // 0 marks a free slot
+    double tokens;
+    int64_t last_us;        // Last refill
+};
+
+// Open addressing keeps the table in one allocation and a lookup in a cache line or two
+struct bucket_table {
+    std::vector<bucket> slots;
+    size_t mask;
+};
+
+thread_local bucket_table *t_table = NULL;
+
+bucket_table *loop_table()
+{
+    if (!t_table) {
+        size_t size = 16;
+        while (size < g_rate_limit_policy.table_size) {
+            size <<= 1;
+        }
+        t_table = new bucket_table();
+        t_table->slots.assign(size, bucket());
+        t_table->mask = size - 1;
+    }
+    return t_table;
+}
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    // FNV-1a, then a final mix so the low bits used for the slot index are spread
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+bucket *find_bucket(bucket_table *table, uint64_t key, int64_t now_us)
+{
+    size_t index = key & table->mask;
+    bucket *victim = NULL;
+    for (size_t i = 0; i < kMaxProbe; ++i) {
+        bucket *b = &table->slots[(index + i) & table->mask];
+        if (b->key == key) {
+            return b;
+        }
+        if (b->key == 0) {
+            victim = b;
+            break;
+        }
+        if (!victim || b->last_us < victim->last_us) {
+            victim = b;
+        }
+    }
+    // A client not seen for a while would have a full bucket anyway
+    victim->key = key;
+    victim->tokens = g_rate_limit_policy.burst;
+    victim->last_us = now_us;
+    return victim;
+}
+
+// Value of a collected request header, from sdata->headers ("name: value\n" lines)
+bool find_header(const stream_data *sdata, const std::string &name, const char **value, size_t *len)
+{
+    if (!sdata->headers) {
+        return false;
+    }
+    const char *p = sdata->headers;
+    const char *end = p + sdata->headers_len - 1;
+    while (p < end) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        if ((size_t)(eol - p) >= name.size() + 2 && memcmp(p, name.data(), name.size()) == 0 &&
+            p[name.size()] == ':' && p[name.size() + 1] == ' ') {
+            *value = p + name.size() + 2;
+            *len = eol - *value;
+            return true;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+// Rejected streams keep this handler: no dispatch, request DATA is dropped
+int rejected_request_data(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                          const uint8_t *data, size_t len)
+{
+    stream_consume(sdata, len);
+    return 0;
+}
+
+RequestHandler rejected_handler_impl = {
+    .handle_request = NULL,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = rejected_request_data,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
+
+// Static header block, nothing is copied or built per rejection
+const nghttp2_nv kTooManyRequests[] = {
+    {(uint8_t*)":status", (uint8_t*)"429", 7, 3, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+    {(uint8_t*)"retry-after", (uint8_t*)"1", 11, 1, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+};
+
+} // namespace
+
+uint64_t rate_limit_peer_key(const muduo::net::InetAddress &peer)
+{
+    const struct sockaddr *sa = peer.getSockAddr();
+    if (sa->sa_family == AF_UNIX) {
+        // Clients of the Unix socket listener are co-located and share one bucket
+        return hash_bytes("unix", 4);
+    }
+    if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+        return hash_bytes(&in6->sin6_addr, sizeof in6->sin6_addr);
+    }
+    const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+    return hash_bytes(&in->sin_addr, sizeof in->sin_addr);
+}
+
+bool rate_limit_reject(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (!g_rate_limit_policy.enabled) {
+        return false;
+    }
+    uint64_t key = sdata->conn->peer_key;
+    const char *value;
+    size_t len;
+    if (!g_rate_limit_policy.key_header.empty() &&
+        find_header(sdata, g_rate_limit_policy.key_header, &value, &len)) {
+        key = hash_bytes(value, len);
+    }
+    if (key == 0) {
+        // In-process session without a peer and no key header
+        return false;
+    }
+
+    bucket_table *table = loop_table();
+    int64_t now_us = sdata->conn->input_us;
+    bucket *b = find_bucket(table, key, now_us);
+    b->tokens += (now_us - b->last_us) * g_rate_limit_policy.rate / muduo::Timestamp::kMicroSecondsPerSecond;
+    if (b->tokens > g_rate_limit_policy.burst) {
+        b->tokens = g_rate_limit_policy.burst;
+    }
+    b->last_us = now_us;
+    if (b->tokens >= 1.0) {
+        b->tokens -= 1.0;
+        return false;
+    }
+
+    metrics_add(METRIC_RATE_LIMITED);
+    sdata->handler = &rejected_handler_impl;
+    if (g_rate_limit_policy.action == RATE_LIMIT_429) {
+        submit_response_headers(session, sdata, kTooManyRequests, 2, NULL);
+    } else {
+        stream_reset(sdata, NGHTTP2_REFUSED_STREAM);
+    }
+    return true;
+}
@@ -0,0 +1,118 @@
+#include "reqlimit.h"
+
+#include "membudget.h"
+#include "metrics.h"
+#include "route.h"
+#include "spool.h"
+
+request_limit_policy g_request_limit_policy = {
+    .max_body = 1ULL << 30,
+    .max_header_count = 128,
+    .max_header_bytes = 64 * 1024,
+};
+
+namespace
+{
+
+// HPACK charges each field 32 bytes on top of its name and value (RFC 7541 section 4.1)
+const size_t kHeaderFieldOverhead = 32;
+
+const nghttp2_nv kPayloadTooLarge[] = {
+    {(uint8_t*)":status", (uint8_t*)"413", 7, 3, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+};
+
+const nghttp2_nv kHeadersTooLarge[] = {
+    {(uint8_t*)":status", (uint8_t*)"431", 7, 3, NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE},
+};
+
+// What was buffered is of no use any more
+void drop_body(stream_data *sdata)
+{
+    if (sdata->spool) {
+        spool_body_free(sdata);
+    } else {
+        free(sdata->body);
+        sdata->body = NULL;
+    }
+    sdata->body_len = 0;
+    sdata->body_cap = 0;
+}
+
+// Headers-only answer. A client still sending the body is told to stop once it is out, see
+// request_limit_response_sent.
+void reject(nghttp2_session *session, int32_t stream_id, stream_data *sdata, uint16_t status)
+{
+    sdata->reject_status = status;
+    metrics_add(METRIC_REQUESTS_TOO_LARGE);
+    submit_response_headers(session, sdata, status == 413 ? kPayloadTooLarge : kHeadersTooLarge, 1, NULL);
+    drop_body(sdata);
+    memory_budget_update_stream(sdata);
+}
+
+} // namespace
+
+const request_limit_policy *request_limits(const stream_data *sdata)
+{
+    if (sdata->route && sdata->route->limits) {
+        return sdata->route->limits;
+    }
+    return &g_request_limit_policy;
+}
+
+bool request_limit_header(stream_data *sdata, size_t namelen, size_t valuelen)
+{
+    const request_limit_policy *limits = request_limits(sdata);
+    sdata->header_count += 1;
+    sdata->header_bytes += namelen + valuelen + kHeaderFieldOverhead;
+    if ((limits->max_header_count && sdata->header_count > limits->max_header_count) ||
+        (limits->max_header_bytes && sdata->header_bytes > limits->max_header_bytes)) {
+        sdata->reject_status = 431;
+        return false;
+    }
+    return true;
+}
+
+bool request_limit_reject(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    uint16_t status = sdata->reject_status;
+    uint64_t max_body = request_limits(sdata)->max_body;
+    if (!status && max_body && sdata->content_length > 0 && (uint64_t)sdata->content_length > max_body) {
+        status = 413;
+    }
+    if (!status) {
+        return false;
+    }
+    reject(session, stream_id, sdata, status);
+    return true;
+}
+
+bool request_limit_data(nghttp2_session *session, int32_t stream_id, stream_data *sdata, size_t len)
+{
+    if (!sdata->reject_status) {
+        sdata->body_received += len;
+        uint64_t max_body = request_limits(sdata)->max_body;
+        if (!max_body || sdata->body_received <= max_body) {
+            return false;
+        }
+        if (sdata->handler && sdata->handler->on_request_data) {
+            // A streaming handler may have answered already; all that is left is to stop the stream
+            sdata->reject_status = 413;
+            metrics_add(METRIC_REQUESTS_TOO_LARGE);
+            stream_reset(sdata, NGHTTP2_ENHANCE_YOUR_CALM);
+        } else {
+            // Buffered requests have not reached their handler yet
+            reject(session, stream_id, sdata, 413);
+        }
+    }
+    // Rejected streams still give the window back for what the client had in flight
+    stream_consume(sdata, len);
+    return true;
+}
+
+void request_limit_response_sent(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    // Queued any earlier, RST_STREAM would close the stream before the answer could be sent
+    if (sdata->reject_status && !sdata->request_done) {
+        stream_reset(sdata, NGHTTP2_NO_ERROR);
+    }
+}
@@ -0,0 +1,171 @@
+#include "route.h"
+#include "co_handler.h"
+#include "grpc.h"
+#include "metrics.h"
+#include "middleware.h"
+#include "proxy.h"
+#include "trace.h"
+#include "websocket.h"
+
+namespace
+{
+
+const char kSiteCss[] =
+    "body{margin:0;font-family:-apple-system,Segoe UI,Helvetica,Arial,sans-serif;color:#222}\n"
+    "h1{margin:2em auto;max-width:40em;font-weight:500}\n";
+
+const static_asset kStaticAssets[] = {
+    {"/static/site.css", "text/css", kSiteCss, sizeof(kSiteCss) - 1},
+};
+
+const preload_link kRootPreload[] = {
+    {"/static/site.css", "style"},
+    {NULL, NULL},
+};
+
+// The JSON API has no use for large requests
+const request_limit_policy kApiLimits = {
+    .max_body = 64 * 1024,
+    .max_header_count = 64,
+    .max_header_bytes = 16 * 1024,
+};
+
+// WebSocket and gRPC streams carry messages for as long as they stay open; their own
+// per-message limits apply instead of a total
+const request_limit_policy kStreamLimits = {
+    .max_body = 0,
+    .max_header_count = 128,
+    .max_header_bytes = 64 * 1024,
+};
+
+// Cross-origin access and the bearer token are off until configured (--cors-origin, --api-token)
+RequestHandler api_pipeline_impl = make_pipeline<ResponseMetrics, Cors, BearerAuth>(&api_handler_impl);
+
+// Checked in order; the first match wins
+route_config kRoutes[] = {
+    {"/api", true, &api_pipeline_impl, NULL, false, &kApiLimits, 2.0, std::string()},
+    {"/static/", true, &static_handler_impl, NULL, false, NULL, 0, std::string()},
+    {"/proxy/", true, &proxy_handler_impl, NULL, false, NULL, 0, std::string()},
+    {"/_admin/metrics", false, &metrics_handler_impl, NULL, false, NULL, 0, std::string()},
+    {"/_admin/trace", false, &trace_handler_impl, NULL, false, NULL, 0, std::string()},
+    {"/muduohttp.Echo/", true, &grpc_echo_service_impl, NULL, false, &kStreamLimits, -1, std::string()},
+    {"/ws/echo", false, &websocket_echo_handler_impl, NULL, false, &kStreamLimits, -1, std::string()},
+    {"/ticks", false, &ticks_handler_impl, NULL, false, NULL, -1, std::string()},
+    {"/", false, &root_handler_impl, kRootPreload, true, NULL, 0, std::string()},
+};
+
+bool build_link_headers()
+{
+    for (route_config &route : kRoutes) {
+        for (const preload_link *link = route.preload; link && link->path; ++link) {
+            if (!route.link_header.empty()) {
+                route.link_header += ", ";
+            }
+            route.link_header += "<";
+            route.link_header += link->path;
+            route.link_header += ">; rel=preload; as=";
+            route.link_header += link->as;
+        }
+    }
+    return true;
+}
+
+const bool link_headers_built = build_link_headers();
+
+// Promise a static asset on the parent stream and answer it right away
+void push_asset(nghttp2_session *session, int32_t stream_id, stream_data *parent, const static_asset *asset)
+{
+    const char *authority = parent->authority ? parent->authority : "";
+    const nghttp2_nv request_headers[] = {
+        {(uint8_t*)":method", (uint8_t*)"GET", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":scheme", (uint8_t*)"http", 7, 4, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":authority", (uint8_t*)authority, 10, strlen(authority), NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":path", (uint8_t*)asset->path, 5, strlen(asset->path), NGHTTP2_NV_FLAG_NONE},
+    };
+    int32_t promised_id = nghttp2_submit_push_promise(session, NGHTTP2_FLAG_NONE, stream_id,
+                                                      request_headers, 4, NULL);
+    if (promised_id < 0) {
+        return;
+    }
+    stream_data *pushed = stream_data_new(session, parent->conn, promised_id);
+    if (!pushed) {
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, promised_id, NGHTTP2_INTERNAL_ERROR);
+        return;
+    }
+    pushed->handler = NULL;
+    pushed->accept_encoding = parent->accept_encoding;
+    pushed->response_body = (char *)malloc(asset->len);
+    if (!pushed->response_body) {
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, promised_id, NGHTTP2_INTERNAL_ERROR);
+        return;
+    }
+    memcpy(pushed->response_body, asset->body, asset->len);
+    pushed->response_len = asset->len;
+
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)asset->content_type, 12, strlen(asset->content_type), NGHTTP2_NV_FLAG_NONE}
+    };
+    submit_stream_response(session, promised_id, pushed, headers, 2, asset->path);
+}
+
+} // namespace
+
+const route_config *find_route(const uint8_t *path, size_t len)
+{
+    for (const route_config &route : kRoutes) {
+        size_t route_len = strlen(route.path);
+        if (route.prefix ? (len >= route_len && memcmp(path, route.path, route_len) == 0)
+                         : (len == route_len && memcmp(path, route.path, len) == 0)) {
+            return &route;
+        }
+    }
+    return NULL;
+}
+
+const static_asset *find_static_asset(const char *path, size_t len)
+{
+    // "/static/site.css?v=1" is still site.css
+    const char *cut = (const char *)memchr(path, '?', len);
+    if (cut) {
+        len = cut - path;
+    }
+    cut = (const char *)memchr(path, '#', len);
+    if (cut) {
+        len = cut - path;
+    }
+    for (const static_asset &asset : kStaticAssets) {
+        if (strlen(asset.path) == len && memcmp(asset.path, path, len) == 0) {
+            return &asset;
+        }
+    }
+    return NULL;
+}
+
+int submit_early_hints(stream_data *sdata, const char *link, size_t linklen)
+{
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"103", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"link", (uint8_t*)link, 4, linklen, NGHTTP2_NV_FLAG_NONE}
+    };
+    return stream_submit_info(sdata, headers, 2);
+}
+
+void route_on_request_headers(nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    const route_config *route = sdata->route;
+    if (!route || route->link_header.empty()) {
+        return;
+    }
+    // No push over HTTP/3: browsers never grant MAX_PUSH_ID
+    if (route->push && session && nghttp2_session_get_remote_settings(session, NGHTTP2_SETTINGS_ENABLE_PUSH)) {
+        // Push what we serve ourselves; the hint below still lists every preload
+        for (const preload_link *link = route->preload; link->path; ++link) {
+            const static_asset *asset = find_static_asset(link->path, strlen(link->path));
+            if (asset) {
+                push_asset(session, stream_id, sdata, asset);
+            }
+        }
+    }
+    submit_early_hints(sdata, route->link_header.data(), route->link_header.size());
+}
@@ -0,0 +1,182 @@
+#include "spool.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <muduo/base/Logging.h>
+
+body_spool_policy g_body_spool_policy = {
+    .threshold = 1024 * 1024,
+    .dir = "/tmp",
+    .write_batch = 256 * 1024,
+};
+
+namespace
+{
+
+int open_temp_file()
+{
+    const char *dir = g_body_spool_policy.dir.c_str();
+#ifdef O_TMPFILE
+    int fd = ::open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return fd;
+    }
+#endif
+    // Filesystem without O_TMPFILE: create a named file and unlink it at once
+    std::string path = g_body_spool_policy.dir + "/muduohttp-body-XXXXXX";
+    int fd2 = ::mkostemp(&path[0], O_CLOEXEC);
+    if (fd2 >= 0) {
+        ::unlink(path.c_str());
+    }
+    return fd2;
+}
+
+bool write_all(body_spool *spool, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = ::write(spool->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_SYSERR << "spooling request body";
+            spool->failed = true;
+            return false;
+        }
+        data += n;
+        len -= n;
+        spool->file_len += n;
+    }
+    return true;
+}
+
+bool flush_batch(body_spool *spool)
+{
+    bool ok = write_all(spool, spool->batch, spool->batch_len);
+    spool->batch_len = 0;
+    return ok;
+}
+
+// Move what is buffered in memory so far into a new temp file
+bool start_spool(stream_data *sdata)
+{
+    body_spool *spool = (body_spool *)calloc(1, sizeof(body_spool));
+    if (!spool) {
+        return false;
+    }
+    spool->fd = open_temp_file();
+    spool->batch = (char *)malloc(g_body_spool_policy.write_batch);
+    sdata->spool = spool;
+    if (spool->fd < 0 || !spool->batch) {
+        LOG_SYSERR << "cannot create a temp file for a request body in " << g_body_spool_policy.dir;
+        spool->failed = true;
+        return false;
+    }
+    bool ok = write_all(spool, sdata->body, sdata->body_len);
+    free(sdata->body);
+    sdata->body = NULL;
+    sdata->body_cap = 0;
+    return ok;
+}
+
+} // namespace
+
+bool spool_body_append(stream_data *sdata, const uint8_t *data, size_t len)
+{
+    if (!sdata->spool) {
+        size_t threshold = g_body_spool_policy.threshold;
+        size_t need = sdata->body_len + len;
+        // A declared length past the threshold goes to disk from the first chunk
+        bool fits = threshold == 0 || (need <= threshold && (sdata->content_length < 0 ||
+                                                             (uint64_t)sdata->content_length <= threshold));
+        if (fits) {
+            if (need > sdata->body_cap) {
+                // content-length sizes the buffer once; otherwise it doubles
+                size_t cap = sdata->content_length >= 0 && (uint64_t)sdata->content_length >= need
+                                 ? (size_t)sdata->content_length
+                                 : (need > 2 * sdata->body_cap ? need : 2 * sdata->body_cap);
+                if (threshold && cap > threshold) {
+                    cap = threshold;        // need <= threshold here
+                }
+                char *body = (char *)realloc(sdata->body, cap);
+                if (!body) {
+                    return false;
+                }
+                sdata->body = body;
+                sdata->body_cap = cap;
+            }
+            memcpy(sdata->body + sdata->body_len, data, len);
+            sdata->body_len = need;
+            return true;
+        }
+        if (!start_spool(sdata)) {
+            return false;
+        }
+    }
+    body_spool *spool = sdata->spool;
+    if (spool->failed) {
+        return false;
+    }
+    sdata->body_len += len;
+    size_t batch_size = g_body_spool_policy.write_batch;
+    if (spool->batch_len + len > batch_size) {
+        if (!flush_batch(spool)) {
+            return false;
+        }
+        if (len >= batch_size) {
+            // Larger than a batch by itself: no point copying it first
+            return write_all(spool, (const char *)data, len);
+        }
+    }
+    memcpy(spool->batch + spool->batch_len, data, len);
+    spool->batch_len += len;
+    return true;
+}
+
+bool spool_body_finish(stream_data *sdata)
+{
+    body_spool *spool = sdata->spool;
+    if (!spool) {
+        return true;
+    }
+    if (spool->failed || !flush_batch(spool)) {
+        return false;
+    }
+    free(spool->batch);
+    spool->batch = NULL;
+    // Page cache backs the mapping, so reading it does not grow the heap
+    void *map = ::mmap(NULL, spool->file_len, PROT_READ, MAP_PRIVATE, spool->fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_SYSERR << "mapping a spooled request body";
+        spool->failed = true;
+        return false;
+    }
+    spool->map = map;
+    sdata->body = (char *)map;
+    sdata->body_len = spool->file_len;
+    return true;
+}
+
+int spool_body_fd(const stream_data *sdata)
+{
+    return sdata->spool ? sdata->spool->fd : -1;
+}
+
+void spool_body_free(stream_data *sdata)
+{
+    body_spool *spool = sdata->spool;
+    if (!spool) {
+        return;
+    }
+    if (spool->map) {
+        ::munmap(spool->map, spool->file_len);
+    } else {
+        free(sdata->body);     // Still in memory if the temp file could not be created
+    }
+    if (spool->fd >= 0) {
+        ::close(spool->fd);
+    }
+    free(spool->batch);
+    free(spool);
+    sdata->spool = NULL;
+    sdata->body = NULL;
+}
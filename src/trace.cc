@@ -0,0 +1,249 @@
+#include "trace.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <muduo/base/CurrentThread.h>
+
+#include "metrics.h"
+#include "util.h"
+
+trace_policy g_trace_policy = {
+    .enabled = false,
+    .sample = 100,
+    .ring_records = 1024,
+};
+
+namespace
+{
+
+const size_t kMaxPath = 64;
+
+struct trace_record {
+    uintptr_t conn;             // Groups streams of one connection; only compared
+    int32_t stream_id;
+    uint16_t status;
+    uint16_t path_len;
+    char method[8];
+    char path[kMaxPath];
+    int64_t ns[TRACE_PHASE_COUNT];
+};
+
+// Seqlock: odd while the owning thread rewrites the record
+struct trace_slot {
+    std::atomic<uint32_t> seq;
+    trace_record record;
+};
+
+// Written only by its thread; read by whoever renders the trace
+struct trace_ring {
+    trace_slot *slots;
+    size_t mask;
+    int tid;
+    uint64_t seen;                      // Producer only, for sampling
+    std::atomic<uint64_t> head;         // Records written so far
+};
+
+std::mutex g_rings_mutex;
+std::vector<trace_ring *> g_rings;
+
+thread_local trace_ring *t_ring = NULL;
+
+trace_ring *local_ring()
+{
+    if (!t_ring) {
+        size_t records = 1;
+        while (records < g_trace_policy.ring_records) {
+            records <<= 1;
+        }
+        trace_ring *ring = new trace_ring();
+        ring->slots = new trace_slot[records]();
+        ring->mask = records - 1;
+        ring->tid = muduo::CurrentThread::tid();
+        ring->seen = 0;
+        ring->head.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        g_rings.push_back(ring);
+        t_ring = ring;
+    }
+    return t_ring;
+}
+
+void append_json_string(std::string *out, const char *s, size_t len)
+{
+    out->push_back('"');
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+            out->push_back((char)c);
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof esc, "\\u%04x", c);
+            out->append(esc);
+        } else {
+            out->push_back((char)c);
+        }
+    }
+    out->push_back('"');
+}
+
+// One nestable async begin/end pair; every stream gets its own track in the viewer
+void append_span(std::string *out, const std::string &name, const trace_record &r, int tid, uint64_t id,
+                 int64_t begin_ns, int64_t end_ns, bool args)
+{
+    char buf[256];
+    out->append("{\"name\":");
+    append_json_string(out, name.data(), name.size());
+    snprintf(buf, sizeof buf, ",\"cat\":\"stream\",\"ph\":\"b\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+             (unsigned long long)id, tid, begin_ns / 1000.0);
+    out->append(buf);
+    if (args) {
+        snprintf(buf, sizeof buf, ",\"args\":{\"stream\":%d,\"status\":%u,\"conn\":\"0x%llx\"}",
+                 r.stream_id, (unsigned)r.status, (unsigned long long)r.conn);
+        out->append(buf);
+    }
+    out->append("},\n{\"name\":");
+    append_json_string(out, name.data(), name.size());
+    snprintf(buf, sizeof buf, ",\"cat\":\"stream\",\"ph\":\"e\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%d,\"ts\":%.3f},\n",
+             (unsigned long long)id, tid, end_ns / 1000.0);
+    out->append(buf);
+}
+
+void render_record(std::string *out, const trace_record &r, int tid, uint64_t id)
+{
+    const int64_t *ns = r.ns;
+    int64_t close = ns[TRACE_CLOSE];
+    std::string title = std::string(r.method[0] ? r.method : "-") + " " + std::string(r.path, r.path_len);
+    append_span(out, title, r, tid, id, ns[TRACE_HEADERS], close, true);
+    if (ns[TRACE_REQUEST_END]) {
+        append_span(out, "receive request", r, tid, id, ns[TRACE_HEADERS], ns[TRACE_REQUEST_END], false);
+    }
+    if (ns[TRACE_HANDLER_START] && ns[TRACE_HANDLER_END]) {
+        append_span(out, "handler", r, tid, id, ns[TRACE_HANDLER_START], ns[TRACE_HANDLER_END], false);
+    }
+    int64_t ready = ns[TRACE_HANDLER_END] ? ns[TRACE_HANDLER_END] : ns[TRACE_REQUEST_END];
+    if (ready && ns[TRACE_FIRST_DATA] > ready) {
+        append_span(out, "until first data", r, tid, id, ready, ns[TRACE_FIRST_DATA], false);
+    }
+    if (ns[TRACE_FIRST_DATA]) {
+        append_span(out, "send response", r, tid, id, ns[TRACE_FIRST_DATA], close, false);
+    }
+}
+
+void trace_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (!is_admin_client(sdata->conn)) {
+        const nghttp2_nv headers[] = {
+            {(uint8_t*)":status", (uint8_t*)"404", 7, 3, NGHTTP2_NV_FLAG_NONE}
+        };
+        submit_response_headers(session, sdata, headers, 1, NULL);
+        return;
+    }
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)"application/json", 12, 16, NGHTTP2_NV_FLAG_NONE}
+    };
+    std::string report = trace_render();
+    char *response_body = (char *)malloc(report.size());
+    if (!response_body) {
+        return;
+    }
+    memcpy(response_body, report.data(), report.size());
+    sdata->response_body = response_body;
+    sdata->response_len = report.size();
+    sdata->response_offset = 0;
+    submit_stream_response(session, stream_id, sdata, headers, 2, NULL);
+}
+
+} // namespace
+
+void trace_stream_begin(stream_data *sdata)
+{
+    if (!g_trace_policy.enabled) {
+        return;
+    }
+    trace_ring *ring = local_ring();
+    if (ring->seen++ % g_trace_policy.sample != 0) {
+        return;
+    }
+    sdata->trace.on = true;
+    trace_stamp(&sdata->trace, TRACE_HEADERS);
+}
+
+void trace_stream_end(stream_data *sdata)
+{
+    if (!sdata->trace.on) {
+        return;
+    }
+    trace_stamp(&sdata->trace, TRACE_CLOSE);
+    trace_ring *ring = local_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    trace_slot &slot = ring->slots[head & ring->mask];
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    trace_record &r = slot.record;
+    r.conn = (uintptr_t)sdata->conn;
+    r.stream_id = sdata->stream_id;
+    r.status = sdata->status;
+    memcpy(r.method, sdata->method, sizeof r.method);
+    size_t path_len = sdata->path ? strlen(sdata->path) : 0;
+    r.path_len = (uint16_t)(path_len < kMaxPath ? path_len : kMaxPath);
+    if (r.path_len) {
+        memcpy(r.path, sdata->path, r.path_len);
+    }
+    memcpy(r.ns, sdata->trace.ns, sizeof r.ns);
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string trace_render()
+{
+    std::vector<trace_ring *> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        rings = g_rings;
+    }
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char buf[128];
+    for (size_t index = 0; index < rings.size(); ++index) {
+        trace_ring *ring = rings[index];
+        snprintf(buf, sizeof buf, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"io-%zu\"}},\n",
+                 ring->tid, index);
+        out.append(buf);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = head > ring->mask ? head - ring->mask - 1 : 0;
+        for (uint64_t i = begin; i < head; ++i) {
+            trace_slot &slot = ring->slots[i & ring->mask];
+            uint32_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                continue;
+            }
+            trace_record r;
+            memcpy(&r, &slot.record, sizeof r);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != seq) {
+                continue;   // Overwritten while we copied it
+            }
+            render_record(&out, r, ring->tid, ((uint64_t)index << 48) | i);
+        }
+    }
+    // The viewer rejects a trailing comma
+    if (out.size() >= 2 && out.compare(out.size() - 2, 2, ",\n") == 0) {
+        out.resize(out.size() - 2);
+        out.push_back('\n');
+    }
+    out.append("]}\n");
+    return out;
+}
+
+RequestHandler trace_handler_impl = {
+    .handle_request = trace_request_handler,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
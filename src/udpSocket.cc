@@ -0,0 +1,317 @@
+#include "udpSocket.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <muduo/base/Logging.h>
+
+namespace
+{
+
+const int kBatch = 16;
+// Largest GRO train the kernel hands up in one read
+const size_t kRecvBufferSize = 65536;
+const size_t kControlSize = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct in6_pktinfo));
+const int kSocketBuffer = 4 * 1024 * 1024;
+
+socklen_t sockaddr_len(const struct sockaddr *sa)
+{
+    return sa->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+muduo::net::InetAddress bound_address(int fd)
+{
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof addr);
+    socklen_t len = sizeof addr;
+    ::getsockname(fd, (struct sockaddr *)&addr, &len);
+    return muduo::net::InetAddress(addr);
+}
+
+bool is_wildcard(const muduo::net::InetAddress& addr)
+{
+    const struct sockaddr *sa = addr.getSockAddr();
+    if (sa->sa_family == AF_INET) {
+        return ((const struct sockaddr_in *)sa)->sin_addr.s_addr == htonl(INADDR_ANY);
+    }
+    return IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+// The local address a datagram was sent to, from its IP_PKTINFO / IPV6_PKTINFO
+bool packet_destination(struct msghdr *msg, const muduo::net::InetAddress& bound, muduo::net::InetAddress *local,
+                        size_t *segment)
+{
+    bool found = false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef UDP_GRO
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+            *segment = (size_t)size;
+            continue;
+        }
+#endif
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof info);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(bound.port());
+            addr.sin_addr = info.ipi_addr;
+            *local = muduo::net::InetAddress(addr);
+            found = true;
+        } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof info);
+            struct sockaddr_in6 addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = htons(bound.port());
+            addr.sin6_addr = info.ipi6_addr;
+            *local = muduo::net::InetAddress(addr);
+            found = true;
+        }
+    }
+    return found;
+}
+
+} // namespace
+
+int UdpSocket::bind(const muduo::net::InetAddress& addr, bool reusePort)
+{
+    int family = addr.family();
+    int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0) {
+        LOG_SYSFATAL << "UdpSocket::bind";
+    }
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (reusePort) {
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on);
+    }
+    if (family == AF_INET6) {
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof on);
+    } else {
+        ::setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof on);
+    }
+#ifdef UDP_GRO
+    // Older kernels refuse it; we then just get one datagram per read
+    ::setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof on);
+#endif
+    // Bursts of a few hundred packets arrive between two loop iterations
+    int size = kSocketBuffer;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    if (::bind(fd, addr.getSockAddr(), sockaddr_len(addr.getSockAddr())) < 0) {
+        LOG_SYSFATAL << "UdpSocket::bind " << addr.toIpPort();
+    }
+    return fd;
+}
+
+UdpSocket::UdpSocket(int fd)
+    : _fd(fd),
+      _gso(false),
+      _wildcard(is_wildcard(bound_address(fd))),
+      _recvBuffers(kBatch * kRecvBufferSize),
+      _sent(0)
+{
+#ifdef UDP_SEGMENT
+    int value = 0;
+    socklen_t len = sizeof value;
+    _gso = ::getsockopt(fd, SOL_UDP, UDP_SEGMENT, &value, &len) == 0;
+#endif
+}
+
+UdpSocket::~UdpSocket()
+{
+    close();
+}
+
+void UdpSocket::close()
+{
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _pending.clear();
+    _sent = 0;
+}
+
+size_t UdpSocket::receive(const PacketCallback& cb, int maxBatches)
+{
+    muduo::net::InetAddress bound = bound_address(_fd);
+    struct mmsghdr msgs[kBatch];
+    struct iovec iovs[kBatch];
+    struct sockaddr_in6 peers[kBatch];
+    char controls[kBatch][kControlSize];
+    size_t count = 0;
+    for (int batch = 0; batch < maxBatches; ++batch) {
+        memset(msgs, 0, sizeof msgs);
+        for (int i = 0; i < kBatch; ++i) {
+            iovs[i].iov_base = &_recvBuffers[i * kRecvBufferSize];
+            iovs[i].iov_len = kRecvBufferSize;
+            msgs[i].msg_hdr.msg_name = &peers[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof peers[i];
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = kControlSize;
+        }
+        int n = ::recvmmsg(_fd, msgs, kBatch, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_SYSERR << "UdpSocket::receive";
+            }
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (msgs[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+                continue;
+            }
+            size_t len = msgs[i].msg_len;
+            size_t segment = len;
+            muduo::net::InetAddress local = bound;
+            packet_destination(&msgs[i].msg_hdr, bound, &local, &segment);
+            muduo::net::InetAddress peer(peers[i]);
+            const uint8_t *data = (const uint8_t *)iovs[i].iov_base;
+            for (size_t offset = 0; offset < len; offset += segment) {
+                cb(data + offset, std::min(segment, len - offset), peer, local);
+                ++count;
+            }
+        }
+        if (n < kBatch) {
+            break;
+        }
+    }
+    return count;
+}
+
+void UdpSocket::send(const muduo::net::InetAddress& peer, const muduo::net::InetAddress& local,
+                     const uint8_t* data, size_t len, size_t segmentSize)
+{
+    Outgoing out;
+    out.peer = peer;
+    out.local = local;
+    out.hasLocal = local.getSockAddr()->sa_family == peer.getSockAddr()->sa_family && !is_wildcard(local);
+    out.data.assign((const char *)data, len);
+    out.segmentSize = segmentSize < len ? segmentSize : 0;
+    _pending.push_back(std::move(out));
+    if (!_gso && _pending.back().segmentSize) {
+        splitTrain(_pending.size() - 1);
+    }
+}
+
+void UdpSocket::splitTrain(size_t index)
+{
+    Outgoing train = std::move(_pending[index]);
+    std::vector<Outgoing> parts;
+    for (size_t offset = 0; offset < train.data.size(); offset += train.segmentSize) {
+        Outgoing part;
+        part.peer = train.peer;
+        part.local = train.local;
+        part.hasLocal = train.hasLocal;
+        part.data = train.data.substr(offset, train.segmentSize);
+        part.segmentSize = 0;
+        parts.push_back(std::move(part));
+    }
+    _pending.erase(_pending.begin() + index);
+    _pending.insert(_pending.begin() + index, std::make_move_iterator(parts.begin()),
+                    std::make_move_iterator(parts.end()));
+}
+
+bool UdpSocket::flush()
+{
+    struct mmsghdr msgs[kBatch];
+    struct iovec iovs[kBatch];
+    char controls[kBatch][kControlSize];
+    while (_sent < _pending.size()) {
+        size_t batch = std::min((size_t)kBatch, _pending.size() - _sent);
+        memset(msgs, 0, sizeof msgs);
+        memset(controls, 0, sizeof controls);
+        for (size_t i = 0; i < batch; ++i) {
+            Outgoing& out = _pending[_sent + i];
+            iovs[i].iov_base = &out.data[0];
+            iovs[i].iov_len = out.data.size();
+            struct msghdr& hdr = msgs[i].msg_hdr;
+            hdr.msg_name = (void *)out.peer.getSockAddr();
+            hdr.msg_namelen = sockaddr_len(out.peer.getSockAddr());
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = controls[i];
+            hdr.msg_controllen = kControlSize;
+            size_t controlLen = 0;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+#ifdef UDP_SEGMENT
+            if (out.segmentSize) {
+                uint16_t segment = (uint16_t)out.segmentSize;
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof segment);
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof segment);
+                controlLen += CMSG_SPACE(sizeof segment);
+                cmsg = (struct cmsghdr *)((char *)cmsg + CMSG_SPACE(sizeof segment));
+            }
+#endif
+            if (_wildcard && out.hasLocal) {
+                const struct sockaddr *sa = out.local.getSockAddr();
+                if (sa->sa_family == AF_INET) {
+                    struct in_pktinfo info;
+                    memset(&info, 0, sizeof info);
+                    info.ipi_spec_dst = ((const struct sockaddr_in *)sa)->sin_addr;
+                    cmsg->cmsg_level = IPPROTO_IP;
+                    cmsg->cmsg_type = IP_PKTINFO;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof info);
+                    memcpy(CMSG_DATA(cmsg), &info, sizeof info);
+                    controlLen += CMSG_SPACE(sizeof info);
+                } else {
+                    struct in6_pktinfo info;
+                    memset(&info, 0, sizeof info);
+                    info.ipi6_addr = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+                    cmsg->cmsg_level = IPPROTO_IPV6;
+                    cmsg->cmsg_type = IPV6_PKTINFO;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof info);
+                    memcpy(CMSG_DATA(cmsg), &info, sizeof info);
+                    controlLen += CMSG_SPACE(sizeof info);
+                }
+            }
+            hdr.msg_controllen = controlLen;
+            if (controlLen == 0) {
+                hdr.msg_control = NULL;
+            }
+        }
+        int n = ::sendmmsg(_fd, msgs, (unsigned)batch, MSG_DONTWAIT);
+        if (n >= 0) {
+            _sent += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            _pending.erase(_pending.begin(), _pending.begin() + _sent);
+            _sent = 0;
+            return false;
+        }
+        if (errno == EIO && _gso && _pending[_sent].segmentSize) {
+            // The device cannot segment; every later train is split up front
+            LOG_WARN << "UDP GSO unsupported on this path, sending datagrams one by one";
+            _gso = false;
+            for (size_t i = _sent; i < _pending.size(); ++i) {
+                if (_pending[i].segmentSize) {
+                    splitTrain(i);
+                }
+            }
+            continue;
+        }
+        // Unreachable peer and the like: QUIC recovers from the loss, drop the datagram
+        LOG_SYSERR << "UdpSocket::flush to " << _pending[_sent].peer.toIpPort();
+        ++_sent;
+    }
+    _pending.clear();
+    _sent = 0;
+    return true;
+}
@@ -0,0 +1,284 @@
+#include "uring.h"
+
+#ifdef MUDUOHTTP_HAVE_IO_URING
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <muduo/base/Logging.h>
+
+namespace
+{
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+} // namespace
+
+Uring::Uring(unsigned entries)
+    : _fd(-1),
+      _sqEntries(0),
+      _sqRing(MAP_FAILED),
+      _sqRingSize(0),
+      _cqRing(MAP_FAILED),
+      _cqRingSize(0),
+      _sqes(NULL),
+      _sqesSize(0),
+      _sqeTail(0),
+      _sqeSubmitted(0),
+      _bufRing(NULL),
+      _bufRingSize(0),
+      _bufMask(0),
+      _bufTail(0),
+      _bufBase(NULL),
+      _bufSize(0),
+      _bgid(0)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // Multishot recv on many connections completes in bursts; leave room before overflow
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = entries * 4;
+    _fd = sys_io_uring_setup(entries, &p);
+    if (_fd < 0 && errno == EINVAL) {
+        p.flags &= ~IORING_SETUP_SINGLE_ISSUER;
+        _fd = sys_io_uring_setup(entries, &p);
+    }
+    if (_fd < 0) {
+        LOG_SYSERR << "io_uring_setup";
+        return;
+    }
+    _sqEntries = p.sq_entries;
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        _sqRingSize = _cqRingSize = _sqRingSize > _cqRingSize ? _sqRingSize : _cqRingSize;
+    }
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    _cqRing = single ? _sqRing
+                     : mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        LOG_SYSERR << "io_uring mmap";
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, _sqesSize);
+        }
+        _sqes = NULL;
+        ::close(_fd);
+        _fd = -1;
+        return;
+    }
+    _sqes = (struct io_uring_sqe *)sqes;
+
+    char *sq = (char *)_sqRing;
+    _sqHead = (unsigned *)(sq + p.sq_off.head);
+    _sqTail = (unsigned *)(sq + p.sq_off.tail);
+    _sqFlags = (unsigned *)(sq + p.sq_off.flags);
+    _sqArray = (unsigned *)(sq + p.sq_off.array);
+    _sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    _sqeTail = _sqeSubmitted = *_sqTail;
+
+    char *cq = (char *)_cqRing;
+    _cqHead = (unsigned *)(cq + p.cq_off.head);
+    _cqTail = (unsigned *)(cq + p.cq_off.tail);
+    _cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+    if (_bufRing) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof reg);
+        reg.bgid = _bgid;
+        sys_io_uring_register(_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(_bufRing, _bufRingSize);
+        free(_bufBase);
+    }
+    if (_sqes) {
+        munmap(_sqes, _sqesSize);
+    }
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing) {
+        munmap(_cqRing, _cqRingSize);
+    }
+    if (_sqRing != MAP_FAILED) {
+        munmap(_sqRing, _sqRingSize);
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+bool Uring::sqFull() const
+{
+    return _sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries;
+}
+
+struct io_uring_sqe *Uring::getSqe()
+{
+    if (sqFull()) {
+        // Let the kernel take what is queued. It refuses (EBUSY) while completions it could not
+        // post are waiting, and only the caller can reap those, so one try is all it gets.
+        int rv = submit();
+        if (sqFull()) {
+            if (rv < 0 && rv != -EBUSY && rv != -EAGAIN) {
+                errno = -rv;
+                LOG_SYSERR << "io_uring submit";
+            }
+            return NULL;
+        }
+    }
+    unsigned index = _sqeTail & _sqMask;
+    struct io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    _sqArray[index] = index;
+    ++_sqeTail;
+    return sqe;
+}
+
+int Uring::submit()
+{
+    unsigned pending = _sqeTail - _sqeSubmitted;
+    if (pending == 0) {
+        return 0;
+    }
+    __atomic_store_n(_sqTail, _sqeTail, __ATOMIC_RELEASE);
+    int rv = sys_io_uring_enter(_fd, pending, 0, 0);
+    if (rv < 0) {
+        return -errno;
+    }
+    _sqeSubmitted += rv;
+    return rv;
+}
+
+int Uring::submitAndWait()
+{
+    __atomic_store_n(_sqTail, _sqeTail, __ATOMIC_RELEASE);
+    int rv = sys_io_uring_enter(_fd, _sqeTail - _sqeSubmitted, 1, IORING_ENTER_GETEVENTS);
+    if (rv < 0) {
+        return -errno;
+    }
+    _sqeSubmitted += rv;
+    return rv;
+}
+
+bool Uring::cqOverflowed() const
+{
+    return __atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW;
+}
+
+void Uring::flushOverflow()
+{
+    // The kernel kept the completions that did not fit; entering with GETEVENTS moves them over
+    sys_io_uring_enter(_fd, 0, 0, IORING_ENTER_GETEVENTS);
+}
+
+bool Uring::setupBufferRing(uint16_t bgid, unsigned entries, size_t bufSize)
+{
+    _bufRingSize = entries * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, _bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    if (posix_memalign((void **)&_bufBase, 4096, entries * bufSize) != 0) {
+        munmap(ring, _bufRingSize);
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LOG_SYSERR << "IORING_REGISTER_PBUF_RING";
+        munmap(ring, _bufRingSize);
+        free(_bufBase);
+        _bufBase = NULL;
+        return false;
+    }
+    // Indexed as a plain array: in C++ the header's flexible array member does not start at offset 0
+    _bufRing = (struct io_uring_buf *)ring;
+    _bufMask = entries - 1;
+    _bufSize = bufSize;
+    _bgid = bgid;
+    _bufTail = 0;
+    for (unsigned i = 0; i < entries; ++i) {
+        recycleBuffer((uint16_t)i);
+    }
+    return true;
+}
+
+void Uring::recycleBuffer(uint16_t bid)
+{
+    struct io_uring_buf *buf = &_bufRing[_bufTail & _bufMask];
+    buf->addr = (uint64_t)(uintptr_t)buffer(bid);
+    buf->len = (uint32_t)_bufSize;
+    buf->bid = bid;
+    ++_bufTail;
+    __atomic_store_n(&_bufRing[0].resv, _bufTail, __ATOMIC_RELEASE);
+}
+
+namespace
+{
+
+// Buffer rings came in 5.19 but multishot recv only in 6.0, where 5.19 fails every such recv
+// with EINVAL; so actually receive a byte through one
+bool probe_multishot_recv(Uring *ring)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return false;
+    }
+    bool ok = false;
+    struct io_uring_sqe *sqe = ring->getSqe();
+    if (sqe && ::write(fds[1], "x", 1) == 1) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = 1;
+        if (ring->submitAndWait() >= 0) {
+            ring->reap([&ok](const struct io_uring_cqe &cqe) {
+                if (cqe.user_data == 1 && cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                    ok = true;
+                }
+            });
+        }
+    }
+    // Closing both ends completes the recv still armed; the ring goes away with it
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return ok;
+}
+
+} // namespace
+
+bool Uring::supported()
+{
+    static int cached = -1;
+    if (cached < 0) {
+        Uring ring(8);
+        cached = ring.ok() && ring.setupBufferRing(0, 8, 4096) && probe_multishot_recv(&ring);
+    }
+    return cached == 1;
+}
+
+#endif
@@ -0,0 +1,469 @@
+#include "uringTransport.h"
+
+#ifdef MUDUOHTTP_HAVE_IO_URING
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <muduo/base/Logging.h>
+
+#include "http2Session.h"
+
+namespace
+{
+
+const unsigned kRingEntries = 256;
+// Provided buffers shared by every connection of the loop: 4MB of receive space
+const uint16_t kBufferGroup = 0;
+const unsigned kBufferCount = 256;
+const size_t kBufferSize = 16 * 1024;
+// Back off before accepting again when out of descriptors
+const double kAcceptRetryDelay = 0.1;
+// Fallback for SQEs the full ring refused, should no completion arrive to retry them sooner
+const double kStallRetryDelay = 0.01;
+
+const int kOpBits = 3;
+
+uint64_t user_data(uint64_t id, int op)
+{
+    return (id << kOpBits) | (uint64_t)op;
+}
+
+} // namespace
+
+struct UringTransport::Conn
+{
+    uint64_t id;
+    int fd;
+    muduo::net::InetAddress peer;
+    muduo::net::Buffer output;      // nghttp2 appends frames here
+    muduo::net::Buffer sending;     // Bytes owned by the send in flight
+    all_data *session;
+    bool recvArmed;
+    bool sendInFlight;
+    bool shutdownPending;           // Close once the queued output (e.g. GOAWAY) is sent; input is ignored
+    bool closing;
+};
+
+UringTransport::UringTransport(muduo::net::EventLoop* loop)
+    : _loop(loop),
+      _ring(kRingEntries),
+      _buffersReady(false),
+      _channel(loop, _ring.fd()),
+      _accepting(false),
+      _cancelPending(false),
+      _draining(false),
+      _nextId(1)
+{
+    _loop->assertInLoopThread();
+    if (!_ring.ok()) {
+        return;
+    }
+    _buffersReady = _ring.setupBufferRing(kBufferGroup, kBufferCount, kBufferSize);
+    // The ring fd polls readable while completions wait; level triggered, so nothing is missed
+    _channel.setReadCallback(std::bind(&UringTransport::handleRead, this));
+    _channel.enableReading();
+}
+
+UringTransport::~UringTransport()
+{
+    _loop->assertInLoopThread();
+    for (auto& item : _conns) {
+        const ConnPtr& conn = item.second;
+        if (conn->session) {
+            http2_session_destroy(conn->session);
+            conn->session = NULL;
+        }
+        ::close(conn->fd);
+    }
+    _conns.clear();
+    if (!_acceptsToRetry.empty()) {
+        _loop->cancel(_acceptRetry);
+    }
+    if (!_stalled.empty()) {
+        _loop->cancel(_stallRetry);
+    }
+    if (_ring.ok()) {
+        _channel.disableAll();
+        _channel.remove();
+    }
+    // Operations still in flight die with the ring
+}
+
+void UringTransport::accept(int listenfd)
+{
+    _loop->assertInLoopThread();
+    _accepting = true;
+    _listenFds.push_back(listenfd);
+    armAccept(_listenFds.size() - 1);
+    _ring.submit();
+}
+
+void UringTransport::stopAccepting()
+{
+    _loop->assertInLoopThread();
+    if (!_accepting) {
+        return;
+    }
+    _accepting = false;
+    cancelAccepts();
+    _ring.submit();
+}
+
+void UringTransport::cancelAccepts()
+{
+    _cancelPending = false;
+    for (size_t i = 0; i < _listenFds.size(); ++i) {
+        struct io_uring_sqe *sqe = _ring.getSqe();
+        if (!sqe) {
+            // Sent again in full after the next reap; cancelling twice does no harm
+            _cancelPending = true;
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = user_data(i, OP_ACCEPT);
+        sqe->user_data = user_data(0, OP_CANCEL);
+    }
+}
+
+void UringTransport::goawayAll()
+{
+    _loop->assertInLoopThread();
+    _draining = true;
+    for (auto& item : _conns) {
+        const ConnPtr& conn = item.second;
+        if (conn->session) {
+            http2_session_goaway(conn->session);
+            flush(conn);
+        }
+    }
+    _ring.submit();
+}
+
+void UringTransport::handleRead()
+{
+    _ring.reap([this](const struct io_uring_cqe& cqe) {
+        handleCompletion(cqe.user_data, cqe.res, cqe.flags);
+    });
+    // The completion queue has room again, so the kernel takes submissions
+    _ring.submit();
+    resumeStalled();
+    _ring.submit();
+}
+
+void UringTransport::handleCompletion(uint64_t userData, int res, uint32_t flags)
+{
+    int op = (int)(userData & ((1 << kOpBits) - 1));
+    uint64_t id = userData >> kOpBits;
+    if (op == OP_ACCEPT) {
+        onAccept(id, res, flags);
+        return;
+    }
+    if (op == OP_CANCEL) {
+        return;
+    }
+    auto it = _conns.find(id);
+    if (it == _conns.end()) {
+        // Only possible for a provided buffer of a connection already gone
+        if (flags & IORING_CQE_F_BUFFER) {
+            _ring.recycleBuffer((uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        return;
+    }
+    ConnPtr conn = it->second;
+    if (op == OP_RECV) {
+        onRecv(conn, res, flags);
+    } else if (op == OP_SEND) {
+        onSend(conn, res);
+    }
+}
+
+void UringTransport::armAccept(size_t index)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    if (!sqe) {
+        retryAcceptLater(index);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = _listenFds[index];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data(index, OP_ACCEPT);
+}
+
+void UringTransport::onAccept(size_t index, int res, uint32_t flags)
+{
+    bool more = flags & IORING_CQE_F_MORE;
+    if (res >= 0) {
+        int fd = res;
+        struct sockaddr_in6 addr;
+        socklen_t addrlen = sizeof addr;
+        memset(&addr, 0, sizeof addr);
+        ::getpeername(fd, (struct sockaddr *)&addr, &addrlen);
+        // Frames are written whole by nghttp2; nothing gains from Nagle here
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+        ConnPtr conn(new Conn());
+        conn->id = _nextId++;
+        conn->fd = fd;
+        conn->peer = muduo::net::InetAddress(addr);
+        conn->recvArmed = false;
+        conn->sendInFlight = false;
+        conn->shutdownPending = false;
+        conn->closing = false;
+        std::weak_ptr<Conn> weak(conn);
+        conn->session = http2_session_create_on(_loop, conn->peer, &conn->output,
+                                                [this, weak]() { sendSoon(weak); });
+        _conns[conn->id] = conn;
+        if (_openCallback) {
+            _openCallback();
+        }
+        armRecv(conn);
+        if (_draining) {
+            // Accepted just before the accepts were cancelled
+            http2_session_goaway(conn->session);
+        }
+        nghttp2_session_send(conn->session->session);
+        flush(conn);
+    } else if (res == -ECANCELED) {
+        return;
+    } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+        errno = -res;
+        LOG_SYSERR << "io_uring accept";
+        if (!more && (res == -EMFILE || res == -ENFILE) && _accepting) {
+            retryAcceptLater(index);
+            return;
+        }
+    }
+    if (!more && _accepting) {
+        armAccept(index);
+    }
+}
+
+void UringTransport::retryAcceptLater(size_t index)
+{
+    if (_acceptsToRetry.empty()) {
+        _acceptRetry = _loop->runAfter(kAcceptRetryDelay, std::bind(&UringTransport::retryAccepts, this));
+    }
+    _acceptsToRetry.push_back(index);
+}
+
+void UringTransport::retryAccepts()
+{
+    std::vector<size_t> indexes;
+    indexes.swap(_acceptsToRetry);
+    if (!_accepting) {
+        return;
+    }
+    for (size_t index : indexes) {
+        armAccept(index);
+    }
+    _ring.submit();
+}
+
+void UringTransport::armRecv(const ConnPtr& conn)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    if (!sqe) {
+        stall(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = user_data(conn->id, OP_RECV);
+    conn->recvArmed = true;
+}
+
+void UringTransport::onRecv(const ConnPtr& conn, int res, uint32_t flags)
+{
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn->recvArmed = false;
+    }
+    if (res > 0) {
+        uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        int rv = 0;
+        if (conn->session && !conn->shutdownPending) {
+            // The provided buffer being read, and the frames still owned by the send in flight
+            size_t held = kBufferSize + conn->sending.internalCapacity();
+            rv = http2_session_on_bytes(conn->session, (const uint8_t *)_ring.buffer(bid), res, held);
+        }
+        // nghttp2 keeps nothing pointing into the buffer, so it can go back right away
+        _ring.recycleBuffer(bid);
+        if (rv < 0) {
+            LOG_ERROR << "Error processing HTTP/2 data: " << nghttp2_strerror(rv);
+            http2_session_fail(conn->session);
+            shutdown(conn);
+        } else {
+            flush(conn);
+        }
+    } else if (res == -ENOBUFS) {
+        // Every buffer was in use; they are recycled by now
+    } else if (res == 0) {
+        // EOF: the peer may still read what is queued for it
+        shutdown(conn);
+    } else {
+        // A socket error; nothing more gets through
+        beginClose(conn);
+    }
+    if (!conn->recvArmed) {
+        if (conn->closing) {
+            releaseIfIdle(conn);
+        } else if (!conn->shutdownPending) {
+            armRecv(conn);
+        }
+    }
+}
+
+void UringTransport::flush(const ConnPtr& conn)
+{
+    if (conn->sendInFlight || conn->closing) {
+        return;
+    }
+    if (conn->sending.readableBytes() == 0) {
+        if (conn->output.readableBytes() == 0) {
+            if (conn->shutdownPending || (conn->session && http2_session_finished(conn->session))) {
+                // GOAWAY went out and the last stream is done
+                beginClose(conn);
+                // With no recv armed (EOF) nothing else completes to release it
+                releaseIfIdle(conn);
+            }
+            return;
+        }
+        conn->sending.swap(conn->output);
+    }
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    if (!sqe) {
+        stall(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->sending.peek();
+    sqe->len = (uint32_t)conn->sending.readableBytes();
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(conn->id, OP_SEND);
+    conn->sendInFlight = true;
+}
+
+void UringTransport::onSend(const ConnPtr& conn, int res)
+{
+    conn->sendInFlight = false;
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET) {
+            errno = -res;
+            LOG_SYSERR << "io_uring send";
+        }
+        conn->sending.retrieveAll();
+        beginClose(conn);
+        releaseIfIdle(conn);
+        return;
+    }
+    conn->sending.retrieve(res);
+    if (conn->closing) {
+        releaseIfIdle(conn);
+        return;
+    }
+    // Partial sends continue from where the kernel stopped, then whatever queued up meanwhile
+    flush(conn);
+}
+
+void UringTransport::sendSoon(const std::weak_ptr<Conn>& weak)
+{
+    _loop->queueInLoop([this, weak]() {
+        ConnPtr conn = weak.lock();
+        if (!conn || !conn->session) {
+            return;
+        }
+        conn->session->conn_data->send_scheduled = false;
+        nghttp2_session_send(conn->session->session);
+        flush(conn);
+        _ring.submit();
+    });
+}
+
+void UringTransport::stall(const ConnPtr& conn)
+{
+    if (_stalled.empty()) {
+        _stallRetry = _loop->runAfter(kStallRetryDelay, [this]() {
+            resumeStalled();
+            _ring.submit();
+        });
+    }
+    _stalled.push_back(conn);
+}
+
+void UringTransport::resumeStalled()
+{
+    if (_cancelPending) {
+        cancelAccepts();
+    }
+    if (_stalled.empty()) {
+        return;
+    }
+    _loop->cancel(_stallRetry);
+    // Whatever finds the ring full again lands back in _stalled
+    std::vector<ConnPtr> stalled;
+    stalled.swap(_stalled);
+    for (const ConnPtr& conn : stalled) {
+        if (conn->closing) {
+            releaseIfIdle(conn);
+            continue;
+        }
+        if (!conn->recvArmed && !conn->shutdownPending) {
+            armRecv(conn);
+        }
+        flush(conn);
+    }
+}
+
+void UringTransport::shutdown(const ConnPtr& conn)
+{
+    // As TcpConnection::shutdown() on the epoll path: what the session still has queued, such
+    // as the GOAWAY for a protocol error, is sent before the connection closes
+    if (conn->shutdownPending || conn->closing) {
+        return;
+    }
+    conn->shutdownPending = true;
+    if (conn->session) {
+        nghttp2_session_send(conn->session->session);
+    }
+    flush(conn);
+}
+
+void UringTransport::beginClose(const ConnPtr& conn)
+{
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    if (conn->session) {
+        http2_session_destroy(conn->session);
+        conn->session = NULL;
+    }
+    // Completes the outstanding recv (and any send) so the descriptor can be closed
+    ::shutdown(conn->fd, SHUT_RDWR);
+}
+
+void UringTransport::releaseIfIdle(const ConnPtr& conn)
+{
+    if (conn->recvArmed || conn->sendInFlight || conn->fd < 0) {
+        return;
+    }
+    ::close(conn->fd);
+    conn->fd = -1;
+    _conns.erase(conn->id);
+    if (_closeCallback) {
+        _closeCallback();
+    }
+}
+
+#endif
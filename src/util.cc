@@ -1,6 +1,21 @@
 #include "util.h"
 #include <dirent.h>
 #include <iostream>
+#include <vector>
+
+#include "accesslog.h"
+#include "cancel.h"
+#include "compress.h"
+#include "deadline.h"
+#include "http3Server.hpp"
+#include "loop_handler.h"
+#include "membudget.h"
+#include "middleware.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "reqlimit.h"
+#include "route.h"
+#include "spool.h"
 
 // http/2相关
 
@@ -15,59 +30,29 @@ void default_request_handler(RequestHandler *self,
         {(uint8_t*)"content-type", (uint8_t*)"text/plain", 12, 10, NGHTTP2_NV_FLAG_NONE}
     };
     
-    // Prepare response body: headers + body
-    const char *header_prefix = "Headers:\n";
-    const char *separator = "\n\nBody:\n";
-    
-    // Calculate lengths
-    size_t header_prefix_len = strlen(header_prefix);
-    size_t separator_len = strlen(separator);
-    size_t headers_len = sdata->headers ? sdata->headers_len - 1 : 0; // exclude null terminator
-    size_t body_len = sdata->body ? sdata->body_len : 0;
-    
-    // Total response length (without null terminator)
-    size_t response_len = header_prefix_len + headers_len + separator_len + body_len;
-    
-    // Allocate memory for response body (plus null terminator)
-    char *response_body = (char *)malloc(response_len + 1);
-    if (!response_body) {
+    // Response body: prefix + headers + separator + body. The collected headers and body
+    // are referenced, not copied, so a large upload is not duplicated in memory.
+    body_chain *chain = body_chain_new();
+    if (!chain) {
         return;
     }
-    
-    char *ptr = response_body;
-    
-    // Build response body manually
+    bool ok = true;
     if (sdata->headers) {
-        memcpy(ptr, header_prefix, header_prefix_len);
-        ptr += header_prefix_len;
-        
-        memcpy(ptr, sdata->headers, headers_len);
-        ptr += headers_len;
+        ok = ok && body_chain_append(chain, "Headers:\n", 9, SEGMENT_STATIC);
+        ok = ok && body_chain_append(chain, sdata->headers, sdata->headers_len - 1, SEGMENT_BORROWED); // exclude null terminator
     }
-    
-    memcpy(ptr, separator, separator_len);
-    ptr += separator_len;
-    
+    ok = ok && body_chain_append(chain, "\n\nBody:\n", 8, SEGMENT_STATIC);
     if (sdata->body) {
-        memcpy(ptr, sdata->body, body_len);
-        ptr += body_len;
+        ok = ok && body_chain_append(chain, sdata->body, sdata->body_len, SEGMENT_BORROWED);
     }
-    
-    // Add null terminator
-    *ptr = '\0';
-    
-    // Set response fields (preserve request body)
-    sdata->response_body = response_body;
-    sdata->response_len = response_len;  // length without null terminator
-    sdata->response_offset = 0;
-    
-    // Prepare data provider
-    nghttp2_data_provider data_prd;
-    data_prd.source.ptr = sdata;
-    data_prd.read_callback = data_read_callback;
+    if (!ok) {
+        body_chain_free(chain);
+        return;
+    }
+    sdata->response_chain = chain;
     
     // Submit response
-    nghttp2_submit_response(session, stream_id, headers, 2, &data_prd);
+    submit_stream_response(session, stream_id, sdata, headers, 2, NULL);
 }
 
 // API request handler implementation
@@ -97,13 +82,8 @@ void api_request_handler(RequestHandler *self,
     sdata->response_len = json_len;
     sdata->response_offset = 0;
     
-    // Prepare data provider
-    nghttp2_data_provider data_prd;
-    data_prd.source.ptr= sdata;
-    data_prd.read_callback = data_read_callback;
-    
-    // Submit response
-    nghttp2_submit_response(session, stream_id, headers, 2, &data_prd);
+    // Submit response (below compression's min_size, so it always goes out as identity)
+    submit_stream_response(session, stream_id, sdata, headers, 2, NULL);
 }
 
 // Root request handler implementation
@@ -118,7 +98,8 @@ void root_request_handler(RequestHandler *self,
     };
     
     // Prepare HTML response
-    const char *html = "<html><body><h1>Welcome to Root</h1></body></html>";
+    const char *html = "<html><head><link rel=\"stylesheet\" href=\"/static/site.css\"></head>"
+                       "<body><h1>Welcome to Root</h1></body></html>";
     size_t html_len = strlen(html);
     
     // Allocate separate memory for response body
@@ -133,20 +114,170 @@ void root_request_handler(RequestHandler *self,
     sdata->response_len = html_len;
     sdata->response_offset = 0;
     
-    // Prepare data provider
+    // Submit response (below compression's min_size, so it always goes out as identity)
+    submit_stream_response(session, stream_id, sdata, headers, 2, NULL);
+}
+
+// Static asset handler: serves the built-in files under /static/
+void static_request_handler(RequestHandler *self, 
+                            nghttp2_session *session, 
+                            int32_t stream_id, 
+                            stream_data *sdata) {
+    const static_asset *asset = NULL;
+    if (sdata->path) {
+        asset = find_static_asset(sdata->path, strlen(sdata->path));
+    }
+    if (!asset) {
+        const nghttp2_nv headers[] = {
+            {(uint8_t*)":status", (uint8_t*)"404", 7, 3, NGHTTP2_NV_FLAG_NONE}
+        };
+        submit_response_headers(session, sdata, headers, 1, NULL);
+        return;
+    }
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"content-type", (uint8_t*)asset->content_type, 12, strlen(asset->content_type), NGHTTP2_NV_FLAG_NONE}
+    };
+    
+    char *response_body = (char *)malloc(asset->len);
+    if (!response_body) {
+        return;
+    }
+    memcpy(response_body, asset->body, asset->len);
+    sdata->response_body = response_body;
+    sdata->response_len = asset->len;
+    sdata->response_offset = 0;
+    
+    submit_stream_response(session, stream_id, sdata, headers, 2, asset->path);
+}
+
+int submit_stream_response(nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                           const nghttp2_nv *nva, size_t nvlen, const char *cache_key) {
+    const char *content_type = NULL;
+    size_t content_type_len = 0;
+    for (size_t i = 0; i < nvlen; ++i) {
+        if (nva[i].namelen == 12 && memcmp(nva[i].name, "content-type", 12) == 0) {
+            content_type = (const char *)nva[i].value;
+            content_type_len = nva[i].valuelen;
+        }
+    }
+
+    // Compression stage: may replace response_body or attach a streaming encoder
+    int encoding = compress_response(sdata, content_type, content_type_len, cache_key);
+
+    std::vector<nghttp2_nv> headers(nva, nva + nvlen);
+    if (encoding) {
+        const char *name = encoding_name(encoding);
+        headers.push_back({(uint8_t*)"content-encoding", (uint8_t*)name, 16, strlen(name), NGHTTP2_NV_FLAG_NO_COPY_NAME});
+    }
+    if (encoding || is_compressible_type(content_type, content_type_len)) {
+        // Representation depends on accept-encoding whether or not this client got it compressed
+        headers.push_back({(uint8_t*)"vary", (uint8_t*)"accept-encoding", 4, 15,
+                           NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE});
+    }
+    memory_budget_update_stream(sdata);
     nghttp2_data_provider data_prd;
     data_prd.source.ptr = sdata;
     data_prd.read_callback = data_read_callback;
-    
-    // Submit response
-    nghttp2_submit_response(session, stream_id, headers, 2, &data_prd);
+    return submit_response_headers(session, sdata, headers.data(), headers.size(), &data_prd);
+}
+
+namespace
+{
+
+int submit_response(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen, const nghttp2_data_provider *prd)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        return transport->submit_response(sdata, nva, nvlen, prd);
+    }
+    return nghttp2_submit_response(sdata->conn->session, sdata->stream_id, nva, nvlen, prd);
+}
+
+} // namespace
+
+int submit_response_headers(nghttp2_session *session, stream_data *sdata, const nghttp2_nv *nva, size_t nvlen,
+                            const nghttp2_data_provider *prd)
+{
+    sdata->response_submitted = true;
+    if (!sdata->response_stage) {
+        return submit_response(sdata, nva, nvlen, prd);
+    }
+    // The middleware sees every response of the stream, errors and the deadline's answer included
+    response_headers headers;
+    headers.nva.assign(nva, nva + nvlen);
+    sdata->response_stage(sdata, &headers);
+    return submit_response(sdata, headers.nva.data(), headers.nva.size(), prd);
+}
+
+int stream_submit_info(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        return transport->submit_info(sdata, nva, nvlen);
+    }
+    // Non-final HEADERS without END_STREAM; the response follows on the same stream
+    return nghttp2_submit_headers(sdata->conn->session, NGHTTP2_FLAG_NONE, sdata->stream_id, NULL, nva, nvlen, NULL);
+}
+
+int stream_submit_trailer(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        return transport->submit_trailer(sdata, nva, nvlen);
+    }
+    return nghttp2_submit_trailer(sdata->conn->session, sdata->stream_id, nva, nvlen);
+}
+
+void stream_resume(stream_data *sdata)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        transport->resume(sdata);
+        return;
+    }
+    nghttp2_session_resume_data(sdata->conn->session, sdata->stream_id);
+}
+
+void stream_consume(stream_data *sdata, size_t n)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        transport->consume(sdata, n, false);
+        return;
+    }
+    nghttp2_session_consume(sdata->conn->session, sdata->stream_id, n);
+}
+
+void stream_consume_connection(stream_data *sdata, size_t n)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        transport->consume(sdata, n, true);
+        return;
+    }
+    nghttp2_session_consume_connection(sdata->conn->session, n);
+}
+
+void stream_reset(stream_data *sdata, uint32_t error_code)
+{
+    const stream_transport *transport = sdata->conn->transport;
+    if (transport) {
+        transport->reset(sdata, error_code);
+        return;
+    }
+    nghttp2_submit_rst_stream(sdata->conn->session, NGHTTP2_FLAG_NONE, sdata->stream_id, error_code);
 }
 
 ssize_t send_callback(nghttp2_session *session, const uint8_t *data,
                              size_t length, int flags, void *user_data) {
-    muduo::net::TcpConnectionPtr conn = *(muduo::net::TcpConnectionPtr *)user_data;
-    conn->send(data,length); 
-    return (length >= 0) ? length : NGHTTP2_ERR_CALLBACK_FAILURE; 
+    connection_data *conn_data = (connection_data *)user_data;
+    if (conn_data->output) {
+        conn_data->output->append(data, length);
+    } else {
+        conn_data->client_fd->send(data, length);
+    }
+    return (ssize_t)length;
 }
 
 
@@ -160,6 +291,18 @@ ssize_t data_read_callback(nghttp2_session *session,
                                   void *user_data) {
     stream_data *sdata = (stream_data *)source->ptr;
     
+    if (sdata->encoder) {
+        return response_encoder_read(sdata->encoder, buf, length, data_flags);
+    }
+    
+    if (sdata->response_chain) {
+        size_t n = body_chain_read(sdata->response_chain, buf, length);
+        if (body_chain_remaining(sdata->response_chain) == 0) {
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        }
+        return n;
+    }
+    
     // Use response_body for sending response
     size_t remaining = sdata->response_len - sdata->response_offset;
     if (remaining == 0) {
@@ -191,123 +334,339 @@ int on_header_callback(nghttp2_session *session,
         connection_data *conn_data = (connection_data *)user_data;
         
         if (!sdata) {
-            // Allocate stream data if not exists
-            sdata = (stream_data *)calloc(1, sizeof(stream_data));
-            nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, sdata);
-            
-            // Set default handler for this stream
-            sdata->handler = conn_data->default_handler;
-        }
-        
-        // Check if this is the :path header
-        if (namelen == 5 && memcmp(name, ":path", 5) == 0) {
-            // Set handler based on path
-            if (valuelen >= 4 && memcmp(value, "/api", 4) == 0) {
-                sdata->handler = &api_handler_impl;
-            } else if (valuelen == 1 && memcmp(value, "/", 1) == 0) {
-                sdata->handler = &root_handler_impl;
+            // Allocate stream data if not exists (starts with the default handler)
+            sdata = stream_data_new(session, conn_data, frame->hd.stream_id);
+            if (!sdata) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
             }
-            // Otherwise keep the default handler
-        }
-        
-        // Format header: "name: value\n" (without null terminator for intermediate strings)
-        size_t content_len = namelen + valuelen + 3; // name + ": " + value + "\n" (no null terminator)
-        char *header_str = (char *)malloc(content_len + 1); // +1 for null terminator
-        snprintf(header_str, content_len + 1, "%.*s: %.*s\n", (int)namelen, name, (int)valuelen, value);
-        
-        // Append to headers string
-        if (sdata->headers) {
-            // Calculate new length: current content length + new content length + null terminator
-            size_t new_content_len = sdata->headers_len - 1; // exclude existing null terminator
-            size_t new_total_len = new_content_len + content_len + 1; // +1 for new null terminator
-            sdata->headers = (char *)realloc(sdata->headers, new_total_len);
-            
-            // Copy new content (overwriting the old null terminator)
-            memcpy(sdata->headers + new_content_len, header_str, content_len);
-            sdata->headers[new_total_len - 1] = '\0'; // add new null terminator
-            sdata->headers_len = new_total_len;
-        } else {
-            sdata->headers = header_str;
-            sdata->headers_len = content_len + 1; // include null terminator
         }
+        stream_on_request_header(sdata, name, namelen, value, valuelen);
     }
     return 0;
 }
 
+void stream_on_request_header(stream_data *sdata, const uint8_t *name, size_t namelen, const uint8_t *value,
+                              size_t valuelen) {
+    // Past the route's header limits nothing more is collected; the stream gets 431
+    if (sdata->reject_status || !request_limit_header(sdata, namelen, valuelen)) {
+        return;
+    }
+    
+    // Check if this is the :path header
+    if (namelen == 5 && memcmp(name, ":path", 5) == 0) {
+        if (!sdata->path) {
+            sdata->path = strndup((const char *)value, valuelen);
+        }
+        // Set handler based on the route table
+        sdata->route = find_route(value, valuelen);
+        if (sdata->route) {
+            sdata->handler = loop_handler_resolve(sdata->route->handler, sdata->conn->loop);
+        }
+        // Otherwise keep the default handler
+    } else if (namelen == 7 && memcmp(name, ":method", 7) == 0) {
+        size_t len = valuelen < sizeof sdata->method - 1 ? valuelen : sizeof sdata->method - 1;
+        memcpy(sdata->method, value, len);
+        sdata->method[len] = '\0';
+    } else if (namelen == 10 && memcmp(name, ":authority", 10) == 0 && !sdata->authority) {
+        sdata->authority = strndup((const char *)value, valuelen);
+    } else if (namelen == 15 && memcmp(name, "accept-encoding", 15) == 0) {
+        sdata->accept_encoding |= parse_accept_encoding(value, valuelen);
+    } else if (namelen == 14 && memcmp(name, "content-length", 14) == 0) {
+        // nghttp2 and nghttp3 have already checked that it is a number
+        int64_t n = 0;
+        for (size_t i = 0; i < valuelen && n < INT64_MAX / 10; ++i) {
+            n = n * 10 + (value[i] - '0');
+        }
+        sdata->content_length = n;
+    } else if (namelen == 12 && memcmp(name, "grpc-timeout", 12) == 0) {
+        deadline_on_request_header(sdata, value, valuelen);
+    }
+    
+    // Format header: "name: value\n" (without null terminator for intermediate strings)
+    size_t content_len = namelen + valuelen + 3; // name + ": " + value + "\n" (no null terminator)
+    char *header_str = (char *)malloc(content_len + 1); // +1 for null terminator
+    snprintf(header_str, content_len + 1, "%.*s: %.*s\n", (int)namelen, name, (int)valuelen, value);
+    
+    // Append to headers string
+    if (sdata->headers) {
+        // Calculate new length: current content length + new content length + null terminator
+        size_t new_content_len = sdata->headers_len - 1; // exclude existing null terminator
+        size_t new_total_len = new_content_len + content_len + 1; // +1 for new null terminator
+        sdata->headers = (char *)realloc(sdata->headers, new_total_len);
+        
+        // Copy new content (overwriting the old null terminator)
+        memcpy(sdata->headers + new_content_len, header_str, content_len);
+        sdata->headers[new_total_len - 1] = '\0'; // add new null terminator
+        sdata->headers_len = new_total_len;
+    } else {
+        sdata->headers = header_str;
+        sdata->headers_len = content_len + 1; // include null terminator
+    }
+    memory_budget_update_stream(sdata);
+}
+
 /* Data receive callback: collect request body */
 int on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags,
                                        int32_t stream_id, const uint8_t *data,
                                        size_t len, void *user_data) {
     stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, stream_id);
     if (!sdata) {
-        sdata = (stream_data *)calloc(1, sizeof(stream_data));
-        nghttp2_session_set_stream_user_data(session, stream_id, sdata);
+        sdata = stream_data_new(session, (connection_data *)user_data, stream_id);
+        if (!sdata) {
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        }
+    }
+    return stream_on_request_data(session, sdata, data, len);
+}
+
+int stream_on_request_data(nghttp2_session *session, stream_data *sdata, const uint8_t *data, size_t len) {
+    int32_t stream_id = sdata->stream_id;
+    
+    // Over the body limit, or already rejected: dropped before any buffering
+    if (request_limit_data(session, stream_id, sdata, len)) {
+        return 0;
     }
     
-    // Append data to body
-    if (sdata->body) {
-        size_t new_len = sdata->body_len + len;
-        sdata->body = (char *)realloc(sdata->body, new_len);
-        memcpy(sdata->body + sdata->body_len, data, len);
-        sdata->body_len = new_len;
-    } else {
-        sdata->body = (char *)malloc(len);
-        memcpy(sdata->body, data, len);
-        sdata->body_len = len;
+    // Streaming handlers take the chunk and give the window back themselves
+    if (sdata->handler && sdata->handler->on_request_data) {
+        return sdata->handler->on_request_data(sdata->handler, session, stream_id, sdata, data, len);
     }
     
+    // Buffered bodies are consumed right away, as automatic WINDOW_UPDATE would
+    stream_consume(sdata, len);
+    
+    // Append data to body; large bodies continue on disk
+    if (sdata->spool && sdata->spool->failed) {
+        return 0;
+    }
+    if (!spool_body_append(sdata, data, len)) {
+        stream_reset(sdata, NGHTTP2_INTERNAL_ERROR);
+    }
+    memory_budget_update_stream(sdata);
+    
     return 0;
 }
 
 /* Frame receive callback: process received HTTP/2 frames */
 int on_frame_recv_callback(nghttp2_session *session,
                                   const nghttp2_frame *frame, void *user_data) {
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+        stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+        if (sdata) {
+            stream_on_request_headers(session, sdata, (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) != 0);
+        }
+    }
+    
     // Only process when we have END_STREAM flag (request complete)
     if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
-        int32_t stream_id = frame->hd.stream_id;
-        stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, stream_id);
+        stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
         
         if (!sdata) {
             // This should not happen because we create stream data in header callback
             return 0;
         }
-        
-        // If handler is set, let it handle the request
-        if (sdata->handler && sdata->handler->handle_request) {
-            sdata->handler->handle_request(sdata->handler, session, stream_id, sdata);
-        }
+        stream_on_request_end(session, sdata);
     }
     return 0;
 }
 
+// Request header block complete: rate limit, then early hints go out before the body or handler
+void stream_on_request_headers(nghttp2_session *session, stream_data *sdata, bool end_stream) {
+    int32_t stream_id = sdata->stream_id;
+    metrics_add(METRIC_REQUESTS);
+    // Short of memory: refused before anything else is spent on the stream
+    if (memory_budget_refuse(session, stream_id, sdata)) {
+        return;
+    }
+    // Over the limit: refused before any hint, body or handler work
+    if (rate_limit_reject(session, stream_id, sdata)) {
+        return;
+    }
+    sdata->request_done = end_stream;
+    // Oversized headers or a declared body over the limit: answered before any hint or handler
+    if (request_limit_reject(session, stream_id, sdata)) {
+        return;
+    }
+    deadline_arm(session, sdata);
+    http3_advertise(session, stream_id, sdata->conn);
+    route_on_request_headers(session, stream_id, sdata);
+    if (sdata->handler && sdata->handler->on_request_headers) {
+        trace_stamp(&sdata->trace, TRACE_HANDLER_START);
+        sdata->handler->on_request_headers(sdata->handler, session, stream_id, sdata);
+    }
+}
+
+void stream_on_request_end(nghttp2_session *session, stream_data *sdata) {
+    int32_t stream_id = sdata->stream_id;
+    sdata->request_done = true;
+    trace_stamp(&sdata->trace, TRACE_REQUEST_END);
+    if (sdata->reject_status) {
+        return;
+    }
+    if (!spool_body_finish(sdata)) {
+        stream_reset(sdata, NGHTTP2_INTERNAL_ERROR);
+        return;
+    }
+    
+    // If handler is set, let it handle the request
+    if (sdata->handler && sdata->handler->handle_request) {
+        trace_stamp(&sdata->trace, TRACE_HANDLER_START);
+        sdata->handler->handle_request(sdata->handler, session, stream_id, sdata);
+        trace_stamp(&sdata->trace, TRACE_HANDLER_END);
+    }
+}
+
+
+/* Frame send callback: response status and progress for the access log and traces, and the
+   end of responses to rejected requests */
+int on_frame_send_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+    if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) {
+        return 0;
+    }
+    stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!sdata) {
+        return 0;
+    }
+    if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+        stream_on_response_end(session, sdata);
+    }
+    if (frame->hd.type == NGHTTP2_DATA) {
+        sdata->bytes_sent += frame->hd.length - frame->data.padlen;
+        trace_stamp(&sdata->trace, TRACE_FIRST_DATA);
+        return 0;
+    }
+    stream_on_response_headers(sdata, frame->headers.nva, frame->headers.nvlen);
+    return 0;
+}
+
+void stream_on_response_headers(stream_data *sdata, const nghttp2_nv *nva, size_t nvlen) {
+    // The final status; 1xx hints come first and trailers carry no :status
+    for (size_t i = 0; i < nvlen && sdata->status == 0; ++i) {
+        const nghttp2_nv &nv = nva[i];
+        if (nv.namelen == 7 && memcmp(nv.name, ":status", 7) == 0 && nv.valuelen == 3 && nv.value[0] != '1') {
+            sdata->status = (uint16_t)((nv.value[0] - '0') * 100 + (nv.value[1] - '0') * 10 + (nv.value[2] - '0'));
+        }
+    }
+}
+
+void stream_on_response_end(nghttp2_session *session, stream_data *sdata) {
+    sdata->response_done = true;
+    request_limit_response_sent(session, sdata->stream_id, sdata);
+}
+
 
 /* Stream close callback: clean up resources */
 int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
                                     uint32_t error_code, void *user_data) {
     stream_data *sdata = (stream_data *)nghttp2_session_get_stream_user_data(session, stream_id);
     if (sdata) {
-        if (sdata->headers) free(sdata->headers);
-        if (sdata->body) free(sdata->body);
-        if (sdata->response_body) free(sdata->response_body); // Free response body
-        free(sdata);
+        stream_data_close(session, sdata, error_code);
         nghttp2_session_set_stream_user_data(session, stream_id, NULL);
     }
     return 0;
 }
 
+std::string peer_address(const muduo::net::InetAddress &peer) {
+    // Unix socket clients are rarely bound to a name; InetAddress cannot print one anyway
+    if (peer.getSockAddr()->sa_family == AF_UNIX) {
+        return "unix";
+    }
+    return peer.toIpPort();
+}
+
+stream_data *stream_data_new(nghttp2_session *session, connection_data *conn_data, int32_t stream_id) {
+    stream_data *sdata = (stream_data *)calloc(1, sizeof(stream_data));
+    if (!sdata) {
+        return NULL;
+    }
+    sdata->stream_id = stream_id;
+    sdata->conn = conn_data;
+    sdata->handler = loop_handler_resolve(conn_data->default_handler, conn_data->loop);
+    sdata->start_us = conn_data->input_us;
+    sdata->content_length = -1;
+    trace_stream_begin(sdata);
+    
+    // Link into the connection's live stream list
+    sdata->next = conn_data->streams;
+    if (conn_data->streams) {
+        conn_data->streams->prev = sdata;
+    }
+    conn_data->streams = sdata;
+    
+    if (session) {
+        nghttp2_session_set_stream_user_data(session, stream_id, sdata);
+    }
+    return sdata;
+}
+
+void stream_data_close(nghttp2_session *session, stream_data *sdata, uint32_t error_code) {
+    trace_stream_end(sdata);
+    access_log_stream(sdata, error_code);
+    deadline_disarm(sdata);
+    // Before the close hook, so work it tears down already sees itself cancelled. Only a complete
+    // response counts as done: RST_STREAM(NO_ERROR) from the peer abandons the stream all the same.
+    stream_cancel(sdata, sdata->response_done ? CANCEL_DONE : CANCEL_RESET);
+    if (sdata->handler && sdata->handler->on_stream_close) {
+        sdata->handler->on_stream_close(sdata->handler, session, sdata->stream_id, sdata, error_code);
+    }
+    
+    // Unlink from the connection
+    if (sdata->prev) {
+        sdata->prev->next = sdata->next;
+    } else {
+        sdata->conn->streams = sdata->next;
+    }
+    if (sdata->next) {
+        sdata->next->prev = sdata->prev;
+    }
+    
+    if (sdata->response_chain) body_chain_free(sdata->response_chain); // May borrow headers and body below
+    if (sdata->headers) free(sdata->headers);
+    if (sdata->spool) spool_body_free(sdata);
+    else if (sdata->body) free(sdata->body);
+    if (sdata->response_body) free(sdata->response_body); // Free response body
+    if (sdata->encoder) response_encoder_free(sdata->encoder);
+    if (sdata->path) free(sdata->path);
+    if (sdata->authority) free(sdata->authority);
+    if (sdata->cancel) cancel_token_unref(sdata->cancel);
+    memory_budget_release_stream(sdata);
+    free(sdata);
+}
+
 
 // Global handler instances
 RequestHandler default_handler_impl = {
     .handle_request = default_request_handler,
-    .data = NULL
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
 };
 
 RequestHandler api_handler_impl = {
     .handle_request = api_request_handler,
-    .data = NULL
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
 };
 
 RequestHandler root_handler_impl = {
     .handle_request = root_request_handler,
-    .data = NULL
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
+
+RequestHandler static_handler_impl = {
+    .handle_request = static_request_handler,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
 };
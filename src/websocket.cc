@@ -0,0 +1,535 @@
+#include "websocket.h"
+#include <strings.h>
+#include <algorithm>
+
+#include "http2Session.h"
+
+websocket_policy g_websocket_policy = {
+    .max_message = 16 * 1024 * 1024,
+};
+
+// One WebSocket; owned by its stream (sdata->handler_state)
+struct websocket {
+    nghttp2_session *session;
+    stream_data *sdata;
+    int32_t stream_id;
+    const websocket_callbacks *callbacks;
+    void *user_data;
+
+    // Frame being received
+    uint8_t header[14];
+    size_t header_len;
+    size_t header_need;             // 2 until the length field has been seen
+    bool in_payload;
+    bool fin;
+    uint8_t opcode;
+    uint8_t mask[4];
+    uint64_t payload_len;
+    uint64_t payload_got;
+    uint8_t *payload;               // Unmasked payload, handed on whole when the frame ends
+
+    // Message being received, one segment per fragment
+    body_chain *message;
+    websocket_opcode message_opcode;
+    size_t message_size;
+
+    body_chain *out;                // Frames waiting for the stream's data provider
+    bool deferred;                  // The data provider is waiting for out to fill
+    bool close_sent;
+    bool close_received;
+    bool failed;                    // Protocol error; the rest of the input is dropped
+    bool peer_ended;                // END_STREAM from the client
+    uint16_t close_code;            // From the peer's close frame
+};
+
+namespace
+{
+
+const uint16_t kCloseProtocolError = 1002;
+const uint16_t kCloseNoStatus = 1005;
+const uint16_t kCloseAbnormal = 1006;
+const uint16_t kCloseTooBig = 1009;
+const size_t kMaxControlPayload = 125;
+
+void wake(websocket *ws)
+{
+    if (ws->deferred) {
+        ws->deferred = false;
+        stream_resume(ws->sdata);
+    }
+    http2_session_schedule_send(ws->sdata->conn);
+}
+
+// Server frames are never masked, so the header is all that is built; payload segments follow as they are
+bool queue_frame(websocket *ws, uint8_t opcode, body_chain *payload)
+{
+    size_t len = payload ? body_chain_remaining(payload) : 0;
+    uint8_t *h = (uint8_t *)malloc(10);
+    if (!h) {
+        body_chain_free(payload);
+        return false;
+    }
+    size_t n;
+    h[0] = 0x80 | opcode;
+    if (len < 126) {
+        h[1] = (uint8_t)len;
+        n = 2;
+    } else if (len <= 0xffff) {
+        h[1] = 126;
+        h[2] = (uint8_t)(len >> 8);
+        h[3] = (uint8_t)len;
+        n = 4;
+    } else {
+        h[1] = 127;
+        for (int i = 0; i < 8; ++i) {
+            h[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+        }
+        n = 10;
+    }
+    if (!body_chain_append(ws->out, (const char *)h, n, SEGMENT_OWNED)) {
+        body_chain_free(payload);
+        return false;
+    }
+    if (payload) {
+        body_chain_splice(ws->out, payload);
+    }
+    wake(ws);
+    return true;
+}
+
+// Codes a close frame may carry (RFC 6455 7.4): 1004-1006 and 1015 are reserved for reporting
+// locally, 1016-2999 for future protocol use, and nothing is defined from 5000 up
+bool close_code_valid(uint16_t code)
+{
+    if (code < 1000 || code >= 5000) {
+        return false;
+    }
+    if (code < 3000) {
+        return code <= 1014 && (code < 1004 || code > 1006);
+    }
+    return true;
+}
+
+bool finishing(const websocket *ws)
+{
+    return ws->peer_ended || (ws->close_sent && (ws->close_received || ws->failed));
+}
+
+ssize_t ws_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                         uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    websocket *ws = (websocket *)source->ptr;
+    size_t n = body_chain_read(ws->out, buf, length);
+    body_chain_release_read(ws->out);
+    if (body_chain_remaining(ws->out) == 0 && finishing(ws)) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        return n;
+    }
+    if (n == 0) {
+        ws->deferred = true;
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    return n;
+}
+
+void fail(websocket *ws, uint16_t code)
+{
+    websocket_close(ws, code, NULL);
+    ws->failed = true;
+    if (ws->message) {
+        body_chain_free(ws->message);
+        ws->message = NULL;
+    }
+    wake(ws);
+}
+
+void handle_control(websocket *ws)
+{
+    size_t len = (size_t)ws->payload_len;
+    if (ws->opcode == WS_PING) {
+        // The pong carries the ping's payload buffer as is
+        body_chain *pong = body_chain_new();
+        if (pong && body_chain_append(pong, (const char *)ws->payload, len, SEGMENT_OWNED)) {
+            ws->payload = NULL;
+            if (!ws->close_sent) {
+                queue_frame(ws, WS_PONG, pong);
+            } else {
+                body_chain_free(pong);
+            }
+        } else {
+            ws->payload = NULL;
+            body_chain_free(pong);
+        }
+    } else if (ws->opcode == WS_CLOSE) {
+        if (len == 1) {
+            fail(ws, kCloseProtocolError);
+            return;
+        }
+        uint16_t code = len >= 2 ? (uint16_t)((ws->payload[0] << 8) | ws->payload[1]) : kCloseNoStatus;
+        if (len >= 2 && !close_code_valid(code)) {
+            fail(ws, kCloseProtocolError);
+            return;
+        }
+        ws->close_received = true;
+        ws->close_code = code;
+        // Answer with the same code, which finishes the handshake and ends the stream
+        websocket_close(ws, ws->close_code == kCloseNoStatus ? 0 : ws->close_code, NULL);
+        wake(ws);
+    }
+    // Unsolicited pongs are ignored
+}
+
+void end_frame(websocket *ws)
+{
+    ws->in_payload = false;
+    ws->header_len = 0;
+    ws->header_need = 2;
+    if (ws->opcode >= WS_CLOSE) {
+        handle_control(ws);
+    } else {
+        // Each fragment becomes a segment of the message; nothing is copied again
+        if (!body_chain_append(ws->message, (const char *)ws->payload, (size_t)ws->payload_len, SEGMENT_OWNED)) {
+            ws->payload = NULL;
+            fail(ws, kCloseTooBig);
+            return;
+        }
+        ws->payload = NULL;
+        if (ws->fin) {
+            body_chain *message = ws->message;
+            ws->message = NULL;
+            ws->callbacks->on_message(ws, ws->message_opcode, message);
+        }
+    }
+    free(ws->payload);
+    ws->payload = NULL;
+}
+
+// The header is complete: validate it and get ready for the payload
+void begin_frame(websocket *ws)
+{
+    const uint8_t *h = ws->header;
+    ws->fin = (h[0] & 0x80) != 0;
+    ws->opcode = h[0] & 0x0f;
+    uint64_t len = h[1] & 0x7f;
+    size_t pos = 2;
+    if (len == 126) {
+        len = ((uint64_t)h[2] << 8) | h[3];
+        pos = 4;
+    } else if (len == 127) {
+        len = 0;
+        for (int i = 0; i < 8; ++i) {
+            len = (len << 8) | h[2 + i];
+        }
+        pos = 10;
+    }
+    memcpy(ws->mask, h + pos, 4);
+    ws->payload_len = len;
+    ws->payload_got = 0;
+
+    bool control = ws->opcode >= WS_CLOSE;
+    if (control) {
+        if (!ws->fin || len > kMaxControlPayload || ws->opcode > WS_PONG) {
+            fail(ws, kCloseProtocolError);
+            return;
+        }
+    } else if (ws->opcode == WS_CONTINUATION) {
+        if (!ws->message) {
+            fail(ws, kCloseProtocolError);
+            return;
+        }
+    } else if (ws->opcode == WS_TEXT || ws->opcode == WS_BINARY) {
+        if (ws->message) {
+            fail(ws, kCloseProtocolError);
+            return;
+        }
+        ws->message = body_chain_new();
+        ws->message_opcode = (websocket_opcode)ws->opcode;
+        ws->message_size = 0;
+        if (!ws->message) {
+            fail(ws, kCloseTooBig);
+            return;
+        }
+    } else {
+        fail(ws, kCloseProtocolError);
+        return;
+    }
+    if (!control) {
+        if (len > g_websocket_policy.max_message - ws->message_size) {
+            fail(ws, kCloseTooBig);
+            return;
+        }
+        ws->message_size += (size_t)len;
+    }
+    ws->payload = NULL;
+    if (len > 0) {
+        ws->payload = (uint8_t *)malloc((size_t)len);
+        if (!ws->payload) {
+            fail(ws, kCloseTooBig);
+            return;
+        }
+    }
+    ws->in_payload = true;
+    if (len == 0) {
+        end_frame(ws);
+    }
+}
+
+bool header_is(const stream_data *sdata, const char *name, const char *value)
+{
+    if (!sdata->headers) {
+        return false;
+    }
+    size_t namelen = strlen(name);
+    const char *p = sdata->headers;
+    while (*p) {
+        const char *eol = strchr(p, '\n');
+        size_t linelen = eol ? (size_t)(eol - p) : strlen(p);
+        if (linelen > namelen + 2 && memcmp(p, name, namelen) == 0 && p[namelen] == ':' && p[namelen + 1] == ' ') {
+            size_t valuelen = linelen - namelen - 2;
+            return valuelen == strlen(value) && strncasecmp(p + namelen + 2, value, valuelen) == 0;
+        }
+        if (!eol) {
+            break;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+void reject(nghttp2_session *session, stream_data *sdata)
+{
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"400", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)"sec-websocket-version", (uint8_t*)"13", 21, 2, NGHTTP2_NV_FLAG_NONE}
+    };
+    submit_response_headers(session, sdata, headers, 2, NULL);
+}
+
+void ws_request_headers(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    // Extended CONNECT: nghttp2 already checked :protocol is only used with CONNECT and our SETTINGS
+    if (strcmp(sdata->method, "CONNECT") != 0 || !header_is(sdata, ":protocol", "websocket") ||
+        !header_is(sdata, "sec-websocket-version", "13") || sdata->request_done) {
+        reject(session, sdata);
+        return;
+    }
+    websocket *ws = (websocket *)calloc(1, sizeof(websocket));
+    if (!ws) {
+        return;
+    }
+    ws->out = body_chain_new();
+    if (!ws->out) {
+        free(ws);
+        return;
+    }
+    ws->session = session;
+    ws->sdata = sdata;
+    ws->stream_id = stream_id;
+    ws->callbacks = (const websocket_callbacks *)self->data;
+    ws->header_need = 2;
+    sdata->handler_state = ws;
+
+    const nghttp2_nv headers[] = {
+        {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE}
+    };
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = ws;
+    data_prd.read_callback = ws_read_callback;
+    submit_response_headers(session, sdata, headers, 1, &data_prd);
+    if (ws->callbacks->on_open) {
+        ws->callbacks->on_open(ws);
+    }
+}
+
+int ws_request_data(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                    const uint8_t *data, size_t len)
+{
+    // Everything is copied out (and unmasked) right away
+    stream_consume(sdata, len);
+    websocket *ws = (websocket *)sdata->handler_state;
+    while (ws && len > 0 && !ws->failed && !ws->close_received) {
+        if (!ws->in_payload) {
+            size_t n = std::min(len, ws->header_need - ws->header_len);
+            memcpy(ws->header + ws->header_len, data, n);
+            ws->header_len += n;
+            data += n;
+            len -= n;
+            if (ws->header_len < ws->header_need) {
+                continue;
+            }
+            if (ws->header_need == 2) {
+                // Reserved bits must be zero and client frames must be masked
+                if ((ws->header[0] & 0x70) || !(ws->header[1] & 0x80)) {
+                    fail(ws, kCloseProtocolError);
+                    break;
+                }
+                uint8_t len7 = ws->header[1] & 0x7f;
+                ws->header_need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+                continue;
+            }
+            begin_frame(ws);
+            continue;
+        }
+        size_t n = (size_t)std::min<uint64_t>(len, ws->payload_len - ws->payload_got);
+        websocket_unmask_copy(ws->payload + ws->payload_got, data, n, ws->mask, (size_t)ws->payload_got);
+        ws->payload_got += n;
+        data += n;
+        len -= n;
+        if (ws->payload_got == ws->payload_len) {
+            end_frame(ws);
+        }
+    }
+    return 0;
+}
+
+// END_STREAM from the client: nothing more can arrive, so end our side as well
+void ws_request_end(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    websocket *ws = (websocket *)sdata->handler_state;
+    if (!ws) {
+        return;
+    }
+    ws->peer_ended = true;
+    wake(ws);
+}
+
+void ws_stream_close(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata,
+                     uint32_t error_code)
+{
+    websocket *ws = (websocket *)sdata->handler_state;
+    if (!ws) {
+        return;
+    }
+    sdata->handler_state = NULL;
+    if (ws->callbacks->on_close) {
+        ws->callbacks->on_close(ws, ws->close_received ? ws->close_code : kCloseAbnormal);
+    }
+    free(ws->payload);
+    body_chain_free(ws->message);
+    body_chain_free(ws->out);
+    free(ws);
+}
+
+void echo_message(websocket *ws, websocket_opcode opcode, body_chain *message)
+{
+    websocket_send_chain(ws, opcode, message);
+}
+
+const websocket_callbacks kEchoCallbacks = {NULL, echo_message, NULL};
+
+} // namespace
+
+RequestHandler make_websocket_handler(const websocket_callbacks *callbacks)
+{
+    RequestHandler handler = {
+        .handle_request = ws_request_end,
+        .data = (void *)callbacks,
+        .on_request_headers = ws_request_headers,
+        .on_request_data = ws_request_data,
+        .on_stream_close = ws_stream_close,
+        .factory = NULL,
+    };
+    return handler;
+}
+
+bool websocket_send(websocket *ws, websocket_opcode opcode, const char *data, size_t len)
+{
+    body_chain *payload = body_chain_new();
+    if (!payload) {
+        return false;
+    }
+    char *copy = (char *)malloc(len ? len : 1);
+    if (!copy) {
+        body_chain_free(payload);
+        return false;
+    }
+    memcpy(copy, data, len);
+    if (!body_chain_append(payload, copy, len, SEGMENT_OWNED)) {
+        body_chain_free(payload);
+        return false;
+    }
+    return websocket_send_chain(ws, opcode, payload);
+}
+
+bool websocket_send_chain(websocket *ws, websocket_opcode opcode, body_chain *payload)
+{
+    if (ws->close_sent || (opcode != WS_TEXT && opcode != WS_BINARY)) {
+        body_chain_free(payload);
+        return false;
+    }
+    return queue_frame(ws, opcode, payload);
+}
+
+void websocket_close(websocket *ws, uint16_t code, const char *reason)
+{
+    if (ws->close_sent) {
+        return;
+    }
+    ws->close_sent = true;
+    body_chain *payload = NULL;
+    if (code) {
+        size_t reason_len = reason ? std::min(strlen(reason), kMaxControlPayload - 2) : 0;
+        char *p = (char *)malloc(2 + reason_len);
+        payload = body_chain_new();
+        if (!p || !payload) {
+            free(p);
+            body_chain_free(payload);
+            payload = NULL;
+        } else {
+            p[0] = (char)(code >> 8);
+            p[1] = (char)code;
+            if (reason_len) {
+                memcpy(p + 2, reason, reason_len);
+            }
+            body_chain_append(payload, p, 2 + reason_len, SEGMENT_OWNED);
+        }
+    }
+    queue_frame(ws, WS_CLOSE, payload);
+}
+
+void websocket_set_user_data(websocket *ws, void *user_data)
+{
+    ws->user_data = user_data;
+}
+
+void *websocket_user_data(const websocket *ws)
+{
+    return ws->user_data;
+}
+
+int32_t websocket_stream_id(const websocket *ws)
+{
+    return ws->stream_id;
+}
+
+void websocket_unmask_copy(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t mask[4], size_t offset)
+{
+    // The mask repeated over a word, starting at the payload position of src[0]
+    uint8_t m[8];
+    for (int i = 0; i < 8; ++i) {
+        m[i] = mask[(offset + i) & 3];
+    }
+    uint64_t word_mask;
+    memcpy(&word_mask, m, 8);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, src + i, 32);
+        w[0] ^= word_mask;
+        w[1] ^= word_mask;
+        w[2] ^= word_mask;
+        w[3] ^= word_mask;
+        memcpy(dst + i, w, 32);
+    }
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        w ^= word_mask;
+        memcpy(dst + i, &w, 8);
+    }
+    for (; i < len; ++i) {
+        dst[i] = src[i] ^ m[i & 7];
+    }
+}
+
+RequestHandler websocket_echo_handler_impl = make_websocket_handler(&kEchoCallbacks);
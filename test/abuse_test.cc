@@ -0,0 +1,86 @@
+// 滥用防护：一秒内的 RST_STREAM 或 PING 超出预算时回 GOAWAY(ENHANCE_YOUR_CALM) 并结束会话，
+// 预算以内、或分散在多个窗口里的同样流量照常服务
+#include <unistd.h>
+
+#include "abuse.h"
+#include "h2test.h"
+
+namespace
+{
+
+// Open a stream and cancel it right away, n times, then hand it all to the server at once
+void rapid_reset(test_client *c, int n)
+{
+    const nghttp2_nv nva[] = {
+        {(uint8_t*)":method", (uint8_t*)"GET", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":scheme", (uint8_t*)"http", 7, 4, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":authority", (uint8_t*)"test", 10, 4, NGHTTP2_NV_FLAG_NONE},
+        {(uint8_t*)":path", (uint8_t*)"/api", 5, 4, NGHTTP2_NV_FLAG_NONE},
+    };
+    for (int i = 0; i < n; ++i) {
+        int32_t id = nghttp2_submit_request(c->session, NULL, nva, 4, NULL, NULL);
+        // HEADERS has to be out before RST_STREAM, or nghttp2 drops both
+        nghttp2_session_send(c->session);
+        nghttp2_submit_rst_stream(c->session, NGHTTP2_FLAG_NONE, id, NGHTTP2_CANCEL);
+        nghttp2_session_send(c->session);
+    }
+    test_pump(c);
+}
+
+void ping_flood(test_client *c, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        nghttp2_submit_ping(c->session, NGHTTP2_FLAG_NONE, NULL);
+    }
+    test_pump(c);
+}
+
+void check_calm(const char *what, test_client *c)
+{
+    std::string name = what;
+    test_check((name + ": GOAWAY").c_str(), c->goaway, true);
+    test_check((name + ": ENHANCE_YOUR_CALM").c_str(), c->goaway_error, NGHTTP2_ENHANCE_YOUR_CALM);
+    test_check_true((name + ": session finished").c_str(), http2_session_finished(c->server));
+}
+
+void check_served(const char *what, test_client *c)
+{
+    std::string name = what;
+    test_check((name + ": no GOAWAY").c_str(), c->goaway, false);
+    test_stream *s = test_get(c, "/api");
+    test_wait_closed(c, s);
+    test_check((name + ": still served").c_str(), s->status, 200);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+
+    test_client *c = test_client_new(&loop, "10.3.0.1");
+    rapid_reset(c, g_abuse_policy.max_resets + 1);
+    check_calm("reset flood", c);
+    test_client_free(c);
+
+    c = test_client_new(&loop, "10.3.0.2");
+    rapid_reset(c, g_abuse_policy.max_resets - 10);
+    check_served("resets within budget", c);
+    // The budget is per second; the same again in the next window is fine
+    usleep(1100 * 1000);
+    rapid_reset(c, g_abuse_policy.max_resets - 10);
+    check_served("resets in the next second", c);
+    test_client_free(c);
+
+    c = test_client_new(&loop, "10.3.0.3");
+    ping_flood(c, g_abuse_policy.max_control_frames + 1);
+    check_calm("ping flood", c);
+    test_client_free(c);
+
+    c = test_client_new(&loop, "10.3.0.4");
+    ping_flood(c, g_abuse_policy.max_control_frames / 2);
+    check_served("pings within budget", c);
+    test_client_free(c);
+
+    return test_failures() ? 1 : 0;
+}
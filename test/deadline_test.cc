@@ -0,0 +1,139 @@
+// 请求期限：到期时触发流的取消令牌；还没提交响应的回 504（按策略可改 503，gRPC 请求回 grpc-status 4），
+// 响应头已经提交的 RST_STREAM(CANCEL)。grpc-timeout 只能把期限缩短
+#include <string>
+
+#include "cancel.h"
+#include "deadline.h"
+#include "h2test.h"
+
+namespace
+{
+
+// Handlers that never finish: one does not answer at all, the other sends its headers and then
+// has no body to give
+enum probe_mode {
+    PROBE_SILENT,
+    PROBE_HEADERS_SENT,
+};
+
+probe_mode g_mode;
+cancel_token *g_token;          // Of the last request, kept past the stream
+
+ssize_t never_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                            uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    return NGHTTP2_ERR_DEFERRED;
+}
+
+void probe_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    if (g_token) {
+        cancel_token_unref(g_token);
+    }
+    g_token = cancel_token_ref(stream_cancel_token(sdata));
+    if (g_mode == PROBE_HEADERS_SENT) {
+        const nghttp2_nv headers[] = {
+            {(uint8_t*)":status", (uint8_t*)"200", 7, 3, NGHTTP2_NV_FLAG_NONE},
+        };
+        nghttp2_data_provider prd;
+        prd.source.ptr = NULL;
+        prd.read_callback = never_read_callback;
+        submit_response_headers(session, sdata, headers, 1, &prd);
+    }
+}
+
+RequestHandler probe_handler_impl = {
+    .handle_request = probe_request_handler,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
+
+void check_cancelled(const char *what)
+{
+    test_check(what, g_token ? cancel_reason_of(g_token) : CANCEL_NONE, CANCEL_DEADLINE);
+}
+
+void test_not_answered(test_client *c)
+{
+    g_mode = PROBE_SILENT;
+    test_stream *s = test_get(c, "/slow");
+    test_check_true("silent: waits out the budget", !test_wait_closed(c, s, 0.1));
+    test_wait_closed(c, s);
+    test_check("silent: 504", s->status, 504);
+    test_check("silent: stream ends normally", s->error_code, NGHTTP2_NO_ERROR);
+    check_cancelled("silent: handler cancelled with CANCEL_DEADLINE");
+
+    g_deadline_policy.status = 503;
+    s = test_get(c, "/slow");
+    test_wait_closed(c, s);
+    test_check("silent: 503 when configured", s->status, 503);
+    g_deadline_policy.status = 504;
+
+    // Still uploading: the answer first, then the upload is stopped
+    s = test_request(c, "POST", "/slow", test_headers(), std::string(1000, 'u'), false);
+    test_wait_closed(c, s);
+    test_check("uploading: 504", s->status, 504);
+    test_check_true("uploading: upload stopped by RST_STREAM", s->reset);
+    test_check("uploading: NO_ERROR", s->error_code, NGHTTP2_NO_ERROR);
+}
+
+void test_headers_sent(test_client *c)
+{
+    g_mode = PROBE_HEADERS_SENT;
+    test_stream *s = test_get(c, "/slow");
+    test_wait(c, [s]() { return s->status != 0; });
+    test_check("headers sent: 200 went out", s->status, 200);
+    test_wait_closed(c, s);
+    test_check_true("headers sent: reset", s->reset);
+    test_check("headers sent: CANCEL", s->error_code, NGHTTP2_CANCEL);
+    check_cancelled("headers sent: handler cancelled with CANCEL_DEADLINE");
+}
+
+void test_grpc_timeout(test_client *c)
+{
+    g_mode = PROBE_SILENT;
+    g_deadline_policy.default_timeout = 10;
+
+    // Shorter than the default: it wins
+    test_headers headers = {{"grpc-timeout", "100m"}};
+    test_stream *s = test_request(c, "GET", "/slow", headers, std::string(), true);
+    test_check_true("grpc-timeout: shortens the budget", test_wait_closed(c, s, 1.0));
+    test_check("grpc-timeout: 504", s->status, 504);
+
+    // A gRPC call is answered the gRPC way, trailers-only
+    headers = {{"content-type", "application/grpc"}, {"te", "trailers"}, {"grpc-timeout", "100000u"}};
+    s = test_request(c, "POST", "/slow", headers, std::string(), true);
+    test_wait_closed(c, s, 1.0);
+    test_check("grpc call: http status", s->status, 200);
+    test_check("grpc call: DEADLINE_EXCEEDED", test_header(s->headers, "grpc-status"), "4");
+
+    // Longer than the budget: ignored
+    g_deadline_policy.default_timeout = 0.1;
+    headers = {{"grpc-timeout", "1H"}};
+    s = test_request(c, "GET", "/slow", headers, std::string(), true);
+    test_check_true("grpc-timeout: cannot extend the budget", test_wait_closed(c, s, 1.0));
+    test_check("grpc-timeout: 504 at the default", s->status, 504);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    g_deadline_policy.default_timeout = 0.2;
+
+    test_client *c = test_client_new(&loop, "10.8.0.1");
+    c->server->conn_data->default_handler = &probe_handler_impl;
+    test_not_answered(c);
+    test_headers_sent(c);
+    test_grpc_timeout(c);
+    test_check("connection survives", c->goaway, false);
+    test_client_free(c);
+    if (g_token) {
+        cancel_token_unref(g_token);
+    }
+    return test_failures() ? 1 : 0;
+}
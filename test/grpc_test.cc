@@ -0,0 +1,122 @@
+// gRPC：5 字节长度前缀的消息无论怎样切进 DATA 都能完整切出，回应带同样的前缀和 grpc-status 尾部；
+// 出错且还没发过消息的调用只有一个带 grpc-status 的 HEADERS（trailers-only）
+#include <string>
+
+#include "grpc.h"
+#include "h2test.h"
+
+namespace
+{
+
+std::string framed(const std::string &msg, uint8_t flags = 0)
+{
+    std::string f;
+    f.push_back((char)flags);
+    size_t len = msg.size();
+    f.push_back((char)(len >> 24));
+    f.push_back((char)(len >> 16));
+    f.push_back((char)(len >> 8));
+    f.push_back((char)len);
+    return f + msg;
+}
+
+test_headers grpc_headers()
+{
+    return {{"content-type", "application/grpc"}, {"te", "trailers"}};
+}
+
+test_stream *start_call(test_client *c, const char *method)
+{
+    std::string path = std::string("/muduohttp.Echo/") + method;
+    return test_request(c, "POST", path.c_str(), grpc_headers(), std::string(), false);
+}
+
+void test_unary(test_client *c)
+{
+    // The prefix and the message both split across DATA frames
+    std::string msg(50000, 'm');
+    std::string wire = framed(msg);
+    test_stream *s = start_call(c, "Unary");
+    test_send(c, s, wire.substr(0, 3), false);
+    test_send(c, s, wire.substr(3, 20000), false);
+    test_send(c, s, wire.substr(20003), true);
+    test_wait_closed(c, s);
+    test_check("unary: status", s->status, 200);
+    test_check("unary: content-type", test_header(s->headers, "content-type"), "application/grpc");
+    test_check_true("unary: response framed like the request", s->body == wire);
+    test_check("unary: grpc-status trailer", test_header(s->trailers, "grpc-status"), "0");
+}
+
+void test_bidi(test_client *c)
+{
+    // Several messages in one DATA frame, an empty one among them
+    test_stream *s = start_call(c, "Bidi");
+    std::string wire = framed("one") + framed("") + framed("three");
+    test_send(c, s, wire, false);
+    test_wait(c, [s, &wire]() { return s->body.size() >= wire.size(); });
+    test_check_true("bidi: each message echoed as it came", s->body == wire);
+    test_check("bidi: no trailers while open", s->trailers.size(), 0);
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+    test_check("bidi: grpc-status trailer after half-close", test_header(s->trailers, "grpc-status"), "0");
+}
+
+// A call that fails before any message was sent: one HEADERS frame carrying grpc-status
+void check_trailers_only(const char *what, test_stream *s, const char *status)
+{
+    std::string name = what;
+    test_check((name + ": http status").c_str(), s->status, 200);
+    test_check((name + ": grpc-status in the headers").c_str(), test_header(s->headers, "grpc-status"), status);
+    test_check_true((name + ": grpc-message present").c_str(), !test_header(s->headers, "grpc-message").empty());
+    test_check_true((name + ": no body, no separate trailers").c_str(), s->body.empty() && s->trailers.empty());
+    test_check((name + ": stream not reset").c_str(), s->error_code, NGHTTP2_NO_ERROR);
+}
+
+void test_errors(test_client *c)
+{
+    test_stream *s = start_call(c, "Nope");
+    test_send(c, s, framed("x"), true);
+    test_wait_closed(c, s);
+    check_trailers_only("unknown method", s, "12");
+
+    s = start_call(c, "Unary");
+    test_send(c, s, framed("x", 1), true);
+    test_wait_closed(c, s);
+    check_trailers_only("compressed message", s, "13");
+
+    s = start_call(c, "Unary");
+    test_send(c, s, framed(std::string(g_grpc_policy.max_message + 1, 'x')).substr(0, 5), false);
+    test_wait(c, [s]() { return s->status != 0; });
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+    check_trailers_only("message over max_message", s, "8");
+
+    s = start_call(c, "Unary");
+    test_send(c, s, framed("truncated").substr(0, 8), true);
+    test_wait_closed(c, s);
+    check_trailers_only("truncated message", s, "13");
+
+    s = start_call(c, "Unary");
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+    check_trailers_only("missing message", s, "13");
+
+    s = test_request(c, "POST", "/muduohttp.Echo/Unary", test_headers(), framed("x"), true);
+    test_wait_closed(c, s);
+    test_check("not gRPC: 415", s->status, 415);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    g_grpc_policy.max_message = 64 * 1024;
+
+    test_client *c = test_client_new(&loop, "10.5.0.1");
+    test_unary(c);
+    test_bidi(c);
+    test_errors(c);
+    test_client_free(c);
+    return test_failures() ? 1 : 0;
+}
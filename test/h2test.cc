@@ -0,0 +1,305 @@
+#include "h2test.h"
+#include <stdio.h>
+#include <algorithm>
+#include <muduo/base/Timestamp.h>
+#include <muduo/net/InetAddress.h>
+
+namespace
+{
+
+// Bytes the server is handed per input, like one socket read
+const size_t kReadSize = 16 * 1024;
+
+int g_failures = 0;
+
+ssize_t client_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+    test_client *c = (test_client *)user_data;
+    c->to_server.append(data, length);
+    return length;
+}
+
+ssize_t upload_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                             uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    test_stream *s = (test_stream *)source->ptr;
+    size_t n = std::min(length, s->upload.size() - s->upload_offset);
+    if (n == 0 && !s->upload_done) {
+        s->deferred = true;
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    memcpy(buf, s->upload.data() + s->upload_offset, n);
+    s->upload_offset += n;
+    if (s->upload_done && s->upload_offset == s->upload.size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+}
+
+int client_on_begin_headers_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    test_stream *s = (test_stream *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (s) {
+        s->block.clear();
+    }
+    return 0;
+}
+
+int client_on_header_callback(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                              size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+    test_stream *s = (test_stream *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (s && frame->hd.type == NGHTTP2_HEADERS) {
+        s->block.emplace_back(std::string((const char *)name, namelen), std::string((const char *)value, valuelen));
+    }
+    return 0;
+}
+
+int client_on_frame_recv_callback(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    test_client *c = (test_client *)user_data;
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        c->goaway = true;
+        c->goaway_error = frame->goaway.error_code;
+        return 0;
+    }
+    if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_RST_STREAM) {
+        return 0;
+    }
+    test_stream *s = (test_stream *)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!s) {
+        return 0;
+    }
+    if (frame->hd.type == NGHTTP2_RST_STREAM) {
+        s->reset = true;
+        return 0;
+    }
+    // A block with :status is a response, 1xx or final; one without is the trailers
+    std::string status = test_header(s->block, ":status");
+    if (status.empty()) {
+        s->trailers.swap(s->block);
+    } else if (status[0] == '1') {
+        s->informational.push_back(atoi(status.c_str()));
+    } else {
+        s->status = atoi(status.c_str());
+        s->headers.swap(s->block);
+    }
+    s->block.clear();
+    return 0;
+}
+
+int client_on_data_chunk_recv_callback(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                       const uint8_t *data, size_t len, void *user_data)
+{
+    test_stream *s = (test_stream *)nghttp2_session_get_stream_user_data(session, stream_id);
+    if (s) {
+        s->body.append((const char *)data, len);
+    }
+    return 0;
+}
+
+int client_on_stream_close_callback(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    test_stream *s = (test_stream *)nghttp2_session_get_stream_user_data(session, stream_id);
+    if (s) {
+        s->closed = true;
+        s->error_code = error_code;
+    }
+    return 0;
+}
+
+nghttp2_nv make_nv(const std::string &name, const std::string &value)
+{
+    nghttp2_nv nv = {(uint8_t *)name.data(), (uint8_t *)value.data(), name.size(), value.size(), NGHTTP2_NV_FLAG_NONE};
+    return nv;
+}
+
+} // namespace
+
+test_client *test_client_new(muduo::net::EventLoop *loop, const char *peer_ip)
+{
+    test_client *c = new test_client();
+    c->loop = loop;
+    c->goaway = false;
+    c->goaway_error = 0;
+    c->server_error = 0;
+    c->alive = std::make_shared<bool>(true);
+    // Deferred sends run from the loop like a transport's; the client may be gone by then
+    std::shared_ptr<bool> alive = c->alive;
+    c->server = http2_session_create_on(loop, muduo::net::InetAddress(peer_ip, 40000), &c->to_client,
+                                        [c, alive]() {
+        c->loop->queueInLoop([c, alive]() {
+            if (!*alive) {
+                return;
+            }
+            c->server->conn_data->send_scheduled = false;
+            nghttp2_session_send(c->server->session);
+        });
+    });
+
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, client_send_callback);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, client_on_begin_headers_callback);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, client_on_header_callback);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, client_on_frame_recv_callback);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, client_on_data_chunk_recv_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, client_on_stream_close_callback);
+    nghttp2_session_client_new(&c->session, callbacks, c);
+    nghttp2_session_callbacks_del(callbacks);
+
+    nghttp2_settings_entry iv = {NGHTTP2_SETTINGS_ENABLE_PUSH, 0};
+    nghttp2_submit_settings(c->session, NGHTTP2_FLAG_NONE, &iv, 1);
+    test_pump(c);
+    return c;
+}
+
+void test_client_free(test_client *c)
+{
+    *c->alive = false;
+    http2_session_destroy(c->server);
+    nghttp2_session_del(c->session);
+    delete c;
+}
+
+test_stream *test_request(test_client *c, const char *method, const char *path, const test_headers &headers,
+                          const std::string &body, bool end_stream)
+{
+    static const std::string kMethod = ":method", kScheme = ":scheme", kAuthority = ":authority", kPath = ":path";
+    static const std::string kHttp = "http", kHost = "test";
+    std::string method_value = method, path_value = path;
+    std::vector<nghttp2_nv> nva;
+    nva.push_back(make_nv(kMethod, method_value));
+    nva.push_back(make_nv(kScheme, kHttp));
+    nva.push_back(make_nv(kAuthority, kHost));
+    nva.push_back(make_nv(kPath, path_value));
+    for (const auto &h : headers) {
+        nva.push_back(make_nv(h.first, h.second));
+    }
+
+    test_stream *s = new test_stream();
+    c->streams.emplace_back(s);
+    s->upload = body;
+    s->upload_offset = 0;
+    s->upload_done = end_stream;
+    s->deferred = false;
+    s->status = 0;
+    s->closed = false;
+    s->reset = false;
+    s->error_code = 0;
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = s;
+    data_prd.read_callback = upload_read_callback;
+    bool has_body = !body.empty() || !end_stream;
+    s->id = nghttp2_submit_request(c->session, NULL, nva.data(), nva.size(), has_body ? &data_prd : NULL, s);
+    test_pump(c);
+    return s;
+}
+
+test_stream *test_get(test_client *c, const char *path)
+{
+    return test_request(c, "GET", path, test_headers(), std::string(), true);
+}
+
+void test_send(test_client *c, test_stream *s, const std::string &data, bool end_stream)
+{
+    s->upload.append(data);
+    s->upload_done = end_stream;
+    if (s->deferred) {
+        s->deferred = false;
+        nghttp2_session_resume_data(c->session, s->id);
+    }
+    test_pump(c);
+}
+
+void test_pump(test_client *c)
+{
+    for (;;) {
+        bool progress = false;
+        nghttp2_session_send(c->session);
+        if (c->to_server.readableBytes() > 0 && c->server_error == 0) {
+            // Handed over in socket-read sized pieces; the session takes all of each unless it fails
+            muduo::net::Buffer chunk;
+            size_t n = std::min(c->to_server.readableBytes(), kReadSize);
+            chunk.append(c->to_server.peek(), n);
+            c->to_server.retrieve(n);
+            int rv = http2_session_on_input(c->server, &chunk);
+            if (rv < 0) {
+                c->server_error = rv;
+                http2_session_fail(c->server);
+            }
+            progress = true;
+        }
+        if (c->to_client.readableBytes() > 0) {
+            nghttp2_session_mem_recv(c->session, (const uint8_t *)c->to_client.peek(), c->to_client.readableBytes());
+            c->to_client.retrieveAll();
+            progress = true;
+        }
+        if (!progress) {
+            break;
+        }
+    }
+}
+
+bool test_wait(test_client *c, const std::function<bool()> &done, double timeout)
+{
+    test_pump(c);
+    if (done()) {
+        return true;
+    }
+    muduo::net::EventLoop *loop = c->loop;
+    muduo::Timestamp until = muduo::addTime(muduo::Timestamp::now(), timeout);
+    bool ok = false;
+    muduo::net::TimerId tick = loop->runEvery(0.001, [&]() {
+        test_pump(c);
+        if (done()) {
+            ok = true;
+            loop->quit();
+        } else if (until < muduo::Timestamp::now()) {
+            loop->quit();
+        }
+    });
+    loop->loop();
+    loop->cancel(tick);
+    return ok;
+}
+
+bool test_wait_closed(test_client *c, test_stream *s, double timeout)
+{
+    return test_wait(c, [s]() { return s->closed; }, timeout);
+}
+
+std::string test_header(const test_headers &headers, const std::string &name)
+{
+    for (const auto &h : headers) {
+        if (h.first == name) {
+            return h.second;
+        }
+    }
+    return std::string();
+}
+
+void test_check(const char *what, const std::string &got, const std::string &want)
+{
+    if (got != want) {
+        printf("FAIL %s: got '%s', want '%s'\n", what, got.c_str(), want.c_str());
+        ++g_failures;
+    } else {
+        printf("ok   %s\n", what);
+    }
+}
+
+void test_check(const char *what, int64_t got, int64_t want)
+{
+    test_check(what, std::to_string(got), std::to_string(want));
+}
+
+void test_check_true(const char *what, bool ok)
+{
+    test_check(what, ok ? "true" : "false", "true");
+}
+
+int test_failures()
+{
+    return g_failures;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
+
+#include "http2Session.h"
+
+// 测试工具：一个 nghttp2 客户端与 http2_session_create_on 建出的服务端 session 在内存里对跑，
+// 字节按一次 socket 读的大小交给服务端。服务端挂在调用方的 EventLoop 上，所以期限、限流、
+// 延后发送这些依赖事件循环的逻辑都照常运行；test_wait 转动循环直到条件满足或超时。
+// 检查结果按 http3_curl.sh 的格式逐行打印 ok / FAIL
+
+typedef std::vector<std::pair<std::string, std::string>> test_headers;
+
+// One request of the client and what came back on it
+struct test_stream {
+    int32_t id;
+
+    // Request body not yet sent; the data provider waits for more until upload_done
+    std::string upload;
+    size_t upload_offset;
+    bool upload_done;
+    bool deferred;
+
+    int status;                         // Final :status, 0 until it arrived
+    std::vector<int> informational;     // 1xx statuses, in order
+    test_headers headers;               // Final response header block
+    test_headers trailers;
+    test_headers block;                 // Header block being received
+    std::string body;
+    bool closed;
+    bool reset;                         // The server sent RST_STREAM
+    uint32_t error_code;                // What the stream closed with; RST_STREAM's code when reset
+};
+
+struct test_client {
+    muduo::net::EventLoop *loop;
+    all_data *server;
+    muduo::net::Buffer to_server;
+    muduo::net::Buffer to_client;
+    nghttp2_session *session;
+    std::vector<std::unique_ptr<test_stream>> streams;
+    bool goaway;
+    uint32_t goaway_error;
+    int server_error;                   // http2_session_on_input failed with this, 0 otherwise
+    std::shared_ptr<bool> alive;        // Cleared on free, for sends still queued on the loop
+};
+
+// Connect a client to a new server session on loop, as if from peer_ip, and exchange SETTINGS
+test_client *test_client_new(muduo::net::EventLoop *loop, const char *peer_ip);
+void test_client_free(test_client *c);
+
+// Submit a request. body is sent after the headers; unless end_stream, more can follow with test_send.
+test_stream *test_request(test_client *c, const char *method, const char *path, const test_headers &headers,
+                          const std::string &body, bool end_stream);
+test_stream *test_get(test_client *c, const char *path);
+
+// More request body for s, ending the request when end_stream
+void test_send(test_client *c, test_stream *s, const std::string &data, bool end_stream);
+
+// Move bytes both ways until neither side has anything left to say
+void test_pump(test_client *c);
+
+// Run loop, pumping c, until done() or timeout seconds passed. Returns done().
+bool test_wait(test_client *c, const std::function<bool()> &done, double timeout = 5.0);
+bool test_wait_closed(test_client *c, test_stream *s, double timeout = 5.0);
+
+// Value of a response header or trailer, empty when absent
+std::string test_header(const test_headers &headers, const std::string &name);
+
+// Print "ok   what", or "FAIL what: got ..., want ..." and count the failure
+void test_check(const char *what, const std::string &got, const std::string &want);
+void test_check(const char *what, int64_t got, int64_t want);
+void test_check_true(const char *what, bool ok);
+
+// Failed checks so far; main returns non-zero when there were any
+int test_failures();
@@ -0,0 +1,64 @@
+#!/bin/bash
+# HTTP/3 loopback test: usage http3_curl.sh path/to/muduohttp server.crt server.key
+# Exits 77 (skipped) when curl cannot speak HTTP/3.
+
+bin=$1
+cert=$2
+key=$3
+port=${HTTP3_TEST_PORT:-18443}
+
+if ! curl --version | grep -qw HTTP3; then
+    echo "curl without HTTP/3 support, skipping"
+    exit 77
+fi
+
+tmp=$(mktemp -d)
+"$bin" "$port" --http3 "$port" --tls-cert "$cert" --tls-key "$key" --threads 2 > "$tmp/server.log" 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$tmp"' EXIT
+
+for i in $(seq 50); do
+    curl -s --http2-prior-knowledge -o /dev/null "http://127.0.0.1:$port/api" && break
+    sleep 0.1
+done
+
+fail=0
+h3() {
+    curl -s --http3-only -k --max-time 10 "$@"
+}
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL $1: got '$2', want '$3'"
+        fail=1
+    else
+        echo "ok   $1"
+    fi
+}
+
+check "GET /api" "$(h3 -o /dev/null -w '%{http_version} %{http_code}' "https://127.0.0.1:$port/api")" "3 200"
+
+# 103 Early Hints ahead of the page, then the page itself
+h3 -D "$tmp/root.headers" -o /dev/null "https://127.0.0.1:$port/"
+check "GET / early hints" "$(grep -c '^HTTP/3 103' "$tmp/root.headers")" "1"
+check "GET / status" "$(grep -c '^HTTP/3 200' "$tmp/root.headers")" "1"
+
+check "GET unknown asset" "$(h3 -o /dev/null -w '%{http_code}' "https://127.0.0.1:$port/static/nope.css")" "404"
+
+encoding=$(h3 -H 'accept-encoding: gzip' -D - -o /dev/null "https://127.0.0.1:$port/static/site.css" |
+           tr -d '\r' | awk -F': ' 'tolower($1) == "content-encoding" { print $2 }')
+check "gzip asset" "$encoding" "gzip"
+
+# A body larger than the stream window: only comes through if consumed bytes reopen the window,
+# and the echo only comes back whole if responses wait for acknowledgements correctly
+head -c 600000 /dev/urandom > "$tmp/body"
+h3 --data-binary @"$tmp/body" -o "$tmp/echo" "https://127.0.0.1:$port/echo"
+check "echo of a large body" "$(tail -c 600000 "$tmp/echo" | cmp -s - "$tmp/body" && echo same)" "same"
+
+# Several requests on one connection
+check "reused connection" "$(h3 -o /dev/null -w '%{http_code}\n' "https://127.0.0.1:$port/api" \
+                              -o /dev/null "https://127.0.0.1:$port/api" | tr '\n' ' ')" "200 200 "
+
+if [ $fail -ne 0 ]; then
+    cat "$tmp/server.log"
+fi
+exit $fail
@@ -0,0 +1,151 @@
+// 反向代理：下游是进程内会话，上游是同一个事件循环上的 http2Server（h2c，默认 handler 回显请求）。
+// 上游起来之前的流在连接池里等待，超时回 502；之后检查请求头的改写、两个方向的流控和连接池
+#include <stdlib.h>
+#include <string>
+#include <muduo/net/InetAddress.h>
+
+#include "h2test.h"
+#include "http2Server.hpp"
+#include "metrics.h"
+#include "proxy.h"
+
+namespace
+{
+
+// A loopback port nothing listens on yet: the kernel picks it, then it is released
+uint16_t unused_port()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    ::bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    ::getsockname(fd, (struct sockaddr *)&addr, &len);
+    ::close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// Value of a request header as the upstream echoed it back ("name: value" lines)
+std::string echoed_header(const std::string &body, const std::string &name)
+{
+    std::string key = "\n" + name + ": ";
+    size_t pos = body.find(key);
+    if (pos == std::string::npos) {
+        return std::string();
+    }
+    pos += key.size();
+    return body.substr(pos, body.find('\n', pos) - pos);
+}
+
+std::string pattern(size_t len)
+{
+    std::string s(len, '\0');
+    for (size_t i = 0; i < len; ++i) {
+        s[i] = (char)('a' + (i * 7 + i / 251) % 26);
+    }
+    return s;
+}
+
+bool ends_with(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void test_pending_timeout(test_client *c)
+{
+    // More than the stream window: the client stalls once the proxy holds 64KB it cannot forward
+    test_stream *s = test_request(c, "POST", "/proxy/echo", test_headers(), pattern(100000), true);
+    test_check_true("no upstream: stream waits", !test_wait_closed(c, s, 0.1));
+    test_check("no upstream: unsent body keeps the stream window closed",
+               nghttp2_session_get_stream_remote_window_size(c->session, s->id), 0);
+
+    test_wait_closed(c, s, 3.0);
+    test_check("no upstream: 502 after the pending timeout", s->status, 502);
+    // The held bytes are consumed with the 502, so the rest of the body can follow; WINDOW_UPDATE
+    // waits for half a window, so up to that much may still be unannounced
+    test_check("no upstream: rest of the body let through", s->upload_offset, s->upload.size());
+    test_check_true("no upstream: connection window given back",
+                    nghttp2_session_get_remote_window_size(c->session) > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE / 2);
+}
+
+void test_forward(test_client *c)
+{
+    // Larger than both the downstream and upstream windows, in both directions: it only gets
+    // through if each side consumes what the other one sent on
+    std::string body = pattern(300000);
+    test_headers headers = {
+        {"te", "trailers"},
+        {"grpc-timeout", "10S"},
+        {"x-test", "yes"},
+    };
+    test_stream *s = test_request(c, "POST", "/proxy/echo?x=1", headers, body, true);
+    test_wait_closed(c, s, 5.0);
+    test_check("forward: status", s->status, 200);
+    test_check("forward: response via", test_header(s->headers, "via"), "2 muduohttp");
+    test_check_true("forward: 300KB echoed whole", ends_with(s->body, body));
+
+    test_check("forward: prefix stripped", echoed_header(s->body, ":path"), "/echo?x=1");
+    test_check("forward: te trailers kept", echoed_header(s->body, "te"), "trailers");
+    test_check("forward: other headers kept", echoed_header(s->body, "x-test"), "yes");
+    test_check("forward: request via", echoed_header(s->body, "via"), "2 muduohttp");
+    test_check("forward: x-forwarded-for", echoed_header(s->body, "x-forwarded-for"), "10.1.0.1");
+
+    // Rewritten to what is left of the deadline, in microseconds
+    std::string timeout = echoed_header(s->body, "grpc-timeout");
+    int64_t us = atoll(timeout.c_str());
+    test_check_true("forward: grpc-timeout rewritten to the remaining budget",
+                    ends_with(timeout, "u") && us > 9000000 && us <= 10000000);
+}
+
+void test_pool(test_client *c)
+{
+    std::vector<test_stream *> streams;
+    for (int i = 0; i < 20; ++i) {
+        streams.push_back(test_get(c, "/proxy/echo"));
+    }
+    test_wait(c, [&streams]() {
+        for (test_stream *s : streams) {
+            if (!s->closed) {
+                return false;
+            }
+        }
+        return true;
+    });
+    int ok = 0;
+    for (test_stream *s : streams) {
+        ok += s->status == 200;
+    }
+    test_check("pool: concurrent streams answered", ok, 20);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    uint16_t port = unused_port();
+    std::string upstream = "127.0.0.1:" + std::to_string(port);
+    proxy_set_upstream(upstream.c_str());
+    g_proxy_config.connections = 2;
+    g_proxy_config.pending_timeout = 0.2;
+
+    test_client *c = test_client_new(&loop, "10.1.0.1");
+    test_pending_timeout(c);
+
+    // The in-tree server as the upstream; the pool reconnects to it on its own
+    uint64_t connections = metrics_get(METRIC_CONNECTIONS);
+    http2Server server(&loop, muduo::net::InetAddress("127.0.0.1", port), "upstream");
+    server.setThreadNum(0);
+    server.start();
+    test_check_true("pool: both upstream connections made", test_wait(c, [connections]() {
+        return metrics_get(METRIC_CONNECTIONS) == connections + 2;
+    }, 10.0));
+
+    test_forward(c);
+    test_pool(c);
+
+    test_client_free(c);
+    return test_failures() ? 1 : 0;
+}
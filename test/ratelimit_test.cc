@@ -0,0 +1,79 @@
+// 限流：桶空时按策略回 429 或 RST_STREAM(REFUSED_STREAM)，按时间补充令牌，不同客户端各用各的桶
+#include <unistd.h>
+
+#include "h2test.h"
+#include "ratelimit.h"
+
+namespace
+{
+
+void test_429(muduo::net::EventLoop *loop)
+{
+    g_rate_limit_policy.action = RATE_LIMIT_429;
+    test_client *c = test_client_new(loop, "10.2.0.1");
+    test_stream *a = test_get(c, "/api");
+    test_stream *b = test_get(c, "/api");
+    test_stream *over = test_get(c, "/api");
+    test_wait_closed(c, over);
+    test_check("429: first of the burst", a->status, 200);
+    test_check("429: second of the burst", b->status, 200);
+    test_check("429: over the burst", over->status, 429);
+    test_check("429: retry-after", test_header(over->headers, "retry-after"), "1");
+    test_check("429: stream ends normally", over->error_code, NGHTTP2_NO_ERROR);
+
+    // 10 tokens a second: one is back after 100ms
+    usleep(110 * 1000);
+    test_stream *refilled = test_get(c, "/api");
+    test_wait_closed(c, refilled);
+    test_check("429: bucket refills", refilled->status, 200);
+    test_stream *again = test_get(c, "/api");
+    test_wait_closed(c, again);
+    test_check("429: refill is one token, not a new burst", again->status, 429);
+
+    // Another client has a bucket of its own
+    test_client *other = test_client_new(loop, "10.2.0.2");
+    test_stream *s = test_get(other, "/api");
+    test_wait_closed(other, s);
+    test_check("429: other client unaffected", s->status, 200);
+    test_client_free(other);
+    test_client_free(c);
+}
+
+void test_refuse(muduo::net::EventLoop *loop)
+{
+    g_rate_limit_policy.action = RATE_LIMIT_REFUSE;
+    test_client *c = test_client_new(loop, "10.2.0.3");
+    test_get(c, "/api");
+    test_get(c, "/api");
+    test_stream *over = test_get(c, "/api");
+    test_wait_closed(c, over);
+    test_check("refuse: no response", over->status, 0);
+    test_check("refuse: REFUSED_STREAM", over->error_code, NGHTTP2_REFUSED_STREAM);
+
+    // A refused request may carry a body; it is dropped and its window given back
+    test_stream *upload = test_request(c, "POST", "/echo", test_headers(), std::string(100000, 'u'), true);
+    test_wait_closed(c, upload);
+    test_check("refuse: upload refused", upload->error_code, NGHTTP2_REFUSED_STREAM);
+    test_check_true("refuse: connection window intact",
+                    nghttp2_session_get_remote_window_size(c->session) > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE / 2);
+
+    usleep(110 * 1000);
+    test_stream *refilled = test_get(c, "/api");
+    test_wait_closed(c, refilled);
+    test_check("refuse: bucket refills", refilled->status, 200);
+    test_client_free(c);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    g_rate_limit_policy.enabled = true;
+    g_rate_limit_policy.rate = 10;
+    g_rate_limit_policy.burst = 2;
+
+    test_429(&loop);
+    test_refuse(&loop);
+    return test_failures() ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+// 请求大小限制：/api 的 content-length 超限在请求头收完时就回 413，没有 content-length 时按收到的
+// DATA 累计；请求头个数或字节数超限回 431。客户端还在上传时，RST_STREAM(NO_ERROR) 在回应发完之后才发
+#include <string>
+
+#include "h2test.h"
+#include "reqlimit.h"
+
+namespace
+{
+
+// The client is still sending: the answer comes first, then RST_STREAM(NO_ERROR) stops the upload
+void check_stopped(const char *what, test_stream *s, int status)
+{
+    std::string name = what;
+    test_check((name + ": answered").c_str(), s->status, status);
+    test_check_true((name + ": upload stopped by RST_STREAM").c_str(), s->closed && s->reset);
+    test_check((name + ": NO_ERROR").c_str(), s->error_code, NGHTTP2_NO_ERROR);
+}
+
+void test_body(test_client *c)
+{
+    // Declared too large: rejected before any of the body is sent
+    test_headers headers = {{"content-length", "100000"}};
+    test_stream *s = test_request(c, "POST", "/api", headers, std::string(), false);
+    test_wait_closed(c, s);
+    check_stopped("content-length over max_body", s, 413);
+    test_check("content-length over max_body: no body sent", s->upload_offset, 0);
+
+    // No content-length: counted as the DATA comes
+    s = test_request(c, "POST", "/api", test_headers(), std::string(40000, 'a'), false);
+    test_check_true("body at 40000: still open", !test_wait_closed(c, s, 0.05));
+    test_check("body at 40000: not answered yet", s->status, 0);
+    test_send(c, s, std::string(40000, 'b'), false);
+    test_wait_closed(c, s);
+    check_stopped("body over max_body", s, 413);
+    test_check_true("body over max_body: connection window given back",
+                    nghttp2_session_get_remote_window_size(c->session) > NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE / 2);
+
+    // Exactly the limit is fine
+    s = test_request(c, "POST", "/api", test_headers(), std::string(64 * 1024, 'c'), true);
+    test_wait_closed(c, s);
+    test_check("body at max_body: accepted", s->status, 200);
+}
+
+void test_headers_limit(test_client *c)
+{
+    test_headers many;
+    for (int i = 0; i < 64; ++i) {
+        many.push_back({"x-h" + std::to_string(i), "v"});
+    }
+    test_stream *s = test_request(c, "GET", "/api", many, std::string(), true);
+    test_wait_closed(c, s);
+    test_check("too many headers: 431", s->status, 431);
+    // The request was complete; there is nothing left to stop
+    test_check_true("too many headers: no RST_STREAM", s->closed && !s->reset);
+    test_check("too many headers: NO_ERROR", s->error_code, NGHTTP2_NO_ERROR);
+
+    test_headers big = {{"x-big", std::string(16 * 1024, 'v')}};
+    s = test_request(c, "GET", "/api", big, std::string(), true);
+    test_wait_closed(c, s);
+    test_check("header bytes over the limit: 431", s->status, 431);
+    test_check_true("header bytes over the limit: no RST_STREAM", !s->reset);
+
+    // The same request still uploading is stopped once answered
+    s = test_request(c, "POST", "/api", big, std::string(), false);
+    test_wait_closed(c, s);
+    check_stopped("header bytes over the limit while uploading", s, 431);
+
+    // Within the limits of the route
+    many.resize(32);
+    s = test_request(c, "GET", "/api", many, std::string(), true);
+    test_wait_closed(c, s);
+    test_check("headers within limits: accepted", s->status, 200);
+}
+
+void test_other_routes(test_client *c)
+{
+    // Routes without limits of their own use the defaults, much larger than /api's
+    test_headers headers = {{"content-length", "100000"}};
+    test_stream *s = test_request(c, "POST", "/echo", headers, std::string(100000, 'd'), true);
+    test_wait_closed(c, s);
+    test_check("default limits: 100000 bytes accepted", s->status, 200);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    test_client *c = test_client_new(&loop, "10.7.0.1");
+    test_body(c);
+    test_headers_limit(c);
+    test_other_routes(c);
+    test_check("connection survives", c->goaway, false);
+    test_client_free(c);
+    return test_failures() ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+// 请求体落盘：不超过阈值的留在内存，超过的从越界那一块起写进临时文件，声明的 content-length
+// 超过阈值时从第一块起就落盘；收完后 mmap 成 sdata->body，handler 读到的和上传的一字不差
+#include <sys/stat.h>
+#include <string>
+
+#include "h2test.h"
+#include "spool.h"
+
+namespace
+{
+
+// What the handler saw of the last request
+struct spool_probe {
+    bool called;
+    int fd;
+    bool mapped;
+    off_t file_size;
+    std::string body;
+};
+
+spool_probe g_probe;
+
+void probe_request_handler(RequestHandler *self, nghttp2_session *session, int32_t stream_id, stream_data *sdata)
+{
+    g_probe.called = true;
+    g_probe.fd = spool_body_fd(sdata);
+    g_probe.mapped = sdata->spool && sdata->spool->map;
+    g_probe.file_size = -1;
+    struct stat st;
+    if (g_probe.fd >= 0 && ::fstat(g_probe.fd, &st) == 0) {
+        g_probe.file_size = st.st_size;
+    }
+    g_probe.body.assign(sdata->body ? sdata->body : "", sdata->body_len);
+    default_request_handler(self, session, stream_id, sdata);
+}
+
+RequestHandler probe_handler_impl = {
+    .handle_request = probe_request_handler,
+    .data = NULL,
+    .on_request_headers = NULL,
+    .on_request_data = NULL,
+    .on_stream_close = NULL,
+    .factory = NULL,
+};
+
+std::string pattern(size_t len)
+{
+    std::string s(len, '\0');
+    for (size_t i = 0; i < len; ++i) {
+        s[i] = (char)(i * 13 + (i >> 8));
+    }
+    return s;
+}
+
+// Upload body in chunks of the given size, without content-length
+test_stream *upload(test_client *c, const std::string &body, size_t chunk)
+{
+    g_probe = spool_probe();
+    test_stream *s = test_request(c, "POST", "/upload", test_headers(), std::string(), false);
+    for (size_t pos = 0; pos < body.size(); pos += chunk) {
+        test_send(c, s, body.substr(pos, chunk), pos + chunk >= body.size());
+    }
+    test_wait_closed(c, s);
+    return s;
+}
+
+stream_data *server_stream(test_client *c, int32_t id)
+{
+    for (stream_data *sdata = c->server->conn_data->streams; sdata; sdata = sdata->next) {
+        if (sdata->stream_id == id) {
+            return sdata;
+        }
+    }
+    return NULL;
+}
+
+void test_threshold(test_client *c)
+{
+    size_t threshold = g_body_spool_policy.threshold;
+    std::string body = pattern(threshold);
+    test_stream *s = upload(c, body, 300);
+    test_check("at threshold: answered", s->status, 200);
+    test_check("at threshold: stays in memory", g_probe.fd, -1);
+    test_check_true("at threshold: body intact", g_probe.body == body);
+
+    body = pattern(threshold + 1);
+    s = upload(c, body, 300);
+    test_check("past threshold: answered", s->status, 200);
+    test_check_true("past threshold: spooled", g_probe.fd >= 0);
+    test_check_true("past threshold: mapped on finish", g_probe.mapped);
+    test_check("past threshold: whole body in the file", g_probe.file_size, (int64_t)body.size());
+    test_check_true("past threshold: body intact", g_probe.body == body);
+    test_check_true("past threshold: echoed", s->body.size() >= body.size() &&
+                                                  s->body.compare(s->body.size() - body.size(), body.size(), body) == 0);
+
+    // Many write batches, the last one partial
+    body = pattern(threshold * 10 + 17);
+    s = upload(c, body, 4096);
+    test_check("large: answered", s->status, 200);
+    test_check("large: whole body in the file", g_probe.file_size, (int64_t)body.size());
+    test_check_true("large: body intact", g_probe.body == body);
+}
+
+void test_content_length(test_client *c)
+{
+    size_t threshold = g_body_spool_policy.threshold;
+    std::string body = pattern(threshold * 2);
+    g_probe = spool_probe();
+    test_headers headers = {{"content-length", std::to_string(body.size())}};
+    test_stream *s = test_request(c, "POST", "/upload", headers, std::string(), false);
+    test_send(c, s, body.substr(0, 100), false);
+    stream_data *sdata = server_stream(c, s->id);
+    test_check_true("content-length: server stream open", sdata != NULL);
+    test_check_true("content-length: spooled from the first chunk", sdata && sdata->spool && !sdata->body);
+
+    test_send(c, s, body.substr(100), true);
+    test_wait_closed(c, s);
+    test_check("content-length: answered", s->status, 200);
+    test_check_true("content-length: mapped on finish", g_probe.mapped);
+    test_check_true("content-length: body intact", g_probe.body == body);
+
+    // A declared length within the threshold is buffered in memory
+    body = pattern(threshold);
+    g_probe = spool_probe();
+    headers = {{"content-length", std::to_string(body.size())}};
+    s = test_request(c, "POST", "/upload", headers, body, true);
+    test_wait_closed(c, s);
+    test_check("content-length within threshold: in memory", g_probe.fd, -1);
+    test_check_true("content-length within threshold: body intact", g_probe.body == body);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    g_body_spool_policy.threshold = 1000;
+    g_body_spool_policy.write_batch = 256;
+
+    test_client *c = test_client_new(&loop, "10.6.0.1");
+    c->server->conn_data->default_handler = &probe_handler_impl;
+    test_threshold(c);
+    test_content_length(c);
+    test_client_free(c);
+    return test_failures() ? 1 : 0;
+}
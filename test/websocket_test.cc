@@ -0,0 +1,203 @@
+// WebSocket over HTTP/2：分片消息（中间夹着控制帧、帧头和负载跨 DATA 分块）重组后整条回显，
+// 关闭码按 RFC 6455 7.4 校验，非法的以 1002 关闭
+#include <string>
+#include <vector>
+
+#include "h2test.h"
+
+namespace
+{
+
+struct ws_frame {
+    bool fin;
+    int opcode;
+    std::string payload;
+};
+
+// A masked client frame
+std::string client_frame(bool fin, int opcode, const std::string &payload)
+{
+    static const uint8_t kMask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::string f;
+    f.push_back((char)((fin ? 0x80 : 0) | opcode));
+    size_t len = payload.size();
+    if (len < 126) {
+        f.push_back((char)(0x80 | len));
+    } else if (len <= 0xffff) {
+        f.push_back((char)(0x80 | 126));
+        f.push_back((char)(len >> 8));
+        f.push_back((char)len);
+    } else {
+        f.push_back((char)(0x80 | 127));
+        for (int i = 0; i < 8; ++i) {
+            f.push_back((char)((uint64_t)len >> (56 - 8 * i)));
+        }
+    }
+    f.append((const char *)kMask, 4);
+    for (size_t i = 0; i < len; ++i) {
+        f.push_back((char)(payload[i] ^ kMask[i & 3]));
+    }
+    return f;
+}
+
+std::string close_payload(uint16_t code)
+{
+    std::string p;
+    p.push_back((char)(code >> 8));
+    p.push_back((char)code);
+    return p;
+}
+
+// The server's frames, unmasked; a frame cut short at the end is left out
+std::vector<ws_frame> server_frames(const std::string &data)
+{
+    std::vector<ws_frame> frames;
+    size_t pos = 0;
+    while (pos + 2 <= data.size()) {
+        const uint8_t *h = (const uint8_t *)data.data() + pos;
+        uint64_t len = h[1] & 0x7f;
+        size_t header = 2;
+        if (len == 126) {
+            len = ((uint64_t)h[2] << 8) | h[3];
+            header = 4;
+        } else if (len == 127) {
+            len = 0;
+            for (int i = 0; i < 8; ++i) {
+                len = (len << 8) | h[2 + i];
+            }
+            header = 10;
+        }
+        if (pos + header + len > data.size()) {
+            break;
+        }
+        frames.push_back({(h[0] & 0x80) != 0, h[0] & 0x0f, data.substr(pos + header, (size_t)len)});
+        pos += header + (size_t)len;
+    }
+    return frames;
+}
+
+test_stream *open_socket(test_client *c)
+{
+    test_headers headers = {
+        {":protocol", "websocket"},
+        {"sec-websocket-version", "13"},
+    };
+    test_stream *s = test_request(c, "CONNECT", "/ws/echo", headers, std::string(), false);
+    test_wait(c, [s]() { return s->status != 0 || s->closed; });
+    return s;
+}
+
+// Code of the server's close frame, -1 when it sent none, 0 when it carried no code
+int close_code(const test_stream *s)
+{
+    for (const ws_frame &f : server_frames(s->body)) {
+        if (f.opcode == 0x8) {
+            return f.payload.size() >= 2 ? ((uint8_t)f.payload[0] << 8) | (uint8_t)f.payload[1] : 0;
+        }
+    }
+    return -1;
+}
+
+void test_fragments(test_client *c)
+{
+    test_stream *s = open_socket(c);
+    test_check("fragments: CONNECT accepted", s->status, 200);
+
+    // Text in three fragments with a ping between them; the middle one arrives a byte at a time
+    // and the last one split inside its header
+    test_send(c, s, client_frame(false, 0x1, "Hel"), false);
+    test_send(c, s, client_frame(true, 0x9, "ping!"), false);
+    std::string middle = client_frame(false, 0x0, "lo, ");
+    for (char ch : middle) {
+        test_send(c, s, std::string(1, ch), false);
+    }
+    std::string last = client_frame(true, 0x0, "world");
+    test_send(c, s, last.substr(0, 1), false);
+    test_send(c, s, last.substr(1), false);
+
+    // A binary message with a 64-bit length, its fragments cut at odd offsets into DATA frames
+    std::string big(200000, '\0');
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = (char)(i * 31 + (i >> 9));
+    }
+    std::string wire = client_frame(false, 0x2, big.substr(0, 70001)) + client_frame(true, 0x0, big.substr(70001));
+    for (size_t pos = 0; pos < wire.size(); pos += 12345) {
+        test_send(c, s, wire.substr(pos, 12345), false);
+    }
+
+    test_wait(c, [s]() { return server_frames(s->body).size() >= 3; });
+    std::vector<ws_frame> frames = server_frames(s->body);
+    test_check("fragments: frames answered", frames.size(), 3);
+    if (frames.size() == 3) {
+        test_check("fragments: pong first", frames[0].opcode, 0xa);
+        test_check("fragments: pong payload", frames[0].payload, "ping!");
+        test_check("fragments: text reassembled", frames[1].payload, "Hello, world");
+        test_check_true("fragments: text is one final frame", frames[1].fin && frames[1].opcode == 0x1);
+        test_check("fragments: binary opcode", frames[2].opcode, 0x2);
+        test_check_true("fragments: 200KB binary reassembled", frames[2].payload == big);
+    }
+
+    test_send(c, s, client_frame(true, 0x8, close_payload(1000)), true);
+    test_wait_closed(c, s);
+    test_check("fragments: close answered", close_code(s), 1000);
+    test_check("fragments: stream ends cleanly", s->error_code, NGHTTP2_NO_ERROR);
+}
+
+// Close with payload; the server must answer with want
+void check_close(test_client *c, const char *what, const std::string &payload, int want)
+{
+    test_stream *s = open_socket(c);
+    test_send(c, s, client_frame(true, 0x8, payload), false);
+    test_wait(c, [s]() { return close_code(s) != -1; });
+    test_check(what, close_code(s), want);
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+}
+
+void test_close_codes(test_client *c)
+{
+    check_close(c, "close: 1000 echoed", close_payload(1000), 1000);
+    check_close(c, "close: 1001 echoed", close_payload(1001), 1001);
+    check_close(c, "close: 1014 echoed", close_payload(1014), 1014);
+    check_close(c, "close: 3000 echoed", close_payload(3000), 3000);
+    check_close(c, "close: 4999 echoed", close_payload(4999), 4999);
+    check_close(c, "close: no code answered without one", std::string(), 0);
+    check_close(c, "close: 999 is a protocol error", close_payload(999), 1002);
+    check_close(c, "close: 1004 is reserved", close_payload(1004), 1002);
+    check_close(c, "close: 1005 is local only", close_payload(1005), 1002);
+    check_close(c, "close: 1006 is local only", close_payload(1006), 1002);
+    check_close(c, "close: 1015 is reserved", close_payload(1015), 1002);
+    check_close(c, "close: 2999 is reserved", close_payload(2999), 1002);
+    check_close(c, "close: 5000 is out of range", close_payload(5000), 1002);
+    check_close(c, "close: one byte payload", std::string(1, '\x03'), 1002);
+}
+
+void test_bad_sequence(test_client *c)
+{
+    test_stream *s = open_socket(c);
+    test_send(c, s, client_frame(true, 0x0, "orphan"), false);
+    test_wait(c, [s]() { return close_code(s) != -1; });
+    test_check("sequence: continuation without a message", close_code(s), 1002);
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+
+    s = open_socket(c);
+    test_send(c, s, client_frame(false, 0x1, "a") + client_frame(true, 0x1, "b"), false);
+    test_wait(c, [s]() { return close_code(s) != -1; });
+    test_check("sequence: new message inside a fragmented one", close_code(s), 1002);
+    test_send(c, s, std::string(), true);
+    test_wait_closed(c, s);
+}
+
+} // namespace
+
+int main()
+{
+    muduo::net::EventLoop loop;
+    test_client *c = test_client_new(&loop, "10.4.0.1");
+    test_fragments(c);
+    test_close_codes(c);
+    test_bad_sequence(c);
+    test_client_free(c);
+    return test_failures() ? 1 : 0;
+}